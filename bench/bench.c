@@ -0,0 +1,694 @@
+/*===========================================================================
+
+  bute
+
+  bench.c
+
+  Copyright (c)2020 Kevin Boone. Distributed uner the terms of the
+    GNU PUblic Licence, v3.0
+
+  A benchmark driver, built by "make bench". It generates files of
+  synthetic text, and times loading and saving them, and editing
+  sessions on them, drawn on a virtual terminal. Results are written
+  as tab-separated lines, one for each corpus, size and operation:
+
+    version corpus mb op usec bytes writes
+
+  The times of the editing sessions run from when the editor asks for
+  the first key to when it asks for one after the last. Drawing the 
+  first screen, up to when the editor first looks for a key, is timed
+  as "open", and loading the rest of the file, which it does while 
+  there are none, as "loaded". bytes and writes count the output to the
+  terminal in the same way.
+
+===========================================================================*/
+#include "cnolib.h"
+#include "textfile.h"
+#include "bute.h"
+#include "virtualterminal.h"
+
+#define MB (1024 * 1024)
+// The size of the virtual terminal, which is fixed so that results can
+//   be compared between machines
+#define BENCH_ROWS 24
+#define BENCH_COLUMNS 80
+
+typedef void (*BenchGenFn) (FILE *f, int mb);
+
+typedef struct _BenchCorpus
+  {
+  const char *name;
+  BenchGenFn gen;
+  } BenchCorpus;
+
+// A session, as the keys that are typed
+typedef struct _BenchSession
+  {
+  const char *op;
+  char *keys;
+  int len;
+  } BenchSession;
+
+// A device that passes everything on to a virtual terminal, and notes
+//   when the editor first looks for input, when it first reads a key, 
+//   and when it reads past the last key
+typedef struct _BenchDevice
+  {
+  TerminalDevice parent;
+  TerminalDevice *vt;
+  long first_look;
+  VirtualTerminalCounts at_first_look;
+  long first_read;
+  long end;
+  VirtualTerminalCounts at_first_read;
+  VirtualTerminal *virtual_terminal;
+  } BenchDevice;
+
+static unsigned long bench_seed;
+// Threads to load files with, or zero for the editor's default
+static int bench_threads;
+// The size of a large file, or -1 for the editor's default
+static off64_t bench_large_min = -1;
+static struct timespec bench_start;
+
+/*===========================================================================
+
+  bench_rand
+
+  A random number from 0 to 32767. The same sequence every time, so
+  that every run generates the same files
+
+===========================================================================*/
+static int bench_rand (void)
+  {
+  bench_seed = bench_seed * 1103515245 + 12345;
+  return (bench_seed >> 16) & 0x7FFF;
+  }
+
+/*===========================================================================
+
+  bench_usec
+
+  Microseconds since the benchmark started
+
+===========================================================================*/
+static long bench_usec (void)
+  {
+  struct timespec now;
+  clock_gettime (CLOCK_MONOTONIC, &now);
+  return (long)(now.tv_sec - bench_start.tv_sec) * 1000000
+    + (now.tv_nsec - bench_start.tv_nsec) / 1000;
+  }
+
+/*===========================================================================
+
+  bench_words
+
+  Write random words, of lower-case letters and spaces, up to len bytes
+
+===========================================================================*/
+static void bench_words (FILE *f, int len)
+  {
+  char word[16];
+  while (len > 0)
+    {
+    int n = 1 + bench_rand () % 10;
+    if (n > len) n = len;
+    for (int i = 0; i < n - 1; i++)
+      word[i] = 'a' + bench_rand () % 26;
+    word[n - 1] = ' ';
+    word[n] = 0;
+    fputs (word, f);
+    len -= n;
+    }
+  }
+
+/*===========================================================================
+
+  bench_gen_short
+
+  Many short lines, as in source code or prose
+
+===========================================================================*/
+static void bench_gen_short (FILE *f, int mb)
+  {
+  for (int m = 0; m < mb; m++)
+    {
+    for (int written = 0; written < MB; )
+      {
+      int len = bench_rand () % 72;
+      bench_words (f, len);
+      fputc ('\n', f);
+      written += len + 1;
+      }
+    }
+  }
+
+/*===========================================================================
+
+  bench_gen_long
+
+  A few very long lines, of a quarter of a megabyte each
+
+===========================================================================*/
+static void bench_gen_long (FILE *f, int mb)
+  {
+  for (int n = 0; n < mb * 4; n++)
+    {
+    bench_words (f, MB / 4 - 1);
+    fputc ('\n', f);
+    }
+  }
+
+/*===========================================================================
+
+  bench_gen_tabs
+
+  Lines indented with tabs, and with tabs between fields
+
+===========================================================================*/
+static void bench_gen_tabs (FILE *f, int mb)
+  {
+  for (int m = 0; m < mb; m++)
+    {
+    for (int written = 0; written < MB; )
+      {
+      int indent = bench_rand () % 6;
+      for (int i = 0; i < indent; i++)
+        fputc ('\t', f);
+      int fields = 1 + bench_rand () % 6;
+      for (int i = 0; i < fields; i++)
+        {
+        bench_words (f, 1 + bench_rand () % 12);
+        fputc ('\t', f);
+        }
+      fputc ('\n', f);
+      written += indent + fields * 8 + 1;
+      }
+    }
+  }
+
+/*===========================================================================
+
+  bench_gen_binary
+
+  Bytes of any value but zero, with a newline every few hundred on
+  average, as a binary file would have. Most of it is not valid UTF-8
+
+===========================================================================*/
+static void bench_gen_binary (FILE *f, int mb)
+  {
+  for (int m = 0; m < mb; m++)
+    {
+    for (int written = 0; written < MB; written++)
+      {
+      int c = 1 + bench_rand () % 255;
+      if (c == '\n' && bench_rand () % 2) c = 'x';
+      fputc (c, f);
+      }
+    }
+  fputc ('\n', f);
+  }
+
+/*===========================================================================
+
+  bench_gen_config
+
+  A configuration file: settings of keys to values, some indented, 
+  comments, some indented, section headings and blank lines
+
+===========================================================================*/
+static void bench_gen_config (FILE *f, int mb)
+  {
+  char num[12];
+  for (int m = 0; m < mb; m++)
+    {
+    for (int written = 0; written < MB; )
+      {
+      int kind = bench_rand () % 20;
+      int indent = bench_rand () % 4 == 0 ? 1 + bench_rand () % 4 : 0;
+      int len = 1;
+      for (int i = 0; i < indent; i++)
+        fputc (' ', f);
+      if (kind < 3 || (kind < 5 && indent == 0))
+        {
+        // A comment
+        fputs ("# ", f);
+        int n = bench_rand () % 60;
+        bench_words (f, n);
+        len += 2 + n;
+        }
+      else if (kind == 5)
+        {
+        fputs ("[section_", f);
+        fputs (itoa (bench_rand (), num, 10), f);
+        fputs ("]", f);
+        len += 10 + strlen (num);
+        }
+      else if (kind < 8)
+        ;
+      else
+        {
+        fputs ("key_", f);
+        fputs (itoa (bench_rand (), num, 10), f);
+        fputs (bench_rand () % 2 ? " = " : "=", f);
+        int n = bench_rand () % 40;
+        bench_words (f, n);
+        len += 7 + strlen (num) + n;
+        }
+      fputc ('\n', f);
+      written += indent + len;
+      }
+    }
+  }
+
+static const BenchCorpus bench_corpora[] =
+  {
+  { "short", bench_gen_short },
+  { "long", bench_gen_long },
+  { "tabs", bench_gen_tabs },
+  { "binary", bench_gen_binary },
+  { "config", bench_gen_config },
+  };
+
+#define BENCH_NCORPORA (int)(sizeof (bench_corpora) / sizeof (BenchCorpus))
+
+/*===========================================================================
+
+  bench_corpus_file
+
+  The name of a corpus file, which the caller must free
+
+===========================================================================*/
+static char *bench_corpus_file (const char *dir, const BenchCorpus *corpus,
+     int mb)
+  {
+  char num[12];
+  char *s = str2 (dir, "/");
+  char *s2 = str2 (s, corpus->name);
+  free (s);
+  s = str2 (s2, "-");
+  free (s2);
+  s2 = str2 (s, itoa (mb, num, 10));
+  free (s);
+  s = str2 (s2, "M.txt");
+  free (s2);
+  return s;
+  }
+
+/*===========================================================================
+
+  bench_generate
+
+  Write a corpus file, unless it is already there
+
+===========================================================================*/
+static BOOL bench_generate (const char *file, const BenchCorpus *corpus,
+     int mb)
+  {
+  if (access (file, R_OK) == 0) return TRUE;
+  FILE *f = fopen (file, "w");
+  if (!f) return FALSE;
+  fputs ("bute-bench: generating ", stderr);
+  fputs (file, stderr);
+  fputs ("\n", stderr);
+  fflush (stderr);
+  bench_seed = mb;
+  corpus->gen (f, mb);
+  fflush (f);
+  fclose (f);
+  return TRUE;
+  }
+
+/*===========================================================================
+
+  bench_keys
+
+  Make a session from a key sequence repeated n times
+
+===========================================================================*/
+static void bench_keys (BenchSession *session, const char *op,
+     const char *keys, int n)
+  {
+  int len = strlen (keys);
+  session->op = op;
+  session->len = len * n;
+  session->keys = malloc (session->len + 1);
+  for (int i = 0; i < n; i++)
+    memcpy (session->keys + i * len, keys, len);
+  }
+
+/*===========================================================================
+
+  bench_sessions
+
+  The editing sessions that are timed. The first, with no keys, times
+  opening the file
+
+===========================================================================*/
+static int bench_sessions (BenchSession *sessions)
+  {
+  int n = 0;
+  bench_keys (&sessions[n++], "open", "", 0);
+  // A page down and up redraws the whole screen
+  bench_keys (&sessions[n++], "page", "\033[6~", 100);
+  bench_keys (&sessions[n++], "scroll", "\033[B", 500);
+  // Half way along a long line, then back
+  bench_keys (&sessions[n++], "across", "\033[C", 2000);
+  bench_keys (&sessions[n++], "type", "the quick brown fox jumps over the "
+     "lazy dog. ", 40);
+  // A paste of 64kB, in 1kB lines
+  BenchSession *paste = &sessions[n++];
+  paste->op = "paste";
+  paste->len = 6 + 64 * 1024 + 6;
+  paste->keys = malloc (paste->len + 1);
+  memcpy (paste->keys, "\033[200~", 6);
+  for (int i = 0; i < 64 * 1024; i++)
+    paste->keys[6 + i] = i % 1024 == 1023 ? '\r' : 'a' + i % 26;
+  memcpy (paste->keys + 6 + 64 * 1024, "\033[201~", 6);
+  // A search typed a character at a time, and then the next 100 
+  //   matches; and one that finds nothing, as there are no capitals in
+  //   the text, so it looks through the whole file
+  BenchSession *search = &sessions[n++];
+  search->op = "search";
+  search->len = 4 + 100;
+  search->keys = malloc (search->len + 1);
+  memcpy (search->keys, "\006the", 4);
+  memset (search->keys + 4, 'F' - 64, 100);
+  bench_keys (&sessions[n++], "miss", "\006QZ\r", 1);
+  // A regular expression search for comments, and the next 100; and
+  //   one for a setting that isn't there, so looks through the file
+  BenchSession *regex = &sessions[n++];
+  regex->op = "regex";
+  regex->len = 7 + 100;
+  regex->keys = malloc (regex->len + 1);
+  memcpy (regex->keys, "\006\022^\\s*#", 7);
+  memset (regex->keys + 7, 'F' - 64, 100);
+  bench_keys (&sessions[n++], "regexmiss", "\006\022key\\s*=\\s*.*QZ\r", 1);
+  // Counting the matches of each, which looks through the whole file
+  bench_keys (&sessions[n++], "count", "\006the\016", 1);
+  bench_keys (&sessions[n++], "regexcount", "\006\022^\\s*#\016", 1);
+  // Counting a regular expression that matches many times in each
+  //   line, which in the long lines would take time in proportion to
+  //   the square of their length if each match looked back over its line
+  bench_keys (&sessions[n++], "regexmany", "\006\022[aeiou]\016", 1);
+  // The next 100 matches once they have all been counted, which the 
+  //   count of each line finds without looking through the lines 
+  //   between
+  BenchSession *indexed = &sessions[n++];
+  indexed->op = "indexed";
+  indexed->len = 5 + 100;
+  indexed->keys = malloc (indexed->len + 1);
+  memcpy (indexed->keys, "\006the\016", 5);
+  memset (indexed->keys + 5, 'F' - 64, 100);
+  return n;
+  }
+
+/*===========================================================================
+
+  bench_result
+
+===========================================================================*/
+static void bench_result (FILE *out, const char *corpus, int mb,
+     const char *op, long usec, long bytes, long writes)
+  {
+  char num[24];
+  fputs (VERSION "\t", out);
+  fputs (corpus, out);
+  fputs ("\t", out);
+  fputs (itoa (mb, num, 10), out);
+  fputs ("\t", out);
+  fputs (op, out);
+  fputs ("\t", out);
+  fputs (ltoa (usec, num, 10), out);
+  fputs ("\t", out);
+  fputs (ltoa (bytes, num, 10), out);
+  fputs ("\t", out);
+  fputs (ltoa (writes, num, 10), out);
+  fputs ("\n", out);
+  fflush (out);
+  }
+
+/*===========================================================================
+
+  bench_file_ops
+
+  Time loading and saving a file, without the editor. The file is 
+  loaded once before it is timed, as the first load of a file this size
+  spends most of its time growing the heap, which the editor sessions
+  that follow don't have to do
+
+===========================================================================*/
+static void bench_file_ops (FILE *out, const char *file, const char *dir,
+     const char *corpus, int mb)
+  {
+  TabStops *tab_stops = tab_stops_create (8);
+  TextFile *text_file = text_file_create ();
+  text_file_set_tab_stops (text_file, tab_stops);
+  text_file_set_load_threads (text_file, bench_threads);
+  text_file_set_large_min (text_file, bench_large_min);
+  text_file_load (text_file, file);
+  text_file_destroy (text_file);
+  text_file = text_file_create ();
+  text_file_set_tab_stops (text_file, tab_stops);
+  text_file_set_load_threads (text_file, bench_threads);
+  text_file_set_large_min (text_file, bench_large_min);
+  long start = bench_usec ();
+  text_file_load (text_file, file);
+  bench_result (out, corpus, mb, "load", bench_usec () - start, 0, 0);
+  char *saved = str2 (dir, "/saved.txt");
+  start = bench_usec ();
+  text_file_save (text_file, saved);
+  bench_result (out, corpus, mb, "save", bench_usec () - start, 0, 0);
+  free (saved);
+  text_file_destroy (text_file);
+  tab_stops_destroy (tab_stops);
+  }
+
+/*===========================================================================
+
+  bench_device_write
+
+===========================================================================*/
+static void bench_device_write (TerminalDevice *device, const char *s,
+     int len)
+  {
+  BenchDevice *self = (BenchDevice *)device;
+  self->vt->write (self->vt, s, len);
+  }
+
+/*===========================================================================
+
+  bench_device_read
+
+===========================================================================*/
+static int bench_device_read (TerminalDevice *device, char *s, int len)
+  {
+  BenchDevice *self = (BenchDevice *)device;
+  long now = bench_usec ();
+  if (self->first_look < 0)
+    {
+    self->first_look = now;
+    virtual_terminal_get_counts (self->virtual_terminal, 
+      &self->at_first_look);
+    }
+  // Replies to the editor's queries are read before any keys
+  if (self->first_read < 0 && self->vt->input_waiting (self->vt) == 0)
+    {
+    self->first_read = now;
+    virtual_terminal_get_counts (self->virtual_terminal, 
+      &self->at_first_read);
+    }
+  int n = self->vt->read (self->vt, s, len);
+  if (n < 0 && self->end < 0) self->end = now;
+  return n;
+  }
+
+/*===========================================================================
+
+  bench_device_input_waiting
+
+===========================================================================*/
+static int bench_device_input_waiting (const TerminalDevice *device)
+  {
+  // Asking changes nothing that the editor can see, but the first time
+  //   is noted
+  BenchDevice *self = (BenchDevice *)device;
+  if (self->first_look < 0)
+    {
+    self->first_look = bench_usec ();
+    virtual_terminal_get_counts (self->virtual_terminal, 
+      &self->at_first_look);
+    }
+  return self->vt->input_waiting (self->vt);
+  }
+
+/*===========================================================================
+
+  bench_device_get_size
+
+===========================================================================*/
+static void bench_device_get_size (const TerminalDevice *device, int *rows,
+     int *columns)
+  {
+  const BenchDevice *self = (const BenchDevice *)device;
+  self->vt->get_size (self->vt, rows, columns);
+  }
+
+/*===========================================================================
+
+  bench_session
+
+  Time an editing session, drawn on a virtual terminal
+
+===========================================================================*/
+static void bench_session (FILE *out, const char *file, 
+     const BenchSession *session, const char *corpus, int mb)
+  {
+  VirtualTerminal *vt = virtual_terminal_create (BENCH_ROWS, BENCH_COLUMNS);
+  virtual_terminal_set_keys (vt, session->keys, session->len);
+  BenchDevice device;
+  memset (&device, 0, sizeof (device));
+  device.parent.write = bench_device_write;
+  device.parent.read = bench_device_read;
+  device.parent.input_waiting = bench_device_input_waiting;
+  device.parent.get_size = bench_device_get_size;
+  device.vt = virtual_terminal_get_device (vt);
+  device.virtual_terminal = vt;
+  device.first_look = -1;
+  device.first_read = -1;
+  device.end = -1;
+  BUTE *bute = bute_create ();
+  bute_set_device (bute, &device.parent);
+  bute_set_load_threads (bute, bench_threads);
+  bute_set_large_min (bute, bench_large_min);
+  char *error = NULL;
+  long start = bench_usec ();
+  if (bute_run (bute, file, &error) == BUTE_RET_ERR)
+    {
+    fputs ("bute-bench: ", stderr);
+    fputs (error, stderr);
+    fputs ("\n", stderr);
+    free (error);
+    }
+  else if (session->len == 0)
+    {
+    const VirtualTerminalCounts *counts = &device.at_first_look;
+    bench_result (out, corpus, mb, session->op, device.first_look - start,
+      counts->bytes, counts->writes);
+    VirtualTerminalCounts end_counts;
+    virtual_terminal_get_counts (vt, &end_counts);
+    bench_result (out, corpus, mb, "loaded", device.end - start,
+      end_counts.bytes, end_counts.writes);
+    }
+  else
+    {
+    VirtualTerminalCounts counts;
+    virtual_terminal_get_counts (vt, &counts);
+    bench_result (out, corpus, mb, session->op, 
+      device.end - device.first_read,
+      counts.bytes - device.at_first_read.bytes,
+      counts.writes - device.at_first_read.writes);
+    }
+  bute_destroy (bute);
+  virtual_terminal_destroy (vt);
+  }
+
+/*===========================================================================
+
+  bench_wanted
+
+  Whether a name is in a comma-separated list
+
+===========================================================================*/
+static BOOL bench_wanted (const char *list, const char *name)
+  {
+  int len = strlen (name);
+  for (const char *s = list; s; s = strchr (s, ','))
+    {
+    if (*s == ',') s++;
+    if (strncmp (s, name, len) == 0 && (s[len] == ',' || s[len] == 0))
+      return TRUE;
+    }
+  return FALSE;
+  }
+
+/*===========================================================================
+
+  bench_usage
+
+===========================================================================*/
+static void bench_usage (FILE *f)
+  {
+  fputs ("usage: bute-bench [options]\n", f);
+  fputs ("  -c LIST  Corpora to use, from short,long,tabs,binary,\n"
+    "           config\n", f);
+  fputs ("  -d DIR   Directory for the corpus files (bench/corpus)\n", f);
+  fputs ("  -j N     Load files with N threads (one per CPU)\n", f);
+  fputs ("  -L N     Treat files bigger than N MB as large\n", f);
+  fputs ("  -s LIST  Sizes of corpus, in megabytes (1,16)\n", f);
+  fflush (f);
+  }
+
+/*===========================================================================
+
+  main
+
+===========================================================================*/
+int main (int argc, char **argv)
+  {
+  const char *dir = "bench/corpus";
+  const char *corpora = NULL;
+  char *sizes = strdup ("1,16");
+  int opt;
+  while ((opt = getopt (argc, argv, "c:d:j:L:s:")) != -1)
+    {
+    switch (opt)
+      {
+      case 'c': corpora = optarg; break;
+      case 'd': dir = optarg; break;
+      case 'j': bench_threads = atoi (optarg); break;
+      case 'L': bench_large_min = (off64_t)atoi (optarg) * 1024 * 1024; break;
+      case 's': free (sizes); sizes = strdup (optarg); break;
+      default: bench_usage (stderr); exit (1);
+      }
+    }
+
+  clock_gettime (CLOCK_MONOTONIC, &bench_start);
+  BenchSession sessions[14];
+  int nsessions = bench_sessions (sessions);
+  FILE *out = stdout;
+  fputs ("version\tcorpus\tmb\top\tusec\tbytes\twrites\n", out);
+
+  for (char *size = strtok (sizes, ","); size; size = strtok (NULL, ","))
+    {
+    int mb = atoi (size);
+    if (mb <= 0) continue;
+    for (int c = 0; c < BENCH_NCORPORA; c++)
+      {
+      const BenchCorpus *corpus = &bench_corpora[c];
+      if (corpora && !bench_wanted (corpora, corpus->name)) continue;
+      char *file = bench_corpus_file (dir, corpus, mb);
+      if (bench_generate (file, corpus, mb))
+        {
+        bench_file_ops (out, file, dir, corpus->name, mb);
+        for (int s = 0; s < nsessions; s++)
+          bench_session (out, file, &sessions[s], corpus->name, mb);
+        }
+      else
+        {
+        fputs ("bute-bench: can't write ", stderr);
+        fputs (file, stderr);
+        fputs ("\n", stderr);
+        fflush (stderr);
+        }
+      free (file);
+      }
+    }
+
+  for (int s = 0; s < nsessions; s++)
+    free (sessions[s].keys);
+  free (sizes);
+  exit (0);
+  }
+
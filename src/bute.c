@@ -18,8 +18,14 @@
 ===========================================================================*/
 #include "cnolib.h"
 #include "textfile.h"
+#include "wrapindex.h"
+#include "search.h"
+#include "matchindex.h"
+#include "utf8.h"
 #include "terminal.h"
 #include "linuxterminal.h"
+#include "keylog.h"
+#include "keystats.h"
 #include "bute.h"
 
 typedef enum _ButeEditMode
@@ -28,10 +34,23 @@ typedef enum _ButeEditMode
   BUTE_EDIT_MODE_REPLACE = 1
   } ButeEditMode;
 
+// The steps of a replace: typing the pattern, which is a search like any
+//   other, then typing what to replace it with, then asking, at each 
+//   match, whether to replace it
+typedef enum _ButeReplace
+  {
+  BUTE_REPLACE_NONE = 0,
+  BUTE_REPLACE_PATTERN = 1,
+  BUTE_REPLACE_WITH = 2,
+  BUTE_REPLACE_ASK = 3
+  } ButeReplace;
+
 struct _BUTE
   {
-  // Top line of the file that is visible on screen
+  // Top line of the file that is visible on screen, and when lines are
+  //   wrapped, the row of that line that is at the top of the screen
   int file_top_row;
+  int top_sub;
   // Line of the file that corresponds to the cursor position
   int file_row;
   // Row on the screen containing the cursor position
@@ -39,6 +58,15 @@ struct _BUTE
 
   int file_col;
   int screen_col;
+  // Column of the lines that is shown at the left edge of the screen,
+  //   and how far the view moves sideways when the cursor leaves it
+  int left_col;
+  int h_jump;
+  // If lines are wrapped, the number of rows each line takes up. Rows 
+  //   are counted from the start of the file through this. Without 
+  //   wrapping, each line is one row, and this is NULL
+  WrapIndex *wrap;
+  BOOL wrap_lines;
 
   ButeEditMode edit_mode;
 
@@ -48,12 +76,80 @@ struct _BUTE
   char *filename;
 
   BOOL did_save; // Set if we modified and saved a file successfully
+  BOOL serial; // Set to use the terminal's serial line profile
+  TerminalDevice *device; // Used in place of the process's terminal
+  // The log that keys are recorded to, or replayed from. key_from_log
+  //   is set if the last key came from the log
+  KeyLog *key_log;
+  BOOL key_from_log;
+  // Where the time and output for each key are counted, if anywhere,
+  //   and whether to show them on the status line
+  KeyStats *key_stats;
+  BOOL hud;
+  TabStops *tab_stops;
+  int load_threads; // Threads to load the file with, zero for automatic
+  off64_t large_min; // Size of a large file, -1 for automatic
+  BOOL redraw_pending; // Set if the terminal dropped a frame
+  // The bytes of a UTF-8 character that has not all arrived yet. Each
+  //   byte comes from the terminal as a separate key
+  char partial[4];
+  int partial_len;
+  // While a search is being typed: the pattern, which way it goes, and
+  //   where the search started, with the view as it was then. For each
+  //   length of the pattern so far, where its match was, or the match 
+  //   before it if it had none, so that deleting a character of the 
+  //   pattern goes back there. search_last is the last pattern looked
+  //   for, which a search that is started again straight away repeats.
+  //   A regular expression that can't be compiled, as it usually can't
+  //   while it is being typed, has no Search, and search_error says why.
+  //   matches counts the matches in each line, of the pattern, or once
+  //   the search has ended, of the last; it is built while there is 
+  //   nothing else to do, and kept up to date as the file changes
+  BOOL searching;
+  BOOL search_back;
+  BOOL search_regex;
+  Search *search;
+  const char *search_error;
+  char *search_text;
+  int search_len;
+  int search_size;
+  int *search_rows;
+  int *search_cols;
+  BOOL *search_failed;
+  int search_top_row;
+  int search_top_sub;
+  int search_left_col;
+  char *search_last;
+  int search_last_len;
+  BOOL search_last_regex;
+  MatchIndex *matches;
+  // While replacing, which step it is at, the text to replace matches 
+  //   with, the length of the match the cursor is at, and where the 
+  //   last match that wasn't empty ended, or -1. replaced is how many 
+  //   have been replaced, to be shown when it ends, or -1
+  ButeReplace replacing;
+  char *replace_text;
+  int replace_len;
+  int replace_size;
+  int replace_match_len;
+  int replace_end_row;
+  int replace_end_col;
+  int replaced;
+#ifdef DEBUG
+  unsigned long refresh_mallocs; // Allocations by the last refresh
+#endif
   };
 
 static void bute_refresh_terminal (BUTE *self, int top); // FWD
+static void bute_draw_row (BUTE *self, int screen_row, int row, 
+     int left); // FWD
 static void bute_write_status (const BUTE *self, const char *msg, 
      BOOL preserve_cursor); // FWD
 static void bute_screen_pos_from_file_pos (BUTE *self); // FWD
+static void bute_show_file_position (const BUTE *self); // FWD
+static void bute_frame_sent (BUTE *self); // FWD
+static Search *bute_search_create (BUTE *self); // FWD
+static void bute_search_status (const BUTE *self); // FWD
 
 /*===========================================================================
 
@@ -64,6 +160,7 @@ BUTE *bute_create (void)
   {
   BUTE *self = malloc (sizeof (BUTE));
   memset (self, 0, sizeof (BUTE));
+  self->large_min = -1;
   return self;
   }
 
@@ -77,32 +174,301 @@ void bute_destroy (BUTE *self)
   if (self)
     {
     if (self->filename) free (self->filename);
+    if (self->tab_stops) tab_stops_destroy (self->tab_stops);
     free (self);
     }
   }
 
+/*===========================================================================
+
+  bute_set_serial
+
+===========================================================================*/
+void bute_set_serial (BUTE *self, BOOL serial)
+  {
+  self->serial = serial;
+  }
+
+/*===========================================================================
+
+  bute_set_device
+
+===========================================================================*/
+void bute_set_device (BUTE *self, TerminalDevice *device)
+  {
+  self->device = device;
+  }
+
+/*===========================================================================
+
+  bute_set_key_log
+
+===========================================================================*/
+void bute_set_key_log (BUTE *self, KeyLog *key_log)
+  {
+  self->key_log = key_log;
+  }
+
+/*===========================================================================
+
+  bute_set_key_stats
+
+===========================================================================*/
+void bute_set_key_stats (BUTE *self, KeyStats *key_stats, BOOL hud)
+  {
+  self->key_stats = key_stats;
+  self->hud = hud;
+  }
+
+/*===========================================================================
+
+  bute_set_tab_stops
+
+===========================================================================*/
+void bute_set_tab_stops (BUTE *self, TabStops *tab_stops)
+  {
+  if (self->tab_stops) tab_stops_destroy (self->tab_stops);
+  self->tab_stops = tab_stops;
+  }
+
+/*===========================================================================
+
+  bute_set_wrap
+
+===========================================================================*/
+void bute_set_wrap (BUTE *self, BOOL wrap)
+  {
+  self->wrap_lines = wrap;
+  }
+
+/*===========================================================================
+
+  bute_set_load_threads
+
+===========================================================================*/
+void bute_set_load_threads (BUTE *self, int load_threads)
+  {
+  self->load_threads = load_threads;
+  }
+
+/*===========================================================================
+
+  bute_set_large_min
+
+===========================================================================*/
+void bute_set_large_min (BUTE *self, off64_t large_min)
+  {
+  self->large_min = large_min;
+  }
+
+/*===========================================================================
+
+  bute_set_h_jump
+
+===========================================================================*/
+void bute_set_h_jump (BUTE *self, int h_jump)
+  {
+  self->h_jump = h_jump;
+  }
+
+/*===========================================================================
+
+  bute_rows_before
+
+  The screen row at which a line starts, counting rows from the start of
+  the file. This is the line number, unless lines are wrapped
+
+===========================================================================*/
+static int bute_rows_before (const BUTE *self, int row)
+  {
+  if (self->wrap) return wrap_index_rows_before (self->wrap, row);
+  return row;
+  }
+
+/*===========================================================================
+
+  bute_line_at
+
+  The line at a screen row counted from the start of the file, and in
+  *sub, the row within that line
+
+===========================================================================*/
+static int bute_line_at (const BUTE *self, int row, int *sub)
+  {
+  if (self->wrap) return wrap_index_line_at (self->wrap, row, sub);
+  *sub = 0;
+  return row;
+  }
+
+/*===========================================================================
+
+  bute_top_row
+
+  The row at the top of the screen, counting from the start of the file
+
+===========================================================================*/
+static int bute_top_row (const BUTE *self)
+  {
+  return bute_rows_before (self, self->file_top_row) + self->top_sub;
+  }
+
+/*===========================================================================
+
+  bute_file_pos_row
+
+  The row of the file position, counting from the start of the file
+
+===========================================================================*/
+static int bute_file_pos_row (const BUTE *self)
+  {
+  int row = bute_rows_before (self, self->file_row);
+  if (self->wrap)
+    row += text_file_get_display_col (self->text_file, self->file_row, 
+      self->file_col) / wrap_index_get_columns (self->wrap);
+  return row;
+  }
+
+/*===========================================================================
+
+  bute_set_top_row
+
+  Set the row at the top of the screen, counting from the start of 
+  the file
+
+===========================================================================*/
+static void bute_set_top_row (BUTE *self, int top)
+  {
+  self->file_top_row = bute_line_at (self, top, &self->top_sub);
+  }
+
+/*===========================================================================
+
+  bute_clamp_top
+
+  The line at the top of the screen might have become shorter, or been
+  deleted, so that the top row is no longer part of it
+
+===========================================================================*/
+static void bute_clamp_top (BUTE *self)
+  {
+  int nlines = text_file_get_line_count (self->text_file);
+  if (self->file_top_row >= nlines)
+    {
+    self->file_top_row = nlines > 0 ? nlines - 1 : 0;
+    self->top_sub = 0;
+    }
+  int nrows = wrap_index_get_rows (self->wrap, self->file_top_row);
+  if (self->top_sub >= nrows) self->top_sub = nrows - 1;
+  }
+
+/*===========================================================================
+
+  bute_lines_changed
+
+  Lines have been added or removed
+
+===========================================================================*/
+static void bute_lines_changed (BUTE *self)
+  {
+  if (self->wrap)
+    {
+    wrap_index_update (self->wrap, self->text_file);
+    bute_clamp_top (self);
+    }
+  }
+
+/*===========================================================================
+
+  bute_line_changed
+
+  A line has been edited. Returns TRUE if it now takes up a different 
+  number of rows, so the lines below it have moved
+
+===========================================================================*/
+static BOOL bute_line_changed (BUTE *self, int row)
+  {
+  if (!self->wrap) return FALSE;
+  int before = wrap_index_get_rows (self->wrap, row);
+  wrap_index_update_line (self->wrap, self->text_file, row);
+  if (wrap_index_get_rows (self->wrap, row) == before) return FALSE;
+  bute_clamp_top (self);
+  return TRUE;
+  }
+
+/*===========================================================================
+
+  bute_follow_cursor
+
+  Move the view, if need be, so that the file position is on the screen.
+  Vertically, the view moves just far enough. Sideways, it moves in 
+  steps of h_jump columns, so moving or typing along a long line redraws
+  the screen only once in every step. Returns TRUE if the view moved, in
+  which case the caller must redraw the screen.
+
+===========================================================================*/
+static BOOL bute_follow_cursor (BUTE *self)
+  {
+  int rows = 24; int columns = 80;
+  self->terminal->get_size (self->terminal, &rows, &columns, NULL);
+  BOOL moved = FALSE;
+
+  int top = bute_top_row (self);
+  int row = bute_file_pos_row (self);
+  if (row < top)
+    top = row;
+  else if (row >= top + rows - 1)
+    top = row - (rows - 1) + 1;
+  if (top != bute_top_row (self))
+    {
+    bute_set_top_row (self, top);
+    moved = TRUE;
+    }
+
+  // Wrapped lines never need to move sideways
+  if (self->wrap) return moved;
+
+  int jump = self->h_jump > 0 ? self->h_jump : columns / 2;
+  if (jump > columns) jump = columns;
+  if (jump < 1) jump = 1;
+
+  int col = text_file_get_display_col (self->text_file, 
+    self->file_row, self->file_col);
+  int left = self->left_col;
+  if (col < left)
+    left = col / jump * jump;
+  else if (col >= left + columns)
+    left = ((col - columns) / jump + 1) * jump;
+  if (left != self->left_col)
+    {
+    self->left_col = left;
+    self->terminal->set_left_col (self->terminal, left);
+    moved = TRUE;
+    }
+  return moved;
+  }
+
 /*===========================================================================
 
   bute_screen_pos_from_file_pos
 
-  Sets the screen cursor from the file position. It is assumed that the
-  top row (file_top_row) has been set correctly before calling this 
-  function
+  Sets the screen cursor from the file position, and moves the view if
+  the position is off the screen
 
 ===========================================================================*/
 void bute_screen_pos_from_file_pos (BUTE *self)
   {
-  const TextFile *text_file = self->text_file;
-  // TODO -- allow for line scrolling
-  self->screen_col = self->file_col;
-
-  const char *this_line = text_file_get_line (text_file, self->file_row);
-  self->screen_col = self->terminal->get_displayed_length (self->terminal,
-    this_line, self->file_col);
+  if (bute_follow_cursor (self))
+    bute_refresh_terminal (self, self->file_top_row);
+  int col = text_file_get_display_col (self->text_file, 
+    self->file_row, self->file_col);
+  if (self->wrap)
+    self->screen_col = col % wrap_index_get_columns (self->wrap);
+  else
+    self->screen_col = col - self->left_col;
+  self->screen_row = bute_file_pos_row (self) - bute_top_row (self);
 
   self->terminal->set_cursor 
-        (self->terminal, self->file_row - self->file_top_row, 
-	   self->screen_col);
+        (self->terminal, self->screen_row, self->screen_col);
   }
 
 /*===========================================================================
@@ -124,6 +490,31 @@ static void bute_cursor_limit_right (BUTE *self)
     } 
   }
 
+/*===========================================================================
+
+  bute_move_page
+
+  Move the view, and the file position with it, to put row 'top' at the
+  top of the screen, and the position on row 'row'. Rows are counted 
+  from the start of the file
+
+===========================================================================*/
+static void bute_move_page (BUTE *self, int top, int row)
+  {
+  bute_set_top_row (self, top);
+  int sub;
+  self->file_row = bute_line_at (self, row, &sub);
+  // Stay in the same screen column
+  int left = self->wrap ? sub * wrap_index_get_columns (self->wrap)
+    : self->left_col;
+  self->file_col = text_file_get_col_at_display (self->text_file, 
+    self->file_row, left + self->screen_col);
+  bute_cursor_limit_right (self);
+  bute_follow_cursor (self);
+  bute_refresh_terminal (self, self->file_top_row);
+  bute_screen_pos_from_file_pos (self);
+  }
+
 /*===========================================================================
 
   bute_cursor_pgdn
@@ -138,20 +529,18 @@ static void bute_cursor_pgdn (BUTE *self)
   int nlines = text_file_get_line_count (text_file);
   if (self->file_row < nlines - 1)
     {
-    self->file_row += rows - 1;
-    self->file_top_row += rows - 1;
+    int top = bute_top_row (self) + rows - 1;
+    int row = bute_file_pos_row (self) + rows - 1;
+    int end = bute_rows_before (self, nlines);
 
-    if (self->file_row >= nlines)
+    if (row >= end)
       {
-      self->file_row = nlines - 1; 
-      self->file_top_row = self->file_row - rows + 2;
-      if (self->file_top_row < 0) self->file_top_row = 0;
+      row = end - 1;
+      top = row - rows + 2;
+      if (top < 0) top = 0;
       }
   
-    self->screen_row = self->file_row - self->file_top_row;
-    bute_refresh_terminal (self, self->file_top_row);
-    bute_cursor_limit_right (self);
-    bute_screen_pos_from_file_pos (self);
+    bute_move_page (self, top, row);
     }
   }
 
@@ -167,22 +556,37 @@ static void bute_cursor_pgup (BUTE *self)
     int rows = 24; int columns;
     self->terminal->get_size (self->terminal, &rows, &columns, NULL);
 
-    self->file_row -= rows - 1;
-    self->file_top_row -= rows - 1;
+    int top = bute_top_row (self) - (rows - 1);
+    int row = bute_file_pos_row (self) - (rows - 1);
 
-    if (self->file_top_row < 0)
+    if (top < 0)
       {
-      self->file_row = 0; 
-      self->file_top_row = 0;
+      row = 0; 
+      top = 0;
       }
   
-    self->screen_row = self->file_row - self->file_top_row;
-    bute_refresh_terminal (self, self->file_top_row);
-    bute_cursor_limit_right (self);
-    bute_screen_pos_from_file_pos (self);
+    bute_move_page (self, top, row);
     }
   }
 
+/*===========================================================================
+
+  bute_move_to_row
+
+  Move the file position to another line, keeping it in the same screen
+  column if the line is long enough. The position in bytes would not do,
+  because characters can take up more than one byte
+
+===========================================================================*/
+static void bute_move_to_row (BUTE *self, int row)
+  {
+  int dcol = text_file_get_display_col (self->text_file, self->file_row,
+    self->file_col);
+  self->file_row = row;
+  self->file_col = text_file_get_col_at_display (self->text_file, row, 
+    dcol);
+  }
+
 /*===========================================================================
 
   bute_cursor_down
@@ -191,23 +595,9 @@ static void bute_cursor_pgup (BUTE *self)
 static void bute_cursor_down (BUTE *self)
   {
   const TextFile *text_file = self->text_file;
-  int rows; int columns = 80;
-  self->terminal->get_size (self->terminal, &rows, &columns, NULL);
-
   int nlines = text_file_get_line_count (text_file);
   if (self->file_row < nlines - 1)
-    {
-    self->file_row++;
-    if (self->file_row - self->file_top_row < rows - 1)
-      {
-      }
-    else
-      {
-      self->file_top_row++;
-      bute_refresh_terminal (self, self->file_top_row);
-      }
-    }
-  self->screen_row = self->file_row - self->file_top_row;
+    bute_move_to_row (self, self->file_row + 1);
   bute_cursor_limit_right (self);
   bute_screen_pos_from_file_pos (self);
   }
@@ -219,19 +609,8 @@ static void bute_cursor_down (BUTE *self)
 ===========================================================================*/
 static void bute_cursor_up (BUTE *self)
   {
-  Terminal *terminal = self->terminal;
-  int rows; int columns = 80;
-  terminal->get_size (terminal, &rows, &columns, NULL);
   if (self->file_row > 0) 
-    {
-    self->file_row--;
-    if (self->file_row < self->file_top_row)
-      {
-      self->file_top_row--;
-      bute_refresh_terminal (self, self->file_top_row); 
-      }
-    }
-  self->screen_row = self->file_row - self->file_top_row;
+    bute_move_to_row (self, self->file_row - 1);
   bute_cursor_limit_right (self);
   bute_screen_pos_from_file_pos (self);
   }
@@ -243,10 +622,10 @@ static void bute_cursor_up (BUTE *self)
 ===========================================================================*/
 static void bute_cursor_left (BUTE *self)
   {
-  // TODO handle left-scrolled line
   if (self->file_col > 0)
     {
-    self->file_col--;
+    self->file_col = utf8_prev (text_file_get_line 
+      (self->text_file, self->file_row), self->file_col);
     }
   bute_screen_pos_from_file_pos (self);
   }
@@ -259,335 +638,1798 @@ static void bute_cursor_left (BUTE *self)
 static void bute_cursor_right (BUTE *self)
   {
   const TextFile *text_file = self->text_file;
+  const char *this_line = text_file_get_line (text_file, self->file_row);
+  int this_len = strlen (this_line);
+  if (self->file_col < this_len/* - 1*/)
+    {
+    self->file_col = utf8_next (this_line, self->file_col);
+    bute_screen_pos_from_file_pos (self);
+    }
+  }
+
+/*===========================================================================
+
+  bute_redraw_wrapped
+
+  Redraw the rows of the cursor line, when lines are wrapped, after it 
+  has changed from character 'from' onwards. If the line now takes a
+  different number of rows, the lines below it have moved, and the whole
+  screen is redrawn.
+
+===========================================================================*/
+static void bute_redraw_wrapped (BUTE *self, int from)
+  {
   Terminal *terminal = self->terminal;
-  int rows; int columns = 80;
+  int rows = 24; int columns;
   terminal->get_size (terminal, &rows, &columns, NULL);
+  if (bute_line_changed (self, self->file_row))
+    {
+    bute_follow_cursor (self);
+    bute_refresh_terminal (self, self->file_top_row);
+    return;
+    }
+
+  int width = wrap_index_get_columns (self->wrap);
+  const char *line = text_file_get_line (self->text_file, self->file_row);
+  int dcol = text_file_get_display_col (self->text_file, self->file_row, 
+    from);
+  int first = bute_rows_before (self, self->file_row) - bute_top_row (self);
+  int nrows = wrap_index_get_rows (self->wrap, self->file_row);
+  for (int sub = dcol / width; sub < nrows && first + sub < rows - 1; sub++)
+    {
+    if (first + sub < 0) continue;
+    if (sub == dcol / width)
+      {
+      terminal->set_left_col (terminal, sub * width);
+      terminal->write_line_from (terminal, first + sub, line, from, dcol, -1);
+      }
+    else
+      bute_draw_row (self, first + sub, self->file_row, sub * width);
+    }
+  }
+
+/*===========================================================================
+
+  bute_insert_char 
+
+  If the rest of the line is ASCII, with no tabs, it just moves one cell
+  to the right, so the terminal can shift it for us. Otherwise tab 
+  expansion might change, or a wide character might not fit at the 
+  edge, and the rest of the line is redrawn.
+
+===========================================================================*/
+static void bute_insert_char (BUTE *self, int c)
+  {
+  TextFile *text_file = self->text_file;
+  Terminal *terminal = self->terminal;
+
+  text_file_insert_char (text_file, self->file_row, self->file_col, c);
   const char *this_line = text_file_get_line (text_file, self->file_row);
-  int this_len = strlen (this_line);
-  if (self->screen_col >= columns - 1)
+  int dcol = self->left_col + self->screen_col;
+  if (self->wrap)
+    {
+    bute_redraw_wrapped (self, self->file_col);
+    }
+  else if (this_line[self->file_col 
+             + utf8_plain_run (this_line + self->file_col, -1)] == 0)
+    {
+    terminal->set_cursor (terminal, self->screen_row, self->screen_col);
+    terminal->insert_chars (terminal, 1);
+    terminal->write_line_from (terminal, self->screen_row, this_line,
+      self->file_col, dcol, 1);
+    }
+  else
+    {
+    terminal->write_line_from (terminal, self->screen_row, this_line,
+      self->file_col, dcol, -1);
+    }
+  self->file_col++;
+  bute_screen_pos_from_file_pos (self);
+  }
+
+/*===========================================================================
+
+  bute_relace_char 
+
+  Only one cell changes, unless a tab is replaced, or replaces
+  something else.
+
+===========================================================================*/
+static void bute_replace_char (BUTE *self, int c)
+  {
+  TextFile *text_file = self->text_file;
+  Terminal *terminal = self->terminal;
+  const char *this_line = text_file_get_line (text_file, self->file_row);
+  int old = 0;
+  if (self->file_col < strlen (this_line)) old = this_line[self->file_col];
+  text_file_replace_char (text_file, self->file_row, self->file_col, c);
+  this_line = text_file_get_line (text_file, self->file_row);
+  int dcol = self->left_col + self->screen_col;
+  if (self->wrap)
+    bute_redraw_wrapped (self, self->file_col);
+  else if (c != '\t' && old != '\t')
+    terminal->write_line_from (terminal, self->screen_row, this_line,
+      self->file_col, dcol, 1);
+  else
+    terminal->write_line_from (terminal, self->screen_row, this_line,
+      self->file_col, dcol, -1);
+  self->file_col++;
+  bute_screen_pos_from_file_pos (self);
+  }
+
+/*===========================================================================
+
+  bute_insert_or_replace_text
+
+  Insert a character that takes more than one byte, or replace the
+  character at the cursor with it. A plain character that replaces a
+  multi-byte one comes here too. The width of the rest of the line may
+  change, so all of it is redrawn.
+
+===========================================================================*/
+static void bute_insert_or_replace_text (BUTE *self, const char *s, 
+      int len)
+  {
+  TextFile *text_file = self->text_file;
+  Terminal *terminal = self->terminal;
+  const char *this_line = text_file_get_line (text_file, self->file_row);
+  if (self->edit_mode == BUTE_EDIT_MODE_REPLACE && this_line[self->file_col])
+    {
+    text_file_delete_text (text_file, self->file_row, self->file_col,
+      utf8_next (this_line, self->file_col) - self->file_col);
+    }
+  text_file_insert_text (text_file, self->file_row, self->file_col, 
+    s, len);
+  if (self->wrap)
+    bute_redraw_wrapped (self, self->file_col);
+  else
+    terminal->write_line_from (terminal, self->screen_row, 
+      text_file_get_line (text_file, self->file_row), self->file_col, 
+      self->left_col + self->screen_col, -1);
+  self->file_col += len;
+  bute_screen_pos_from_file_pos (self);
+  }
+
+/*===========================================================================
+
+  bute_insert_or_relace_char 
+
+===========================================================================*/
+static void bute_insert_or_replace_char (BUTE *self, int c)
+  {
+  if (self->edit_mode == BUTE_EDIT_MODE_REPLACE)
+    {
+    const char *this_line = text_file_get_line (self->text_file, 
+      self->file_row);
+    char s = (char)c;
+    if ((unsigned char)this_line[self->file_col] >= 0x80)
+      bute_insert_or_replace_text (self, &s, 1);
+    else
+      bute_replace_char (self, c);
+    }
+  else
+    bute_insert_char (self, c);
+  }
+
+/*===========================================================================
+
+  bute_utf8_key
+
+  Collect the bytes of a UTF-8 character as they arrive, and insert it
+  when it is complete. Bytes that are not part of a valid character are
+  dropped
+
+===========================================================================*/
+static void bute_utf8_key (BUTE *self, int c)
+  {
+  if ((c & 0xC0) == 0x80 && self->partial_len > 0)
+    self->partial[self->partial_len++] = (char)c;
+  else if (utf8_seq_len (c) > 1)
+    {
+    self->partial[0] = (char)c;
+    self->partial_len = 1;
+    }
+  else
+    {
+    self->partial_len = 0;
+    return;
+    }
+  int len = self->partial_len;
+  if (len == utf8_seq_len (self->partial[0]))
+    {
+    self->partial_len = 0;
+    if (utf8_char (self->partial, NULL) == len)
+      bute_insert_or_replace_text (self, self->partial, len);
+    }
+  }
+
+/*===========================================================================
+
+  bute_insert_newline
+
+===========================================================================*/
+static void bute_insert_newline (BUTE *self)
+  {
+  TextFile *text_file = self->text_file;
+  text_file_insert_newline (text_file, self->file_row, self->file_col);
+  self->file_col = 0;
+  self->file_row++; 
+  bute_lines_changed (self);
+  bute_follow_cursor (self);
+  bute_refresh_terminal (self, self->file_top_row); 
+  bute_screen_pos_from_file_pos (self);
+  }
+
+/*===========================================================================
+
+  bute_load_part
+
+  Load the next part of a file that is being loaded a part at a time
+
+===========================================================================*/
+static BOOL bute_load_part (BUTE *self)
+  {
+  BOOL ok = text_file_load_more (self->text_file);
+  if (self->wrap) wrap_index_add_lines (self->wrap, self->text_file);
+  return ok;
+  }
+
+/*===========================================================================
+
+  bute_load_failed
+
+===========================================================================*/
+static void bute_load_failed (BUTE *self)
+  {
+  char *mesg = str2 ("Can't read all of the file: ", strerror (errno));
+  bute_write_status (self, mesg, TRUE);
+  free (mesg);
+  }
+
+/*===========================================================================
+
+  bute_load_ahead
+
+  Make sure that the lines on the screen, and a screenful after them, 
+  are loaded, so that moving and editing don't reach the end of what is
+  loaded before the end of the file
+
+===========================================================================*/
+static void bute_load_ahead (BUTE *self)
+  {
+  TextFile *text_file = self->text_file;
+  if (!text_file_is_loading (text_file)) return;
+  int rows = 24; int columns = 80;
+  self->terminal->get_size (self->terminal, &rows, &columns, NULL);
+  while (text_file_is_loading (text_file) 
+      && (int)text_file_get_line_count (text_file) 
+           < self->file_top_row + 2 * rows)
+    {
+    if (!bute_load_part (self))
+      {
+      bute_load_failed (self);
+      return;
+      }
+    }
+  if (!text_file_is_loading (text_file)) bute_show_file_position (self);
+  }
+
+/*===========================================================================
+
+  bute_load_idle
+
+  Load the next part of the file while there is no key to deal with, 
+  and show how much is loaded
+
+===========================================================================*/
+static void bute_load_idle (BUTE *self)
+  {
+  Terminal *terminal = self->terminal;
+  int rows = 24; int columns = 80;
+  terminal->get_size (terminal, &rows, &columns, NULL);
+  int before = text_file_get_line_count (self->text_file);
+  terminal->begin_frame (terminal);
+  BOOL ok = bute_load_part (self);
+  // Only lines that go where the screen is empty need drawing
+  if (before < self->file_top_row + rows - 1 || self->redraw_pending)
+    bute_refresh_terminal (self, self->file_top_row);
+  if (!ok)
+    bute_load_failed (self);
+  else if (text_file_is_loading (self->text_file))
+    {
+    char s[40];
+    strcpy (s, "Loading ");
+    itoa (text_file_get_load_percent (self->text_file), s + strlen (s), 10);
+    strcat (s, "%...");
+    bute_write_status (self, s, TRUE);
+    }
+  else
+    bute_show_file_position (self);
+  self->redraw_pending = !terminal->end_frame (terminal);
+  bute_frame_sent (self);
+  }
+
+/*===========================================================================
+
+  bute_search_idle
+
+  Count the matches of the pattern being searched for in some more of
+  the file, while there is no key to deal with, and show how many there
+  are when they have all been counted. Returns FALSE if there are none
+  to count
+
+===========================================================================*/
+static BOOL bute_search_idle (BUTE *self)
+  {
+  if (!self->searching || !self->search || self->search_len == 0
+       || (self->matches && match_index_is_complete (self->matches)))
+    return FALSE;
+  if (!self->matches) 
+    self->matches = match_index_create (bute_search_create (self), 
+      self->text_file);
+  Terminal *terminal = self->terminal;
+  terminal->begin_frame (terminal);
+  if (match_index_count_more (self->matches)) bute_search_status (self);
+  self->redraw_pending = !terminal->end_frame (terminal);
+  bute_frame_sent (self);
+  return TRUE;
+  }
+
+/*===========================================================================
+
+  bute_read_key
+
+  Get a key from the log being replayed, if there is one, and then from
+  the terminal. Keys from the terminal are recorded, if a log is being
+  recorded. The file goes on loading until a key arrives, and then the
+  matches of a search are counted. Nothing is using any lines of the 
+  file at this point, so the parts of a large file that are out of 
+  sight, and unchanged, are dropped
+
+===========================================================================*/
+static int bute_read_key (BUTE *self)
+  {
+  Terminal *terminal = self->terminal;
+  KeyLog *key_log = self->key_log;
+  int rows = 24; int columns = 80;
+  terminal->get_size (terminal, &rows, &columns, NULL);
+  text_file_trim (self->text_file, self->file_top_row, rows);
+  if (key_log && key_log_is_replaying (key_log))
+    {
+    int c = key_log_get_key (key_log);
+    self->key_from_log = c != VK_EOF;
+    if (self->key_from_log) return c;
+    }
+  int c;
+  do
+    {
+    while (!terminal->key_waiting (terminal))
+      {
+      if (text_file_is_loading (self->text_file))
+        bute_load_idle (self);
+      else if (!bute_search_idle (self))
+        break;
+      }
+    c = terminal->read_key (terminal);
+    } while (c == VK_NONE);
+  if (key_log && !key_log_is_replaying (key_log) && c != VK_EOF)
+    key_log_put_key (key_log, c);
+  return c;
+  }
+
+/*===========================================================================
+
+  bute_read_paste
+
+  Get the text of a paste, from wherever the key that started it came
+
+===========================================================================*/
+static char *bute_read_paste (BUTE *self, int *len)
+  {
+  Terminal *terminal = self->terminal;
+  KeyLog *key_log = self->key_log;
+  if (key_log && self->key_from_log)
+    return key_log_get_text (key_log, len);
+  char *text = terminal->read_paste (terminal, len);
+  if (key_log && !key_log_is_replaying (key_log))
+    key_log_put_text (key_log, text, *len);
+  return text;
+  }
+
+/*===========================================================================
+
+  bute_paste
+
+  Insert the text of a bracketed paste in a single operation, and 
+  repaint once at the end, rather than treating each character as 
+  a keystroke. Pasted text is always inserted, even in replace mode.
+
+===========================================================================*/
+static void bute_paste (BUTE *self)
+  {
+  Terminal *terminal = self->terminal;
+  int rows = 24; int columns;
+  terminal->get_size (terminal, &rows, &columns, NULL);
+
+  int len;
+  char *text = bute_read_paste (self, &len);
+
+  // Drop control characters other than tab and newline, and DEL, and
+  //   work out where the cursor will end up
+  int n = 0;
+  int newlines = 0;
+  int last_len = 0;
+  for (int i = 0; i < len; i++)
+    {
+    unsigned char c = (unsigned char)text[i];
+    if ((c >= 32 && c != 127) || c == '\t' || c == '\n')
+      {
+      text[n++] = c;
+      if (c == '\n')
+        {
+        newlines++;
+        last_len = 0;
+        }
+      else
+        last_len++;
+      }
+    }
+
+  if (n > 0)
+    {
+    TextFile *text_file = self->text_file;
+    int this_len = strlen (text_file_get_line (text_file, self->file_row));
+    if (self->file_col > this_len) self->file_col = this_len;
+
+    text_file_insert_text (text_file, self->file_row, self->file_col, 
+      text, n);
+
+    if (newlines > 0)
+      {
+      self->file_row += newlines;
+      self->file_col = last_len;
+      }
+    else
+      self->file_col += last_len;
+
+    bute_lines_changed (self);
+    bute_follow_cursor (self);
+    bute_refresh_terminal (self, self->file_top_row); 
+    bute_screen_pos_from_file_pos (self);
+    }
+
+  free (text);
+  }
+
+/*===========================================================================
+
+  bute_toggle_replace_mode
+
+===========================================================================*/
+static void bute_toggle_replace_mode (BUTE *self)
+  {
+  if (self->edit_mode == BUTE_EDIT_MODE_REPLACE)
+    {
+    self->edit_mode = BUTE_EDIT_MODE_INSERT;
+    self->terminal->cursor_line (self->terminal);
+    }
+  else
+    {
+    self->edit_mode = BUTE_EDIT_MODE_REPLACE;
+    self->terminal->cursor_block (self->terminal);
+    }
+
+  if (self->edit_mode == BUTE_EDIT_MODE_REPLACE)
+    bute_write_status (self, "Replace mode", TRUE);
+  else
+    bute_write_status (self, "Insert mode", TRUE);
+  }
+
+/*===========================================================================
+
+  bute_redraw_after_delete
+
+  Update the cursor row after the character at file_col has been 
+  deleted. 'plain' is set if it was ASCII, and not a tab. screen_col 
+  must be the position of file_col. As for insertion, if there are no 
+  tabs or wide characters involved the terminal can shift the rest of 
+  the line, and then only the cell exposed at the right margin needs to
+  be drawn.
+
+===========================================================================*/
+static void bute_redraw_after_delete (BUTE *self, BOOL plain)
+  {
+  Terminal *terminal = self->terminal;
+  int rows; int columns = 80;
+  terminal->get_size (terminal, &rows, &columns, NULL);
+  const char *this_line = text_file_get_line 
+     (self->text_file, self->file_row);
+
+  if (self->wrap)
+    bute_redraw_wrapped (self, self->file_col);
+  else if (plain && this_line[self->file_col 
+             + utf8_plain_run (this_line + self->file_col, -1)] == 0)
+    {
+    terminal->set_cursor (terminal, self->screen_row, self->screen_col);
+    terminal->delete_chars (terminal, 1);
+    int exposed = self->file_col + columns - 1 - self->screen_col;
+    if (exposed < strlen (this_line))
+      terminal->write_line_from (terminal, self->screen_row, this_line,
+        exposed, self->left_col + columns - 1, 1);
+    }
+  else
+    {
+    terminal->write_line_from (terminal, self->screen_row, this_line,
+      self->file_col, self->left_col + self->screen_col, -1);
+    }
+  terminal->set_cursor (terminal, self->screen_row, self->screen_col);
+  }
+
+/*===========================================================================
+
+  bute_delete_forward
+
+===========================================================================*/
+static void bute_delete_forward (BUTE *self)
+  {
+  TextFile *text_file = self->text_file;
+  
+  const char *this_line = text_file_get_line (text_file, self->file_row);
+  int len = strlen (this_line);
+  if (self->file_col < len)
+    {
+    int n = utf8_next (this_line, self->file_col) - self->file_col;
+    BOOL plain = utf8_plain_run (this_line + self->file_col, n) == 1;
+    text_file_delete_text (text_file, self->file_row, self->file_col, n);
+    bute_redraw_after_delete (self, plain);
+    }
+  else
+    {
+    text_file_merge_line_forward (text_file, self->file_row);
+    bute_lines_changed (self);
+    bute_follow_cursor (self);
+    bute_refresh_terminal (self, self->file_top_row); 
+    bute_screen_pos_from_file_pos (self);
+    }
+  }
+
+
+/*===========================================================================
+
+  bute_destructive_backspace
+
+===========================================================================*/
+static void bute_destructive_backspace (BUTE *self)
+  {
+  TextFile *text_file = self->text_file;
+  if (self->file_col > 0)
+    {
+    const char *this_line = text_file_get_line (text_file, self->file_row);
+    int end = self->file_col;
+    self->file_col = utf8_prev (this_line, end);
+    int n = end - self->file_col;
+    BOOL plain = utf8_plain_run (this_line + self->file_col, n) == 1;
+    bute_screen_pos_from_file_pos (self);
+    text_file_delete_text (text_file, self->file_row, self->file_col, n);
+    bute_redraw_after_delete (self, plain);
+    }
+  else
+    {
+    // Backspce at start of line -- merge two lines
+    if (self->file_row >= 1)
+      { 
+      self->file_row--;
+      int orig_len = strlen (text_file_get_line (text_file, self->file_row));
+      self->file_col = orig_len;
+      text_file_merge_line_forward (text_file, self->file_row);
+      bute_lines_changed (self);
+      bute_follow_cursor (self);
+      bute_refresh_terminal (self, self->file_top_row); 
+      bute_screen_pos_from_file_pos (self);
+      }
+    }
+  }
+
+
+/*===========================================================================
+
+  bute_ensure_file_not_empty
+
+===========================================================================*/
+static void bute_ensure_file_not_empty (BUTE *self)
+  {
+  TextFile *text_file = self->text_file;
+  if (text_file_get_line_count (text_file) == 0)
+    {
+    text_file_insert_blank_line_at (text_file, 0);
+    }
+  }
+
+
+/*===========================================================================
+
+  bute_delete_line
+
+===========================================================================*/
+static void bute_delete_line (BUTE *self)
+  {
+  // The cursor stays in the same screen column, on whatever line takes
+  //   the place of this one
+  int dcol = text_file_get_display_col (self->text_file, self->file_row,
+    self->file_col);
+  text_file_delete_line (self->text_file, self->file_row);
+  if (self->file_row >= text_file_get_line_count (self->text_file))
+    {
+    if (self->file_row > 0)
+      self->file_row--;
+    } 
+  bute_ensure_file_not_empty (self);
+  self->file_col = text_file_get_col_at_display (self->text_file, 
+    self->file_row, dcol);
+  bute_cursor_limit_right (self);
+  bute_lines_changed (self);
+  bute_follow_cursor (self);
+  bute_refresh_terminal (self, self->file_top_row); 
+  bute_screen_pos_from_file_pos (self);
+  }
+
+
+/*===========================================================================
+
+  bute_end
+
+===========================================================================*/
+static void bute_end (BUTE *self)
+  {
+  const char *this_line = text_file_get_line 
+     (self->text_file, self->file_row);
+  self->file_col = strlen (this_line);
+  bute_screen_pos_from_file_pos (self);
+  }
+
+
+/*===========================================================================
+
+  bute_home
+
+===========================================================================*/
+static void bute_home (BUTE *self)
+  {
+  if (self->file_col != 0)
+    {
+    self->file_col = 0;
+    bute_screen_pos_from_file_pos (self);
+    }
+  }
+
+
+/*===========================================================================
+
+  bute_save
+
+===========================================================================*/
+static void bute_save (BUTE *self)
+  {
+  BOOL was_modified = text_file_is_modified (self->text_file);
+  BOOL saved = text_file_save (self->text_file, self->filename);
+  // The rest of the file is loaded to save it
+  if (self->wrap) wrap_index_add_lines (self->wrap, self->text_file);
+  if (saved)
+    {
+    char *mesg = str2 ("Saved ", self->filename);
+    bute_write_status (self, mesg, TRUE);
+    free (mesg);
+    if (was_modified)
+      self->did_save = TRUE;
+    }
+  else
+    {
+    char *mesg1 = str2 ("Can't write ", self->filename); 
+    char *mesg2 = str2 (mesg1, ": ");
+    char *mesg3 = str2 (mesg2, strerror (errno));
+    bute_write_status (self, mesg3, TRUE);
+    free (mesg3);
+    free (mesg2);
+    free (mesg1);
+    }
+  }
+
+/*===========================================================================
+
+  bute_put_usec
+
+  Add a time to a string, in microseconds if it is short, and 
+  milliseconds if not
+
+===========================================================================*/
+static void bute_put_usec (char *s, long usec)
+  {
+  if (usec < 10000)
+    {
+    ltoa (usec, s + strlen (s), 10);
+    strcat (s, "us");
+    }
+  else
+    {
+    ltoa (usec / 1000, s + strlen (s), 10);
+    strcat (s, "ms");
+    }
+  }
+
+/*===========================================================================
+
+  bute_show_file_position
+
+  With the HUD, the latencies and costs of the keys before this one are
+  shown as well
+
+===========================================================================*/
+static void bute_show_file_position (const BUTE *self)
+  {
+  // Room for every field at its longest: two ints, and a long for each
+  //   latency and count, with their labels, come to about 200 bytes
+  char s[256];
+  itoa (self->file_row + 1, s, 10);
+  strcat (s + strlen (s), ",");
+  itoa (text_file_get_display_col (self->text_file, self->file_row,
+    self->file_col) + 1, s + strlen (s), 10);
+#ifdef DEBUG
+  strcat (s, " refresh mallocs:");
+  itoa ((int)self->refresh_mallocs, s + strlen (s), 10);
+#endif
+  if (self->hud)
+    {
+    long bytes, syscalls, mallocs;
+    key_stats_get_last (self->key_stats, &bytes, &syscalls, &mallocs);
+    strcat (s, "  p50 ");
+    bute_put_usec (s, key_stats_percentile (self->key_stats, 50));
+    strcat (s, " p99 ");
+    bute_put_usec (s, key_stats_percentile (self->key_stats, 99));
+    strcat (s, "  last key ");
+    ltoa (bytes, s + strlen (s), 10);
+    strcat (s, " bytes ");
+    ltoa (syscalls, s + strlen (s), 10);
+    strcat (s, " syscalls ");
+    ltoa (mallocs, s + strlen (s), 10);
+    strcat (s, " mallocs");
+    }
+  bute_write_status (self, s, TRUE);
+  }
+
+/*===========================================================================
+
+  bute_frame_sent
+
+  Count the time and output for the keys that the frame just sent 
+  showed the effect of. If the frame was dropped, they are counted with
+  the next one
+
+===========================================================================*/
+static void bute_frame_sent (BUTE *self)
+  {
+  if (self->key_stats && !self->redraw_pending)
+    {
+    key_stats_flushed (self->key_stats, 
+      linux_terminal_get_bytes_written ((LinuxTerminal *)self->terminal));
+    }
+  }
+
+/*===========================================================================
+
+  bute_search_matches
+
+  Put into s which match the cursor is at, and how many there are, if 
+  they have all been counted; or just how many, if it isn't at one. 
+  Returns FALSE if they haven't been
+
+===========================================================================*/
+static BOOL bute_search_matches (const BUTE *self, char *s)
+  {
+  *s = 0;
+  if (!self->matches || self->search_len == 0 
+       || !match_index_is_complete (self->matches))
+    return FALSE;
+  long total = match_index_get_total (self->matches);
+  long n = match_index_get_number (self->matches, self->file_row, 
+    self->file_col);
+  strcpy (s, "  (");
+  if (n >= 0)
+    {
+    strcat (s, "match ");
+    ltoa (n + 1, s + strlen (s), 10);
+    strcat (s, " of ");
+    ltoa (total, s + strlen (s), 10);
+    strcat (s, ")");
+    }
+  else
+    {
+    ltoa (total, s + strlen (s), 10);
+    strcat (s, total == 1 ? " match)" : " matches)");
+    }
+  return TRUE;
+  }
+
+/*===========================================================================
+
+  bute_search_status
+
+  Show the pattern being typed on the status line
+
+===========================================================================*/
+static void bute_search_status (const BUTE *self)
+  {
+  char prompt[40];
+  self->search_text[self->search_len] = 0;
+  if (self->replacing == BUTE_REPLACE_ASK)
+    {
+    char s[80];
+    strcpy (s, "Replace this? (y, n, ! for all, q)");
+    bute_search_matches (self, s + strlen (s));
+    bute_write_status (self, s, TRUE);
+    return;
+    }
+  if (self->replacing == BUTE_REPLACE_WITH)
+    {
+    self->replace_text[self->replace_len] = 0;
+    char *mesg1 = str2 ("Replace ", self->search_text);
+    char *mesg2 = str2 (mesg1, " with: ");
+    char *mesg3 = str2 (mesg2, self->replace_text);
+    bute_write_status (self, mesg3, TRUE);
+    free (mesg3);
+    free (mesg2);
+    free (mesg1);
+    return;
+    }
+  if (self->search_failed[self->search_len])
+    strcpy (prompt, "Not found");
+  else if (self->replacing)
+    strcpy (prompt, "Replace");
+  else
+    strcpy (prompt, "Search");
+  if (self->search_regex) strcat (prompt, " regex");
+  if (self->search_back) strcat (prompt, " backward");
+  strcat (prompt, ": ");
+  char *mesg = str2 (prompt, self->search_text);
+  if (self->search_error)
+    {
+    char *mesg1 = str2 (mesg, "  (");
+    free (mesg);
+    char *mesg2 = str2 (mesg1, self->search_error);
+    free (mesg1);
+    mesg = str2 (mesg2, ")");
+    free (mesg2);
+    }
+  char s[60];
+  if (bute_search_matches (self, s))
+    {
+    char *mesg1 = str2 (mesg, s);
+    free (mesg);
+    mesg = mesg1;
+    }
+  bute_write_status (self, mesg, TRUE);
+  free (mesg);
+  }
+
+/*===========================================================================
+
+  bute_search_show
+
+  Move the file position to a match. One that is off the screen is
+  brought to the middle of it
+
+===========================================================================*/
+static void bute_search_show (BUTE *self, int row, int col)
+  {
+  int rows = 24; int columns = 80;
+  self->terminal->get_size (self->terminal, &rows, &columns, NULL);
+  self->file_row = row;
+  self->file_col = col;
+  int top = bute_top_row (self);
+  int pos = bute_file_pos_row (self);
+  if (pos < top || pos >= top + rows - 1)
+    {
+    top = pos - (rows - 1) / 2;
+    if (top < 0) top = 0;
+    bute_set_top_row (self, top);
+    bute_refresh_terminal (self, self->file_top_row);
+    }
+  bute_screen_pos_from_file_pos (self);
+  }
+
+/*===========================================================================
+
+  bute_search_find
+
+  Look for the pattern from a position, in the direction of the search.
+  Searching forwards, the part of the file that has not been loaded yet
+  is loaded, and looked through, a part at a time. Once the matches 
+  have all been counted, the count of each line says where the next 
+  is. The length of the match is put in self->replace_match_len
+
+===========================================================================*/
+static BOOL bute_search_find (BUTE *self, int *row, int *col)
+  {
+  TextFile *text_file = self->text_file;
+  if (!self->search) return FALSE;
+  if (self->matches && self->search_len > 0 
+       && match_index_is_complete (self->matches))
+    return match_index_find (self->matches, self->search_back, row, col,
+      &self->replace_match_len);
+  int r = *row;
+  int c = *col;
+  while (!search_file (self->search, text_file, self->search_back, &r, &c,
+      &self->replace_match_len))
+    {
+    if (self->search_back || !text_file_is_loading (text_file)) 
+      return FALSE;
+    r = text_file_get_line_count (text_file);
+    c = 0;
+    if (!bute_load_part (self))
+      {
+      bute_load_failed (self);
+      return FALSE;
+      }
+    }
+  *row = r;
+  *col = c;
+  return TRUE;
+  }
+
+/*===========================================================================
+
+  bute_search_grow
+
+  Copy an array of n items of a given size to a new one of 'size' items
+
+===========================================================================*/
+static void *bute_search_grow (void *old, int n, int size, size_t item)
+  {
+  void *ret = malloc (size * item);
+  if (old)
+    {
+    memcpy (ret, old, n * item);
+    free (old);
+    }
+  return ret;
+  }
+
+/*===========================================================================
+
+  bute_search_set_length
+
+  Set the length of the pattern, making room for it, and for where 
+  each length of it was found
+
+===========================================================================*/
+static void bute_search_set_length (BUTE *self, int len)
+  {
+  if (len >= self->search_size)
+    {
+    int n = self->search_size;
+    int size = n > 0 ? n * 2 : 32;
+    if (size <= len) size = len + 1;
+    self->search_text = bute_search_grow (self->search_text, n, size + 1, 1);
+    self->search_rows = bute_search_grow (self->search_rows, n + 1, 
+      size + 1, sizeof (int));
+    self->search_cols = bute_search_grow (self->search_cols, n + 1,
+      size + 1, sizeof (int));
+    self->search_failed = bute_search_grow (self->search_failed, n + 1,
+      size + 1, sizeof (BOOL));
+    self->search_size = size;
+    }
+  self->search_len = len;
+  }
+
+/*===========================================================================
+
+  bute_search_create
+
+===========================================================================*/
+static Search *bute_search_create (BUTE *self)
+  {
+  Search *search;
+  self->search_error = NULL;
+  if (self->search_regex)
+    search = search_create_regex (self->search_text, self->search_len, 
+      &self->search_error);
+  else
+    search = search_create (self->search_text, self->search_len);
+  if (search) search_set_threads (search, self->load_threads);
+  return search;
+  }
+
+/*===========================================================================
+
+  bute_search_compile
+
+  Any matches counted are kept: they are of the last pattern, which is
+  used again, until the pattern is changed
+
+===========================================================================*/
+static void bute_search_compile (BUTE *self)
+  {
+  search_destroy (self->search);
+  self->search = bute_search_create (self);
+  }
+
+/*===========================================================================
+
+  bute_search_changed
+
+  The pattern has been changed, so the matches counted are of another
+
+===========================================================================*/
+static void bute_search_changed (BUTE *self)
+  {
+  match_index_destroy (self->matches);
+  self->matches = NULL;
+  bute_search_compile (self);
+  }
+
+/*===========================================================================
+
+  bute_search_begin
+
+===========================================================================*/
+static void bute_search_begin (BUTE *self, BOOL back)
+  {
+  self->searching = TRUE;
+  self->search_back = back;
+  self->search_regex = FALSE;
+  self->search_size = 0;
+  bute_search_set_length (self, 0);
+  bute_search_compile (self);
+  self->search_rows[0] = self->file_row;
+  self->search_cols[0] = self->file_col;
+  self->search_failed[0] = FALSE;
+  self->search_top_row = self->file_top_row;
+  self->search_top_sub = self->top_sub;
+  self->search_left_col = self->left_col;
+  }
+
+/*===========================================================================
+
+  bute_search_end
+
+  Stop searching, and leave the file position at the match, or if the
+  search is cancelled, put it back where it was, and the view with it
+
+===========================================================================*/
+static void bute_search_end (BUTE *self, BOOL cancel)
+  {
+  if (self->search_len > 0)
+    {
+    if (self->search_last) free (self->search_last);
+    self->search_last = malloc (self->search_len);
+    memcpy (self->search_last, self->search_text, self->search_len);
+    self->search_last_len = self->search_len;
+    self->search_last_regex = self->search_regex;
+    }
+  if (cancel)
+    {
+    self->file_row = self->search_rows[0];
+    self->file_col = self->search_cols[0];
+    if (self->file_top_row != self->search_top_row
+         || self->top_sub != self->search_top_sub
+         || self->left_col != self->search_left_col)
+      {
+      self->file_top_row = self->search_top_row;
+      self->top_sub = self->search_top_sub;
+      self->left_col = self->search_left_col;
+      self->terminal->set_left_col (self->terminal, self->left_col);
+      bute_refresh_terminal (self, self->file_top_row);
+      }
+    bute_screen_pos_from_file_pos (self);
+    }
+  self->searching = FALSE;
+  search_destroy (self->search);
+  self->search = NULL;
+  free (self->search_text);
+  free (self->search_rows);
+  free (self->search_cols);
+  free (self->search_failed);
+  self->search_text = NULL;
+  self->search_rows = NULL;
+  self->search_cols = NULL;
+  self->search_failed = NULL;
+  if (self->replacing)
+    {
+    if (self->replace_text) free (self->replace_text);
+    self->replace_text = NULL;
+    self->replacing = BUTE_REPLACE_NONE;
+    }
+  bute_show_file_position (self);
+  }
+
+/*===========================================================================
+
+  bute_search_add
+
+  Add a byte to the pattern, and look for it from where the pattern 
+  before it was found. If that wasn't found, neither can this be. A
+  regular expression may match somewhere that what was typed before it
+  doesn't, so it is looked for from where the search started
+
+===========================================================================*/
+static void bute_search_add (BUTE *self, int c)
+  {
+  int len = self->search_len;
+  bute_search_set_length (self, len + 1);
+  self->search_text[len] = c;
+  bute_search_changed (self);
+  int from = self->search_regex ? 0 : len;
+  int row = self->search_rows[from];
+  int col = self->search_cols[from];
+  BOOL failed = (self->search_failed[len] && !self->search_regex)
+    || !bute_search_find (self, &row, &col);
+  if (failed)
+    {
+    row = self->search_rows[len];
+    col = self->search_cols[len];
+    }
+  self->search_rows[len + 1] = row;
+  self->search_cols[len + 1] = col;
+  self->search_failed[len + 1] = failed;
+  bute_search_show (self, row, col);
+  }
+
+/*===========================================================================
+
+  bute_search_delete
+
+  Take the last byte off the pattern, and go back to where the pattern
+  without it was found
+
+===========================================================================*/
+static void bute_search_delete (BUTE *self)
+  {
+  if (self->search_len == 0) return;
+  bute_search_set_length (self, self->search_len - 1);
+  bute_search_changed (self);
+  bute_search_show (self, self->search_rows[self->search_len], 
+    self->search_cols[self->search_len]);
+  }
+
+/*===========================================================================
+
+  bute_search_from_start
+
+  Say that every length of the pattern was found where the search 
+  started, so that deleting any of it goes back there
+
+===========================================================================*/
+static void bute_search_from_start (BUTE *self)
+  {
+  for (int i = 1; i <= self->search_len; i++)
+    {
+    self->search_rows[i] = self->search_rows[0];
+    self->search_cols[i] = self->search_cols[0];
+    self->search_failed[i] = FALSE;
+    }
+  }
+
+/*===========================================================================
+
+  bute_search_use_last
+
+  Make the pattern the one last looked for, if there was one
+
+===========================================================================*/
+static BOOL bute_search_use_last (BUTE *self)
+  {
+  if (!self->search_last) return FALSE;
+  int len = self->search_last_len;
+  bute_search_set_length (self, len);
+  memcpy (self->search_text, self->search_last, len);
+  self->search_regex = self->search_last_regex;
+  bute_search_compile (self);
+  bute_search_from_start (self);
+  return TRUE;
+  }
+
+/*===========================================================================
+
+  bute_search_count
+
+  Count the matches in the whole file now, rather than while there is 
+  nothing else to do, or of the last pattern if none has been typed 
+  yet. The file is loaded first if it hasn't all been
+
+===========================================================================*/
+static void bute_search_count (BUTE *self)
+  {
+  TextFile *text_file = self->text_file;
+  if (self->search_len == 0 && !bute_search_use_last (self)) return;
+  if (!self->search) return;
+  while (text_file_is_loading (text_file))
+    {
+    if (!bute_load_part (self))
+      {
+      bute_load_failed (self);
+      return;
+      }
+    }
+  if (!self->matches) 
+    self->matches = match_index_create (bute_search_create (self), 
+      text_file);
+  while (!match_index_count_more (self->matches))
+    ;
+  }
+
+/*===========================================================================
+
+  bute_search_toggle_regex
+
+  Switch between looking for the pattern as it is and as a regular
+  expression, and look for it again from where the search started
+
+===========================================================================*/
+static void bute_search_toggle_regex (BUTE *self)
+  {
+  int len = self->search_len;
+  self->search_regex = !self->search_regex;
+  if (len == 0) 
+    {
+    bute_search_compile (self);
+    return;
+    }
+  bute_search_changed (self);
+  bute_search_from_start (self);
+  int row = self->search_rows[0];
+  int col = self->search_cols[0];
+  if (bute_search_find (self, &row, &col))
+    {
+    self->search_rows[len] = row;
+    self->search_cols[len] = col;
+    }
+  else
+    self->search_failed[len] = TRUE;
+  bute_search_show (self, self->search_rows[len], self->search_cols[len]);
+  }
+
+/*===========================================================================
+
+  bute_search_next
+
+  Look for the next match after the one found, or before it, going 
+  backwards. With no pattern yet, the last one is looked for again
+
+===========================================================================*/
+static void bute_search_next (BUTE *self, BOOL back)
+  {
+  self->search_back = back;
+  if (self->search_len == 0 && !bute_search_use_last (self)) return;
+  int len = self->search_len;
+  int row = self->search_rows[len];
+  int col = self->search_cols[len];
+  if (!back)
+    col++;
+  else if (col > 0)
+    col--;
+  else if (row > 0)
     {
-    // TODO shift line left
+    row--;
+    col = 0x7fffffff;
     }
   else
     {
-    if (self->file_col < this_len/* - 1*/)
-      {
-      self->file_col++;
-      bute_screen_pos_from_file_pos (self);
-      }
+    self->search_failed[len] = TRUE;
+    return;
     }
+  if (bute_search_find (self, &row, &col))
+    {
+    self->search_rows[len] = row;
+    self->search_cols[len] = col;
+    self->search_failed[len] = FALSE;
+    bute_search_show (self, row, col);
+    }
+  else
+    self->search_failed[len] = TRUE;
   }
 
 /*===========================================================================
 
-  bute_insert_char 
+  bute_replace_begin
 
 ===========================================================================*/
-static void bute_insert_char (BUTE *self, int c)
+static void bute_replace_begin (BUTE *self)
   {
-  TextFile *text_file = self->text_file;
-  Terminal *terminal = self->terminal;
-  // TODO line scrolling
-  int rows; int columns = 80;
-  terminal->get_size (terminal, &rows, &columns, NULL);
-
-  text_file_insert_char (text_file, self->file_row, self->file_col, c);
-  const char *this_line = text_file_get_line (text_file, self->file_row);
-  //terminal->set_cursor (terminal, self->screen_row, 0);
-  // TODO only erase and write from the char inserted
-  terminal->erase_current_line (terminal);
-  terminal->write_line (terminal, self->screen_row, this_line, TRUE);
-  if (self->screen_col < columns)
-    {
-    self->file_col++;
-    //self->screen_col++;
-    // TODO line scrolling
-    }
-  //terminal->set_cursor (terminal, self->screen_row, self->screen_col);
-  bute_screen_pos_from_file_pos (self);
+  bute_search_begin (self, FALSE);
+  self->replacing = BUTE_REPLACE_PATTERN;
   }
 
 /*===========================================================================
 
-  bute_relace_char 
+  bute_replace_with
+
+  The pattern has been typed; ask for what to replace it with. With no
+  pattern, the last one looked for is used
 
 ===========================================================================*/
-static void bute_replace_char (BUTE *self, int c)
+static void bute_replace_with (BUTE *self)
   {
-  TextFile *text_file = self->text_file;
-  Terminal *terminal = self->terminal;
-  // TODO line scrolling
-  int rows; int columns = 80;
-  terminal->get_size (terminal, &rows, &columns, NULL);
-  text_file_replace_char (text_file, self->file_row, self->file_col, c);
-  const char *this_line = text_file_get_line (text_file, self->file_row);
-  //terminal->set_cursor (terminal, self->screen_row, 0);
-  // TODO only erase and write from the char inserted
-  terminal->erase_current_line (terminal);
-  terminal->write_line (terminal, self->screen_row, this_line, TRUE);
-  if (self->screen_col < columns)
+  if (self->search_len == 0 && !bute_search_use_last (self))
     {
-    self->file_col++;
-    // TODO line scrolling
+    bute_search_end (self, TRUE);
+    return;
     }
-  //terminal->set_cursor (terminal, self->screen_row, self->screen_col);
-  bute_screen_pos_from_file_pos (self);
+  if (!self->search) return; 
+  self->replacing = BUTE_REPLACE_WITH;
+  self->replace_size = 32;
+  self->replace_text = malloc (self->replace_size + 1);
+  self->replace_len = 0;
   }
 
 /*===========================================================================
 
-  bute_insert_or_relace_char 
+  bute_replace_find
+
+  Look for the next match to replace from a position. An empty match
+  straight after the last one is passed over, as sed does
 
 ===========================================================================*/
-static void bute_insert_or_replace_char (BUTE *self, int c)
+static BOOL bute_replace_find (BUTE *self, int *row, int *col)
   {
-  if (self->edit_mode == BUTE_EDIT_MODE_REPLACE)
-    bute_replace_char (self, c);
-  else
-    bute_insert_char (self, c);
+  if (!bute_search_find (self, row, col)) return FALSE;
+  if (self->replace_match_len > 0 || *row != self->replace_end_row
+       || *col != self->replace_end_col)
+    return TRUE;
+  (*col)++;
+  return bute_search_find (self, row, col);
   }
 
 /*===========================================================================
 
-  bute_insert_newline
+  bute_replace_next
+
+  Look for the next match from a position, and ask whether to replace 
+  it, or if there are no more, stop
 
 ===========================================================================*/
-static void bute_insert_newline (BUTE *self)
+static void bute_replace_next (BUTE *self, int row, int col)
   {
-  Terminal *terminal = self->terminal;
-  TextFile *text_file = self->text_file;
-  int rows; int columns = 80;
-  terminal->get_size (terminal, &rows, &columns, NULL);
-  text_file_insert_newline (text_file, self->file_row, self->file_col);
-  // TODO -- line scrolling
-  self->screen_col = 0;
-  self->file_col = 0;
-  self->file_row++; 
-  if (self->screen_row >= rows - 2)
+  if (bute_replace_find (self, &row, &col))
     {
-    self->file_top_row++;
+    self->replacing = BUTE_REPLACE_ASK;
+    bute_search_show (self, row, col);
     }
   else
-    {
-    self->screen_row++; 
-    }
-  bute_refresh_terminal (self, self->file_top_row); 
-  bute_screen_pos_from_file_pos (self);
+    bute_search_end (self, FALSE);
   }
 
 /*===========================================================================
 
-  bute_toggle_replace_mode
+  bute_replace_size
+
+  The most that a match of m bytes can be replaced by
 
 ===========================================================================*/
-static void bute_toggle_replace_mode (BUTE *self)
+static int bute_replace_size (const BUTE *self, int m)
   {
-  if (self->edit_mode == BUTE_EDIT_MODE_REPLACE)
-    {
-    self->edit_mode = BUTE_EDIT_MODE_INSERT;
-    self->terminal->cursor_line (self->terminal);
-    }
-  else
-    {
-    self->edit_mode = BUTE_EDIT_MODE_REPLACE;
-    self->terminal->cursor_block (self->terminal);
-    }
-
-  if (self->edit_mode == BUTE_EDIT_MODE_REPLACE)
-    bute_write_status (self, "Replace mode", TRUE);
-  else
-    bute_write_status (self, "Insert mode", TRUE);
+  int size = self->replace_len;
+  for (int i = 0; i < self->replace_len - 1; i++)
+    if (self->replace_text[i] == '\\' && self->replace_text[i + 1] == '0')
+      size += m;
+  return size;
   }
 
 /*===========================================================================
 
-  bute_delete_forward
+  bute_replace_expand
+
+  Put what a match of m bytes is replaced by in 'text', which must have
+  room for bute_replace_size bytes. In the replacement, \0 stands for 
+  the text of the match, and \t, \n and \\ for a tab, a newline and a 
+  backslash. Returns its length
 
 ===========================================================================*/
-static void bute_delete_forward (BUTE *self)
+static int bute_replace_expand (const BUTE *self, const char *match, int m,
+     char *text)
   {
-  TextFile *text_file = self->text_file;
-  Terminal *terminal = self->terminal;
-  
-  // TODO line scrolling
-  const char *this_line = text_file_get_line (text_file, self->file_row);
-  int len = strlen (this_line);
-  if (self->file_col < len)
-    {
-    text_file_delete_char (text_file, self->file_row, self->file_col);
-    terminal->set_cursor (terminal, self->screen_row, 0);
-    // TODO only erase and write from the char inserted
-    terminal->erase_current_line (terminal);
-    terminal->write_line (terminal, self->screen_row, this_line, TRUE);
-    terminal->set_cursor (terminal, self->screen_row, self->screen_col);
-    }
-  else
+  int n = 0;
+  for (int i = 0; i < self->replace_len; i++)
     {
-    text_file_merge_line_forward (text_file, self->file_row);
-    bute_refresh_terminal (self, self->file_top_row); 
-    bute_screen_pos_from_file_pos (self);
+    char c = self->replace_text[i];
+    if (c == '\\' && i + 1 < self->replace_len)
+      {
+      char e = self->replace_text[++i];
+      if (e == '0')
+        {
+        memcpy (text + n, match, m);
+        n += m;
+        continue;
+        }
+      else if (e == 't')
+        c = '\t';
+      else if (e == 'n')
+        c = '\n';
+      else if (e == '\\')
+        c = '\\';
+      else
+        i--;
+      }
+    text[n++] = c;
     }
+  return n;
   }
 
-
 /*===========================================================================
 
-  bute_destructive_backspace
+  bute_replace_this
+
+  Replace the match at a position, and move the position to where the
+  next match could start. Returns TRUE if a newline was put in, so the
+  lines have moved
 
 ===========================================================================*/
-static void bute_destructive_backspace (BUTE *self)
+static BOOL bute_replace_this (BUTE *self, int *row, int *col)
   {
   TextFile *text_file = self->text_file;
-  Terminal *terminal = self->terminal;
-  //
-  // TODO line scrolling
-  if (self->file_col > 0)
+  int m = self->replace_match_len;
+  const char *match = text_file_get_line (text_file, *row) + *col;
+  char *text = malloc (bute_replace_size (self, m) + 1);
+  int n = bute_replace_expand (self, match, m, text);
+  int newlines = 0;
+  int last_len = 0;
+  for (int i = 0; i < n; i++)
     {
-    self->file_col--;
-
-    text_file_delete_char (text_file, self->file_row, self->file_col);
-    const char *this_line = text_file_get_line (text_file, self->file_row);
-    terminal->set_cursor (terminal, self->screen_row, 0);
-    // TODO only erase and write from the char inserted
-    terminal->erase_current_line (terminal);
-    terminal->write_line (terminal, self->screen_row, this_line, TRUE);
-    terminal->set_cursor (terminal, self->screen_row, self->screen_col);
-    bute_screen_pos_from_file_pos (self);
+    if (text[i] == '\n')
+      {
+      newlines++;
+      last_len = 0;
+      }
+    else
+      last_len++;
     }
-  else
+  if (m > 0) text_file_delete_text (text_file, *row, *col, m);
+  if (n > 0) text_file_insert_text (text_file, *row, *col, text, n);
+  free (text);
+  if (newlines > 0)
     {
-    // Backspce at start of line -- merge two lines
-    if (self->file_row >= 1)
-      { 
-      self->file_row--;
-      int orig_len = strlen (text_file_get_line (text_file, self->file_row));
-      self->screen_row--;
-      self->file_col = orig_len;
-      // TODO line scrolling
-      text_file_merge_line_forward (text_file, self->file_row);
-      bute_refresh_terminal (self, self->file_top_row); 
-      bute_screen_pos_from_file_pos (self);
-      }
+    *row += newlines;
+    *col = last_len;
     }
+  else
+    *col += last_len;
+  // An empty match is not matched again, at the same place
+  self->replace_end_row = m > 0 ? *row : -1;
+  self->replace_end_col = *col;
+  if (m == 0) (*col)++;
+  self->replaced++;
+  return newlines > 0;
   }
 
-
 /*===========================================================================
 
-  bute_ensure_file_not_empty
+  bute_replace_line
+
+  The text of a line with every match that starts from 'from' to 'to'
+  replaced, or NULL if there are none. After a match that isn't empty,
+  an empty one where it ends is passed over; 'end' is where the last 
+  one before the line ended, or -1. Where the match at 'mark', if any,
+  is replaced is put in *mark_row, counting the lines the text is split
+  into from zero, and *mark_col; and the number of newlines in the text
+  in *newlines
 
 ===========================================================================*/
-static void bute_ensure_file_not_empty (BUTE *self)
+static char *bute_replace_line (BUTE *self, const char *line, int from,
+     int to, int end, int mark, int *mark_row, int *mark_col, 
+     int *newlines)
   {
-  TextFile *text_file = self->text_file;
-  if (text_file_get_line_count (text_file) == 0)
+  int len = strlen (line);
+  int size = 0;
+  char *text = NULL;
+  int n = 0;
+  int copied = 0;
+  int at = from;
+  int m;
+  *newlines = 0;
+  int line_start = 0;
+  search_set_line (self->search, line, len);
+  while ((at = search_line (self->search, line, len, at, &m)) >= 0 
+      && at <= to)
     {
-    text_file_insert_blank_line_at (text_file, 0);
+    if (m == 0 && at == end)
+      {
+      at++;
+      continue;
+      }
+    int need = n + (at - copied) + bute_replace_size (self, m) 
+      + (len - at - m) + 1;
+    if (need > size)
+      {
+      int grow = size > 0 ? size * 2 : len + 64;
+      if (grow < need) grow = need;
+      text = bute_search_grow (text, n, grow, 1);
+      size = grow;
+      }
+    memcpy (text + n, line + copied, at - copied);
+    n += at - copied;
+    if (at == mark)
+      {
+      *mark_row = *newlines;
+      *mark_col = n - line_start;
+      }
+    int start = n;
+    n += bute_replace_expand (self, line + at, m, text + n);
+    for (int i = start; i < n; i++)
+      {
+      if (text[i] == '\n')
+        {
+        (*newlines)++;
+        line_start = i + 1;
+        }
+      }
+    self->replaced++;
+    copied = at + m;
+    if (m > 0) end = at + m;
+    at = m > 0 ? at + m : at + 1;
     }
+  search_set_line (self->search, NULL, 0);
+  if (!text) return NULL;
+  memcpy (text + n, line + copied, len - copied);
+  text[n + len - copied] = 0;
+  return text;
   }
 
-
 /*===========================================================================
 
-  bute_delete_line
+  bute_replace_all
+
+  Replace the match at a position, and all the rest in the direction of
+  the search, as one step that can be undone. The file is loaded first,
+  if it hasn't all been. The lines with matches are found a round at a
+  time, as search_file finds them, and only those are rebuilt, each in 
+  one piece, and then put in the file together. The position is left 
+  where the match was replaced
 
 ===========================================================================*/
-static void bute_delete_line (BUTE *self)
+static void bute_replace_all (BUTE *self, int row, int col)
   {
-  text_file_delete_line (self->text_file, self->file_row);
-  bute_refresh_terminal (self, self->file_top_row); 
-  if (self->file_row >= text_file_get_line_count (self->text_file))
+  TextFile *text_file = self->text_file;
+  BOOL back = self->search_back;
+  while (text_file_is_loading (text_file))
     {
-    if (self->file_row > 0)
-      self->file_row--;
-    } 
-  bute_ensure_file_not_empty (self);
-  bute_screen_pos_from_file_pos (self);
+    if (!bute_load_part (self))
+      {
+      bute_load_failed (self);
+      return;
+      }
+    }
+  int first = back ? 0 : row;
+  int last = back ? row : (int)text_file_get_line_count (text_file) - 1;
+  int *rows = NULL;
+  int *counts = NULL;
+  int size = 0;
+  TextFileEdit *edits = NULL;
+  int edits_size = 0;
+  int mark_row = row;
+  int mark_col = col;
+  text_file_begin_undo (text_file);
+  int r = first;
+  while (r <= last)
+    {
+    int n = search_file_lines (self->search, text_file, &r, last, 
+      0x7fffffff, &rows, &counts, &size);
+    if (n > edits_size)
+      {
+      if (edits) free (edits);
+      edits = malloc (n * sizeof (TextFileEdit));
+      edits_size = n;
+      }
+    int nedits = 0;
+    // Lines added by the edits before, which move the lines after them
+    int added = 0;
+    for (int i = 0; i < n; i++)
+      {
+      int k = rows[i];
+      int from = 0;
+      int to = 0x7fffffff;
+      int end = -1;
+      if (k == row && !back)
+        {
+        from = col;
+        if (self->replace_end_row == row) end = self->replace_end_col;
+        }
+      if (k == row && back) to = col;
+      int mr, mc, newlines;
+      char *text = bute_replace_line (self, 
+        text_file_get_line (text_file, k), from, to, end, 
+        k == row ? col : -1, &mr, &mc, &newlines);
+      if (!text) continue;
+      if (k == row)
+        {
+        mark_row = k + added + mr;
+        mark_col = mc;
+        }
+      edits[nedits].row = k;
+      edits[nedits].n = 1;
+      edits[nedits].text = text;
+      nedits++;
+      added += newlines;
+      }
+    if (nedits > 0) text_file_replace_lines (text_file, edits, nedits);
+    r += added;
+    last += added;
+    }
+  if (size > 0)
+    {
+    free (rows);
+    free (counts);
+    }
+  if (edits) free (edits);
+  bute_lines_changed (self);
+  bute_search_show (self, mark_row, mark_col);
+  bute_refresh_terminal (self, self->file_top_row);
   }
 
-
 /*===========================================================================
 
-  bute_end
+  bute_replace_ask
+
+  Deal with the answer to whether to replace a match. Returns FALSE if
+  the key is not an answer, so the replace is ended, and the key should
+  be dealt with as usual
 
 ===========================================================================*/
-static void bute_end (BUTE *self)
+static BOOL bute_replace_ask (BUTE *self, int c)
   {
-  // Because we can't really handle lines longer than the terminal
-  //  width, we must check that going to the end of line won't take
-  //  the cursor beyond the limit
-  Terminal *terminal = self->terminal;
-  int rows; int columns = 80;
-  terminal->get_size (terminal, &rows, &columns, NULL);
-  const char *this_line = text_file_get_line 
-     (self->text_file, self->file_row);
-  int this_len = strlen (this_line);
-  int dlen = self->terminal->get_displayed_length 
-    (self->terminal, this_line, this_len);
-  if (dlen < columns)
+  int row = self->file_row;
+  int col = self->file_col;
+  switch (c)
     {
-    self->file_col = this_len;
-    bute_screen_pos_from_file_pos (self);
+    case 'y':
+    case ' ':
+      if (bute_replace_this (self, &row, &col))
+        bute_lines_changed (self);
+      else
+        bute_line_changed (self, self->file_row);
+      bute_refresh_terminal (self, self->file_top_row);
+      bute_replace_next (self, row, col);
+      return TRUE;
+    case 'n':
+      if (self->replace_match_len > 0)
+        {
+        col += self->replace_match_len;
+        self->replace_end_row = row;
+        self->replace_end_col = col;
+        }
+      else
+        col++;
+      bute_replace_next (self, row, col);
+      return TRUE;
+    case '!':
+      // The rest are replaced without asking, and the screen drawn once
+      bute_replace_all (self, row, col);
+      bute_search_end (self, FALSE);
+      return TRUE;
+    case 'q':
+    case VK_ENTER:
+    case 'G'-64: // ctrl+g
+    case '\x1b':
+      bute_search_end (self, FALSE);
+      return TRUE;
+    default:
+      bute_search_end (self, FALSE);
+      return FALSE;
     }
   }
 
-
 /*===========================================================================
 
-  bute_home
+  bute_replace_key
+
+  Deal with a key while the replacement is being typed, or while asking
+  whether to replace a match. Returns FALSE if it is not one the 
+  replace uses, as bute_search_key does
 
 ===========================================================================*/
-static void bute_home (BUTE *self)
+static BOOL bute_replace_key (BUTE *self, int c)
   {
-  if (self->file_col != 0)
+  if (self->replacing == BUTE_REPLACE_ASK) return bute_replace_ask (self, c);
+  switch (c)
     {
-    self->file_col = 0;
-    self->screen_col = 0; // TODO -- line scrolling
-    bute_screen_pos_from_file_pos (self);
+    case VK_BACK:
+      if (self->replace_len > 0) self->replace_len--;
+      return TRUE;
+    case VK_ENTER:
+      self->replaced = 0;
+      self->replace_end_row = -1;
+      bute_replace_next (self, self->search_rows[0], self->search_cols[0]);
+      return TRUE;
+    case 'G'-64: // ctrl+g
+    case '\x1b':
+      bute_search_end (self, TRUE);
+      return TRUE;
+    default:
+      if (c == VK_TAB || (c >= 32 && c < 0x7f) || (c >= 0x80 && c <= 0xFF))
+        {
+        if (self->replace_len == self->replace_size)
+          {
+          int size = self->replace_size * 2;
+          self->replace_text = bute_search_grow (self->replace_text, 
+            self->replace_len, size + 1, 1);
+          self->replace_size = size;
+          }
+        self->replace_text[self->replace_len++] = c;
+        return TRUE;
+        }
+      bute_search_end (self, FALSE);
+      return FALSE;
     }
   }
 
-
 /*===========================================================================
 
-  bute_save
+  bute_search_key
+
+  Deal with a key while a search is being typed. Returns FALSE if the 
+  key is not one the search uses, in which case the search is ended, 
+  leaving the position at the match, and the key should be dealt with
+  as usual
 
 ===========================================================================*/
-static void bute_save (BUTE *self)
+static BOOL bute_search_key (BUTE *self, int c)
   {
-  BOOL was_modified = text_file_is_modified (self->text_file);
-  if (text_file_save (self->text_file, self->filename))
-    {
-    char *mesg = str2 ("Saved ", self->filename);
-    bute_write_status (self, mesg, TRUE);
-    free (mesg);
-    if (was_modified)
-      self->did_save = TRUE;
-    }
-  else
+  if (self->replacing > BUTE_REPLACE_PATTERN) 
+    return bute_replace_key (self, c);
+  switch (c)
     {
-    char *mesg1 = str2 ("Can't write ", self->filename); 
-    char *mesg2 = str2 (mesg1, ": ");
-    char *mesg3 = str2 (mesg2, strerror (errno));
-    bute_write_status (self, mesg3, TRUE);
-    free (mesg3);
-    free (mesg2);
-    free (mesg1);
+    case 'F'-64: // ctrl+f
+      bute_search_next (self, FALSE);
+      return TRUE;
+    case 'B'-64: // ctrl+b
+      bute_search_next (self, TRUE);
+      return TRUE;
+    case 'R'-64: // ctrl+r
+      bute_search_toggle_regex (self);
+      return TRUE;
+    case 'N'-64: // ctrl+n
+      bute_search_count (self);
+      return TRUE;
+    case VK_BACK:
+      bute_search_delete (self);
+      return TRUE;
+    case VK_ENTER:
+      if (self->replacing)
+        bute_replace_with (self);
+      else
+        bute_search_end (self, FALSE);
+      return TRUE;
+    case 'G'-64: // ctrl+g
+    case '\x1b':
+      bute_search_end (self, TRUE);
+      return TRUE;
+    default:
+      if (c == VK_TAB || (c >= 32 && c < 0x7f) || (c >= 0x80 && c <= 0xFF))
+        {
+        bute_search_add (self, c);
+        return TRUE;
+        }
+      bute_search_end (self, FALSE);
+      return FALSE;
     }
   }
 
 /*===========================================================================
 
-  bute_show_file_position
+  bute_undo
+
+  Undo the last replace of all the matches, if nothing has changed 
+  since, and go to the first line it changed
 
 ===========================================================================*/
-static void bute_show_file_position (const BUTE *self)
+static void bute_undo (BUTE *self)
   {
-  char s[40];
-  itoa (self->file_row + 1, s, 10);
-  strcat (s + strlen (s), ",");
-  itoa (self->screen_col + 1, s + strlen (s), 10);
-  bute_write_status (self, s, TRUE);
+  int row = text_file_undo (self->text_file);
+  if (row < 0)
+    {
+    bute_write_status (self, "Nothing to undo", TRUE);
+    return;
+    }
+  bute_lines_changed (self);
+  bute_search_show (self, row, 0);
+  bute_refresh_terminal (self, self->file_top_row);
   }
 
 /*===========================================================================
@@ -601,16 +2443,26 @@ static ButeReturn bute_keyboard_loop (BUTE *self)
 
   Terminal *terminal = self->terminal;
 
-  terminal->raw_mode (terminal, TRUE);
-
   BOOL quit = FALSE;
   do
     {
     int old_screen_row = self->screen_row;
     int old_screen_col = self->screen_col;
-    int c = terminal->read_key (self->terminal);
+    int old_file_row = self->file_row;
+    int old_file_col = self->file_col;
+    int c = bute_read_key (self);
+    if (self->key_stats && c != VK_EOF) key_stats_key (self->key_stats);
+    terminal->begin_frame (terminal);
+    bute_load_ahead (self);
+    // Anything but the rest of a UTF-8 character abandons it
+    if (c < 0x80 || c > 0xFF) self->partial_len = 0;
+    // While a search is being typed, it takes the keys it uses. Any 
+    //   other ends it, and then does what it usually does
+    if (self->searching && bute_search_key (self, c)) c = VK_NONE;
     switch (c)
       {
+      case VK_NONE: // Taken by the search
+        break;
       case VK_HOME:
         bute_home (self);
         break;
@@ -647,9 +2499,21 @@ static ButeReturn bute_keyboard_loop (BUTE *self)
       case VK_LEFT:
         bute_cursor_left (self);
         break;
+      case VK_PASTE:
+        bute_paste (self);
+        break;
       case 'D'-64: // ctrl+d
 	bute_delete_line (self);
         break;
+      case 'F'-64: // ctrl+f
+        bute_search_begin (self, FALSE);
+        break;
+      case 'B'-64: // ctrl+b
+        bute_search_begin (self, TRUE);
+        break;
+      case 'T'-64: // ctrl+t
+        bute_replace_begin (self);
+        break;
       case 'Q'-64: // ctrl+q
         if (text_file_is_modified (self->text_file))
           {
@@ -667,21 +2531,51 @@ static ButeReturn bute_keyboard_loop (BUTE *self)
 	bute_save (self);
         break;
       case 'X'-64: // ctrl+x
+      case VK_EOF:
         quit = TRUE;
         break;
+      case 'Z'-64: // ctrl+z
+        bute_undo (self);
+        break;
       default:
-        if (c >= 32)
+        if (c >= 0x80 && c <= 0xFF)
+          bute_utf8_key (self, c);
+        else if (c >= 32)
           bute_insert_or_replace_char (self, c);
         break;
       }
-    if (old_screen_row != self->screen_row ||
-         old_screen_col != self->screen_col)
+    // The view might have moved, leaving the cursor where it was on
+    //   the screen. While searching, the status line shows the search,
+    //   and when a replace ends, how many were replaced
+    if (self->searching)
+      bute_search_status (self);
+    else if (self->replaced >= 0)
+      {
+      char s[40];
+      strcpy (s, "Replaced ");
+      itoa (self->replaced, s + strlen (s), 10);
+      bute_write_status (self, s, TRUE);
+      self->replaced = -1;
+      }
+    else if (old_screen_row != self->screen_row ||
+         old_screen_col != self->screen_col ||
+         old_file_row != self->file_row || old_file_col != self->file_col)
       {
       bute_show_file_position (self);
       }
+    // If an earlier frame was dropped, the screen is behind, and all
+    //   of it has to be drawn again
+    if (self->redraw_pending)
+      {
+      bute_refresh_terminal (self, self->file_top_row);
+      if (self->searching)
+        bute_search_status (self);
+      else
+        bute_show_file_position (self);
+      }
+    self->redraw_pending = !terminal->end_frame (terminal);
+    bute_frame_sent (self);
     }  while (!quit);
-    
-  self->terminal->raw_mode (self->terminal, FALSE);
 
   if (text_file_is_modified (self->text_file))
     {
@@ -732,6 +2626,32 @@ static void bute_write_status (const BUTE *self, const char *msg,
     self->screen_col);
   }
 
+/*===========================================================================
+
+  bute_draw_row
+
+  Draw the part of a line that starts at display column 'left' on a row
+  of the screen. Only the characters that are on the screen are looked 
+  at. If left is zero, the screen row must already be blank.
+
+===========================================================================*/
+static void bute_draw_row (BUTE *self, int screen_row, int row, int left)
+  {
+  TextFile *text_file = self->text_file;
+  Terminal *terminal = self->terminal;
+  const char *line = text_file_get_line (text_file, row);
+  if (left == 0)
+    terminal->write_line (terminal, screen_row, line, TRUE);
+  else
+    {
+    // Start with the character at the left edge
+    int from = text_file_get_col_at_display (text_file, row, left);
+    terminal->set_left_col (terminal, left);
+    terminal->write_line_from (terminal, screen_row, line, from, 
+      text_file_get_display_col (text_file, row, from), -1);
+    }
+  }
+
 /*===========================================================================
 
   bute_refresh_terminal
@@ -745,11 +2665,31 @@ void bute_refresh_terminal (BUTE *self, int top)
   int rows, cols;
   terminal->get_size (terminal, &rows, &cols, NULL);
   int nlines = text_file_get_line_count (text_file);
-  for (int i = 0; i < nlines - 0 - top && i < rows - 1; i++)
+#ifdef DEBUG
+  unsigned long mallocs = malloc_calls;
+#endif
+  int row = top;
+  int sub = self->top_sub;
+  for (int i = 0; row < nlines && i < rows - 1; i++)
     {
-    const char *line = text_file_get_line (text_file, top + i);
-    terminal->write_line (terminal, i, line, TRUE);
+    if (self->wrap)
+      {
+      bute_draw_row (self, i, row, sub * wrap_index_get_columns (self->wrap));
+      if (++sub == wrap_index_get_rows (self->wrap, row))
+        {
+        sub = 0;
+        row++;
+        }
+      }
+    else
+      {
+      bute_draw_row (self, i, row, self->left_col);
+      row++;
+      }
     }
+#ifdef DEBUG
+  self->refresh_mallocs = malloc_calls - mallocs;
+#endif
   }
 
 
@@ -790,13 +2730,50 @@ static void bute_set_init_status (BUTE *self)
 ButeReturn bute_run (BUTE *self, const char *filename, char **error)
   {
   ButeReturn ret = BUTE_RET_NO_CHANGE;
+  // Settings made before bute_run() survive the reset
+  BOOL serial = self->serial;
+  TerminalDevice *device = self->device;
+  KeyLog *key_log = self->key_log;
+  KeyStats *key_stats = self->key_stats;
+  BOOL hud = self->hud;
+  TabStops *tab_stops = self->tab_stops;
+  int h_jump = self->h_jump;
+  BOOL wrap_lines = self->wrap_lines;
+  int load_threads = self->load_threads;
+  off64_t large_min = self->large_min;
   memset (self, 0, sizeof (BUTE));
+  self->serial = serial;
+  self->device = device;
+  self->key_log = key_log;
+  self->key_stats = key_stats;
+  self->hud = hud;
+  self->h_jump = h_jump;
+  self->wrap_lines = wrap_lines;
+  self->load_threads = load_threads;
+  self->large_min = large_min;
+  self->tab_stops = tab_stops ? tab_stops : tab_stops_create (8);
   self->edit_mode = BUTE_EDIT_MODE_INSERT;
+  self->replaced = -1;
   self->terminal = (Terminal *)linux_terminal_create();
+  linux_terminal_set_serial ((LinuxTerminal *)self->terminal, self->serial);
+  if (self->device)
+    linux_terminal_set_device ((LinuxTerminal *)self->terminal, self->device);
+  self->terminal->set_tab_stops (self->terminal, self->tab_stops);
   if (self->terminal->init (self->terminal, error))
     {
     self->text_file = text_file_create ();
-    if (!text_file_load (self->text_file, filename))
+    text_file_set_tab_stops (self->text_file, self->tab_stops);
+    text_file_set_load_threads (self->text_file, self->load_threads);
+    text_file_set_large_min (self->text_file, self->large_min);
+    // Only the first screen, and one more, is loaded before the first
+    //   screen is drawn; the rest is loaded while waiting for keys
+    int rows = 24; int columns = 80;
+    self->terminal->get_size (self->terminal, &rows, &columns, NULL);
+    BOOL loaded = text_file_load_start (self->text_file, filename);
+    while (loaded && text_file_is_loading (self->text_file)
+        && (int)text_file_get_line_count (self->text_file) < 2 * rows)
+      loaded = text_file_load_more (self->text_file);
+    if (!loaded)
       {
       // File could not be read. But this is not an error if the
       //  reason is not ENONENT -- it's OK to specify a non-existent
@@ -815,20 +2792,39 @@ ButeReturn bute_run (BUTE *self, const char *filename, char **error)
       {
       self->filename = strdup (filename);
       bute_ensure_file_not_empty (self);
+      // Wrapping needs the width of every line, which would mean 
+      //   reading the whole of a large file
+      if (self->wrap_lines && !text_file_is_large (self->text_file))
+        {
+        self->wrap = wrap_index_create ();
+        wrap_index_build (self->wrap, self->text_file, columns);
+        }
+      self->terminal->raw_mode (self->terminal, TRUE);
+      self->terminal->begin_frame (self->terminal);
       bute_top_of_file (self);
       self->terminal->cursor_line (self->terminal);
 
       bute_set_init_status (self);
+      self->redraw_pending = !self->terminal->end_frame (self->terminal);
+      bute_frame_sent (self);
 
       ret = bute_keyboard_loop (self);
 
+      self->terminal->raw_mode (self->terminal, FALSE);
+
       self->terminal->cursor_line (self->terminal);
       self->terminal->clear (self->terminal);
 
+      if (self->wrap) wrap_index_destroy (self->wrap);
+      self->wrap = NULL;
+      match_index_destroy (self->matches);
+      self->matches = NULL;
       text_file_destroy (self->text_file);
 
       if (self->filename) free (self->filename);
       self->filename = NULL;
+      if (self->search_last) free (self->search_last);
+      self->search_last = NULL;
       }
     }
   else
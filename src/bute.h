@@ -10,6 +10,11 @@
 ===========================================================================*/
 #pragma once
 
+#include "tabstops.h"
+#include "terminal.h"
+#include "keylog.h"
+#include "keystats.h"
+
 struct _BUTE;
 typedef struct _BUTE BUTE;
 
@@ -29,6 +34,52 @@ typedef enum _ButeReturn
 extern BUTE      *bute_create (void);
 extern void       bute_destroy (BUTE *bute);
 
+// Use the serial line profile for the terminal, which keeps output to
+//   a minimum. Must be called before bute_run()
+extern void       bute_set_serial (BUTE *bute, BOOL serial);
+
+// Draw on, and take keys from, a device such as a VirtualTerminal,
+//   rather than the process's terminal. The BUTE does not take 
+//   ownership of the device. Must be called before bute_run()
+extern void       bute_set_device (BUTE *bute, TerminalDevice *device);
+
+// Record the keys of the session to a log, or replay them from one,
+//   according to how the log was set up. When a log being replayed 
+//   runs out, keys come from the terminal again. The BUTE does not 
+//   take ownership of the log. Must be called before bute_run()
+extern void       bute_set_key_log (BUTE *bute, KeyLog *key_log);
+
+// Count the time each key takes to show on the terminal, and what it
+//   costs in output, system calls and allocations. With hud set, the
+//   latencies are shown on the status line as well. The BUTE does not
+//   take ownership of the KeyStats. Must be called before bute_run()
+extern void       bute_set_key_stats (BUTE *bute, KeyStats *key_stats,
+                    BOOL hud);
+
+// Set the tab stops. The BUTE takes ownership of the TabStops. If this
+//   is not called, there is a stop every eight columns
+extern void       bute_set_tab_stops (BUTE *bute, TabStops *tab_stops);
+
+// Wrap lines longer than the screen width onto the following rows, 
+//   rather than moving the view sideways. Must be called before 
+//   bute_run()
+extern void       bute_set_wrap (BUTE *bute, BOOL wrap);
+
+// Set how many threads to load the file with. If this is not called,
+//   or load_threads is zero, there is one for each processor
+extern void       bute_set_load_threads (BUTE *bute, int load_threads);
+
+// Set the size, in bytes, above which a file is large, and only the 
+//   parts of it near the screen, or that have been changed, are kept in
+//   memory. If this is not called, it is a quarter of the memory. Lines
+//   are not wrapped in a large file
+extern void       bute_set_large_min (BUTE *bute, off64_t large_min);
+
+// Set how many columns the view moves sideways when the cursor goes
+//   off the edge of the screen. If this is not called, or h_jump is 
+//   zero, the view moves by half the screen width
+extern void       bute_set_h_jump (BUTE *bute, int h_jump);
+
 // bute_run returns various status codes. If the return value is
 //   BUTE_RET_ERR the caller can expect **error to be assigned, so
 //   long as error != NULL on entry. All other outcomes are considered
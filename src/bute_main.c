@@ -13,6 +13,9 @@
 ===========================================================================*/
 #include "cnolib.h"
 #include "bute.h"
+#include "virtualterminal.h"
+#include "keylog.h"
+#include "keystats.h"
 
 /* Write a number without newline */
 void putn (int n)
@@ -52,18 +55,91 @@ void bute_main_usage (FILE *f)
   fputs ("File will be created if it does not exist.\n", f);
   fputs ("\n", f);
   fputs ("Options:\n", f);
+  fputs ("  -H    Draw on a virtual terminal, and print its screen, and\n", f);
+  fputs ("        counts of the output, at the end\n", f);
+  fputs ("  -j N  Load and search the file with N threads (default: one\n", f);
+  fputs ("        per CPU)\n", f);
+  fputs ("  -k F  Take keys from file F, and draw on a virtual terminal\n", f);
+  fputs ("  -L N  Keep only the parts of a file bigger than N MB that\n", f);
+  fputs ("        are in view, or changed, in memory\n", f);
+  fputs ("  -l F  Write the time each key took to show, as a histogram,\n", f);
+  fputs ("        and the output and system calls it took, to file F\n", f);
+  fputs ("  -m    Show the time keys take to show on the status line\n", f);
+  fputs ("  -p F  Replay the keys recorded in file F\n", f);
+  fputs ("  -r F  Record the keys of the session in file F\n", f);
+  fputs ("  -s    Serial line: send as little output as possible\n", f);
+  fputs ("  -t N  Tab stops every N columns\n", f);
+  fputs ("  -t N1,N2,...\n", f);
+  fputs ("        Tab stops at columns N1, N2... (counting from zero)\n", f);
+  fputs ("  -T    With -p, keep the time between keys that was recorded\n", f);
   fputs ("  -v    Show version\n", f);
+  fputs ("  -w    Wrap long lines onto the following rows\n", f);
+  fputs ("  -x N  Scroll long lines sideways N columns at a time\n", f);
   fputs ("\n", f);
   fputs ("Key assignments:\n", f);
+  fputs ("  ctrl-b   search backward\n", f);
   fputs ("  ctrl+d   delete line\n", f);
+  fputs ("  ctrl-f   search forward\n", f);
+  fputs ("  ctrl-n   while searching, count the matches now\n", f);
   fputs ("  ctrl-q   quit, warn if unsaved\n", f);
-  fputs ("  ctrl-r   toggle between insert and replace modes\n", f);
+  fputs ("  ctrl-r   toggle between insert and replace modes; while\n", f);
+  fputs ("           searching, a regular expression or plain text\n", f);
   fputs ("  ctrl-s   save\n", f);
+  fputs ("  ctrl-t   replace, asking at each match\n", f);
   fputs ("  ctrl-x   quit without saving\n", f);
+  fputs ("  ctrl-z   undo the last replace of all the matches\n", f);
   fflush (f);
   }
 
 
+/*===========================================================================
+
+  bute_main_read_keys
+
+  Read the whole of a file of keystrokes. Returns NULL, with errno set,
+  if it can't be read
+
+===========================================================================*/
+static char *bute_main_read_keys (const char *file, int *len)
+  {
+  FILE *f = fopen (file, "r");
+  if (!f) return NULL;
+  int size = BUFSIZ;
+  int n = 0;
+  char *keys = malloc (size);
+  int r;
+  while ((r = fread (keys + n, 1, size - n, f)) > 0)
+    {
+    n += r;
+    if (n == size)
+      {
+      size *= 2;
+      keys = realloc (keys, size);
+      }
+    }
+  fclose (f);
+  *len = n;
+  return keys;
+  }
+
+/*===========================================================================
+
+  bute_main_virtual_size
+
+  The size of the virtual terminal: LINES and COLUMNS, if they are set,
+  or else 24x80
+
+===========================================================================*/
+static void bute_main_virtual_size (int *rows, int *columns)
+  {
+  const char *s = getenv ("LINES");
+  *rows = s ? atoi (s) : 0;
+  if (*rows < 2) *rows = 24;
+  s = getenv ("COLUMNS");
+  *columns = s ? atoi (s) : 0;
+  if (*columns < 2) *columns = 80;
+  }
+
 /*===========================================================================
 
   bute_main 
@@ -75,17 +151,102 @@ int bute_main (int argc, char **argv)
   int opt;
   BOOL show_usage = FALSE;
   BOOL show_version = FALSE;
+  BOOL serial = FALSE;
+  TabStops *tab_stops = NULL;
+  int h_jump = 0;
+  BOOL wrap = FALSE;
+  const char *keys_file = NULL;
+  const char *record_file = NULL;
+  const char *replay_file = NULL;
+  BOOL headless = FALSE;
+  BOOL timed = FALSE;
+  const char *stats_file = NULL;
+  BOOL hud = FALSE;
+  int load_threads = 0;
+  off64_t large_min = -1;
   optreset = 1;
-  while ((opt = getopt (argc, argv, "hv")) != -1)
+  while ((opt = getopt (argc, argv, "Hhj:k:L:l:mp:r:sTt:vwx:")) != -1)
     {
     switch (opt)
       {
+      case 'H': 
+        headless = TRUE; 
+	break;
       case 'h': 
         show_usage = TRUE; 
 	break;
+      case 'j': 
+        load_threads = atoi (optarg);
+        if (load_threads <= 0)
+          {
+          fputs (NAME ": Invalid number of threads\n", stderr);
+          fflush (stderr);
+          ret = BUTE_RET_ERR;
+          }
+	break;
+      case 'k': 
+        keys_file = optarg; 
+        headless = TRUE; 
+	break;
+      case 'L': 
+        large_min = (off64_t)atoi (optarg) * 1024 * 1024;
+        if (large_min < 0)
+          {
+          fputs (NAME ": Invalid large file size\n", stderr);
+          fflush (stderr);
+          ret = BUTE_RET_ERR;
+          }
+	break;
+      case 'l': 
+        stats_file = optarg; 
+	break;
+      case 'm': 
+        hud = TRUE; 
+	break;
+      case 'p': 
+        replay_file = optarg; 
+	break;
+      case 'r': 
+        record_file = optarg; 
+	break;
+      case 'T': 
+        timed = TRUE; 
+	break;
+      case 's': 
+        serial = TRUE; 
+	break;
+      case 't': 
+        {
+        char *error = NULL;
+        if (tab_stops) tab_stops_destroy (tab_stops);
+        tab_stops = tab_stops_parse (optarg, &error);
+        if (!tab_stops)
+          {
+          fputs (NAME, stderr);
+          fputs (": ", stderr);
+          fputs (error, stderr);
+          fputs ("\n", stderr);
+          fflush (stderr);
+          free (error);
+          ret = BUTE_RET_ERR;
+          }
+        }
+	break;
       case 'v': 
         show_version = TRUE; 
 	break;
+      case 'w': 
+        wrap = TRUE; 
+	break;
+      case 'x': 
+        h_jump = atoi (optarg);
+        if (h_jump <= 0)
+          {
+          fputs (NAME ": Invalid scroll step\n", stderr);
+          fflush (stderr);
+          ret = BUTE_RET_ERR;
+          }
+	break;
       default:
         bute_main_usage (stderr); 
 	errno = EINVAL;
@@ -94,6 +255,13 @@ int bute_main (int argc, char **argv)
       }
     }
 
+  if (record_file && replay_file)
+    {
+    fputs (NAME ": Can't record and replay at once\n", stderr);
+    fflush (stderr);
+    ret = BUTE_RET_ERR;
+    }
+
   if (show_usage)
     {
     bute_main_usage (stdout);
@@ -110,12 +278,86 @@ int bute_main (int argc, char **argv)
     {
     if (argc - optind == 1)
       {
-      const char *filename = argv[argc - optind];
+      const char *filename = argv[optind];
       char *error = NULL;
+      VirtualTerminal *vt = NULL;
+      KeyLog *key_log = NULL;
+      KeyStats *key_stats = NULL;
+      char *keys = NULL;
+      int keys_len = 0;
 
       BUTE *bute = bute_create();
+      bute_set_serial (bute, serial);
+      if (tab_stops) bute_set_tab_stops (bute, tab_stops);
+      bute_set_h_jump (bute, h_jump);
+      bute_set_wrap (bute, wrap);
+      bute_set_load_threads (bute, load_threads);
+      bute_set_large_min (bute, large_min);
+
+      if (keys_file)
+        {
+        keys = bute_main_read_keys (keys_file, &keys_len);
+        if (!keys)
+          {
+          error = str2 ("Can't read keys: ", strerror (errno));
+          ret = BUTE_RET_ERR;
+          }
+        }
 
-      ret = bute_run (bute, filename, &error);
+      if (ret != BUTE_RET_ERR && (record_file || replay_file))
+        {
+        key_log = key_log_create ();
+        if (record_file ? key_log_record (key_log, record_file)
+             : key_log_replay (key_log, replay_file))
+          {
+          key_log_set_timed (key_log, timed);
+          bute_set_key_log (bute, key_log);
+          }
+        else
+          {
+          error = str2 ("Can't open key log: ", strerror (errno));
+          ret = BUTE_RET_ERR;
+          }
+        }
+
+      if (stats_file || hud)
+        {
+        key_stats = key_stats_create ();
+        bute_set_key_stats (bute, key_stats, hud);
+        }
+
+      if (ret != BUTE_RET_ERR && headless)
+        {
+        int rows, columns;
+        bute_main_virtual_size (&rows, &columns);
+        vt = virtual_terminal_create (rows, columns);
+        virtual_terminal_set_keys (vt, keys, keys_len);
+        bute_set_device (bute, virtual_terminal_get_device (vt));
+        }
+
+      if (ret != BUTE_RET_ERR)
+        ret = bute_run (bute, filename, &error);
+      if (vt && ret != BUTE_RET_ERR)
+        virtual_terminal_dump (vt, stdout);
+      if (stats_file && ret != BUTE_RET_ERR)
+        {
+        FILE *f = fopen (stats_file, "w");
+        if (f)
+          {
+          key_stats_dump (key_stats, f);
+          fclose (f);
+          }
+        else
+          {
+          // The session is over, so this is only worth a warning
+          fputs (NAME ": Can't write ", stderr);
+          fputs (stats_file, stderr);
+          fputs (": ", stderr);
+          fputs (strerror (errno), stderr);
+          fputs ("\n", stderr);
+          fflush (stderr);
+          }
+        }
       if (ret == BUTE_RET_ERR)
         {
         fputs (NAME, stderr);
@@ -126,6 +368,10 @@ int bute_main (int argc, char **argv)
         free (error);
         }
       bute_destroy (bute);
+      if (vt) virtual_terminal_destroy (vt);
+      if (key_log) key_log_destroy (key_log);
+      if (key_stats) key_stats_destroy (key_stats);
+      if (keys) free (keys);
       }
     else
       {
@@ -56,10 +56,165 @@ char **envp;
 // stdin, etc, FILE * initialized in __main()
 FILE *stdin, *stdout, *stderr;
 
+// The number of system calls made so far. syscall() in the assembly-code
+//   module counts them
+unsigned long syscall_calls;
+
+// clock_gettime() in the vDSO, if __main found it
+static int (*vdso_clock_gettime) (int clk_id, struct timespec *tp);
+
+// Just enough of the ELF format to find a function in the vDSO. The
+//   header and dynamic entries have the same layout on 32- and 64-bit
+//   machines, if the addresses are the size of a pointer; the program
+//   headers and symbols do not
+#define AT_NULL         0
+#define AT_SYSINFO_EHDR 33
+#define PT_LOAD         1
+#define PT_DYNAMIC      2
+#define DT_NULL         0
+#define DT_HASH         4
+#define DT_STRTAB       5
+#define DT_SYMTAB       6
+#define STT_FUNC        2
+#define SHN_UNDEF       0
+
+typedef struct _ElfEhdr
+  {
+  unsigned char e_ident[16];
+  unsigned short e_type;
+  unsigned short e_machine;
+  unsigned int e_version;
+  uintptr_t e_entry;
+  uintptr_t e_phoff;
+  uintptr_t e_shoff;
+  unsigned int e_flags;
+  unsigned short e_ehsize;
+  unsigned short e_phentsize;
+  unsigned short e_phnum;
+  } ElfEhdr;
+
+typedef struct _ElfDyn
+  {
+  intptr_t d_tag;
+  uintptr_t d_val;
+  } ElfDyn;
+
+#if __WORDSIZE == 64
+typedef struct _ElfPhdr
+  {
+  unsigned int p_type;
+  unsigned int p_flags;
+  uintptr_t p_offset;
+  uintptr_t p_vaddr;
+  uintptr_t p_paddr;
+  uintptr_t p_filesz;
+  uintptr_t p_memsz;
+  uintptr_t p_align;
+  } ElfPhdr;
+
+typedef struct _ElfSym
+  {
+  unsigned int st_name;
+  unsigned char st_info;
+  unsigned char st_other;
+  unsigned short st_shndx;
+  uintptr_t st_value;
+  uintptr_t st_size;
+  } ElfSym;
+#else
+typedef struct _ElfPhdr
+  {
+  unsigned int p_type;
+  uintptr_t p_offset;
+  uintptr_t p_vaddr;
+  uintptr_t p_paddr;
+  uintptr_t p_filesz;
+  uintptr_t p_memsz;
+  unsigned int p_flags;
+  uintptr_t p_align;
+  } ElfPhdr;
+
+typedef struct _ElfSym
+  {
+  unsigned int st_name;
+  uintptr_t st_value;
+  uintptr_t st_size;
+  unsigned char st_info;
+  unsigned char st_other;
+  unsigned short st_shndx;
+  } ElfSym;
+#endif
+
 // We need to define a reference to the program's main(), so we can
 //   call it from __main()
 extern int main (int argc, char **argv);
 
+/*===========================================================================
+
+  vdso_find
+
+  Find a function in the vDSO -- the small shared library that the 
+  kernel maps into every process, so that calls like clock_gettime() 
+  can be made without the cost of a system call. base is where the 
+  kernel says, in the aux vector, that it is. Returns NULL if the 
+  function isn't there
+
+===========================================================================*/
+static void *vdso_find (const char *base, const char *name)
+  {
+  const ElfEhdr *ehdr = (const ElfEhdr *)base;
+  if (strncmp ((const char *)ehdr->e_ident, "\177ELF", 4) != 0) return NULL;
+  // Addresses in the dynamic section are those the library was linked
+  //   at, which the first loadable segment tells us how to convert
+  const ElfPhdr *phdr = (const ElfPhdr *)(base + ehdr->e_phoff);
+  const ElfDyn *dyn = NULL;
+  uintptr_t load = 0;
+  BOOL loaded = FALSE;
+  for (int i = 0; i < ehdr->e_phnum; i++)
+    {
+    if (phdr[i].p_type == PT_LOAD && !loaded)
+      {
+      load = (uintptr_t)base + phdr[i].p_offset - phdr[i].p_vaddr;
+      loaded = TRUE;
+      }
+    else if (phdr[i].p_type == PT_DYNAMIC)
+      dyn = (const ElfDyn *)(base + phdr[i].p_offset);
+    }
+  if (!loaded || !dyn) return NULL;
+
+  const ElfSym *symtab = NULL;
+  const char *strtab = NULL;
+  const unsigned int *hash = NULL;
+  for (; dyn->d_tag != DT_NULL; dyn++)
+    {
+    switch (dyn->d_tag)
+      {
+      case DT_SYMTAB: 
+        symtab = (const ElfSym *)(load + dyn->d_val); 
+        break;
+      case DT_STRTAB: 
+        strtab = (const char *)(load + dyn->d_val); 
+        break;
+      case DT_HASH: 
+        hash = (const unsigned int *)(load + dyn->d_val); 
+        break;
+      }
+    }
+  if (!symtab || !strtab || !hash) return NULL;
+
+  // The second word of the hash table is the number of symbols. There
+  //   are only a handful, so we don't use the hash to find the one we
+  //   want
+  for (unsigned int i = 0; i < hash[1]; i++)
+    {
+    const ElfSym *sym = &symtab[i];
+    if (sym->st_shndx != SHN_UNDEF && (sym->st_info & 0xF) == STT_FUNC
+         && strcmp (strtab + sym->st_name, name) == 0)
+      return (void *)(load + sym->st_value);
+    }
+  return NULL;
+  }
+
 /*===========================================================================
 
  __main 
@@ -74,6 +229,18 @@ int __main (int argc, char **argv)
   //   This is data that was put on the stack by the kernel
   envp = &(argv[argc + 1]);
 
+  // The aux vector follows the environment: pairs of type and value,
+  //   ending with AT_NULL. One of them tells us where the vDSO is
+  char **p = envp;
+  while (*p) p++;
+  for (const uintptr_t *auxv = (const uintptr_t *)(p + 1); 
+       auxv[0] != AT_NULL; auxv += 2)
+    {
+    if (auxv[0] == AT_SYSINFO_EHDR)
+      vdso_clock_gettime = vdso_find ((const char *)auxv[1], 
+        "__vdso_clock_gettime");
+    }
+
   // We would initialize the memory management system here, if it was
   //  sophisticated enough to need any initialization
 
@@ -220,10 +387,11 @@ int fork (void)
 ===========================================================================*/
 void exit (int status)
   {
-  syscall (SYS_EXIT, status);
+  // SYS_EXIT would end only the calling thread
+  syscall (SYS_EXIT_GROUP, status);
   // Ugh -- gcc recognizes "exit" as a "noreturn" function by default. So
   //   we have to do something that the compiler things is non-returning.
-  // This code will ever be reached, because syscall 60 terminates the
+  // This code will ever be reached, because exit_group terminates the
   //   program. However, the compiler doesn't know that.
   for(;;);
   }
@@ -321,12 +489,30 @@ char *strdup (const char *s)
 
   strlen
 
+  Bytes are looked at one at a time until they are on a word boundary,
+  and then a word at a time; an aligned word never crosses into a page
+  that might not be mapped, even if it includes the terminating null
+
 ===========================================================================*/
 size_t strlen (const char *str)
   {
-  for (size_t len = 0; ; ++len) 
-    if (str[len] == 0) return len;
-  return 0;
+  typedef unsigned long Word __attribute__ ((__may_alias__));
+  const unsigned long ones = (unsigned long)-1 / 0xFF;
+  const unsigned long highs = ones * 0x80;
+  const char *p = str;
+  while (((unsigned long)p & (sizeof (Word) - 1)) != 0)
+    {
+    if (*p == 0) return p - str;
+    p++;
+    }
+  for (;;)
+    {
+    Word w = *(const Word *)p;
+    if ((w - ones) & ~w & highs) break;
+    p += sizeof (Word);
+    }
+  while (*p) p++;
+  return p - str;
   }
 
 /*===========================================================================
@@ -624,6 +810,25 @@ char *itoa (int n, char *str, int base)
   return ltoa (n, str, base);
   } 
 
+/*===========================================================================
+
+  atoi 
+
+  Leading whitespace and a sign are allowed. Conversion stops at the
+  first character that is not a digit.
+
+===========================================================================*/
+int atoi (const char *s)
+  {
+  while (*s == ' ' || *s == '\t') s++;
+  BOOL neg = (*s == '-');
+  if (*s == '-' || *s == '+') s++;
+  int n = 0;
+  while (*s >= '0' && *s <= '9')
+    n = n * 10 + *s++ - '0';
+  return neg ? -n : n;
+  }
+
 
 /*===========================================================================
 
@@ -642,6 +847,11 @@ typedef struct free_block
 static free_block free_block_list_head = { 0, 0 };
 static const size_t align_to = 16;
 
+// Once there is more than one thread, the heap is locked while the free 
+//   list is being worked on
+static BOOL malloc_threaded;
+static pthread_mutex_t malloc_lock = PTHREAD_MUTEX_INITIALIZER;
+
 /*===========================================================================
 
   brk 
@@ -672,8 +882,13 @@ void *sbrk (intptr_t increment)
   malloc 
 
 ===========================================================================*/
+unsigned long malloc_calls;
+
 void *malloc (size_t size)
   {
+  BOOL locked = malloc_threaded;
+  if (locked) pthread_mutex_lock (&malloc_lock);
+  malloc_calls++;
   // Align size of 16-byte boundary
   size = (size + sizeof(size_t) + (align_to - 1)) & ~ (align_to - 1);
   free_block* block = free_block_list_head.next;
@@ -683,6 +898,7 @@ void *malloc (size_t size)
     if (block->size >= size) 
       {
       *head = block->next;
+      if (locked) pthread_mutex_unlock (&malloc_lock);
       return ((char*)block) + sizeof(size_t);
       }
     head = &(block->next);
@@ -692,6 +908,7 @@ void *malloc (size_t size)
   block = (free_block*)sbrk(size);
   block->size = size;
 
+  if (locked) pthread_mutex_unlock (&malloc_lock);
   return ((char*)block) + sizeof(size_t);
   }
 
@@ -699,19 +916,20 @@ void *malloc (size_t size)
 
   realloc 
 
-  This implementation is a bit lazy. We really ought to check whether the
-  existing memory block can be expanded, before allocating another.
+  The block is kept if it already has room for size bytes, which, as 
+  blocks are rounded up, and reused whole, it often has. Otherwise only
+  what was in the old block is copied, and the old block is freed.
 
-  In addition, when copying the existing block, we copy the new block size,
-  not the old block size. I need to look at this because, not only is
-  it inefficient, but it will copy a load of garbage. It won't crash,
-  I think, even though the read will overrun the memory block --
-  we're still reading from allocated space. But, still... eeew.
 ===========================================================================*/
 void *realloc (void *ptr, size_t size)
   {
+  if (!ptr) return malloc (size);
+  free_block *block = (free_block *)(((char *)ptr) - sizeof (size_t));
+  size_t room = block->size - sizeof (size_t);
+  if (room >= size) return ptr;
   char *newp = malloc (size);
-  memcpy (newp, ptr, size);
+  memcpy (newp, ptr, room);
+  free (ptr);
   return newp;
   }
 
@@ -722,9 +940,51 @@ void *realloc (void *ptr, size_t size)
 ===========================================================================*/
 void free (void* ptr) 
   {
+  BOOL locked = malloc_threaded;
+  if (locked) pthread_mutex_lock (&malloc_lock);
   free_block* block = (free_block*)(((char*)ptr) - sizeof(size_t));
   block->next = free_block_list_head.next;
   free_block_list_head.next = block;
+  if (locked) pthread_mutex_unlock (&malloc_lock);
+  }
+
+/*===========================================================================
+
+  mmap 
+
+===========================================================================*/
+void *mmap (void *addr, size_t length, int prot, int flags, int fd, 
+     off_t offset)
+  {
+#ifdef SYS_MMAP2
+  long r = syscall (SYS_MMAP2, addr, length, prot, flags, fd, offset >> 12);
+#else
+  long r = syscall (SYS_MMAP, addr, length, prot, flags, fd, offset);
+#endif
+  // An address can look negative on a 32-bit machine; an error is 
+  //   always between -4095 and -1
+  if ((unsigned long)r >= (unsigned long)-4095)
+    {
+    errno = -r;
+    return MAP_FAILED;
+    }
+  return (void *)r;
+  }
+
+/*===========================================================================
+
+  munmap 
+
+===========================================================================*/
+int munmap (void *addr, size_t length)
+  {
+  int r = syscall (SYS_MUNMAP, addr, length);
+  if (r < 0) 
+    {
+    errno = -r;
+    return -1;
+    }
+  return 0;
   }
 
 /*===========================================================================
@@ -754,20 +1014,37 @@ void *memcpy (void *dest, const void *src, size_t n)
 
   memmove
 
+  Copies a word at a time, and then the bytes left over. Copying from 
+  the end when the destination is after the source means each word is
+  read before anything is written over it
+
 ===========================================================================*/
 void *memmove (void *dest, const void *src, size_t n)
   {
+  typedef unsigned long Word __attribute__ ((__may_alias__, aligned (1)));
   char *d = (char*)dest;
-  char *s = (char*)src;
+  const char *s = (const char*)src;
   if (s < d) 
     {
     s += n;
     d += n;
+    for (; n >= sizeof (Word); n -= sizeof (Word))
+      {
+      s -= sizeof (Word);
+      d -= sizeof (Word);
+      *(Word *)d = *(const Word *)s;
+      }
     while (n--)
       *--d = *--s;
     } 
   else 
     {
+    for (; n >= sizeof (Word); n -= sizeof (Word))
+      {
+      *(Word *)d = *(const Word *)s;
+      s += sizeof (Word);
+      d += sizeof (Word);
+      }
     while (n--)
       *d++ = *s++;
     }
@@ -775,6 +1052,22 @@ void *memmove (void *dest, const void *src, size_t n)
   return dest;
   }
 
+/*===========================================================================
+
+  memcmp
+
+===========================================================================*/
+int memcmp (const void *s1, const void *s2, size_t n)
+  {
+  const unsigned char *p1 = s1;
+  const unsigned char *p2 = s2;
+  for (size_t i = 0; i < n; i++)
+    {
+    if (p1[i] != p2[i]) return p1[i] - p2[i];
+    }
+  return 0;
+  }
+
 /*===========================================================================
 
   memset
@@ -874,6 +1167,32 @@ off_t lseek (int fd, off_t offset, int whence)
   return syscall (SYS_LSEEK, fd, offset, whence);
   }
 
+/*===========================================================================
+
+  lseek64
+
+  On ARM, _llseek takes the offset in two halves, and returns the new
+  position through a pointer
+
+===========================================================================*/
+off64_t lseek64 (int fd, off64_t offset, int whence)
+  {
+#ifdef __arm__
+  off64_t pos;
+  long r = syscall (SYS__LLSEEK, fd, (long)(offset >> 32), (long)offset, 
+    &pos, whence);
+#else
+  long r = syscall (SYS_LSEEK, fd, offset, whence);
+  off64_t pos = r;
+#endif
+  if (r < 0)
+    {
+    errno = -r;
+    return -1;
+    }
+  return pos;
+  }
+
 
 /*===========================================================================
 
@@ -956,6 +1275,43 @@ int read (int fd, const void *buff, int l)
     }
   }
 
+/*===========================================================================
+
+  pread 
+
+  On ARM, a 64-bit offset goes in an aligned pair of registers, so there
+  is a gap before it
+
+===========================================================================*/
+int pread (int fd, void *buff, int l, off_t offset)
+  {
+  return pread64 (fd, buff, l, offset);
+  }
+
+/*===========================================================================
+
+  pread64
+
+  On ARM, the offset goes in an even-numbered pair of registers, low 
+  half first, so a padding argument comes before it
+
+===========================================================================*/
+int pread64 (int fd, void *buff, int l, off64_t offset)
+  {
+#ifdef __arm__
+  int r = syscall (SYS_PREAD64, fd, buff, l, 0, (long)offset, 
+    (long)(offset >> 32));
+#else
+  int r = syscall (SYS_PREAD64, fd, buff, l, offset);
+#endif
+  if (r < 0) 
+    {
+    errno = -r;
+    return -1;
+    }
+  return r;
+  }
+
 
 /*===========================================================================
 
@@ -1013,7 +1369,7 @@ extern int fflush (FILE *f)
       break;
     case _IODIR_OUT:
       // Write the accumulated data to file
-      if (write (f->fd, f->buff, f->pos) != 0)
+      if (f->pos > 0 && write (f->fd, f->buff, f->pos) != f->pos)
         {
         ret = -1; // errno set by write()
         }
@@ -1111,9 +1467,11 @@ char *fgets (char *s, int size, FILE *f)
       // Yes, there's a newline. Shift the buffer down, and
       //  signal that we're done
       int eoloff = eol - (char *)f->buff + 1;
-      int tocopy = eoloff < size - 2 ? eoloff : size - 2; 
+      int tocopy = eoloff < size - 1 ? eoloff : size - 1; 
       memcpy (s, (char *)f->buff, tocopy); 
-      int shift_down = eol - (char *)f->buff + 1;
+      // If the line is too long for s, the rest of it is left for the
+      //   next call
+      int shift_down = tocopy;
       memmove (f->buff, f->buff + shift_down, BUFSIZ - shift_down);
       f->pos -= shift_down; 
       if (f->pos < 0) f->pos = 0;
@@ -1122,6 +1480,19 @@ char *fgets (char *s, int size, FILE *f)
       got_newline = TRUE;
       }
 
+    if (!got_newline && (f->pos >= size - 1 || f->pos == BUFSIZ))
+      {
+      // No newline, but either s or our buffer is full. Return what 
+      //  fits, as a partial line
+      int tocopy = f->pos < size - 1 ? f->pos : size - 1; 
+      memcpy (s, (char *)f->buff, tocopy); 
+      memmove (f->buff, f->buff + tocopy, BUFSIZ - tocopy);
+      f->pos -= tocopy;
+      s[tocopy] = 0;
+      ret = s;
+      got_newline = TRUE;
+      }
+
     if (!got_newline)
       {
       // We didn't get a newline. Are we at EOF? If so, we will 
@@ -1136,7 +1507,7 @@ char *fgets (char *s, int size, FILE *f)
         else
           {
           int eoloff = f->pos; 
-          int tocopy = eoloff < size - 2 ? eoloff : size - 2; 
+          int tocopy = eoloff < size - 1 ? eoloff : size - 1; 
           memcpy (s, (char *)f->buff, tocopy); 
           s[tocopy] = 0;
           f->pos = 0;
@@ -1350,6 +1721,102 @@ int access (const char *pathname, int mode)
   return syscall (SYS_ACCESS, pathname, mode);
   }
 
+/*===========================================================================
+
+  sys_result 
+
+  Turn the result of a system call that returns nothing else into 0, or
+  -1 with errno set
+
+===========================================================================*/
+static int sys_result (long r)
+  {
+  if (r < 0)
+    {
+    errno = -r;
+    return -1;
+    }
+  return 0;
+  }
+
+/*===========================================================================
+
+  fstat 
+
+===========================================================================*/
+int fstat (int fd, struct stat *st)
+  {
+#ifdef __arm__
+  return sys_result (syscall (SYS_FSTAT64, fd, st));
+#else
+  return sys_result (syscall (SYS_FSTAT, fd, st));
+#endif
+  }
+
+/*===========================================================================
+
+  fchmod 
+
+===========================================================================*/
+int fchmod (int fd, unsigned int mode)
+  {
+  return sys_result (syscall (SYS_FCHMOD, fd, mode));
+  }
+
+/*===========================================================================
+
+  fchown 
+
+===========================================================================*/
+int fchown (int fd, unsigned int uid, unsigned int gid)
+  {
+#ifdef __arm__
+  return sys_result (syscall (SYS_FCHOWN32, fd, uid, gid));
+#else
+  return sys_result (syscall (SYS_FCHOWN, fd, uid, gid));
+#endif
+  }
+
+/*===========================================================================
+
+  fsync 
+
+===========================================================================*/
+int fsync (int fd)
+  {
+  return sys_result (syscall (SYS_FSYNC, fd));
+  }
+
+/*===========================================================================
+
+  rename 
+
+===========================================================================*/
+int rename (const char *from, const char *to)
+  {
+  return sys_result (syscall (SYS_RENAME, from, to));
+  }
+
+/*===========================================================================
+
+  unlink 
+
+===========================================================================*/
+int unlink (const char *pathname)
+  {
+  return sys_result (syscall (SYS_UNLINK, pathname));
+  }
+
+/*===========================================================================
+
+  sysinfo 
+
+===========================================================================*/
+int sysinfo (struct sysinfo *info)
+  {
+  return sys_result (syscall (SYS_SYSINFO, info));
+  }
+
 /*===========================================================================
 
   error_handling 
@@ -1441,6 +1908,26 @@ char *strerror (int errnum)
   Time and date 
 
 ===========================================================================*/
+/*===========================================================================
+
+  clock_gettime 
+
+  The vDSO's clock_gettime() reads the clock without entering the 
+  kernel, and returns what the system call would, if it has to make it
+
+===========================================================================*/
+int clock_gettime (int clk_id, struct timespec *tp)
+  {
+  int r = vdso_clock_gettime ? vdso_clock_gettime (clk_id, tp)
+    : syscall (SYS_CLOCK_GETTIME, clk_id, tp); 
+  if (r < 0) 
+    {
+    errno = -r;
+    return -1;
+    }
+  return r;
+  }
+
 /*===========================================================================
 
   nanosleep 
@@ -1651,4 +2138,279 @@ char *basename (char *path)
   }
 
 
+/*===========================================================================
+
+  Threads 
+
+  A thread is a clone() of the process that shares its memory, files
+  and signal handlers, with a stack of its own from mmap(). The kernel
+  writes the new thread's ID into its struct _pthread, and clears it,
+  and wakes anyone waiting on it with a futex, when the thread ends; 
+  that is what pthread_join() waits for.
+
+===========================================================================*/
+#define CLONE_VM             0x00000100
+#define CLONE_FS             0x00000200
+#define CLONE_FILES          0x00000400
+#define CLONE_SIGHAND        0x00000800
+#define CLONE_THREAD         0x00010000
+#define CLONE_SYSVSEM        0x00040000
+#define CLONE_PARENT_SETTID  0x00100000
+#define CLONE_CHILD_CLEARTID 0x00200000
+#define PTHREAD_CLONE_FLAGS (CLONE_VM | CLONE_FS | CLONE_FILES \
+  | CLONE_SIGHAND | CLONE_THREAD | CLONE_SYSVSEM | CLONE_PARENT_SETTID \
+  | CLONE_CHILD_CLEARTID)
+
+#define FUTEX_WAIT           0
+#define FUTEX_WAKE           1
+// Futexes that are only used within this process. The kernel wakes
+//   pthread_join() with a futex that is not private
+#define FUTEX_PRIVATE_FLAG   128
+
+#define PTHREAD_STACK_SIZE (256 * 1024)
+
+struct _pthread
+  {
+  int tid;
+  void *stack;
+  size_t stack_size;
+  void *(*start)(void *);
+  void *arg;
+  void *ret;
+  };
+
+/*===========================================================================
+
+  futex_wait 
+
+  Sleep if *addr is still val. Returns straight away if it is not, and
+  may return for no reason, so the caller must check again
+
+===========================================================================*/
+static void futex_wait (int *addr, int val, int flags)
+  {
+  syscall (SYS_FUTEX, addr, FUTEX_WAIT | flags, val, NULL, NULL, 0);
+  }
+
+/*===========================================================================
+
+  futex_wake 
+
+===========================================================================*/
+static void futex_wake (int *addr, int n)
+  {
+  syscall (SYS_FUTEX, addr, FUTEX_WAKE | FUTEX_PRIVATE_FLAG, n, NULL, 
+    NULL, 0);
+  }
+
+/*===========================================================================
+
+  pthread_run 
+
+  What __clone() runs in the new thread
+
+===========================================================================*/
+static int pthread_run (void *arg)
+  {
+  struct _pthread *thread = arg;
+  thread->ret = thread->start (thread->arg);
+  return 0;
+  }
+
+/*===========================================================================
+
+  get_nprocs 
+
+  Count the processors in this process's affinity mask, which the 
+  kernel returns as many bytes as it has
+
+===========================================================================*/
+int get_nprocs (void)
+  {
+  unsigned long mask[16];
+  int r = syscall (SYS_SCHED_GETAFFINITY, 0, sizeof (mask), mask);
+  int n = 0;
+  for (int i = 0; i < r / (int)sizeof (unsigned long); i++)
+    for (unsigned long m = mask[i]; m; m &= m - 1)
+      n++;
+  return n > 0 ? n : 1;
+  }
+
+/*===========================================================================
+
+  pthread_attr_init 
+
+===========================================================================*/
+int pthread_attr_init (pthread_attr_t *attr)
+  {
+  attr->stack_size = PTHREAD_STACK_SIZE;
+  return 0;
+  }
+
+/*===========================================================================
+
+  pthread_attr_setstacksize 
+
+===========================================================================*/
+int pthread_attr_setstacksize (pthread_attr_t *attr, size_t stack_size)
+  {
+  attr->stack_size = stack_size;
+  return 0;
+  }
+
+/*===========================================================================
+
+  pthread_create 
+
+===========================================================================*/
+int pthread_create (pthread_t *thread, const pthread_attr_t *attr, 
+     void *(*start)(void *), void *arg)
+  {
+  size_t size = attr ? attr->stack_size : PTHREAD_STACK_SIZE;
+  size = (size + 4095) & ~(size_t)4095;
+  void *stack = mmap (NULL, size, PROT_READ | PROT_WRITE, 
+    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (stack == MAP_FAILED) return errno;
+
+  // From here on, the heap might be used by two threads at once
+  malloc_threaded = TRUE;
+  struct _pthread *t = malloc (sizeof (struct _pthread));
+  memset (t, 0, sizeof (struct _pthread));
+  t->stack = stack;
+  t->stack_size = size;
+  t->start = start;
+  t->arg = arg;
+  int r = __clone (pthread_run, (char *)stack + size, PTHREAD_CLONE_FLAGS,
+    t, &t->tid, &t->tid);
+  if (r < 0)
+    {
+    munmap (stack, size);
+    free (t);
+    return -r;
+    }
+  *thread = t;
+  return 0;
+  }
+
+/*===========================================================================
+
+  pthread_join 
+
+===========================================================================*/
+int pthread_join (pthread_t thread, void **ret)
+  {
+  int tid;
+  while ((tid = atomic_load (&thread->tid)) != 0)
+    futex_wait (&thread->tid, tid, 0);
+  if (ret) *ret = thread->ret;
+  munmap (thread->stack, thread->stack_size);
+  free (thread);
+  return 0;
+  }
+
+/*===========================================================================
+
+  pthread_mutex_init 
+
+===========================================================================*/
+int pthread_mutex_init (pthread_mutex_t *mutex, const void *attr)
+  {
+  (void)attr;
+  mutex->state = 0;
+  return 0;
+  }
+
+/*===========================================================================
+
+  pthread_mutex_lock 
+
+  If the mutex is free, one atomic operation takes it. If not, we mark
+  it as having waiters, so that unlocking will wake us, and sleep
+
+===========================================================================*/
+int pthread_mutex_lock (pthread_mutex_t *mutex)
+  {
+  int c = 0;
+  if (atomic_compare_exchange_strong (&mutex->state, &c, 1)) return 0;
+  if (c != 2) c = atomic_exchange (&mutex->state, 2);
+  while (c != 0)
+    {
+    futex_wait (&mutex->state, 2, FUTEX_PRIVATE_FLAG);
+    c = atomic_exchange (&mutex->state, 2);
+    }
+  return 0;
+  }
+
+/*===========================================================================
+
+  pthread_mutex_unlock 
+
+  A system call is only needed if someone might be waiting
+
+===========================================================================*/
+int pthread_mutex_unlock (pthread_mutex_t *mutex)
+  {
+  if (atomic_fetch_sub (&mutex->state, 1) != 1)
+    {
+    atomic_store (&mutex->state, 0);
+    futex_wake (&mutex->state, 1);
+    }
+  return 0;
+  }
+
+/*===========================================================================
+
+  pthread_cond_init 
+
+===========================================================================*/
+int pthread_cond_init (pthread_cond_t *cond, const void *attr)
+  {
+  (void)attr;
+  cond->seq = 0;
+  return 0;
+  }
+
+/*===========================================================================
+
+  pthread_cond_wait 
+
+  If the sequence number changes between our unlocking the mutex and
+  sleeping, the futex won't sleep, so a signal can't be missed. Others
+  may be waiting for the mutex, which we can't tell, so we take it as
+  if they were
+
+===========================================================================*/
+int pthread_cond_wait (pthread_cond_t *cond, pthread_mutex_t *mutex)
+  {
+  int seq = atomic_load (&cond->seq);
+  pthread_mutex_unlock (mutex);
+  futex_wait (&cond->seq, seq, FUTEX_PRIVATE_FLAG);
+  while (atomic_exchange (&mutex->state, 2) != 0)
+    futex_wait (&mutex->state, 2, FUTEX_PRIVATE_FLAG);
+  return 0;
+  }
+
+/*===========================================================================
+
+  pthread_cond_signal 
+
+===========================================================================*/
+int pthread_cond_signal (pthread_cond_t *cond)
+  {
+  atomic_fetch_add (&cond->seq, 1);
+  futex_wake (&cond->seq, 1);
+  return 0;
+  }
+
+/*===========================================================================
+
+  pthread_cond_broadcast 
+
+===========================================================================*/
+int pthread_cond_broadcast (pthread_cond_t *cond)
+  {
+  atomic_fetch_add (&cond->seq, 1);
+  futex_wake (&cond->seq, 0x7FFFFFFF);
+  return 0;
+  }
 
@@ -48,6 +48,10 @@ typedef int UTF32;
 #define __WORDSIZE32_PTRDIFF_LONG       0
 #endif
 
+// A position in a file that may be bigger than 2GB, even on a 32-bit
+//   machine
+typedef long long               off64_t;
+
 #if __WORDSIZE == 64
 typedef long                    off_t;
 typedef long int                intptr_t;
@@ -85,6 +89,21 @@ struct rusage;
 #define SYS_WAIT4       61
 #define SYS_CHDIR       80
 #define SYS_NANOSLEEP   35
+#define SYS_CLOCK_GETTIME 228
+#define SYS_MMAP        9
+#define SYS_MUNMAP      11
+#define SYS_CLONE       56
+#define SYS_FUTEX       202
+#define SYS_EXIT_GROUP  231
+#define SYS_PREAD64     17
+#define SYS_SCHED_GETAFFINITY 204
+#define SYS_FSTAT       5
+#define SYS_RENAME      82
+#define SYS_UNLINK      87
+#define SYS_FSYNC       74
+#define SYS_FCHMOD      91
+#define SYS_FCHOWN      93
+#define SYS_SYSINFO     99
 // TODO add the rest
 #endif
 #ifdef __arm__
@@ -102,6 +121,24 @@ struct rusage;
 #define SYS_WAIT4       0x72
 #define SYS_CHDIR       12
 #define SYS_NANOSLEEP   162
+#define SYS_CLOCK_GETTIME 263
+// mmap2, which takes the offset in 4kB pages
+#define SYS_MMAP2       192
+#define SYS_MUNMAP      91
+#define SYS_CLONE       120
+#define SYS_FUTEX       240
+#define SYS_EXIT_GROUP  248
+#define SYS_PREAD64     180
+#define SYS_SCHED_GETAFFINITY 242
+#define SYS_FSTAT64     197
+#define SYS_RENAME      38
+#define SYS_UNLINK      10
+#define SYS_FCHMOD      94
+#define SYS_FSYNC       118
+// fchown32, which takes 32-bit user and group IDs
+#define SYS_FCHOWN32    207
+#define SYS_SYSINFO     116
+#define SYS__LLSEEK     140
 #endif
 // TODO add other architectures
 
@@ -116,6 +153,12 @@ struct rusage;
 #define O_TRUNC         00001000
 #define O_APPEND        00002000
 #define O_NONBLOCK      00004000
+// Needed on a 32-bit machine to open a file bigger than 2GB
+#ifdef __arm__
+#define O_LARGEFILE     00400000
+#else
+#define O_LARGEFILE     0
+#endif
 
 // File status constants
 #define R_OK            4
@@ -178,7 +221,16 @@ extern int      sys_read (int fd, const void *, int l);
 extern int      sys_brk (unsigned long brk);
 extern int      sys_open (const char *pathname, int flags,...);
 extern int      sys_close (int fd);
-extern int      syscall (int number,...);
+extern long     syscall (int number,...);
+/* The number of system calls made so far, by syscall(), on any thread.
+   Calls that the vDSO answers, such as clock_gettime(), are not system
+   calls */
+extern unsigned long syscall_calls;
+/* Start a thread that shares everything with this one, running fn(arg)
+   on the given stack, and ending when fn returns. Returns the thread ID
+   or -errno, as clone() does. Use pthread_create(), rather than this */
+extern int      __clone (int (*fn)(void *), void *stack, int flags, 
+                  void *arg, int *ptid, int *ctid);
 
 /* Fundamental platform functions */
 extern int      chdir (const char *dir); 
@@ -209,11 +261,90 @@ extern size_t   strspn (const char *s, const char *accept);
 extern char    *strtok (char *str, const char *delim);
 extern char    *itoa (int n, char * buffer, int radix);
 extern char    *ltoa (long n, char * buffer, int radix);
+extern int      atoi (const char *s);
 extern void     reverse (char str[], int length);
 
 /* File status */
 
+// What fstat() reports, laid out as the kernel writes it. On ARM this 
+//   is the kernel's stat64, so that sizes above 2GB can be reported
+#ifdef __arm__
+struct stat
+  {
+  unsigned long long st_dev;
+  unsigned char __pad0[4];
+  unsigned long __st_ino;
+  unsigned int st_mode;
+  unsigned int st_nlink;
+  unsigned long st_uid;
+  unsigned long st_gid;
+  unsigned long long st_rdev;
+  unsigned char __pad3[4];
+  long long st_size;
+  unsigned long st_blksize;
+  unsigned long long st_blocks;
+  unsigned long st_atime;
+  unsigned long st_atime_nsec;
+  unsigned long st_mtime;
+  unsigned long st_mtime_nsec;
+  unsigned long st_ctime;
+  unsigned long st_ctime_nsec;
+  unsigned long long st_ino;
+  };
+#else
+struct stat
+  {
+  unsigned long st_dev;
+  unsigned long st_ino;
+  unsigned long st_nlink;
+  unsigned int st_mode;
+  unsigned int st_uid;
+  unsigned int st_gid;
+  unsigned int __pad0;
+  unsigned long st_rdev;
+  long st_size;
+  long st_blksize;
+  long st_blocks;
+  unsigned long st_atime;
+  unsigned long st_atime_nsec;
+  unsigned long st_mtime;
+  unsigned long st_mtime_nsec;
+  unsigned long st_ctime;
+  unsigned long st_ctime_nsec;
+  long __unused[3];
+  };
+#endif
+
 extern int      access (const char *pathname, int mode);
+extern int      fstat (int fd, struct stat *st);
+extern int      fchmod (int fd, unsigned int mode);
+extern int      fchown (int fd, unsigned int uid, unsigned int gid);
+extern int      fsync (int fd);
+extern int      rename (const char *from, const char *to);
+extern int      unlink (const char *pathname);
+
+/* System information */
+
+struct sysinfo
+  {
+  long uptime;
+  unsigned long loads[3];
+  unsigned long totalram;
+  unsigned long freeram;
+  unsigned long sharedram;
+  unsigned long bufferram;
+  unsigned long totalswap;
+  unsigned long freeswap;
+  unsigned short procs;
+  unsigned short pad;
+  unsigned long totalhigh;
+  unsigned long freehigh;
+  // The size of the units that the memory sizes are in
+  unsigned int mem_unit;
+  char _f[20 - 2 * sizeof (long) - sizeof (int)];
+  };
+
+extern int      sysinfo (struct sysinfo *info);
 
 
 /* Basic I/O */
@@ -221,12 +352,19 @@ extern int      access (const char *pathname, int mode);
 extern int      puts (const char *s);
 extern int      ioctl (int fd, unsigned int cmd, unsigned long arg);
 extern off_t    lseek (int fd, off_t offset, int whence);
+// lseek, with 64-bit offsets even on a 32-bit machine. Returns -1, with
+//   errno set, on failure
+extern off64_t  lseek64 (int fd, off64_t offset, int whence);
 // Note that we don't yet support the three-argument form of open().
 // Files are created with permissions set by umask
 extern int      open (const char *pathname, int flags);
 extern int      close (int fd);
 extern int      write (int fd, const void *, int l);
 extern int      read (int fd, const void *, int l);
+// Read from a position in a file, without moving the file offset, so 
+//   that several threads can read the same file at once
+extern int      pread (int fd, void *buff, int l, off_t offset);
+extern int      pread64 (int fd, void *buff, int l, off64_t offset);
 extern int      putchar (int c);
 
 /* Buffered I/O */
@@ -265,17 +403,97 @@ extern int     fseek (FILE *stream, long offset, int whence);
 
 /* Memory management */
 
+#define PROT_NONE       0
+#define PROT_READ       1
+#define PROT_WRITE      2
+#define MAP_SHARED      0x01
+#define MAP_PRIVATE     0x02
+#define MAP_ANONYMOUS   0x20
+#define MAP_FAILED      ((void *)-1)
+
+extern void    *mmap (void *addr, size_t length, int prot, int flags, 
+                  int fd, off_t offset);
+extern int      munmap (void *addr, size_t length);
 extern int      brk (void *addr);
 extern void     free (void* ptr);
+/* The number of calls to malloc() so far, including those made by
+   realloc() and strdup(). For checking code that should not allocate */
+extern unsigned long malloc_calls;
 extern void    *sbrk (intptr_t increment);
 extern void    *malloc (size_t size);
 extern void    *realloc (void *ptr, size_t size);
 extern void    *memcpy (void *dest, const void *src, size_t n);
 extern void    *memmove (void *dest, const void *src, size_t n);
 extern void    *memset (void *s, int c, size_t n);
+extern int      memcmp (const void *s1, const void *s2, size_t n);
 extern void    *memchr(const void *s, int c, size_t n);
 extern void    *rawmemchr(const void *s, int c);
 
+/* Threads
+
+   Enough of POSIX threads to run work in the background. Threads share
+   one errno, and FILE streams must not be used by two threads at once;
+   malloc() and free() are made safe to call from any thread when the
+   first thread is created. There is no thread-local storage */
+
+typedef struct _pthread *pthread_t;
+
+typedef struct _pthread_attr_t
+  {
+  size_t stack_size;
+  } pthread_attr_t;
+
+// A mutex is a futex word: 0 unlocked, 1 locked, 2 locked with threads
+//   waiting. A condition variable is a sequence number that waiters
+//   sleep on, and that signalling changes
+typedef struct _pthread_mutex_t
+  {
+  int state;
+  } pthread_mutex_t;
+
+typedef struct _pthread_cond_t
+  {
+  int seq;
+  } pthread_cond_t;
+
+#define PTHREAD_MUTEX_INITIALIZER { 0 }
+#define PTHREAD_COND_INITIALIZER { 0 }
+
+// The number of processors this process may run on
+extern int      get_nprocs (void);
+extern int      pthread_attr_init (pthread_attr_t *attr);
+extern int      pthread_attr_setstacksize (pthread_attr_t *attr, 
+                  size_t stack_size);
+extern int      pthread_create (pthread_t *thread, 
+                  const pthread_attr_t *attr, void *(*start)(void *), 
+                  void *arg);
+extern int      pthread_join (pthread_t thread, void **ret);
+extern int      pthread_mutex_init (pthread_mutex_t *mutex, 
+                  const void *attr);
+extern int      pthread_mutex_lock (pthread_mutex_t *mutex);
+extern int      pthread_mutex_unlock (pthread_mutex_t *mutex);
+extern int      pthread_cond_init (pthread_cond_t *cond, const void *attr);
+extern int      pthread_cond_wait (pthread_cond_t *cond, 
+                  pthread_mutex_t *mutex);
+extern int      pthread_cond_signal (pthread_cond_t *cond);
+extern int      pthread_cond_broadcast (pthread_cond_t *cond);
+
+// Atomic operations on ints, longs and pointers, with the names of
+//   C11's, but on ordinary variables rather than _Atomic ones. All are
+//   sequentially consistent. gcc makes them into instructions, so they
+//   need no library
+#define atomic_load(p) __atomic_load_n ((p), __ATOMIC_SEQ_CST)
+#define atomic_store(p, v) __atomic_store_n ((p), (v), __ATOMIC_SEQ_CST)
+#define atomic_exchange(p, v) \
+  __atomic_exchange_n ((p), (v), __ATOMIC_SEQ_CST)
+#define atomic_fetch_add(p, v) \
+  __atomic_fetch_add ((p), (v), __ATOMIC_SEQ_CST)
+#define atomic_fetch_sub(p, v) \
+  __atomic_fetch_sub ((p), (v), __ATOMIC_SEQ_CST)
+#define atomic_compare_exchange_strong(p, expected, v) \
+  __atomic_compare_exchange_n ((p), (expected), (v), 0, \
+    __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)
+
 /* Error handling */
 extern void     perror (const char *message);
 extern char    *strerror (int errnum);
@@ -294,6 +512,10 @@ struct timespec
   long tv_nsec;
   };
 
+#define CLOCK_REALTIME  0
+#define CLOCK_MONOTONIC 1
+
+extern int clock_gettime (int clk_id, struct timespec *tp);
 extern int nanosleep (const struct timespec *req, struct timespec *rem);
 extern unsigned int sleep (unsigned int sec);
 
@@ -316,6 +538,12 @@ typedef unsigned int    tcflag_t;
 #define ECHO      0000010
 #define IXON	  0002000
 #define IEXTEN	  0100000
+#define OPOST	  0000001
+#define ONLCR	  0000004
+
+/* c_cflag line speed bits */
+#define CBAUD     0010017
+#define CBAUDEX   0010000
 
 #define VMIN            6
 #define VTIME           5
@@ -337,6 +565,8 @@ struct termios
 
 
 #define TIOCGWINSZ      0x5413
+#define TIOCOUTQ        0x5411
+#define FIONREAD        0x541B
 #define TCGETS		0x5401
 #define TCSETS		0x5402
 #define TCSETSW		0x5403
@@ -0,0 +1,257 @@
+/*===========================================================================
+
+  bute
+
+  keylog.c
+
+  Copyright (c)2020 Kevin Boone. Distributed uner the terms of the
+    GNU PUblic Licence, v3.0
+
+  A log starts with the eight bytes KEYLOG_MAGIC. Each key follows as
+  two numbers: the milliseconds since the key before (or since the
+  recording started), and the key code. A VK_PASTE is followed by the
+  length of the pasted text, and the text. Numbers are written seven
+  bits to a byte, lowest first, with the top bit set on all but the
+  last byte, so most keys take two bytes.
+
+===========================================================================*/
+#include "cnolib.h"
+#include "terminal.h"
+#include "keylog.h"
+
+#define KEYLOG_MAGIC "BUTEKEY1"
+#define KEYLOG_MAGIC_LEN 8
+
+struct _KeyLog
+  {
+  // Set while recording
+  FILE *f;
+  // Set while replaying. The whole log is read into memory
+  char *data;
+  int len;
+  int pos;
+  BOOL timed;
+  // When recording or replaying started, and the time, in msec since
+  //   then, of the last key
+  struct timespec start;
+  long last;
+  };
+
+/*===========================================================================
+
+  key_log_create
+
+===========================================================================*/
+KeyLog *key_log_create (void)
+  {
+  KeyLog *self = malloc (sizeof (KeyLog));
+  memset (self, 0, sizeof (KeyLog));
+  return self;
+  }
+
+/*===========================================================================
+
+  key_log_destroy
+
+===========================================================================*/
+void key_log_destroy (KeyLog *self)
+  {
+  if (self)
+    {
+    if (self->f) fclose (self->f);
+    if (self->data) free (self->data);
+    free (self);
+    }
+  }
+
+/*===========================================================================
+
+  key_log_now
+
+  Milliseconds since recording or replaying started. Working from the
+  start keeps the sum in a long, even on a 32-bit machine
+
+===========================================================================*/
+static long key_log_now (const KeyLog *self)
+  {
+  struct timespec now;
+  clock_gettime (CLOCK_MONOTONIC, &now);
+  return (long)(now.tv_sec - self->start.tv_sec) * 1000
+    + (now.tv_nsec - self->start.tv_nsec) / 1000000;
+  }
+
+/*===========================================================================
+
+  key_log_record
+
+===========================================================================*/
+BOOL key_log_record (KeyLog *self, const char *file)
+  {
+  self->f = fopen (file, "w");
+  if (!self->f) return FALSE;
+  fwrite (KEYLOG_MAGIC, 1, KEYLOG_MAGIC_LEN, self->f);
+  clock_gettime (CLOCK_MONOTONIC, &self->start);
+  self->last = 0;
+  return TRUE;
+  }
+
+/*===========================================================================
+
+  key_log_replay
+
+===========================================================================*/
+BOOL key_log_replay (KeyLog *self, const char *file)
+  {
+  FILE *f = fopen (file, "r");
+  if (!f) return FALSE;
+  int size = BUFSIZ;
+  int n = 0;
+  char *data = malloc (size);
+  int r;
+  while ((r = fread (data + n, 1, size - n, f)) > 0)
+    {
+    n += r;
+    if (n == size)
+      {
+      size *= 2;
+      data = realloc (data, size);
+      }
+    }
+  fclose (f);
+  if (n < KEYLOG_MAGIC_LEN
+       || strncmp (data, KEYLOG_MAGIC, KEYLOG_MAGIC_LEN) != 0)
+    {
+    free (data);
+    errno = EINVAL;
+    return FALSE;
+    }
+  self->data = data;
+  self->len = n;
+  self->pos = KEYLOG_MAGIC_LEN;
+  clock_gettime (CLOCK_MONOTONIC, &self->start);
+  self->last = 0;
+  return TRUE;
+  }
+
+/*===========================================================================
+
+  key_log_set_timed
+
+===========================================================================*/
+void key_log_set_timed (KeyLog *self, BOOL timed)
+  {
+  self->timed = timed;
+  }
+
+/*===========================================================================
+
+  key_log_is_replaying
+
+===========================================================================*/
+BOOL key_log_is_replaying (const KeyLog *self)
+  {
+  return self->data != NULL;
+  }
+
+/*===========================================================================
+
+  key_log_put_num
+
+===========================================================================*/
+static void key_log_put_num (KeyLog *self, unsigned long n)
+  {
+  while (n >= 0x80)
+    {
+    fputc ((n & 0x7F) | 0x80, self->f);
+    n >>= 7;
+    }
+  fputc (n, self->f);
+  }
+
+/*===========================================================================
+
+  key_log_get_num
+
+  Returns -1 if the log ends part way through the number
+
+===========================================================================*/
+static long key_log_get_num (KeyLog *self)
+  {
+  unsigned long n = 0;
+  int shift = 0;
+  while (self->pos < self->len)
+    {
+    unsigned char c = self->data[self->pos++];
+    n |= (unsigned long)(c & 0x7F) << shift;
+    if (!(c & 0x80)) return (long)n;
+    shift += 7;
+    }
+  return -1;
+  }
+
+/*===========================================================================
+
+  key_log_put_key
+
+===========================================================================*/
+void key_log_put_key (KeyLog *self, int key)
+  {
+  long now = key_log_now (self);
+  key_log_put_num (self, now - self->last);
+  key_log_put_num (self, key);
+  self->last = now;
+  }
+
+/*===========================================================================
+
+  key_log_put_text
+
+===========================================================================*/
+void key_log_put_text (KeyLog *self, const char *text, int len)
+  {
+  key_log_put_num (self, len);
+  fwrite (text, 1, len, self->f);
+  }
+
+/*===========================================================================
+
+  key_log_get_key
+
+  With timing, we wait until the key is due, counting from the start of
+  the replay, so that time spent on the keys before doesn't add up
+
+===========================================================================*/
+int key_log_get_key (KeyLog *self)
+  {
+  long delay = key_log_get_num (self);
+  long key = key_log_get_num (self);
+  if (delay < 0 || key < 0) return VK_EOF;
+  self->last += delay;
+  if (self->timed)
+    {
+    long wait = self->last - key_log_now (self);
+    if (wait > 0)
+      {
+      struct timespec ts = { wait / 1000, (wait % 1000) * 1000000 };
+      nanosleep (&ts, NULL);
+      }
+    }
+  return (int)key;
+  }
+
+/*===========================================================================
+
+  key_log_get_text
+
+===========================================================================*/
+char *key_log_get_text (KeyLog *self, int *len)
+  {
+  long n = key_log_get_num (self);
+  if (n < 0 || n > self->len - self->pos) n = self->len - self->pos;
+  char *text = malloc (n + 1);
+  memcpy (text, self->data + self->pos, n);
+  self->pos += n;
+  *len = (int)n;
+  return text;
+  }
+
@@ -0,0 +1,48 @@
+/*===========================================================================
+
+  bute -- barely useful text editor
+
+  keylog.h
+
+  Copyright (c)2020 Kevin Boone. Distributed uner the terms of the
+    GNU PUblic Licence, v3.0
+
+===========================================================================*/
+#pragma once
+
+#include "cnolib.h"
+
+// A log of the keys of an editing session, as read_key() returned them,
+//   with the time between them, and the text of any pastes. A session
+//   can be recorded to a log, and the log replayed later, so that the
+//   same editing can be repeated, and timed
+struct _KeyLog;
+typedef struct _KeyLog KeyLog;
+
+extern KeyLog     *key_log_create (void);
+// Destroying a log that is being recorded finishes writing it
+extern void        key_log_destroy (KeyLog *self);
+
+// Start recording to a file. Returns FALSE, with errno set, if it
+//   can't be written
+extern BOOL        key_log_record (KeyLog *self, const char *file);
+// Read a log, to replay it. Returns FALSE, with errno set, if it can't
+//   be read, or EINVAL if it isn't a log
+extern BOOL        key_log_replay (KeyLog *self, const char *file);
+// Set whether keys are replayed with the time between them that they
+//   were recorded with, rather than as fast as they are asked for
+extern void        key_log_set_timed (KeyLog *self, BOOL timed);
+extern BOOL        key_log_is_replaying (const KeyLog *self);
+
+// Record a key, at the present time. If it is VK_PASTE, the text of
+//   the paste must be recorded next
+extern void        key_log_put_key (KeyLog *self, int key);
+extern void        key_log_put_text (KeyLog *self, const char *text,
+                     int len);
+
+// Get the next key of the log being replayed, or VK_EOF at its end. If
+//   it is VK_PASTE, get_text returns the text of the paste, in a
+//   buffer the caller must free, as read_paste() does
+extern int         key_log_get_key (KeyLog *self);
+extern char       *key_log_get_text (KeyLog *self, int *len);
+
@@ -0,0 +1,256 @@
+/*===========================================================================
+
+  bute
+
+  keystats.c
+
+  Copyright (c)2020 Kevin Boone. Distributed uner the terms of the
+    GNU PUblic Licence, v3.0
+
+  Times are kept in a histogram of microseconds. Below 16 usec there is
+  a bucket for each; above that, each power of two is split into eight
+  buckets, so a time is known to within 1/8th, up to 2^31 usec (about
+  35 minutes), which all longer times are counted as.
+
+===========================================================================*/
+#include "cnolib.h"
+#include "keystats.h"
+
+#define KEY_STATS_SUB_BITS 3
+#define KEY_STATS_SUB (1 << KEY_STATS_SUB_BITS)
+#define KEY_STATS_LINEAR (2 * KEY_STATS_SUB)
+#define KEY_STATS_BUCKETS (KEY_STATS_LINEAR + 27 * KEY_STATS_SUB)
+
+struct _KeyStats
+  {
+  long histogram[KEY_STATS_BUCKETS];
+  long keys;
+  long frames;
+  long max_usec;
+  // Totals, and the counts when the last frame was sent
+  long bytes;
+  long syscalls;
+  long mallocs;
+  long last_bytes;
+  long last_syscalls;
+  long last_mallocs;
+  long bytes_at;
+  unsigned long syscalls_at;
+  unsigned long mallocs_at;
+  // Keys read since the last frame, and when the first arrived
+  int pending;
+  struct timespec first_key;
+  };
+
+/*===========================================================================
+
+  key_stats_create
+
+===========================================================================*/
+KeyStats *key_stats_create (void)
+  {
+  KeyStats *self = malloc (sizeof (KeyStats));
+  memset (self, 0, sizeof (KeyStats));
+  self->syscalls_at = syscall_calls;
+  self->mallocs_at = malloc_calls;
+  return self;
+  }
+
+/*===========================================================================
+
+  key_stats_destroy
+
+===========================================================================*/
+void key_stats_destroy (KeyStats *self)
+  {
+  if (self) free (self);
+  }
+
+/*===========================================================================
+
+  key_stats_bucket
+
+===========================================================================*/
+static int key_stats_bucket (long usec)
+  {
+  if (usec < KEY_STATS_LINEAR) return usec < 0 ? 0 : (int)usec;
+  int bit = 0;
+  for (unsigned long v = usec; v > 1; v >>= 1) bit++;
+  int b = KEY_STATS_LINEAR + (bit - KEY_STATS_SUB_BITS - 1) * KEY_STATS_SUB
+    + (int)((usec >> (bit - KEY_STATS_SUB_BITS)) & (KEY_STATS_SUB - 1));
+  return b < KEY_STATS_BUCKETS ? b : KEY_STATS_BUCKETS - 1;
+  }
+
+/*===========================================================================
+
+  key_stats_bucket_low
+
+  The shortest time that goes in a bucket
+
+===========================================================================*/
+static long key_stats_bucket_low (int b)
+  {
+  if (b < KEY_STATS_LINEAR) return b;
+  int bit = (b - KEY_STATS_LINEAR) / KEY_STATS_SUB + KEY_STATS_SUB_BITS + 1;
+  int sub = (b - KEY_STATS_LINEAR) % KEY_STATS_SUB;
+  return (long)(KEY_STATS_SUB + sub) << (bit - KEY_STATS_SUB_BITS);
+  }
+
+/*===========================================================================
+
+  key_stats_bucket_high
+
+  The longest time that goes in a bucket
+
+===========================================================================*/
+static long key_stats_bucket_high (int b)
+  {
+  if (b == KEY_STATS_BUCKETS - 1) return (long)(~0UL >> 1);
+  return key_stats_bucket_low (b + 1) - 1;
+  }
+
+/*===========================================================================
+
+  key_stats_key
+
+===========================================================================*/
+void key_stats_key (KeyStats *self)
+  {
+  if (self->pending++ == 0)
+    clock_gettime (CLOCK_MONOTONIC, &self->first_key);
+  }
+
+/*===========================================================================
+
+  key_stats_flushed
+
+  A frame with no keys before it, such as the first screen, only
+  starts the counts again
+
+===========================================================================*/
+void key_stats_flushed (KeyStats *self, long bytes_written)
+  {
+  if (self->pending)
+    {
+    struct timespec now;
+    clock_gettime (CLOCK_MONOTONIC, &now);
+    long usec = (long)(now.tv_sec - self->first_key.tv_sec) * 1000000
+      + (now.tv_nsec - self->first_key.tv_nsec) / 1000;
+    self->histogram[key_stats_bucket (usec)] += self->pending;
+    if (usec > self->max_usec) self->max_usec = usec;
+    self->keys += self->pending;
+    self->frames++;
+    self->last_bytes = bytes_written - self->bytes_at;
+    self->last_syscalls = (long)(syscall_calls - self->syscalls_at);
+    self->last_mallocs = (long)(malloc_calls - self->mallocs_at);
+    self->bytes += self->last_bytes;
+    self->syscalls += self->last_syscalls;
+    self->mallocs += self->last_mallocs;
+    self->pending = 0;
+    }
+  self->bytes_at = bytes_written;
+  self->syscalls_at = syscall_calls;
+  self->mallocs_at = malloc_calls;
+  }
+
+/*===========================================================================
+
+  key_stats_percentile
+
+===========================================================================*/
+long key_stats_percentile (const KeyStats *self, int pct)
+  {
+  if (self->keys == 0) return 0;
+  // The number of keys that must be within the time, rounded up
+  long want = (self->keys * pct + 99) / 100;
+  long n = 0;
+  for (int b = 0; b < KEY_STATS_BUCKETS; b++)
+    {
+    n += self->histogram[b];
+    if (n >= want && n > 0)
+      {
+      long high = key_stats_bucket_high (b);
+      return high < self->max_usec ? high : self->max_usec;
+      }
+    }
+  return self->max_usec;
+  }
+
+/*===========================================================================
+
+  key_stats_get_last
+
+===========================================================================*/
+void key_stats_get_last (const KeyStats *self, long *bytes, long *syscalls,
+     long *mallocs)
+  {
+  *bytes = self->last_bytes;
+  *syscalls = self->last_syscalls;
+  *mallocs = self->last_mallocs;
+  }
+
+/*===========================================================================
+
+  key_stats_put
+
+  Write a name and a number, and perhaps a number per key, on a line
+
+===========================================================================*/
+static void key_stats_put (const KeyStats *self, FILE *f, const char *name,
+     long n, BOOL per_key)
+  {
+  char s[24];
+  fputs (name, f);
+  fputs ("\t", f);
+  ltoa (n, s, 10);
+  fputs (s, f);
+  if (per_key && self->keys)
+    {
+    fputs ("\t", f);
+    ltoa (n / self->keys, s, 10);
+    fputs (s, f);
+    fputs (" per key", f);
+    }
+  fputs ("\n", f);
+  }
+
+/*===========================================================================
+
+  key_stats_dump
+
+===========================================================================*/
+void key_stats_dump (const KeyStats *self, FILE *f)
+  {
+  key_stats_put (self, f, "keys", self->keys, FALSE);
+  key_stats_put (self, f, "frames", self->frames, FALSE);
+  key_stats_put (self, f, "bytes", self->bytes, TRUE);
+  key_stats_put (self, f, "syscalls", self->syscalls, TRUE);
+  key_stats_put (self, f, "mallocs", self->mallocs, TRUE);
+  key_stats_put (self, f, "p50_usec", key_stats_percentile (self, 50),
+    FALSE);
+  key_stats_put (self, f, "p90_usec", key_stats_percentile (self, 90),
+    FALSE);
+  key_stats_put (self, f, "p99_usec", key_stats_percentile (self, 99),
+    FALSE);
+  key_stats_put (self, f, "max_usec", self->max_usec, FALSE);
+  // The histogram: the range of times in each bucket that has any
+  //   keys, and the number of keys
+  fputs ("usec_from\tusec_to\tkeys\n", f);
+  for (int b = 0; b < KEY_STATS_BUCKETS; b++)
+    {
+    if (self->histogram[b] == 0) continue;
+    char s[24];
+    ltoa (key_stats_bucket_low (b), s, 10);
+    fputs (s, f);
+    fputs ("\t", f);
+    long high = key_stats_bucket_high (b);
+    ltoa (high < self->max_usec ? high : self->max_usec, s, 10);
+    fputs (s, f);
+    fputs ("\t", f);
+    ltoa (self->histogram[b], s, 10);
+    fputs (s, f);
+    fputs ("\n", f);
+    }
+  fflush (f);
+  }
+
@@ -0,0 +1,45 @@
+/*===========================================================================
+
+  bute -- barely useful text editor
+
+  keystats.h
+
+  Copyright (c)2020 Kevin Boone. Distributed uner the terms of the
+    GNU PUblic Licence, v3.0
+
+===========================================================================*/
+#pragma once
+
+#include "cnolib.h"
+
+// Measurements of how the editor responds to keys: the time from a
+//   key arriving to the frame that shows its effect being sent to the
+//   terminal, and the bytes written, system calls made and heap
+//   allocations made along the way. Times go into a histogram, from
+//   which percentiles are worked out
+struct _KeyStats;
+typedef struct _KeyStats KeyStats;
+
+extern KeyStats   *key_stats_create (void);
+extern void        key_stats_destroy (KeyStats *self);
+
+// A key has been read. If the frame before it was not sent, the time
+//   is counted from the first key that has not been shown
+extern void        key_stats_key (KeyStats *self);
+// The frame has been sent to the terminal, which has now had
+//   bytes_written bytes in all. Every key since the last frame is
+//   counted as taking as long as the first
+extern void        key_stats_flushed (KeyStats *self, long bytes_written);
+
+// The time, in microseconds, within which pct percent of keys were
+//   shown, as near as the histogram can tell. Zero if there have been
+//   no keys
+extern long        key_stats_percentile (const KeyStats *self, int pct);
+// What the last key cost: bytes written, system calls and allocations,
+//   from the frame before it was sent to its own being sent
+extern void        key_stats_get_last (const KeyStats *self, long *bytes,
+                     long *syscalls, long *mallocs);
+
+// Write the totals, percentiles and the whole histogram, as text
+extern void        key_stats_dump (const KeyStats *self, FILE *f);
+
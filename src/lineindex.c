@@ -0,0 +1,299 @@
+/*===========================================================================
+
+  bute
+
+  lineindex.c
+
+  Copyright (c)2020 Kevin Boone. Distributed uner the terms of the
+    GNU PUblic Licence, v3.0
+
+  The index of FILE is saved in FILE.bute-index: a header, and then an
+  entry for each block. The header starts with the eight bytes
+  LINE_INDEX_MAGIC, and holds the inode, size and modification time of
+  the file, a fingerprint of the text at its start, middle and end, the
+  number of entries, and a checksum of the rest of the header and the
+  entries. An index whose file has been replaced, or written to, fails
+  the first test; one that was cut short or garbled, the checksum. The
+  entries are checked to be in order, and within the file, as well, so
+  that whatever is in the index, the blocks make sense.
+
+===========================================================================*/
+#include "cnolib.h"
+#include "lineindex.h"
+
+#define LINE_INDEX_MAGIC "BUTEIDX1"
+#define LINE_INDEX_MAGIC_LEN 8
+#define LINE_INDEX_SUFFIX ".bute-index"
+// What is added to the name of the index to write it under, until it is
+//   whole
+#define LINE_INDEX_TEMP ".new"
+// The bytes taken from each of the start, middle and end of a file for
+//   its fingerprint
+#define LINE_INDEX_SAMPLE 4096
+
+typedef struct _LineIndexHeader
+  {
+  char magic[LINE_INDEX_MAGIC_LEN];
+  unsigned long long ino;
+  long long size;
+  unsigned long long mtime;
+  unsigned long long mtime_nsec;
+  unsigned long long fingerprint;
+  unsigned long long count;
+  unsigned long long checksum;
+  } LineIndexHeader;
+
+struct _LineIndex
+  {
+  // The whole of the index file, mapped
+  void *map;
+  size_t len;
+  int count;
+  const LineIndexEntry *entries;
+  };
+
+/*===========================================================================
+
+  line_index_hash
+
+  Add some bytes to a 64-bit FNV-1a hash
+
+===========================================================================*/
+static unsigned long long line_index_hash (unsigned long long hash,
+     const void *data, size_t len)
+  {
+  const unsigned char *p = data;
+  for (size_t i = 0; i < len; i++)
+    {
+    hash ^= p[i];
+    hash *= 0x100000001b3ULL;
+    }
+  return hash;
+  }
+
+/*===========================================================================
+
+  line_index_fingerprint
+
+  A hash of the size of a file, and of the text at its start, middle and
+  end. Returns zero if it can't be read
+
+===========================================================================*/
+static unsigned long long line_index_fingerprint (int fd, off64_t size)
+  {
+  char buff[LINE_INDEX_SAMPLE];
+  unsigned long long hash = line_index_hash (0xcbf29ce484222325ULL,
+    &size, sizeof (size));
+  off64_t at[3] = { 0, size / 2, size - LINE_INDEX_SAMPLE };
+  for (int i = 0; i < 3; i++)
+    {
+    if (at[i] < 0) at[i] = 0;
+    int want = size - at[i] < LINE_INDEX_SAMPLE
+      ? (int)(size - at[i]) : LINE_INDEX_SAMPLE;
+    if (pread64 (fd, buff, want, at[i]) != want) return 0;
+    hash = line_index_hash (hash, buff, want);
+    }
+  return hash;
+  }
+
+/*===========================================================================
+
+  line_index_make_header
+
+  Fill in a header for a file as it is now, except for the count and
+  the checksum. Returns FALSE, with errno set, if the file can't be read
+
+===========================================================================*/
+static BOOL line_index_make_header (int fd, LineIndexHeader *header)
+  {
+  struct stat st;
+  if (fstat (fd, &st) != 0) return FALSE;
+  memset (header, 0, sizeof (LineIndexHeader));
+  memcpy (header->magic, LINE_INDEX_MAGIC, LINE_INDEX_MAGIC_LEN);
+  header->ino = st.st_ino;
+  header->size = st.st_size;
+  header->mtime = st.st_mtime;
+  header->mtime_nsec = st.st_mtime_nsec;
+  header->fingerprint = line_index_fingerprint (fd, st.st_size);
+  if (header->fingerprint == 0)
+    {
+    errno = EIO;
+    return FALSE;
+    }
+  return TRUE;
+  }
+
+/*===========================================================================
+
+  line_index_checksum
+
+  The hash of the header, up to the checksum, and the entries
+
+===========================================================================*/
+static unsigned long long line_index_checksum (const LineIndexHeader *header,
+     const LineIndexEntry *entries, int count)
+  {
+  unsigned long long hash = line_index_hash (0xcbf29ce484222325ULL,
+    header, (const char *)&header->checksum - (const char *)header);
+  return line_index_hash (hash, entries, count * sizeof (LineIndexEntry));
+  }
+
+/*===========================================================================
+
+  line_index_check_entries
+
+  Whether the blocks are in order, start at the start of the file, stay
+  within it, and have fewer lines than an int can count
+
+===========================================================================*/
+static BOOL line_index_check_entries (const LineIndexEntry *entries,
+     int count, off64_t size)
+  {
+  if (count < 1 || entries[0].start != 0) return FALSE;
+  int lines = 0;
+  for (int i = 0; i < count; i++)
+    {
+    off64_t end = i + 1 < count ? entries[i + 1].start : size;
+    if (entries[i].start > end || entries[i].nlines < 0
+         || entries[i].nlines > end - entries[i].start
+         || entries[i].nlines > 0x7fffffff - lines)
+      return FALSE;
+    lines += entries[i].nlines;
+    }
+  return TRUE;
+  }
+
+/*===========================================================================
+
+  line_index_open
+
+===========================================================================*/
+LineIndex *line_index_open (const char *file, int fd)
+  {
+  LineIndexHeader want;
+  if (!line_index_make_header (fd, &want)) return NULL;
+  char *name = str2 (file, LINE_INDEX_SUFFIX);
+  int ifd = open (name, O_RDONLY);
+  free (name);
+  if (ifd < 0) return NULL;
+  struct stat st;
+  if (fstat (ifd, &st) != 0 || st.st_size < (long long)sizeof (want)
+       || st.st_size > 0x7fffffff)
+    {
+    close (ifd);
+    return NULL;
+    }
+  size_t len = st.st_size;
+  void *map = mmap (NULL, len, PROT_READ, MAP_PRIVATE, ifd, 0);
+  close (ifd);
+  if (map == MAP_FAILED) return NULL;
+
+  const LineIndexHeader *header = map;
+  const LineIndexEntry *entries = (const LineIndexEntry *)(header + 1);
+  size_t room = (len - sizeof (LineIndexHeader)) / sizeof (LineIndexEntry);
+  // The checksum is over the fields of the header up to itself, and
+  //   these should all be the same as the file's own
+  BOOL ok = memcmp (header, &want,
+      (const char *)&want.count - (const char *)&want) == 0
+    && header->count == room
+    && len == sizeof (LineIndexHeader) + room * sizeof (LineIndexEntry)
+    && line_index_checksum (header, entries, (int)room) == header->checksum
+    && line_index_check_entries (entries, (int)room, want.size);
+  if (!ok)
+    {
+    munmap (map, len);
+    return NULL;
+    }
+  LineIndex *self = malloc (sizeof (LineIndex));
+  self->map = map;
+  self->len = len;
+  self->count = (int)room;
+  self->entries = entries;
+  return self;
+  }
+
+/*===========================================================================
+
+  line_index_close
+
+===========================================================================*/
+void line_index_close (LineIndex *self)
+  {
+  if (self)
+    {
+    munmap (self->map, self->len);
+    free (self);
+    }
+  }
+
+/*===========================================================================
+
+  line_index_get_count
+
+===========================================================================*/
+int line_index_get_count (const LineIndex *self)
+  {
+  return self->count;
+  }
+
+/*===========================================================================
+
+  line_index_get_entries
+
+===========================================================================*/
+const LineIndexEntry *line_index_get_entries (const LineIndex *self)
+  {
+  return self->entries;
+  }
+
+/*===========================================================================
+
+  line_index_save
+
+  The index gets the permissions of the file, less any to execute it.
+  It is written under a name of its own, made afresh, so that a link
+  left there is never followed, and then renamed over the index, which
+  replaces a link there, not what it points to. A file left under the
+  new name, by a save that didn't finish, is removed first
+
+===========================================================================*/
+BOOL line_index_save (const char *file, int fd,
+     const LineIndexEntry *entries, int count)
+  {
+  LineIndexHeader header;
+  if (!line_index_make_header (fd, &header)) return FALSE;
+  header.count = count;
+  header.checksum = line_index_checksum (&header, entries, count);
+  struct stat st;
+  fstat (fd, &st);
+
+  BOOL ret = FALSE;
+  char *name = str2 (file, LINE_INDEX_SUFFIX);
+  char *temp = str2 (name, LINE_INDEX_TEMP);
+  int ifd = open (temp, O_WRONLY | O_CREAT | O_EXCL);
+  if (ifd < 0 && errno == EEXIST)
+    {
+    unlink (temp);
+    ifd = open (temp, O_WRONLY | O_CREAT | O_EXCL);
+    }
+  if (ifd >= 0)
+    {
+    fchmod (ifd, st.st_mode & 0666);
+    FILE *f = fdopen (ifd, "w");
+    fwrite (&header, sizeof (header), 1, f);
+    fwrite (entries, sizeof (LineIndexEntry), count, f);
+    fflush (f);
+    ret = !ferror (f);
+    fclose (f);
+    if (ret) ret = rename (temp, name) == 0;
+    if (!ret)
+      {
+      unlink (temp);
+      errno = EIO;
+      }
+    }
+  free (temp);
+  free (name);
+  return ret;
+  }
+
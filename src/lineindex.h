@@ -0,0 +1,44 @@
+/*===========================================================================
+
+  bute -- barely useful text editor
+
+  lineindex.h
+
+  Copyright (c)2020 Kevin Boone. Distributed uner the terms of the
+    GNU PUblic Licence, v3.0
+
+===========================================================================*/
+#pragma once
+
+#include "cnolib.h"
+
+// Where each block of a large file starts, and how many lines it has,
+//   saved beside the file, so that the next time it is opened it
+//   needn't be read through to find its lines. The index records the
+//   inode, size and modification time of the file, and a fingerprint
+//   of some of its text, and is only used if they still match
+struct _LineIndex;
+typedef struct _LineIndex LineIndex;
+
+typedef struct _LineIndexEntry
+  {
+  off64_t start;
+  int nlines;
+  int unused;
+  } LineIndexEntry;
+
+// Map the index saved beside a file, which is open on fd. Returns NULL
+//   if there is none, or it is for some other version of the file, or
+//   it is damaged
+extern LineIndex  *line_index_open (const char *file, int fd);
+extern void        line_index_close (LineIndex *self);
+extern int         line_index_get_count (const LineIndex *self);
+// The entries, in the order of the file. Each block ends where the next
+//   starts, and the last at the end of the file
+extern const LineIndexEntry *line_index_get_entries (const LineIndex *self);
+
+// Save an index beside a file, which is open on fd. Returns FALSE, with
+//   errno set, if it can't be written
+extern BOOL        line_index_save (const char *file, int fd,
+                     const LineIndexEntry *entries, int count);
+
@@ -13,83 +13,1090 @@
 
 ===========================================================================*/
 #include "cnolib.h"
+#include "tabstops.h"
+#include "utf8.h"
 #include "terminal.h"
 #include "linuxterminal.h"
 
 #define TERM_CLEAR "\033[2J\033[1;1H"
 #define TERM_ERASE_LINE "\033[K"
+#define TERM_HIDE_CURSOR "\033[?25l"
+#define TERM_SHOW_CURSOR "\033[?25h"
+// DEC private mode 2026: the terminal holds back screen updates between
+//   these markers, and shows them all at once. Terminals that support
+//   it say so when asked using DECRQM
+#define TERM_SYNC_BEGIN "\033[?2026h"
+#define TERM_SYNC_END "\033[?2026l"
+#define TERM_SYNC_QUERY "\033[?2026$p"
+#define TERM_SYNC_MODE 2026
+#define TERM_INSERT_CHARS '@'
+#define TERM_DELETE_CHARS 'P'
+#define TERM_ERASE_CHARS 'X'
+#define TERM_REPEAT_CHAR 'b'
 #define TERM_CUR_BLOCK "\033[?6c"
 #define TERM_CUR_LINE "\033[?2c"
+#define TERM_PASTE_ON "\033[?2004h"
+#define TERM_PASTE_OFF "\033[?2004l"
+#define TERM_PASTE_END "\033[201~"
+#define TERM_CLEAR_TABS "\033[3g"
+#define TERM_SET_TAB "\033H"
 
-#define TAB_SIZE 8
+// Give up on a bracketed paste whose end marker does not arrive after
+//   this many consecutive read timeouts (VTIME is 1/10 sec)
+#define PASTE_MAX_TIMEOUTS 20
+
+// Size of the buffer in which output is accumulated, until the 
+//   terminal waits for input
+#define OUT_BUFF_SIZE 8192 
+
+// In the serial profile, a frame that would take longer than this
+//   (in msec) to send is dropped if there is more input waiting
+#define FRAME_DROP_MSEC 30
+
+// Space reserved at the start of the output buffer for the sequences
+//   that begin a frame
+#define FRAME_HEADER_SIZE \
+  (sizeof (TERM_HIDE_CURSOR) + sizeof (TERM_SYNC_BEGIN) - 2)
 
 struct _LinuxTerminal
   {
   Terminal parent;
+  // Output not yet written to the terminal
+  char out_buff[OUT_BUFF_SIZE];
+  int out_len;
+  // Where we believe the terminal's cursor is. cur_row is -1 if we
+  //   don't know, for example after writing something we can't
+  //   interpret, or writing to the last column
+  int cur_row;
+  int cur_col;
+  // What we believe is on the screen, so that the cursor can be moved
+  //   right by writing the characters it passes over. A zero is a cell
+  //   whose contents are not known. The dimensions are those of the
+  //   terminal when the screen was last cleared
+  char *screen;
+  int rows;
+  int columns;
+  // Set if the terminal driver translates LF to CR-LF on output
+  BOOL lf_is_crlf;
+  // The tab stops, which the terminal's own are set to match
+  const TabStops *tab_stops;
+  // The column of a line shown at the left edge, by write_line_from
+  int left_col;
+  // Set if the terminal has told us it supports synchronized output
+  BOOL sync_supported;
+  // Frame state. When a frame begins, space is left at the start of the
+  //   output buffer, and we decide whether to fill it with the frame
+  //   header when the buffer is first written. frame_row is the first
+  //   row the cursor was moved to in the frame
+  BOOL in_frame;
+  BOOL frame_reserved;
+  BOOL frame_wrapped;
+  BOOL frame_multirow;
+  int frame_row;
+  // Serial line profile. Output is worked out cell by cell against the
+  //   screen contents, and clearing and erasing are put off until we
+  //   know what will be drawn over them. pending[row] is the column 
+  //   from which a row is to be blank, but has not yet been erased. 
+  //   target is the row being drawn. The saved_ copies allow a frame 
+  //   to be abandoned
+  BOOL serial;
+  int baud;
+  BOOL use_ech;
+  BOOL use_rep;
+  int *pending;
+  char *target;
+  char *saved_screen;
+  int *saved_pending;
+  int saved_row;
+  int saved_col;
+  BOOL frame_droppable;
+  // Bytes read from the terminal but not yet consumed. Reads of pasted
+  //   text are done in blocks, and may pick up keystrokes that follow
+  //   the paste
+  char in_buff[BUFSIZ];
+  int in_pos;
+  int in_len;
+  // The device to use in place of the process's terminal, if any, and
+  //   whether it has said there will be no more input
+  TerminalDevice *device;
+  BOOL input_ended;
+  // Bytes written to the terminal so far
+  long bytes_written;
   };
 
-struct termios orig_termios;
+struct termios orig_termios;
+
+void linux_terminal_clear (Terminal *self);
+BOOL linux_terminal_init (Terminal *self, char **error);
+BOOL linux_terminal_get_size (const Terminal *terminal, int *rows, 
+      int *columns, char **error);
+void linux_terminal_write_line (Terminal *self, int row, const char *line, 
+      BOOL truncate);
+void linux_terminal_write_line_from (Terminal *self, int row, 
+      const char *line, int from, int dcol, int n);
+void linux_terminal_raw_mode (Terminal *self, BOOL raw); 
+int linux_terminal_read_key (Terminal *self); 
+BOOL linux_terminal_key_waiting (const Terminal *self); 
+char *linux_terminal_read_paste (Terminal *self, int *len); 
+void linux_terminal_set_cursor (Terminal *self, int row, int col);
+void linux_terminal_erase_current_line (Terminal *self);
+void linux_terminal_insert_chars (Terminal *self, int n);
+void linux_terminal_delete_chars (Terminal *self, int n);
+void linux_terminal_begin_frame (Terminal *terminal);
+BOOL linux_terminal_end_frame (Terminal *terminal);
+void linux_terminal_cursor_block (Terminal *terminal);
+void linux_terminal_cursor_line (Terminal *terminal);
+int linux_terminal_get_displayed_length (const Terminal *self, 
+     const char *line, int col);
+void linux_terminal_set_tab_stops (Terminal *self, const TabStops *tab_stops);
+void linux_terminal_set_left_col (Terminal *self, int left_col);
+static void linux_terminal_flush (LinuxTerminal *self);
+
+/*===========================================================================
+
+  linux_terminal_create
+
+===========================================================================*/
+LinuxTerminal *linux_terminal_create (void)
+  {
+  LinuxTerminal *self = malloc (sizeof (LinuxTerminal));
+  memset (self, 0, sizeof (LinuxTerminal));
+  self->parent.init = linux_terminal_init;
+  self->parent.get_size = linux_terminal_get_size;
+  self->parent.clear = linux_terminal_clear;
+  self->parent.write_line = linux_terminal_write_line;
+  self->parent.write_line_from = linux_terminal_write_line_from;
+  self->parent.raw_mode = linux_terminal_raw_mode;
+  self->parent.read_key = linux_terminal_read_key;
+  self->parent.key_waiting = linux_terminal_key_waiting;
+  self->parent.read_paste = linux_terminal_read_paste;
+  self->parent.set_cursor = linux_terminal_set_cursor;
+  self->parent.erase_current_line = linux_terminal_erase_current_line;
+  self->parent.insert_chars = linux_terminal_insert_chars;
+  self->parent.delete_chars = linux_terminal_delete_chars;
+  self->parent.begin_frame = linux_terminal_begin_frame;
+  self->parent.end_frame = linux_terminal_end_frame;
+  self->parent.cursor_block = linux_terminal_cursor_block;
+  self->parent.cursor_line = linux_terminal_cursor_line;
+  self->parent.get_displayed_length = linux_terminal_get_displayed_length;
+  self->parent.set_tab_stops = linux_terminal_set_tab_stops;
+  self->parent.set_left_col = linux_terminal_set_left_col;
+  self->cur_row = -1;
+  return self;
+  }
+
+/*===========================================================================
+
+  linux_terminal_destroy
+
+===========================================================================*/
+void linux_terminal_destroy (LinuxTerminal *self)
+  {
+  if (self)
+    {
+    linux_terminal_flush (self);
+    if (self->screen) free (self->screen);
+    if (self->pending) free (self->pending);
+    if (self->target) free (self->target);
+    if (self->saved_screen) free (self->saved_screen);
+    if (self->saved_pending) free (self->saved_pending);
+    free (self);
+    }
+  }
+
+/*===========================================================================
+
+  linux_terminal_set_serial
+
+===========================================================================*/
+void linux_terminal_set_serial (LinuxTerminal *self, BOOL serial)
+  {
+  self->serial = serial;
+  }
+
+/*===========================================================================
+
+  linux_terminal_set_device
+
+===========================================================================*/
+void linux_terminal_set_device (LinuxTerminal *self, TerminalDevice *device)
+  {
+  self->device = device;
+  }
+
+/*===========================================================================
+
+  linux_terminal_get_bytes_written
+
+===========================================================================*/
+long linux_terminal_get_bytes_written (const LinuxTerminal *self)
+  {
+  return self->bytes_written;
+  }
+
+/*===========================================================================
+
+  linux_terminal_write
+
+  Write bytes to the device, or to stdout
+
+===========================================================================*/
+static void linux_terminal_write (LinuxTerminal *self, const char *s, 
+      int len)
+  {
+  self->bytes_written += len;
+  if (self->device)
+    self->device->write (self->device, s, len);
+  else
+    write (STDOUT_FILENO, s, len);
+  }
+
+/*===========================================================================
+
+  linux_terminal_read
+
+  Read bytes from the device, or from stdin. A device that has no more 
+  input returns -1, and we take note of it
+
+===========================================================================*/
+static int linux_terminal_read (LinuxTerminal *self, char *s, int len)
+  {
+  if (!self->device) return read (STDIN_FILENO, s, len);
+  if (self->input_ended) return -1;
+  int n = self->device->read (self->device, s, len);
+  if (n < 0) self->input_ended = TRUE;
+  return n;
+  }
+
+/*===========================================================================
+
+  linux_terminal_flush
+
+  Write any accumulated output to the terminal. If this is the first
+  output of a frame, this is the point at which we decide whether the
+  frame needs a header. If it does, the header goes into the space 
+  reserved for it, so the whole buffer is still written in one go.
+
+===========================================================================*/
+static void linux_terminal_flush (LinuxTerminal *self)
+  {
+  int start = 0;
+  if (self->frame_reserved)
+    {
+    self->frame_reserved = FALSE;
+    self->frame_wrapped = self->frame_multirow 
+      && self->out_len > FRAME_HEADER_SIZE;
+    start = FRAME_HEADER_SIZE;
+    if (self->frame_wrapped)
+      {
+      if (self->sync_supported)
+        {
+        start -= sizeof (TERM_SYNC_BEGIN) - 1;
+        memcpy (self->out_buff + start, TERM_SYNC_BEGIN, 
+          sizeof (TERM_SYNC_BEGIN) - 1);
+        }
+      start -= sizeof (TERM_HIDE_CURSOR) - 1;
+      memcpy (self->out_buff + start, TERM_HIDE_CURSOR, 
+        sizeof (TERM_HIDE_CURSOR) - 1);
+      }
+    }
+  if (self->out_len > start)
+    linux_terminal_write (self, self->out_buff + start, 
+      self->out_len - start);
+  self->out_len = 0;
+  }
+
+/*===========================================================================
+
+  linux_terminal_out
+
+  Add bytes to the output buffer. The caller is responsible for
+  keeping track of the cursor position and screen contents.
+
+===========================================================================*/
+static void linux_terminal_out (LinuxTerminal *self, const char *s, int len)
+  {
+  if (self->out_len + len > OUT_BUFF_SIZE)
+    {
+    linux_terminal_flush (self);
+    if (len > OUT_BUFF_SIZE)
+      {
+      linux_terminal_write (self, s, len);
+      return;
+      }
+    }
+  memcpy (self->out_buff + self->out_len, s, len);
+  self->out_len += len;
+  }
+
+/*===========================================================================
+
+  linux_terminal_num_len
+
+  The number of decimal digits in n, which is positive
+
+===========================================================================*/
+static int linux_terminal_num_len (int n)
+  {
+  int l = 1;
+  while (n >= 10)
+    {
+    n /= 10;
+    l++;
+    }
+  return l;
+  }
+
+/*===========================================================================
+
+  linux_terminal_fmt_num
+
+  Write the decimal digits of n, which is positive, to s. Returns the
+  number of digits
+
+===========================================================================*/
+static int linux_terminal_fmt_num (char *s, int n)
+  {
+  int l = linux_terminal_num_len (n);
+  for (int i = l - 1; i >= 0; i--)
+    {
+    s[i] = '0' + n % 10;
+    n /= 10;
+    }
+  return l;
+  }
+
+/*===========================================================================
+
+  linux_terminal_out_csi
+
+  Output a control sequence with a single numeric parameter. A parameter
+  equal to 'dflt' is left out, since that is what the terminal will
+  assume.
+
+===========================================================================*/
+static void linux_terminal_out_csi (LinuxTerminal *self, int n, int dflt,
+     char op)
+  {
+  char s[16];
+  int l = 2;
+  s[0] = '\033'; s[1] = '[';
+  if (n != dflt) l += linux_terminal_fmt_num (s + l, n);
+  s[l++] = op;
+  linux_terminal_out (self, s, l);
+  }
+
+/*===========================================================================
+
+  linux_terminal_csi_cost
+
+  The length of the sequence that linux_terminal_out_csi would produce
+
+===========================================================================*/
+static int linux_terminal_csi_cost (int n, int dflt)
+  {
+  return n == dflt ? 3 : 3 + linux_terminal_num_len (n);
+  }
+
+/*===========================================================================
+
+  linux_terminal_cell
+
+  The remembered contents of a screen cell, or zero if it's not known
+
+===========================================================================*/
+static char linux_terminal_cell (const LinuxTerminal *self, int row,
+      int col)
+  {
+  if (row < 0 || row >= self->rows || col >= self->columns) return 0;
+  return self->screen[row * self->columns + col];
+  }
+
+/*===========================================================================
+
+  linux_terminal_forget_row
+
+  Mark a row, from col onwards, as having unknown contents
+
+===========================================================================*/
+static void linux_terminal_forget_row (LinuxTerminal *self, int row, int col)
+  {
+  if (row >= 0 && row < self->rows)
+    {
+    for (; col < self->columns; col++)
+      self->screen[row * self->columns + col] = 0;
+    }
+  }
+
+/*===========================================================================
+
+  linux_terminal_put_text
+
+  Output text, which must fit on the cursor row, and keep track of the
+  cursor and screen contents. Anything other than printable characters
+  and tab leaves us unsure where the cursor is, and what's on the row.
+  The cells a multi-byte character covers are marked as unknown, so that
+  they are never reprinted to move the cursor. The text must not end 
+  part of the way through a character.
+
+===========================================================================*/
+static void linux_terminal_put_text (LinuxTerminal *self, const char *s,
+      int len)
+  {
+  linux_terminal_out (self, s, len);
+  for (int i = 0; i < len && self->cur_row >= 0; i++)
+    {
+    unsigned char c = (unsigned char)s[i];
+    if (c == '\t')
+      {
+      self->cur_col = tab_stops_next (self->tab_stops, self->cur_col);
+      if (self->cur_col > self->columns - 1)
+        self->cur_col = self->columns - 1;
+      }
+    else if (c < 32 || c == 127)
+      {
+      linux_terminal_forget_row (self, self->cur_row, self->cur_col);
+      self->cur_row = -1;
+      }
+    else if (c > 127)
+      {
+      int width;
+      i += utf8_char (s + i, &width) - 1;
+      // A wide character that doesn't fit wraps, on some terminals
+      if (self->cur_row >= self->rows 
+          || self->cur_col + width > self->columns)
+        {
+        linux_terminal_forget_row (self, self->cur_row, self->cur_col);
+        self->cur_row = -1;
+        continue;
+        }
+      char *cells = self->screen + self->cur_row * self->columns;
+      if (width == 0 && self->cur_col > 0) cells[self->cur_col - 1] = 0;
+      for (int k = 0; k < width; k++) cells[self->cur_col++] = 0;
+      if (self->cur_col >= self->columns)
+        self->cur_row = -1;
+      }
+    else
+      {
+      if (self->cur_row < self->rows && self->cur_col < self->columns)
+        self->screen[self->cur_row * self->columns + self->cur_col] = c;
+      self->cur_col++;
+      // Writing the last column leaves the cursor in a state where the
+      //   next character will wrap, and terminals differ in how they
+      //   treat motion from there
+      if (self->cur_col >= self->columns)
+        self->cur_row = -1;
+      }
+    }
+  }
+
+/*===========================================================================
+
+  linux_terminal_h_cost
+
+  Work out the cheapest way to move the cursor along row 'row' from
+  column 'from' to column 'to'. The cost is the number of bytes, and
+  *how receives the character that identifies the method: 'C' and 'D'
+  for the CUF and CUB sequences, 'b' for backspaces, 'p' for reprinting
+  the characters between the two positions, or 0 for no movement.
+
+===========================================================================*/
+static int linux_terminal_h_cost (const LinuxTerminal *self, int row,
+      int from, int to, char *how)
+  {
+  int cost = 0;
+  *how = 0;
+  if (to > from)
+    {
+    *how = 'C';
+    cost = linux_terminal_csi_cost (to - from, 1);
+    if (to - from < cost)
+      {
+      BOOL known = TRUE;
+      for (int c = from; c < to && known; c++)
+        known = linux_terminal_cell (self, row, c) != 0;
+      if (known)
+        {
+        *how = 'p';
+        cost = to - from;
+        }
+      }
+    // On a serial line, tabs are worth using. The terminal's tab stops
+    //   are the same as ours
+    if (self->serial && tab_stops_next (self->tab_stops, from) <= to)
+      {
+      char rest;
+      int ntabs = 0;
+      int stop = from;
+      while (tab_stops_next (self->tab_stops, stop) <= to)
+        {
+        stop = tab_stops_next (self->tab_stops, stop);
+        ntabs++;
+        }
+      int tcost = ntabs + linux_terminal_h_cost (self, row, stop, to, &rest);
+      if (tcost < cost)
+        {
+        *how = 't';
+        cost = tcost;
+        }
+      }
+    }
+  else if (to < from)
+    {
+    *how = 'D';
+    cost = linux_terminal_csi_cost (from - to, 1);
+    if (from - to <= cost)
+      {
+      *how = 'b';
+      cost = from - to;
+      }
+    }
+  return cost;
+  }
+
+/*===========================================================================
+
+  linux_terminal_h_move
+
+  Carry out the horizontal movement chosen by linux_terminal_h_cost
+
+===========================================================================*/
+static void linux_terminal_h_move (LinuxTerminal *self, int row,
+      int from, int to, char how)
+  {
+  switch (how)
+    {
+    case 'C':
+      linux_terminal_out_csi (self, to - from, 1, 'C');
+      break;
+    case 'D':
+      linux_terminal_out_csi (self, from - to, 1, 'D');
+      break;
+    case 'b':
+      for (int c = from; c > to; c--)
+        linux_terminal_out (self, "\b", 1);
+      break;
+    case 'p':
+      linux_terminal_out (self, self->screen + row * self->columns + from,
+        to - from);
+      break;
+    case 't':
+      {
+      int stop = from;
+      char rest;
+      while (tab_stops_next (self->tab_stops, stop) <= to)
+        {
+        stop = tab_stops_next (self->tab_stops, stop);
+        linux_terminal_out (self, "\t", 1);
+        }
+      linux_terminal_h_cost (self, row, stop, to, &rest);
+      linux_terminal_h_move (self, row, stop, to, rest);
+      }
+      break;
+    }
+  }
+
+/*===========================================================================
+
+  linux_terminal_move
+
+  Move the cursor to (row, col), by whichever of the available methods
+  produces the fewest bytes of output. If we don't know where the cursor
+  is, only an absolute move will do. Otherwise we consider moving
+  vertically by CUU/CUD, line feeds or reverse index, and then
+  horizontally from wherever that leaves the cursor, either directly
+  or after a carriage return.
+
+===========================================================================*/
+static void linux_terminal_move (LinuxTerminal *self, int row, int col)
+  {
+  if (self->in_frame)
+    {
+    if (self->frame_row < 0) 
+      self->frame_row = row;
+    else if (row != self->frame_row)
+      self->frame_multirow = TRUE;
+    }
+
+  // The terminal won't put the cursor beyond the last column, so
+  //   neither should our idea of where it is
+  if (self->columns > 0 && col >= self->columns) col = self->columns - 1;
+  if (self->cur_row == row && self->cur_col == col) return;
+
+  // Absolute positioning. The column can be left out if it is the
+  //   first, and both can be left out for the home position
+  int best = 3;
+  if (row > 0 || col > 0) best += linux_terminal_num_len (row + 1);
+  if (col > 0) best += 1 + linux_terminal_num_len (col + 1);
+  char best_v = 'H';
+  char best_h = 0;
+  BOOL best_cr = FALSE;
+
+  if (self->cur_row >= 0)
+    {
+    // Candidate vertical moves: the method, its cost, and the column it
+    //   leaves the cursor in
+    char vs[2]; int vcost[2]; int vcol[2]; int nv = 0;
+    int dr = row - self->cur_row;
+    if (dr == 0)
+      {
+      vs[nv] = 0; vcost[nv] = 0; vcol[nv++] = self->cur_col;
+      }
+    else if (dr > 0)
+      {
+      vs[nv] = 'B'; vcost[nv] = linux_terminal_csi_cost (dr, 1);
+      vcol[nv++] = self->cur_col;
+      vs[nv] = '\n'; vcost[nv] = dr;
+      vcol[nv++] = self->lf_is_crlf ? 0 : self->cur_col;
+      }
+    else
+      {
+      vs[nv] = 'A'; vcost[nv] = linux_terminal_csi_cost (-dr, 1);
+      vcol[nv++] = self->cur_col;
+      vs[nv] = 'M'; vcost[nv] = -2 * dr;
+      vcol[nv++] = self->cur_col;
+      }
+
+    for (int i = 0; i < nv; i++)
+      {
+      char how;
+      int cost = vcost[i] +
+        linux_terminal_h_cost (self, row, vcol[i], col, &how);
+      if (cost < best)
+        {
+        best = cost; best_v = vs[i]; best_h = how; best_cr = FALSE;
+        }
+      if (vcol[i] != 0)
+        {
+        cost = vcost[i] + 1 + linux_terminal_h_cost (self, row, 0, col, &how);
+        if (cost < best)
+          {
+          best = cost; best_v = vs[i]; best_h = how; best_cr = TRUE;
+          }
+        }
+      }
+    }
+
+  int from = self->cur_col;
+  switch (best_v)
+    {
+    case 'H':
+      {
+      char s[32];
+      int l = 2;
+      s[0] = '\033'; s[1] = '[';
+      if (row > 0 || col > 0) l += linux_terminal_fmt_num (s + l, row + 1);
+      if (col > 0)
+        {
+        s[l++] = ';';
+        l += linux_terminal_fmt_num (s + l, col + 1);
+        }
+      s[l++] = 'H';
+      linux_terminal_out (self, s, l);
+      from = col;
+      }
+      break;
+    case 'A':
+      linux_terminal_out_csi (self, self->cur_row - row, 1, 'A');
+      break;
+    case 'B':
+      linux_terminal_out_csi (self, row - self->cur_row, 1, 'B');
+      break;
+    case 'M':
+      for (int r = self->cur_row; r > row; r--)
+        linux_terminal_out (self, "\033M", 2);
+      break;
+    case '\n':
+      for (int r = self->cur_row; r < row; r++)
+        linux_terminal_out (self, "\n", 1);
+      if (self->lf_is_crlf) from = 0;
+      break;
+    }
+  if (best_cr)
+    {
+    linux_terminal_out (self, "\r", 1);
+    from = 0;
+    }
+  linux_terminal_h_move (self, row, from, col, best_h);
+
+  self->cur_row = row;
+  self->cur_col = col;
+  }
+
+/*===========================================================================
+
+  linux_terminal_erase_eol
+
+  Erase from the cursor to the end of the row, now
+
+===========================================================================*/
+static void linux_terminal_erase_eol (LinuxTerminal *self)
+  {
+  linux_terminal_out (self, TERM_ERASE_LINE, sizeof (TERM_ERASE_LINE) - 1);
+  if (self->cur_row >= 0 && self->cur_row < self->rows)
+    {
+    memset (self->screen + self->cur_row * self->columns + self->cur_col, 
+      ' ', self->columns - self->cur_col);
+    if (self->pending && self->pending[self->cur_row] >= self->cur_col)
+      self->pending[self->cur_row] = self->columns;
+    }
+  }
+
+/*===========================================================================
+
+  linux_terminal_repeat
+
+  Write n copies of the character c, using REP. The cursor must be on a
+  known row, with room for all the characters
+
+===========================================================================*/
+static void linux_terminal_repeat (LinuxTerminal *self, char c, int n)
+  {
+  linux_terminal_out (self, &c, 1);
+  linux_terminal_out_csi (self, n - 1, 1, TERM_REPEAT_CHAR);
+  memset (self->screen + self->cur_row * self->columns + self->cur_col, 
+    c, n);
+  self->cur_col += n;
+  if (self->cur_col >= self->columns)
+    self->cur_row = -1;
+  }
+
+/*===========================================================================
+
+  linux_terminal_render_row
+
+  Make a row of the screen match self->target, from column 'from'
+  onwards, sending as little as we can. Cells that already match are
+  skipped over, runs of spaces are erased with ECH, runs of the same
+  character use REP, and a blank end of the row is erased with EL. A
+  zero in the target is a cell to leave alone.
+
+===========================================================================*/
+static void linux_terminal_render_row (LinuxTerminal *self, int row, 
+      int from)
+  {
+  int columns = self->columns;
+  const char *target = self->target;
+  char *screen = self->screen + row * columns;
+
+  // Where the target becomes blank to the end of the row
+  int tail = columns;
+  while (tail > from && target[tail - 1] == ' ') tail--;
+
+  int c = from;
+  while (c < columns)
+    {
+    if (target[c] == 0 || target[c] == screen[c])
+      {
+      c++;
+      continue;
+      }
+    linux_terminal_move (self, row, c);
+    if (c >= tail)
+      {
+      linux_terminal_erase_eol (self);
+      break;
+      }
+    char ch = target[c];
+    int n = 1;
+    while (c + n < tail && target[c + n] == ch) n++;
+    if (ch == ' ' && self->use_ech 
+        && 2 * linux_terminal_csi_cost (n, 1) < n)
+      {
+      // ECH does not move the cursor, and the cells it blanks can be
+      //   passed over by a tab later
+      linux_terminal_out_csi (self, n, 1, TERM_ERASE_CHARS);
+      memset (screen + c, ' ', n);
+      }
+    else if (ch != ' ' && self->use_rep && n > 1
+        && 1 + linux_terminal_csi_cost (n - 1, 1) < n)
+      {
+      linux_terminal_repeat (self, ch, n);
+      }
+    else
+      {
+      linux_terminal_put_text (self, &target[c], 1);
+      n = 1;
+      }
+    c += n;
+    }
+  self->pending[row] = columns;
+  }
+
+/*===========================================================================
+
+  linux_terminal_target_row
+
+  Set the target for a row to what it should look like if nothing more
+  is drawn on it: as it is, but with any erasure that is still pending
+
+===========================================================================*/
+static void linux_terminal_target_row (LinuxTerminal *self, int row)
+  {
+  int p = self->pending[row];
+  memcpy (self->target, self->screen + row * self->columns, p);
+  memset (self->target + p, ' ', self->columns - p);
+  }
+
+/*===========================================================================
+
+  linux_terminal_settle_row
+
+  Carry out any erasure pending on a row
+
+===========================================================================*/
+static void linux_terminal_settle_row (LinuxTerminal *self, int row)
+  {
+  if (self->pending && row >= 0 && row < self->rows 
+      && self->pending[row] < self->columns)
+    {
+    int from = self->pending[row];
+    linux_terminal_target_row (self, row);
+    linux_terminal_render_row (self, row, from);
+    }
+  }
+
+/*===========================================================================
+
+  linux_terminal_settle
+
+  Carry out all pending erasure, and put the cursor back where it was
+
+===========================================================================*/
+static void linux_terminal_settle (LinuxTerminal *self)
+  {
+  int row = self->cur_row;
+  int col = self->cur_col;
+  BOOL moved = FALSE;
+  for (int r = 0; self->pending && r < self->rows; r++)
+    {
+    if (self->pending[r] < self->columns)
+      {
+      linux_terminal_settle_row (self, r);
+      moved = TRUE;
+      }
+    }
+  if (moved && row >= 0) linux_terminal_move (self, row, col);
+  }
+
+/*===========================================================================
+
+  linux_terminal_expand
+
+  Put up to n characters of s (all of it, if n is negative) into the 
+  target, starting at display column 'col', with tabs expanded. Column
+  'left' of the line goes in the first cell of the target, and anything
+  to the left of it is passed over. Returns FALSE if s contains anything 
+  else we can't display cell by cell.
+
+===========================================================================*/
+static BOOL linux_terminal_expand (LinuxTerminal *self, const char *s,
+      int n, int col, int left)
+  {
+  int end = left + self->columns;
+  for (int done = 0; *s && (n < 0 || done < n) && col < end; s++, done++)
+    {
+    unsigned char c = (unsigned char)*s;
+    if (c == '\t')
+      {
+      int next = tab_stops_next (self->tab_stops, col);
+      if (col < left) col = next < left ? next : left;
+      for (; col < next && col < end; col++)
+        self->target[col - left] = ' ';
+      }
+    else if (c < 32 || c >= 127)
+      return FALSE;
+    else if (col++ >= left)
+      self->target[col - 1 - left] = c;
+    }
+  return TRUE;
+  }
+
+/*===========================================================================
+
+  linux_terminal_input_waiting
+
+===========================================================================*/
+static BOOL linux_terminal_input_waiting (const LinuxTerminal *self)
+  {
+  int n = 0;
+  if (self->in_pos < self->in_len) return TRUE;
+  if (self->device) return self->device->input_waiting (self->device) > 0;
+  ioctl (STDIN_FILENO, FIONREAD, (uintptr_t)&n);
+  return n > 0;
+  }
+
+/*===========================================================================
 
-void linux_terminal_clear (Terminal *self);
-BOOL linux_terminal_init (Terminal *self, char **error);
-BOOL linux_terminal_get_size (const Terminal *terminal, int *rows, 
-      int *columns, char **error);
-void linux_terminal_write_line (Terminal *self, int row, const char *line, 
-      BOOL truncate);
-void linux_terminal_raw_mode (Terminal *self, BOOL raw); 
-int linux_terminal_read_key (Terminal *self); 
-void linux_terminal_set_cursor (Terminal *self, int row, int col);
-void linux_terminal_erase_current_line (Terminal *self);
-void linux_terminal_cursor_block (Terminal *terminal);
-void linux_terminal_cursor_line (Terminal *terminal);
-int linux_terminal_get_displayed_length (const Terminal *self, 
-     const char *line, int col);
+  linux_terminal_key_waiting
+
+===========================================================================*/
+BOOL linux_terminal_key_waiting (const Terminal *terminal)
+  {
+  return linux_terminal_input_waiting ((const LinuxTerminal *)terminal);
+  }
 
 /*===========================================================================
 
-  linux_terminal_create
+  linux_terminal_send_time
+
+  Estimate how long, in msec, it will take for 'len' bytes to reach the
+  terminal, allowing for output the kernel has not sent yet. We assume
+  ten bits per character.
 
 ===========================================================================*/
-LinuxTerminal *linux_terminal_create (void)
+static int linux_terminal_send_time (const LinuxTerminal *self, int len)
   {
-  LinuxTerminal *self = malloc (sizeof (LinuxTerminal));
-  memset (&self->parent, 0, sizeof (Terminal));
-  self->parent.init = linux_terminal_init;
-  self->parent.get_size = linux_terminal_get_size;
-  self->parent.clear = linux_terminal_clear;
-  self->parent.write_line = linux_terminal_write_line;
-  self->parent.raw_mode = linux_terminal_raw_mode;
-  self->parent.read_key = linux_terminal_read_key;
-  self->parent.set_cursor = linux_terminal_set_cursor;
-  self->parent.erase_current_line = linux_terminal_erase_current_line;
-  self->parent.cursor_block = linux_terminal_cursor_block;
-  self->parent.cursor_line = linux_terminal_cursor_line;
-  self->parent.get_displayed_length = linux_terminal_get_displayed_length;
-  return self;
+  int queued = 0;
+  if (!self->device)
+    ioctl (STDOUT_FILENO, TIOCOUTQ, (uintptr_t)&queued);
+  return (len + queued) * 10 / (self->baud / 1000 + 1);
   }
 
 /*===========================================================================
 
-  linux_terminal_destroy
+  linux_terminal_program_tabs
+
+  Set the terminal's tab stops, over its full width, to match ours. 
+  This leaves the cursor somewhere on the row it was on.
 
 ===========================================================================*/
-void linux_terminal_destroy (LinuxTerminal *self)
+static void linux_terminal_program_tabs (LinuxTerminal *self, 
+      const TabStops *tab_stops, int columns)
   {
-  if (self)
+  linux_terminal_out (self, TERM_CLEAR_TABS, sizeof (TERM_CLEAR_TABS) - 1);
+  linux_terminal_out (self, "\r", 1);
+  int col = 0;
+  for (int stop = tab_stops_next (tab_stops, 0); stop < columns; 
+        stop = tab_stops_next (tab_stops, stop))
     {
-    free (self);
+    linux_terminal_out_csi (self, stop - col, 1, 'C');
+    linux_terminal_out (self, TERM_SET_TAB, sizeof (TERM_SET_TAB) - 1);
+    col = stop;
     }
+  self->cur_row = -1;
   }
 
+
 /*===========================================================================
 
   linux_terminal_clear
 
+  Clearing the screen is also the point at which we take note of the
+  terminal size, for tracking what is on the screen. In the serial
+  profile, once we know what is on the screen, clearing it is put off
+  until we see what gets drawn over it.
+
 ===========================================================================*/
 void linux_terminal_clear (Terminal *terminal)
   {
-  write (1, TERM_CLEAR, sizeof (TERM_CLEAR) - 1);
-  write (1, TERM_CUR_BLOCK, sizeof (TERM_CUR_BLOCK) - 1);
+  LinuxTerminal *self = (LinuxTerminal *)terminal;
+  int rows = 24; int columns = 80; // defaults, in case get_size fails
+  linux_terminal_get_size (terminal, &rows, &columns, NULL);
+  self->frame_multirow = TRUE;
+  if (rows != self->rows || columns != self->columns)
+    {
+    if (self->screen) free (self->screen);
+    if (self->pending) free (self->pending);
+    if (self->target) free (self->target);
+    if (self->saved_screen) free (self->saved_screen);
+    if (self->saved_pending) free (self->saved_pending);
+    self->screen = malloc (rows * columns);
+    self->pending = malloc (rows * sizeof (int));
+    self->target = malloc (columns);
+    self->saved_screen = malloc (rows * columns);
+    self->saved_pending = malloc (rows * sizeof (int));
+    self->rows = rows;
+    self->columns = columns;
+    self->frame_droppable = FALSE;
+    // Tab stops beyond the old width may not have been set
+    if (!tab_stops_is_default (self->tab_stops))
+      linux_terminal_program_tabs (self, self->tab_stops, columns);
+    }
+  else if (self->serial)
+    {
+    for (int r = 0; r < rows; r++)
+      self->pending[r] = 0;
+    return;
+    }
+  memset (self->screen, ' ', rows * columns);
+  for (int r = 0; r < rows; r++)
+    self->pending[r] = columns;
+  linux_terminal_out (self, TERM_CLEAR, sizeof (TERM_CLEAR) - 1);
+  linux_terminal_out (self, TERM_CUR_BLOCK, sizeof (TERM_CUR_BLOCK) - 1);
+  self->cur_row = 0;
+  self->cur_col = 0;
+  }
+
+
+/*===========================================================================
+
+  linux_terminal_begin_frame
+
+===========================================================================*/
+void linux_terminal_begin_frame (Terminal *terminal)
+  {
+  LinuxTerminal *self = (LinuxTerminal *)terminal;
+  linux_terminal_flush (self);
+  self->in_frame = TRUE;
+  self->frame_reserved = TRUE;
+  self->frame_wrapped = FALSE;
+  self->frame_multirow = FALSE;
+  self->frame_row = -1;
+  self->out_len = FRAME_HEADER_SIZE;
+  self->frame_droppable = self->serial && self->screen;
+  if (self->frame_droppable)
+    {
+    memcpy (self->saved_screen, self->screen, self->rows * self->columns);
+    memcpy (self->saved_pending, self->pending, self->rows * sizeof (int));
+    self->saved_row = self->cur_row;
+    self->saved_col = self->cur_col;
+    }
+  }
+
+
+/*===========================================================================
+
+  linux_terminal_end_frame
+
+  In the serial profile, a frame is dropped if it is slow to send and
+  there is already more input, since the next frame will overwrite it.
+  That is only possible if none of the frame has been written yet.
+
+===========================================================================*/
+BOOL linux_terminal_end_frame (Terminal *terminal)
+  {
+  LinuxTerminal *self = (LinuxTerminal *)terminal;
+  linux_terminal_settle (self);
+  if (self->frame_droppable && self->frame_reserved 
+      && linux_terminal_send_time (self, self->out_len) > FRAME_DROP_MSEC
+      && linux_terminal_input_waiting (self))
+    {
+    memcpy (self->screen, self->saved_screen, self->rows * self->columns);
+    memcpy (self->pending, self->saved_pending, self->rows * sizeof (int));
+    self->cur_row = self->saved_row;
+    self->cur_col = self->saved_col;
+    self->out_len = 0;
+    self->frame_reserved = FALSE;
+    self->in_frame = FALSE;
+    return FALSE;
+    }
+  if (self->frame_reserved)
+    {
+    self->frame_wrapped = self->frame_multirow 
+      && self->out_len > FRAME_HEADER_SIZE;
+    }
+  if (self->frame_wrapped)
+    {
+    if (self->sync_supported)
+      linux_terminal_out (self, TERM_SYNC_END, sizeof (TERM_SYNC_END) - 1);
+    linux_terminal_out (self, TERM_SHOW_CURSOR, 
+      sizeof (TERM_SHOW_CURSOR) - 1);
+    }
+  linux_terminal_flush (self);
+  self->in_frame = FALSE;
+  self->frame_wrapped = FALSE;
+  return TRUE;
   }
 
 
@@ -100,7 +1107,8 @@ void linux_terminal_clear (Terminal *terminal)
 ===========================================================================*/
 void linux_terminal_cursor_block (Terminal *terminal)
   {
-  write (1, TERM_CUR_BLOCK, sizeof (TERM_CUR_BLOCK) - 1);
+  LinuxTerminal *self = (LinuxTerminal *)terminal;
+  linux_terminal_out (self, TERM_CUR_BLOCK, sizeof (TERM_CUR_BLOCK) - 1);
   }
 
 
@@ -111,7 +1119,8 @@ void linux_terminal_cursor_block (Terminal *terminal)
 ===========================================================================*/
 void linux_terminal_cursor_line (Terminal *terminal)
   {
-  write (1, TERM_CUR_LINE, sizeof (TERM_CUR_LINE) - 1);
+  LinuxTerminal *self = (LinuxTerminal *)terminal;
+  linux_terminal_out (self, TERM_CUR_LINE, sizeof (TERM_CUR_LINE) - 1);
   }
 
 
@@ -119,10 +1128,75 @@ void linux_terminal_cursor_line (Terminal *terminal)
 
   linux_terminal_erase_current_line
 
+  In the serial profile, the erasure is put off
+
+===========================================================================*/
+void linux_terminal_erase_current_line (Terminal *terminal)
+  {
+  LinuxTerminal *self = (LinuxTerminal *)terminal;
+  if (self->serial && self->cur_row >= 0 && self->cur_row < self->rows)
+    {
+    if (self->cur_col < self->pending[self->cur_row])
+      self->pending[self->cur_row] = self->cur_col;
+    }
+  else
+    linux_terminal_erase_eol (self);
+  }
+
+/*===========================================================================
+
+  linux_terminal_insert_chars
+
+  ICH, and keep track of the effect on the screen
+
+===========================================================================*/
+void linux_terminal_insert_chars (Terminal *terminal, int n)
+  {
+  LinuxTerminal *self = (LinuxTerminal *)terminal;
+  if (self->pending && self->cur_row >= 0 && self->cur_row < self->rows
+      && self->pending[self->cur_row] < self->columns)
+    {
+    int row = self->cur_row, col = self->cur_col;
+    linux_terminal_settle_row (self, row);
+    linux_terminal_move (self, row, col);
+    }
+  linux_terminal_out_csi (self, n, 1, TERM_INSERT_CHARS);
+  if (self->cur_row >= 0 && self->cur_row < self->rows)
+    {
+    char *row = self->screen + self->cur_row * self->columns;
+    int col = self->cur_col;
+    if (n > self->columns - col) n = self->columns - col;
+    memmove (row + col + n, row + col, self->columns - col - n);
+    memset (row + col, ' ', n);
+    }
+  }
+
+/*===========================================================================
+
+  linux_terminal_delete_chars
+
+  DCH, and keep track of the effect on the screen
+
 ===========================================================================*/
-void linux_terminal_erase_current_line (Terminal *self)
+void linux_terminal_delete_chars (Terminal *terminal, int n)
   {
-  write (1, TERM_ERASE_LINE, sizeof (TERM_ERASE_LINE) - 1);
+  LinuxTerminal *self = (LinuxTerminal *)terminal;
+  if (self->pending && self->cur_row >= 0 && self->cur_row < self->rows
+      && self->pending[self->cur_row] < self->columns)
+    {
+    int row = self->cur_row, col = self->cur_col;
+    linux_terminal_settle_row (self, row);
+    linux_terminal_move (self, row, col);
+    }
+  linux_terminal_out_csi (self, n, 1, TERM_DELETE_CHARS);
+  if (self->cur_row >= 0 && self->cur_row < self->rows)
+    {
+    char *row = self->screen + self->cur_row * self->columns;
+    int col = self->cur_col;
+    if (n > self->columns - col) n = self->columns - col;
+    memmove (row + col, row + col + n, self->columns - col - n);
+    memset (row + self->columns - n, ' ', n);
+    }
   }
 
 /*===========================================================================
@@ -133,9 +1207,15 @@ void linux_terminal_erase_current_line (Terminal *self)
 BOOL linux_terminal_get_size (const Terminal *terminal, int *rows, 
       int *columns, char **error)
   {
+  const LinuxTerminal *self = (const LinuxTerminal *)terminal;
   BOOL ret;
   struct winsize w;
-  if (ioctl (1, TIOCGWINSZ, (unsigned long) &w) == 0)
+  if (self->device)
+    {
+    self->device->get_size (self->device, rows, columns);
+    ret = TRUE;
+    }
+  else if (ioctl (1, TIOCGWINSZ, (unsigned long) &w) == 0)
     {
     *rows = w.ws_row;
     *columns = w.ws_col;
@@ -150,20 +1230,60 @@ BOOL linux_terminal_get_size (const Terminal *terminal, int *rows,
   return ret;
   }
 
+/*===========================================================================
+
+  linux_terminal_baud
+
+  The line speed encoded in termios c_cflag, or zero if it isn't one of
+  the standard speeds
+
+===========================================================================*/
+static int linux_terminal_baud (tcflag_t cflag)
+  {
+  static const int speeds[] = { 0, 50, 75, 110, 134, 150, 200, 300, 600, 
+    1200, 1800, 2400, 4800, 9600, 19200, 38400 };
+  static const int ex_speeds[] = { 0, 57600, 115200, 230400, 460800, 
+    500000, 576000, 921600, 1000000, 1152000, 1500000, 2000000, 2500000,
+    3000000, 3500000, 4000000 };
+  int code = cflag & CBAUD;
+  if (code & CBAUDEX) return ex_speeds[code & ~CBAUDEX];
+  return speeds[code];
+  }
+
+
 /*===========================================================================
 
   linux_terminal_init
 
 ===========================================================================*/
-BOOL linux_terminal_init (Terminal *self, char **error)
+BOOL linux_terminal_init (Terminal *terminal, char **error)
   {
+  LinuxTerminal *self = (LinuxTerminal *)terminal;
   BOOL ret = TRUE;
   int rows; int columns;
   // Just check that we can get the terminal size. If we can,
   //   everything is probably OK
-  if (linux_terminal_get_size (self, &rows, &columns, error))
+  if (linux_terminal_get_size (terminal, &rows, &columns, error))
     {
-    // Nothing else to do here.
+    // Cursor movement by line feed depends on whether the terminal 
+    //   driver adds a carriage return
+    struct termios t;
+    self->baud = 38400;
+    // A device has no line discipline, and so doesn't add CRs
+    if (!self->device && tcgetattr (STDOUT_FILENO, &t) == 0)
+      {
+      self->lf_is_crlf = (t.c_oflag & (OPOST | ONLCR)) == (OPOST | ONLCR);
+      int speed = linux_terminal_baud (t.c_cflag);
+      if (speed > 0) self->baud = speed;
+      }
+    // Only a VT220 or later has ECH, and REP is later still. The Linux
+    //   console doesn't have REP, either
+    const char *term = getenv ("TERM");
+    if (!term) term = "";
+    self->use_ech = self->serial && strncmp (term, "vt100", 5) != 0
+      && strncmp (term, "vt102", 5) != 0 && strncmp (term, "vt52", 4) != 0;
+    self->use_rep = self->serial && strncmp (term, "vt", 2) != 0
+      && strcmp (term, "linux") != 0;
     }
   else
     {
@@ -179,78 +1299,252 @@ BOOL linux_terminal_init (Terminal *self, char **error)
   linux_terminal_raw_mode
 
 ===========================================================================*/
-void linux_terminal_raw_mode (Terminal *self, BOOL raw)
+void linux_terminal_raw_mode (Terminal *terminal, BOOL raw)
   {
+  LinuxTerminal *self = (LinuxTerminal *)terminal;
   if (raw)
     {
-    tcgetattr (STDIN_FILENO, &orig_termios);
-    struct termios raw = orig_termios;
-    raw.c_iflag &= ~(IXON);
-    raw.c_lflag &= ~(ECHO | ICANON | IEXTEN | ISIG);
-    raw.c_cc[VTIME] = 1;
-    raw.c_cc[VMIN] = 0;
-    tcsetattr (STDIN_FILENO, TCSAFLUSH, &raw);
+    if (!self->device)
+      {
+      tcgetattr (STDIN_FILENO, &orig_termios);
+      struct termios raw = orig_termios;
+      raw.c_iflag &= ~(IXON);
+      raw.c_lflag &= ~(ECHO | ICANON | IEXTEN | ISIG);
+      raw.c_cc[VTIME] = 1;
+      raw.c_cc[VMIN] = 0;
+      tcsetattr (STDIN_FILENO, TCSAFLUSH, &raw);
+      }
+    linux_terminal_out (self, TERM_PASTE_ON, sizeof (TERM_PASTE_ON) - 1);
+    int rows = 24; int columns = 80;
+    linux_terminal_get_size (terminal, &rows, &columns, NULL);
+    if (!tab_stops_is_default (self->tab_stops))
+      linux_terminal_program_tabs (self, self->tab_stops, columns);
+    // Ask whether synchronized output is supported. The answer, if
+    //   there is one, arrives like a keystroke. The Linux console
+    //   doesn't understand the question, and prints part of it
+    const char *term = getenv ("TERM");
+    if (!term || strcmp (term, "linux") != 0)
+      linux_terminal_out (self, TERM_SYNC_QUERY, sizeof (TERM_SYNC_QUERY) - 1);
     }
   else
     {
-    tcsetattr(STDIN_FILENO, TCSAFLUSH, &orig_termios);
+    linux_terminal_out (self, TERM_PASTE_OFF, sizeof (TERM_PASTE_OFF) - 1);
+    if (!tab_stops_is_default (self->tab_stops))
+      {
+      // Put back the usual stops, every eight columns
+      int rows = 24; int columns = 80;
+      TabStops *usual = tab_stops_create (8);
+      linux_terminal_get_size (terminal, &rows, &columns, NULL);
+      linux_terminal_program_tabs (self, usual, columns);
+      tab_stops_destroy (usual);
+      }
+    linux_terminal_flush (self);
+    if (!self->device)
+      tcsetattr(STDIN_FILENO, TCSAFLUSH, &orig_termios);
     }
   }
 
 
 /*===========================================================================
 
-  linux_terminal_read_key
+  linux_terminal_getc
+
+  Get the next byte from the terminal, from the input buffer if there
+  is anything in it. Returns 1 if there was one, 0 if nothing arrived 
+  before the raw-mode timeout, or -1, with errno set, if the terminal
+  couldn't be read.
 
 ===========================================================================*/
-int linux_terminal_read_key (Terminal *self)
+static int linux_terminal_getc (LinuxTerminal *self, char *c)
   {
-  int nread;
-  char c;
-  while ((nread = read(STDIN_FILENO, &c, 1)) != 1) 
+  if (self->in_pos < self->in_len)
     {
-    if (nread == -1 && errno != EAGAIN) exit (-1); // TODO 
+    *c = self->in_buff[self->in_pos++];
+    return 1;
     }
-  if (c == '\x1b') 
+  return linux_terminal_read (self, c, 1);
+  }
+
+
+/*===========================================================================
+
+  linux_terminal_read_key
+
+  Besides keys, the terminal may send reports in response to queries. 
+  These are dealt with here, and we carry on waiting for a key if more
+  input is waiting; if not, we return VK_NONE, so that the caller can
+  get on with something else in the meantime.
+
+===========================================================================*/
+int linux_terminal_read_key (Terminal *terminal)
+  {
+  LinuxTerminal *self = (LinuxTerminal *)terminal;
+  // Everything drawn since the last key has to be on the screen before
+  //   we wait for the next
+  linux_terminal_flush (self);
+  for (;;)
     {
-    char seq[3];
-    if (read(STDIN_FILENO, &seq[0], 1) != 1) return '\x1b';
-    if (read(STDIN_FILENO, &seq[1], 1) != 1) return '\x1b';
-    if (seq[0] == '[') 
+    char c;
+    int got;
+    while ((got = linux_terminal_getc (self, &c)) != 1) 
+      {
+      // Any other failure to read means the terminal has gone -- it has
+      //   been hung up, say -- and there will be no more keys
+      if (got < 0 && errno != EAGAIN && errno != EINTR) 
+        self->input_ended = TRUE;
+      if (self->input_ended) return VK_EOF;
+      }
+    if (c != '\x1b') 
+      {
+      if (c == 127) c = VK_BACK;
+      // Bytes of UTF-8 characters are passed on as they are
+      return (unsigned char)c;
+      } 
+
+    char seq;
+    if (linux_terminal_getc (self, &seq) != 1) return '\x1b';
+    if (seq != '[') return '\x1b';
+    // Collect the private marker and up to two numeric parameters, 
+    //   if there are any, and any intermediate characters, up to the 
+    //   final character of the sequence
+    char private = 0;
+    char inter = 0;
+    int param[2] = {0, 0};
+    int nparam = 0;
+    if (linux_terminal_getc (self, &seq) != 1) return '\x1b';
+    if (seq == '?')
+      {
+      private = seq;
+      if (linux_terminal_getc (self, &seq) != 1) return '\x1b';
+      }
+    while ((seq >= '0' && seq <= '9') || seq == ';' 
+            || (seq >= 0x20 && seq <= 0x2F)) 
       {
-      if (seq[1] >= '0' && seq[1] <= '9') 
+      if (seq == ';')
+        nparam++;
+      else if (seq >= '0' && seq <= '9')
         {
-        if (read(1, &seq[2], 1) != 1) return '\x1b';
-        if (seq[2] == '~') 
-          {
-          switch (seq[1]) 
-            {
-            case '3': return VK_DEL; // Usually the key marked "del"
-            case '5': return VK_PGUP;
-            case '6': return VK_PGDN;
-            }
-          }
+        if (nparam < 2) param[nparam] = param[nparam] * 10 + seq - '0';
         }
       else
+        inter = seq;
+      if (linux_terminal_getc (self, &seq) != 1) return '\x1b';
+      }
+
+    if (private == '?' && inter == '$' && seq == 'y')
+      {
+      // DECRPM: 1 and 2 mean the mode is supported, and set or reset
+      if (param[0] == TERM_SYNC_MODE)
+        self->sync_supported = (param[1] == 1 || param[1] == 2);
+      if (!linux_terminal_input_waiting (self)) return VK_NONE;
+      continue;
+      }
+    if (seq == '~') 
+      {
+      switch (param[0]) 
         {
-        switch (seq[1]) 
-          {
-          case 'A': return VK_UP;
-          case 'B': return VK_DOWN;
-          case 'C': return VK_RIGHT;
-          case 'D': return VK_LEFT;
-          case 'H': return VK_HOME;
-          case 'F': return VK_END;
-          }
+        case 3: return VK_DEL; // Usually the key marked "del"
+        case 5: return VK_PGUP;
+        case 6: return VK_PGDN;
+        case 200: return VK_PASTE;
+        }
+      }
+    else
+      {
+      switch (seq) 
+        {
+        case 'A': return VK_UP;
+        case 'B': return VK_DOWN;
+        case 'C': return VK_RIGHT;
+        case 'D': return VK_LEFT;
+        case 'H': return VK_HOME;
+        case 'F': return VK_END;
         }
       }
     return '\x1b';
-    } 
- else 
+    }
+  }
+
+
+/*===========================================================================
+
+  linux_terminal_read_paste
+
+  Read everything up to the end-of-paste marker in blocks, rather than
+  a byte at a time. Anything read after the marker is left in the
+  input buffer for read_key. Terminals send CR for line breaks in 
+  a paste; these (and CR-LF pairs) become LF.
+
+===========================================================================*/
+char *linux_terminal_read_paste (Terminal *terminal, int *len)
+  {
+  LinuxTerminal *self = (LinuxTerminal *)terminal;
+  const int lmarker = sizeof (TERM_PASTE_END) - 1;
+  int size = BUFSIZ;
+  int n = 0;
+  int end = -1;
+  int timeouts = 0;
+  char *buff = malloc (size);
+
+  // Start with whatever is already buffered
+  n = self->in_len - self->in_pos;
+  memcpy (buff, self->in_buff + self->in_pos, n);
+  self->in_pos = self->in_len = 0;
+
+  int scan = 0;
+  while (end < 0)
     {
-    if (c == 127) c = VK_BACK;
-    return c;
-    } 
+    // Look for the marker in the data we have not yet checked
+    for (; scan + lmarker <= n && end < 0; scan++)
+      {
+      if (buff[scan] == '\033' 
+            && strncmp (buff + scan, TERM_PASTE_END, lmarker) == 0)
+        end = scan;
+      }
+    if (end >= 0) break;
+    // The marker might straddle the end of the data so far
+    scan = n - lmarker + 1;
+    if (scan < 0) scan = 0;
+
+    if (size - n < BUFSIZ)
+      {
+      size *= 2;
+      buff = realloc (buff, size);
+      }
+    int r = linux_terminal_read (self, buff + n, BUFSIZ);
+    if (r > 0)
+      {
+      n += r;
+      timeouts = 0;
+      }
+    else if (self->input_ended || ++timeouts > PASTE_MAX_TIMEOUTS)
+      {
+      end = n; // The marker went missing. Take what we have
+      }
+    }
+
+  // Push back anything that followed the marker
+  if (end + lmarker < n)
+    {
+    self->in_len = n - end - lmarker;
+    memcpy (self->in_buff, buff + end + lmarker, self->in_len);
+    }
+
+  // Normalize line endings, in place
+  int out = 0;
+  for (int i = 0; i < end; i++)
+    {
+    if (buff[i] == '\r')
+      {
+      buff[out++] = '\n';
+      if (i + 1 < end && buff[i + 1] == '\n') i++;
+      }
+    else
+      buff[out++] = buff[i];
+    }
+
+  *len = out;
+  return buff;
   }
 
 
@@ -261,16 +1555,30 @@ int linux_terminal_read_key (Terminal *self)
 ===========================================================================*/
 void linux_terminal_set_cursor (Terminal *self, int row, int col)
   {
-  char s[30];
-  char ss[20];
-  strcpy (s, "\033[");
-  itoa (row + 1, ss, 10);
-  strcat (s + strlen (s), ss);
-  strcat (s + strlen (s), ";");
-  itoa (col + 1, ss, 10);
-  strcat (s + strlen (s), ss);
-  strcat (s + strlen (s), "H");
-  write (STDOUT_FILENO, s, strlen (s));
+  linux_terminal_move ((LinuxTerminal *)self, row, col);
+  }
+
+/*===========================================================================
+
+  linux_terminal_set_tab_stops
+
+===========================================================================*/
+void linux_terminal_set_tab_stops (Terminal *terminal, 
+      const TabStops *tab_stops)
+  {
+  LinuxTerminal *self = (LinuxTerminal *)terminal;
+  self->tab_stops = tab_stops;
+  }
+
+/*===========================================================================
+
+  linux_terminal_set_left_col
+
+===========================================================================*/
+void linux_terminal_set_left_col (Terminal *terminal, int left_col)
+  {
+  LinuxTerminal *self = (LinuxTerminal *)terminal;
+  self->left_col = left_col;
   }
 
 /*===========================================================================
@@ -283,26 +1591,27 @@ int linux_terminal_get_displayed_length (const Terminal *self,
   {
   int dlen = 0;
   int pos = 0;
-  BOOL eol = FALSE;
-
-  while (pos < col)
-   {
-   if (line[pos] == 0) eol = TRUE;
-   if (eol)
-     dlen++;
-   else
-     {
-     if (line[pos] == '\t')
-        {
-        // TODO -- this logic only works with 8-space tabs
-        dlen += TAB_SIZE;
-        dlen &= 0xFFFFFFF8;
-        }
-     else       
-        dlen++;
-     }
-   pos++;
-   }
+
+  while (pos < col && line[pos])
+    {
+    int run = utf8_plain_run (line + pos, col - pos);
+    pos += run;
+    dlen += run;
+    if (pos >= col || line[pos] == 0) break;
+    if (line[pos] == '\t')
+      {
+      dlen = tab_stops_next (((const LinuxTerminal *)self)->tab_stops, dlen);
+      pos++;
+      }
+    else
+      {
+      int width;
+      pos += utf8_char (line + pos, &width);
+      dlen += width;
+      }
+    }
+  // Missing characters beyond the end of the line are one column each
+  if (pos < col) dlen += col - pos;
 
   return dlen;
   }
@@ -310,29 +1619,41 @@ int linux_terminal_get_displayed_length (const Terminal *self,
 
 /*===========================================================================
 
-  linux_terminal_write_line
+  linux_terminal_visible_bytes
+
+  The number of bytes at the start of line that fit in 'columns' 
+  columns of the screen. The line is drawn straight from where it is
+  stored, so nothing is allocated when the screen is redrawn.
 
 ===========================================================================*/
-void linux_terminal_truncate_line (int columns, char *line, int *len)
+static int linux_terminal_visible_bytes (const LinuxTerminal *self, 
+      int columns, const char *line)
   {
   int dlen = 0;
-  char *p = line;
-  *len = 0;
+  const char *p = line;
 
   while (*p && dlen < columns)
     {
+    int run = utf8_plain_run (p, columns - dlen);
+    p += run;
+    dlen += run;
+    if (*p == 0 || dlen >= columns) break;
     if (*p == '\t')
       {
-      // TODO -- this logic only works with 8-space tabs
-      dlen += TAB_SIZE;
-      dlen &= 0xFFFFFFF8;
+      dlen = tab_stops_next (self->tab_stops, dlen);
+      p++;
+      }
+    else
+      {
+      // A wide character that would not fit is left off
+      int width;
+      int len = utf8_char (p, &width);
+      if (dlen + width > columns) break;
+      dlen += width;
+      p += len;
       }
-    else       
-      dlen++;
-    p++;
-    (*len)++;
     }
-  *p = 0;
+  return p - line;
   }
 
 
@@ -341,38 +1662,159 @@ void linux_terminal_truncate_line (int columns, char *line, int *len)
   linux_terminal_write_line
 
 ===========================================================================*/
-void linux_terminal_write_line (Terminal *self, int row, const char *line, 
-      BOOL truncate)
+void linux_terminal_write_line (Terminal *terminal, int row, 
+      const char *line, BOOL truncate)
   {
-  int len = strlen (line);
+  LinuxTerminal *self = (LinuxTerminal *)terminal;
   int rows = 24; int columns = 80; // defaults, in case get_size fails
-  linux_terminal_set_cursor (self, row, 0);
-  linux_terminal_get_size (self, &rows, &columns, NULL);
-  if (truncate)
+  if (self->serial && truncate && self->screen && row < self->rows)
     {
-    char *line2 = strdup (line);
-    int len;
-    linux_terminal_truncate_line (columns, line2, &len);
-    write (STDOUT_FILENO, line2, len);
-
-    /*
-    if (len > columns)
+    memset (self->target, ' ', self->columns);
+    if (linux_terminal_expand (self, line, -1, 0, 0))
       {
-      write (STDOUT_FILENO, line, columns);
+      linux_terminal_render_row (self, row, 0);
+      return;
       }
-    else
+    // Can't be drawn cell by cell; carry on as usual, on a row with
+    //   any pending erasure done
+    linux_terminal_settle_row (self, row);
+    }
+  linux_terminal_move (self, row, 0);
+  linux_terminal_get_size (terminal, &rows, &columns, NULL);
+  if (truncate)
+    {
+    linux_terminal_put_text (self, line, 
+      linux_terminal_visible_bytes (self, columns, line));
+    }
+  else
+    {
+    linux_terminal_put_text (self, line, strlen (line));
+    }
+  }
+
+
+/*===========================================================================
+
+  linux_terminal_write_line_from
+
+===========================================================================*/
+void linux_terminal_write_line_from (Terminal *terminal, int row, 
+      const char *line, int from, int dcol, int n)
+  {
+  LinuxTerminal *self = (LinuxTerminal *)terminal;
+  int rows = 24; int columns = 80; // defaults, in case get_size fails
+  linux_terminal_get_size (terminal, &rows, &columns, NULL);
+  int left = self->left_col;
+  if (dcol - left >= columns) return;
+  // The screen column where drawing starts. A tab that starts to the 
+  //   left of the screen can still cover its first cells
+  int scol = dcol > left ? dcol - left : 0;
+
+  if (self->serial && self->screen && row < self->rows 
+      && scol < self->columns)
+    {
+    int start = self->pending[row] < scol ? self->pending[row] : scol;
+    linux_terminal_target_row (self, row);
+    if (n < 0) memset (self->target + scol, ' ', self->columns - scol);
+    if (from > strlen (line) 
+        || linux_terminal_expand (self, line + from, n, dcol, left))
       {
-      write (STDOUT_FILENO, line, len);
+      linux_terminal_render_row (self, row, start);
+      return;
       }
-    */
-    
-    free (line2);
+    linux_terminal_settle_row (self, row);
     }
-  else
+
+  linux_terminal_move (self, row, scol);
+
+  // A tab moves the cursor over cells without erasing them, so a
+  //   whole suffix is written over an erased row. A fixed-length span 
+  //   is written over existing cells, so its tabs become spaces. So do
+  //   all tabs when the line is shifted, because the terminal's stops 
+  //   are then in the wrong places
+  if (n < 0) linux_terminal_erase_eol (self);
+  BOOL tabs_as_spaces = n >= 0 || left > 0;
+
+  // 'from' might be beyond the end of the line, in which case there is
+  //   nothing to write
+  if (from <= strlen (line))
     {
-    write (STDOUT_FILENO, line, len);
+    const char *p = line + from;
+    int done = 0; // Characters consumed
+
+    // Pass over whatever is to the left of the screen
+    while (*p && (n < 0 || done < n) && dcol < left)
+      {
+      int width = 1;
+      int bytes = 1;
+      int next;
+      if (*p == '\t')
+        next = tab_stops_next (self->tab_stops, dcol);
+      else
+        {
+        bytes = utf8_char (p, &width);
+        next = dcol + width;
+        }
+      if (next > left) 
+        {
+        // A tab that covers the left edge is drawn below. A wide 
+        //   character can't be drawn in part, so the part of it that 
+        //   is on the screen is left blank
+        if (*p == '\t') break;
+        for (; dcol < next; dcol++)
+          if (dcol >= left) linux_terminal_put_text (self, " ", 1);
+        }
+      dcol = next;
+      done++;
+      p += bytes;
+      }
+
+    int len = 0; // Length of the run not yet written
+    while (p[len] && (n < 0 || done < n) && dcol - left < columns)
+      {
+      if (n < 0)
+        {
+        // Pass over a run of characters that are one column each
+        int run = utf8_plain_run (p + len, columns - (dcol - left));
+        len += run;
+        dcol += run;
+        if (p[len] == 0 || dcol - left >= columns) break;
+        }
+      done++;
+      if (p[len] == '\t')
+        {
+        int next = tab_stops_next (self->tab_stops, dcol);
+        if (tabs_as_spaces)
+          {
+          linux_terminal_put_text (self, p, len);
+          if (dcol < left) dcol = left;
+          for (; dcol < next && dcol - left < columns; dcol++)
+            linux_terminal_put_text (self, " ", 1);
+          p += len + 1;
+          len = 0;
+          continue;
+          }
+        dcol = next;
+        len++;
+        }
+      else if ((unsigned char)p[len] < 0x80)
+        {
+        dcol++;
+        len++;
+        }
+      else
+        {
+        // A wide character that doesn't fit is left off, rather than
+        //   letting the terminal wrap it
+        int width;
+        int bytes = utf8_char (p + len, &width);
+        if (dcol - left + width > columns) break;
+        dcol += width;
+        len += bytes;
+        }
+      }
+    linux_terminal_put_text (self, p, len);
     }
-  if (len < columns && row < rows - 1) write (STDOUT_FILENO, "\n", 1);
   }
 
 
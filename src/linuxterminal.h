@@ -16,3 +16,18 @@ typedef struct _LinuxTerminal LinuxTerminal;
 extern  LinuxTerminal *linux_terminal_create (void);
 extern  void           linux_terminal_destroy (LinuxTerminal *self);
 
+// Select the serial line profile, which trades CPU time for fewer bytes
+//   of output. Must be called before init()
+extern  void           linux_terminal_set_serial (LinuxTerminal *self, 
+                         BOOL serial);
+
+// Talk to a device, such as a VirtualTerminal, instead of the process's
+//   terminal. The LinuxTerminal does not take ownership of the device.
+//   Must be called before init()
+extern  void           linux_terminal_set_device (LinuxTerminal *self, 
+                         TerminalDevice *device);
+
+// The number of bytes written to the terminal since it was created
+extern  long           linux_terminal_get_bytes_written 
+                         (const LinuxTerminal *self);
+
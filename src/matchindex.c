@@ -0,0 +1,415 @@
+/*===========================================================================
+
+  bute
+
+  matchindex.c
+
+  Copyright (c)2020 Kevin Boone. Distributed uner the terms of the
+    GNU PUblic Licence, v3.0
+
+  A "class" that records how many matches of a search there are in each
+  line of a file. As in WrapIndex, the counts are held in a Fenwick
+  tree, so that the number of matches before a line, and the line that
+  a match is in, take time proportional to the logarithm of the number
+  of lines; the next match after a line that has none is in the line
+  that holds the match whose number is the count of those before it.
+
+  The lines are counted from the start, a go at a time, by
+  search_file_lines, with the lines not yet counted taken to have none.
+  A go is bounded by the text looked through, not by the number of 
+  lines, so that it is short even where the lines are long, and a key
+  pressed during it waits for no more than that.
+  The file notes the runs of lines that change, and before the index is
+  used, the lines in each run are counted again. If lines have been
+  added or removed, the counts of the other lines are moved to where
+  their lines are now, and the tree is built again from them, which
+  needs no searching.
+
+===========================================================================*/
+#include "cnolib.h"
+#include "search.h"
+#include "textfile.h"
+#include "matchindex.h"
+
+// About the most text that each thread looks through in one go, so
+//   that a go takes a short time, however long the lines are
+#define MATCH_INDEX_BYTES (2 * 1024 * 1024)
+
+struct _MatchIndex
+  {
+  Search *search;
+  TextFile *text_file;
+  // What the file notes the changes to it for the index with
+  int noter;
+  int nlines;
+  // The lines before this one have been counted
+  int counted;
+  // The number of entries there is room for in counts and tree
+  int size;
+  // counts[i] is the number of matches in line i
+  int *counts;
+  // tree[i], counting from one, is the sum of the counts of the lines
+  //   from i - (i & -i) up to i - 1
+  long *tree;
+  // The lines with matches that a go finds, and their counts, with room
+  //   for rows_size of them
+  int *rows;
+  int *row_counts;
+  int rows_size;
+  };
+
+/*===========================================================================
+
+  match_index_create
+
+===========================================================================*/
+MatchIndex *match_index_create (Search *search, TextFile *text_file)
+  {
+  MatchIndex *self = malloc (sizeof (MatchIndex));
+  memset (self, 0, sizeof (MatchIndex));
+  self->search = search;
+  self->text_file = text_file;
+  self->size = 1;
+  self->counts = malloc (sizeof (int));
+  self->tree = malloc (sizeof (long));
+  self->tree[0] = 0;
+  self->noter = text_file_note_changes (text_file);
+  return self;
+  }
+
+/*===========================================================================
+
+  match_index_destroy
+
+===========================================================================*/
+void match_index_destroy (MatchIndex *self)
+  {
+  if (self)
+    {
+    text_file_stop_noting (self->text_file, self->noter);
+    search_destroy (self->search);
+    free (self->counts);
+    free (self->tree);
+    if (self->rows_size > 0)
+      {
+      free (self->rows);
+      free (self->row_counts);
+      }
+    free (self);
+    }
+  }
+
+/*===========================================================================
+
+  match_index_line_count
+
+===========================================================================*/
+static int match_index_line_count (const MatchIndex *self, int line)
+  {
+  const char *text = text_file_get_line (self->text_file, line);
+  return search_count_line (self->search, text, strlen (text),
+    0x7fffffff);
+  }
+
+/*===========================================================================
+
+  match_index_add
+
+  Add to the count for a line
+
+===========================================================================*/
+static void match_index_add (MatchIndex *self, int line, int delta)
+  {
+  self->counts[line] += delta;
+  for (int i = line + 1; i <= self->nlines; i += i & -i)
+    self->tree[i] += delta;
+  }
+
+/*===========================================================================
+
+  match_index_build_tree
+
+  Each node adds itself to its parent, which gives the whole tree in
+  one pass
+
+===========================================================================*/
+static void match_index_build_tree (MatchIndex *self)
+  {
+  self->tree[0] = 0;
+  for (int i = 0; i < self->nlines; i++)
+    self->tree[i + 1] = self->counts[i];
+  for (int i = 1; i <= self->nlines; i++)
+    {
+    int parent = i + (i & -i);
+    if (parent <= self->nlines) self->tree[parent] += self->tree[i];
+    }
+  }
+
+/*===========================================================================
+
+  match_index_add_lines
+
+  Add lines, not yet counted, at the end. A new node is the sum of the
+  nodes below it, which are all there already
+
+===========================================================================*/
+static void match_index_add_lines (MatchIndex *self, int nlines)
+  {
+  if (nlines <= self->nlines) return;
+  if (nlines + 1 > self->size)
+    {
+    int size = self->size * 2;
+    if (size < nlines + 1) size = nlines + 1;
+    int *counts = malloc (size * sizeof (int));
+    long *tree = malloc (size * sizeof (long));
+    memcpy (counts, self->counts, self->nlines * sizeof (int));
+    memcpy (tree, self->tree, (self->nlines + 1) * sizeof (long));
+    free (self->counts);
+    free (self->tree);
+    self->counts = counts;
+    self->tree = tree;
+    self->size = size;
+    }
+  for (int i = self->nlines; i < nlines; i++)
+    {
+    int node = i + 1;
+    self->counts[i] = 0;
+    self->tree[node] = 0;
+    for (int child = 1; child < (node & -node); child *= 2)
+      self->tree[node] += self->tree[node - child];
+    }
+  self->nlines = nlines;
+  }
+
+/*===========================================================================
+
+  match_index_apply
+
+  Count the lines in runs that have changed again, if they had been
+  counted. A run that the lines counted so far end in is counted to its
+  end. When no lines have been added or removed, only the counts that
+  change are changed in the tree
+
+===========================================================================*/
+static void match_index_apply (MatchIndex *self,
+     const TextFileChange *changes, int n)
+  {
+  if (n == 1 && changes[0].added == 0)
+    {
+    for (int line = changes[0].first; line < changes[0].end; line++)
+      {
+      if (line >= self->counted) break;
+      match_index_add (self, line,
+        match_index_line_count (self, line) - self->counts[line]);
+      }
+    return;
+    }
+  int added = 0;
+  for (int i = 0; i < n; i++) added += changes[i].added;
+  int nlines = self->nlines + added;
+  int size = nlines + 1;
+  int *counts = malloc (size * sizeof (int));
+  int counted = -1;
+  // Where the lines that haven't changed were, and where they are now
+  int from = 0;
+  int to = 0;
+  for (int i = 0; i <= n; i++)
+    {
+    int len = (i < n ? changes[i].first : nlines) - to;
+    memcpy (counts + to, self->counts + from, len * sizeof (int));
+    if (counted < 0 && self->counted <= from + len)
+      counted = to + self->counted - from;
+    from += len;
+    to += len;
+    if (i == n) break;
+    const TextFileChange *run = &changes[i];
+    BOOL count = from < self->counted;
+    for (; to < run->end; to++)
+      counts[to] = count ? match_index_line_count (self, to) : 0;
+    from += run->end - run->first - run->added;
+    if (count && counted < 0 && self->counted <= from) counted = to;
+    }
+  free (self->counts);
+  free (self->tree);
+  self->counts = counts;
+  self->tree = malloc (size * sizeof (long));
+  self->size = size;
+  self->nlines = nlines;
+  self->counted = counted;
+  match_index_build_tree (self);
+  }
+
+/*===========================================================================
+
+  match_index_update
+
+  Bring the index up to date with the changes to the file since it was
+  last used, and the lines loaded since. Lines are loaded only at the
+  end, so those that were there before the changes were made, which
+  the changes are counted from, are all the lines there are now, less
+  those the changes added
+
+===========================================================================*/
+static void match_index_update (MatchIndex *self)
+  {
+  TextFile *text_file = self->text_file;
+  int nlines = text_file_get_line_count (text_file);
+  int n;
+  TextFileChange *changes = text_file_take_changes (text_file, self->noter, 
+    &n);
+  if (changes)
+    {
+    int added = 0;
+    for (int i = 0; i < n; i++) added += changes[i].added;
+    match_index_add_lines (self, nlines - added);
+    match_index_apply (self, changes, n);
+    free (changes);
+    }
+  match_index_add_lines (self, nlines);
+  }
+
+/*===========================================================================
+
+  match_index_count_more
+
+===========================================================================*/
+BOOL match_index_count_more (MatchIndex *self)
+  {
+  match_index_update (self);
+  if (self->counted < self->nlines)
+    {
+    int row = self->counted;
+    int n = search_file_lines (self->search, self->text_file, &row,
+      self->nlines - 1, MATCH_INDEX_BYTES, &self->rows, &self->row_counts,
+      &self->rows_size);
+    for (int i = 0; i < n; i++)
+      match_index_add (self, self->rows[i], self->row_counts[i]);
+    self->counted = row;
+    }
+  return self->counted >= self->nlines;
+  }
+
+/*===========================================================================
+
+  match_index_is_complete
+
+===========================================================================*/
+BOOL match_index_is_complete (MatchIndex *self)
+  {
+  match_index_update (self);
+  return self->counted >= self->nlines
+    && !text_file_is_loading (self->text_file);
+  }
+
+/*===========================================================================
+
+  match_index_before
+
+  The number of matches in the lines before 'line'
+
+===========================================================================*/
+static long match_index_before (const MatchIndex *self, int line)
+  {
+  long sum = 0;
+  for (int i = line; i > 0; i -= i & -i)
+    sum += self->tree[i];
+  return sum;
+  }
+
+/*===========================================================================
+
+  match_index_line_at
+
+  The line that holds match n, counting from zero. Walk down the tree,
+  taking each node whose matches all come before it
+
+===========================================================================*/
+static int match_index_line_at (const MatchIndex *self, long n)
+  {
+  int step = 1;
+  while (step * 2 <= self->nlines) step *= 2;
+
+  int line = 0;
+  for (; step > 0; step /= 2)
+    {
+    if (line + step <= self->nlines && self->tree[line + step] <= n)
+      {
+      line += step;
+      n -= self->tree[line];
+      }
+    }
+  return line;
+  }
+
+/*===========================================================================
+
+  match_index_get_total
+
+===========================================================================*/
+long match_index_get_total (MatchIndex *self)
+  {
+  match_index_update (self);
+  return match_index_before (self, self->nlines);
+  }
+
+/*===========================================================================
+
+  match_index_get_number
+
+===========================================================================*/
+long match_index_get_number (MatchIndex *self, int row, int col)
+  {
+  match_index_update (self);
+  if (row < 0 || row >= self->nlines) return -1;
+  const char *line = text_file_get_line (self->text_file, row);
+  int len = strlen (line);
+  int match_len;
+  if (search_line (self->search, line, len, col, &match_len) != col)
+    return -1;
+  return match_index_before (self, row)
+    + search_count_line (self->search, line, len, col);
+  }
+
+/*===========================================================================
+
+  match_index_find
+
+  Only the line that the search starts in is looked through. If the
+  match isn't there, the tree says which line it is in
+
+===========================================================================*/
+BOOL match_index_find (MatchIndex *self, BOOL back, int *row, int *col,
+     int *match_len)
+  {
+  match_index_update (self);
+  int r = *row;
+  int c = *col;
+  if (r >= self->nlines)
+    {
+    if (!back) return FALSE;
+    r = self->nlines - 1;
+    c = 0x7fffffff;
+    }
+  if (r < 0) return FALSE;
+  const char *line = text_file_get_line (self->text_file, r);
+  int len = strlen (line);
+  int found = back ? search_line_back (self->search, line, len, c, match_len)
+    : search_line (self->search, line, len, c, match_len);
+  if (found < 0)
+    {
+    long n = match_index_before (self, back ? r : r + 1);
+    if (back ? n == 0 : n >= match_index_before (self, self->nlines))
+      return FALSE;
+    r = match_index_line_at (self, back ? n - 1 : n);
+    line = text_file_get_line (self->text_file, r);
+    len = strlen (line);
+    found = back
+      ? search_line_back (self->search, line, len, 0x7fffffff, match_len)
+      : search_line (self->search, line, len, 0, match_len);
+    if (found < 0) return FALSE;
+    }
+  *row = r;
+  *col = found;
+  return TRUE;
+  }
+
@@ -0,0 +1,52 @@
+/*===========================================================================
+
+  bute -- barely useful text editor
+
+  matchindex.h
+
+  Copyright (c)2020 Kevin Boone. Distributed uner the terms of the
+    GNU PUblic Licence, v3.0
+
+===========================================================================*/
+#pragma once
+
+#include "cnolib.h"
+#include "search.h"
+#include "textfile.h"
+
+// The number of matches of a search in each line of a file, kept so
+//   that the number of a match, and the next or last match from
+//   anywhere, can be found without looking through the lines between.
+//   The lines are counted a few at a time, and once they have been,
+//   only those that change are counted again
+struct _MatchIndex;
+typedef struct _MatchIndex MatchIndex;
+
+// The index takes the search, and destroys it with itself. The file
+//   must outlast the index; its changes are noted while the index is
+//   there
+extern MatchIndex *match_index_create (Search *search,
+                     TextFile *text_file);
+extern void        match_index_destroy (MatchIndex *self);
+
+// Count the matches in the next lines that haven't been counted, as
+//   many as can be looked through in a short time. Returns TRUE if all
+//   the lines loaded so far have now been counted
+extern BOOL        match_index_count_more (MatchIndex *self);
+// Whether every line of the file has been counted, now that it is all
+//   loaded, so that what follows can be used
+extern BOOL        match_index_is_complete (MatchIndex *self);
+
+// The number of matches in the file
+extern long        match_index_get_total (MatchIndex *self);
+// The number of the match that starts at line 'row', position 'col',
+//   counting from zero, or -1 if none does
+extern long        match_index_get_number (MatchIndex *self, int row,
+                     int col);
+// The first match that starts at line *row, position *col, or after
+//   it, or going backwards, the last that starts there or before.
+//   Returns TRUE, and the match in *row and *col, and its length in
+//   *match_len, if there is one, as search_file does
+extern BOOL        match_index_find (MatchIndex *self, BOOL back,
+                     int *row, int *col, int *match_len);
+
@@ -0,0 +1,1556 @@
+/*===========================================================================
+
+  bute
+
+  regex.c
+
+  Copyright (c)2020 Kevin Boone. Distributed uner the terms of the
+    GNU PUblic Licence, v3.0
+
+  Regular expressions, without backtracking. A pattern is parsed into a
+  tree, and the tree made into two NFAs (Thompson's construction): one
+  for the pattern, and one for the pattern reversed. Neither is run as
+  it is. Instead, each has a DFA, whose states are sets of NFA states,
+  and which is built a state and a transition at a time, as the text
+  needs them, and kept for the next search. Once there are
+  REGEX_DFA_STATES states, they are all thrown away, and building
+  starts again, so memory is limited whatever the pattern; the cost is
+  that a DFA that needs more states than that is built again as it
+  goes, but it still takes time in proportion to the length of the
+  text.
+
+  The bytes are put into classes that no part of the pattern tells
+  apart, so that each DFA state has a transition for each class, not
+  each byte.
+
+  To find the first match in a line, a third DFA, for the pattern as if
+  it were preceded by .*, is run forwards, only to find whether there
+  is any match at all; one for a pattern that starts with ^ has nowhere
+  to go after the first byte, so it stops there. Then the reversed DFA
+  is run back from
+  the end of the line, as if the reversed pattern were preceded by .*;
+  the last place where it finds a match is where the first match
+  starts. Then the forward DFA is run from there, anchored, to find
+  the longest match that starts there. A line with no match is looked
+  at once, a byte at a time.
+
+  When a line is looked through for one match after another, as when
+  they are counted, going back from the end of the line for each of
+  them would take time in proportion to the square of its length. So a
+  line can be set, and the first search in it runs the reversed DFA
+  back over the whole of it once, noting every place where a match
+  starts; the searches after that take the first of those at or after
+  where they start from, and only the forward DFA is run from there.
+
+  Most patterns can only match text that includes some piece of text
+  as it is -- "key" in key\s*=, say -- and that is worked out from the
+  tree, so that the lines that don't include it can be passed over 
+  without running the DFAs on them at all.
+
+===========================================================================*/
+#include "cnolib.h"
+#include "regex.h"
+
+// Limits on the pattern, so that it can't take all the memory
+#define REGEX_MAX_NFA 20000
+#define REGEX_MAX_REPEAT 255
+#define REGEX_MAX_DEPTH 100
+// The most DFA states kept, and the size of the table they are found in
+#define REGEX_DFA_STATES 1024
+#define REGEX_HASH_SIZE 1024
+// A transition that has not been worked out yet, and the state with no
+//   way to a match
+#define REGEX_UNKNOWN -2
+#define REGEX_DEAD -1
+// Set in a transition to a state that is a match, so that a DFA can be
+//   run without looking at the states it passes through
+#define REGEX_MATCHING (1 << 30)
+// The longest piece of text that every match must include that is kept
+#define REGEX_MAX_LITERAL 64
+// The bits in each word of the places where matches start
+#define REGEX_WORD_BITS (8 * (int)sizeof (unsigned long))
+
+typedef enum _RegexNodeType
+  {
+  REGEX_NODE_SET = 0,
+  REGEX_NODE_EMPTY,
+  REGEX_NODE_CAT,
+  REGEX_NODE_ALT,
+  REGEX_NODE_REPEAT,
+  REGEX_NODE_BOL,
+  REGEX_NODE_EOL
+  } RegexNodeType;
+
+// A node of the parsed pattern. a and b are the nodes it is made of, or
+//   for a set, the set. A repeat is from min to max times, with max -1
+//   for no limit
+typedef struct _RegexNode
+  {
+  RegexNodeType type;
+  int a;
+  int b;
+  int min;
+  int max;
+  } RegexNode;
+
+typedef enum _RegexStateType
+  {
+  // Consume a byte in the set, and go to out
+  REGEX_STATE_SET = 0,
+  // Go to out, and to out1
+  REGEX_STATE_SPLIT,
+  // Go to out
+  REGEX_STATE_EMPTY,
+  // Go to out, at the start of the text being run through, or at the
+  //   end of it
+  REGEX_STATE_BOL,
+  REGEX_STATE_EOL,
+  REGEX_STATE_MATCH
+  } RegexStateType;
+
+typedef struct _RegexState
+  {
+  RegexStateType type;
+  int out;
+  int out1;
+  int set;
+  } RegexState;
+
+// A DFA state: its NFA states, in order, and whether it is a match, or
+//   is one if the text ends here
+typedef struct _RegexDfaState
+  {
+  int first;
+  int n;
+  BOOL match;
+  BOOL match_end;
+  // The same, when the text is empty, so it is at its start as well
+  BOOL match_empty;
+  unsigned int hash;
+  int chain;
+  } RegexDfaState;
+
+typedef struct _RegexDfa
+  {
+  // The NFA state it starts at, and whether it looks for a match that
+  //   starts anywhere, not just at the start
+  int start;
+  BOOL unanchored;
+  RegexDfaState *states;
+  int nstates;
+  // The NFA states of every DFA state, one after another
+  int *pool;
+  int pool_len;
+  int pool_size;
+  // For each state, the state each class of byte leads to
+  int *trans;
+  int hash[REGEX_HASH_SIZE];
+  // The states it starts in, not at and at the start of the text
+  int begin[2];
+  // How many times it has been emptied
+  int resets;
+  } RegexDfa;
+
+struct _Regex
+  {
+  RegexState *states;
+  int nstates;
+  // Sets of bytes, 32 bytes of bits each
+  unsigned char *sets;
+  int nsets;
+  // The class of each byte, and a byte of each class
+  unsigned char cls[256];
+  unsigned char rep[256];
+  int ncls;
+  // The transitions of each DFA state take up 1 << shift places, at 
+  //   least one for each class, so that where a state's are is found 
+  //   by a shift, and the DFAs pass that around in place of the state
+  int shift;
+  RegexDfa fwd;
+  RegexDfa rev;
+  RegexDfa any;
+  // Room for working out sets of NFA states: a mark for each state,
+  //   set to 'gen' when it has been added, a stack, and the set
+  int *mark;
+  int gen;
+  int *stack;
+  int *set;
+  // Text that every match includes, if any
+  unsigned char literal[REGEX_MAX_LITERAL];
+  int literal_len;
+  // The line set by regex_set_line, and once it has been looked 
+  //   through, a bit for each place in it, from 0 to line_len, that is
+  //   set if a match starts there, with room for starts_size words
+  const char *line;
+  int line_len;
+  BOOL have_starts;
+  unsigned long *starts;
+  int starts_size;
+  };
+
+// What is known of the text that a part of the pattern matches: text
+//   that it always starts with, always ends with, and always includes,
+//   and whether it is only ever exactly the text it starts with
+typedef struct _RegexLiteral
+  {
+  BOOL exact;
+  unsigned char prefix[REGEX_MAX_LITERAL];
+  int prefix_len;
+  unsigned char suffix[REGEX_MAX_LITERAL];
+  int suffix_len;
+  unsigned char best[REGEX_MAX_LITERAL];
+  int best_len;
+  } RegexLiteral;
+
+// The state of the parser
+typedef struct _RegexParser
+  {
+  const unsigned char *p;
+  int len;
+  int pos;
+  int depth;
+  RegexNode *nodes;
+  int nnodes;
+  int nodes_size;
+  Regex *re;
+  int sets_size;
+  const char *error;
+  } RegexParser;
+
+/*===========================================================================
+
+  regex_grow
+
+  Copy an array of n items of a given size to a new one of 'size' items
+
+===========================================================================*/
+static void *regex_grow (void *old, int n, int size, size_t item)
+  {
+  void *ret = malloc (size * item);
+  if (old)
+    {
+    memcpy (ret, old, n * item);
+    free (old);
+    }
+  return ret;
+  }
+
+/*===========================================================================
+
+  regex_add_node
+
+===========================================================================*/
+static int regex_add_node (RegexParser *ps, RegexNodeType type, int a,
+     int b)
+  {
+  if (ps->nnodes == ps->nodes_size)
+    {
+    int size = ps->nodes_size * 2 + 16;
+    ps->nodes = regex_grow (ps->nodes, ps->nnodes, size, sizeof (RegexNode));
+    ps->nodes_size = size;
+    }
+  RegexNode *node = &ps->nodes[ps->nnodes];
+  node->type = type;
+  node->a = a;
+  node->b = b;
+  node->min = 0;
+  node->max = 0;
+  return ps->nnodes++;
+  }
+
+/*===========================================================================
+
+  regex_add_set
+
+  A new set node, with no bytes in it yet
+
+===========================================================================*/
+static int regex_add_set (RegexParser *ps)
+  {
+  Regex *re = ps->re;
+  if (re->nsets == ps->sets_size)
+    {
+    int size = ps->sets_size * 2 + 8;
+    re->sets = regex_grow (re->sets, re->nsets * 32, size * 32, 1);
+    ps->sets_size = size;
+    }
+  memset (re->sets + re->nsets * 32, 0, 32);
+  return regex_add_node (ps, REGEX_NODE_SET, re->nsets++, 0);
+  }
+
+/*===========================================================================
+
+  regex_set_bits
+
+  The bits of the set of a set node
+
+===========================================================================*/
+static unsigned char *regex_set_bits (RegexParser *ps, int node)
+  {
+  return ps->re->sets + ps->nodes[node].a * 32;
+  }
+
+/*===========================================================================
+
+  regex_set_add
+
+  Add the bytes from first to last to a set
+
+===========================================================================*/
+static void regex_set_add (unsigned char *bits, int first, int last)
+  {
+  for (int c = first; c <= last; c++)
+    bits[c >> 3] |= 1 << (c & 7);
+  }
+
+/*===========================================================================
+
+  regex_set_escape
+
+  Add the bytes of \s, \d or \w to a set, or of the opposite for the
+  capital letter. Returns FALSE if c is not one of these
+
+===========================================================================*/
+static BOOL regex_set_escape (unsigned char *bits, int c)
+  {
+  unsigned char add[32];
+  memset (add, 0, 32);
+  switch (c | 0x20)
+    {
+    case 's':
+      regex_set_add (add, ' ', ' ');
+      regex_set_add (add, '\t', '\r');
+      break;
+    case 'd':
+      regex_set_add (add, '0', '9');
+      break;
+    case 'w':
+      regex_set_add (add, '0', '9');
+      regex_set_add (add, 'A', 'Z');
+      regex_set_add (add, 'a', 'z');
+      regex_set_add (add, '_', '_');
+      break;
+    default:
+      return FALSE;
+    }
+  BOOL invert = c >= 'A' && c <= 'Z';
+  for (int i = 0; i < 32; i++)
+    bits[i] |= invert ? ~add[i] : add[i];
+  return TRUE;
+  }
+
+/*===========================================================================
+
+  regex_set_named
+
+  Add the bytes of a class like [:space:] to a set, where the name
+  starts at the parser's position. Returns FALSE if there is no such
+  class there
+
+===========================================================================*/
+static BOOL regex_set_named (RegexParser *ps, unsigned char *bits)
+  {
+  static const char *names[] = { "alpha", "digit", "alnum", "space",
+    "upper", "lower", "punct", "xdigit", "blank", NULL };
+  for (int n = 0; names[n]; n++)
+    {
+    int l = strlen (names[n]);
+    if (ps->pos + l + 2 > ps->len
+        || memcmp (ps->p + ps->pos, names[n], l) != 0
+        || ps->p[ps->pos + l] != ':' || ps->p[ps->pos + l + 1] != ']')
+      continue;
+    ps->pos += l + 2;
+    for (int c = 0; c < 128; c++)
+      {
+      BOOL upper = c >= 'A' && c <= 'Z';
+      BOOL lower = c >= 'a' && c <= 'z';
+      BOOL digit = c >= '0' && c <= '9';
+      BOOL space = c == ' ' || (c >= '\t' && c <= '\r');
+      BOOL in = FALSE;
+      switch (n)
+        {
+        case 0: in = upper || lower; break;
+        case 1: in = digit; break;
+        case 2: in = upper || lower || digit; break;
+        case 3: in = space; break;
+        case 4: in = upper; break;
+        case 5: in = lower; break;
+        case 6: in = c > 32 && c < 127 && !upper && !lower && !digit; break;
+        case 7: in = digit || ((c | 0x20) >= 'a' && (c | 0x20) <= 'f');
+          break;
+        case 8: in = c == ' ' || c == '\t'; break;
+        }
+      if (in) regex_set_add (bits, c, c);
+      }
+    return TRUE;
+    }
+  return FALSE;
+  }
+
+/*===========================================================================
+
+  regex_escape_char
+
+  The byte that an escaped character stands for: \t, \n and \r for
+  themselves, and anything else for itself
+
+===========================================================================*/
+static int regex_escape_char (int c)
+  {
+  switch (c)
+    {
+    case 't': return '\t';
+    case 'n': return '\n';
+    case 'r': return '\r';
+    case 'f': return '\f';
+    case 'v': return '\v';
+    }
+  return c;
+  }
+
+/*===========================================================================
+
+  regex_parse_class
+
+  A bracket expression, after the [
+
+===========================================================================*/
+static int regex_parse_class (RegexParser *ps)
+  {
+  int node = regex_add_set (ps);
+  unsigned char *bits = regex_set_bits (ps, node);
+  BOOL invert = ps->pos < ps->len && ps->p[ps->pos] == '^';
+  if (invert) ps->pos++;
+  BOOL first = TRUE;
+  for (;;)
+    {
+    if (ps->pos >= ps->len)
+      {
+      ps->error = "Unmatched [";
+      return -1;
+      }
+    int c = ps->p[ps->pos++];
+    if (c == ']' && !first) break;
+    first = FALSE;
+    if (c == '[' && ps->pos < ps->len && ps->p[ps->pos] == ':')
+      {
+      ps->pos++;
+      if (!regex_set_named (ps, bits))
+        {
+        ps->error = "Unknown class name";
+        return -1;
+        }
+      continue;
+      }
+    if (c == '\\' && ps->pos < ps->len)
+      {
+      c = ps->p[ps->pos++];
+      if (regex_set_escape (bits, c)) continue;
+      c = regex_escape_char (c);
+      }
+    int last = c;
+    if (ps->pos + 1 < ps->len && ps->p[ps->pos] == '-'
+         && ps->p[ps->pos + 1] != ']')
+      {
+      last = ps->p[ps->pos + 1];
+      ps->pos += 2;
+      if (last == '\\' && ps->pos < ps->len)
+        last = regex_escape_char (ps->p[ps->pos++]);
+      if (last < c)
+        {
+        ps->error = "Bad range";
+        return -1;
+        }
+      }
+    regex_set_add (bits, c, last);
+    }
+  if (invert)
+    for (int i = 0; i < 32; i++) bits[i] = ~bits[i];
+  return node;
+  }
+
+/*===========================================================================
+
+  regex_parse_count
+
+  A number in a {m,n} repeat. Returns -1 if there isn't one
+
+===========================================================================*/
+static int regex_parse_count (RegexParser *ps)
+  {
+  int n = -1;
+  while (ps->pos < ps->len && ps->p[ps->pos] >= '0'
+       && ps->p[ps->pos] <= '9')
+    {
+    if (n < 0) n = 0;
+    if (n <= REGEX_MAX_REPEAT) n = n * 10 + ps->p[ps->pos] - '0';
+    ps->pos++;
+    }
+  return n;
+  }
+
+/*===========================================================================
+
+  regex_parse_braces
+
+  A {m}, {m,} or {m,n} after an atom, starting at the {. Returns FALSE,
+  leaving the position where it was, if it is not one of these, in
+  which case the { is an ordinary character
+
+===========================================================================*/
+static BOOL regex_parse_braces (RegexParser *ps, int *min, int *max)
+  {
+  int pos = ps->pos;
+  ps->pos++;
+  *min = regex_parse_count (ps);
+  *max = *min;
+  if (ps->pos < ps->len && ps->p[ps->pos] == ',')
+    {
+    ps->pos++;
+    *max = regex_parse_count (ps);
+    }
+  if (*min < 0 || ps->pos >= ps->len || ps->p[ps->pos] != '}')
+    {
+    ps->pos = pos;
+    return FALSE;
+    }
+  ps->pos++;
+  return TRUE;
+  }
+
+static int regex_parse_alt (RegexParser *ps); // FWD
+
+/*===========================================================================
+
+  regex_parse_atom
+
+  Returns the node, or -1 if there is an error
+
+===========================================================================*/
+static int regex_parse_atom (RegexParser *ps)
+  {
+  int c = ps->p[ps->pos++];
+  switch (c)
+    {
+    case '(':
+      {
+      if (++ps->depth > REGEX_MAX_DEPTH)
+        {
+        ps->error = "Too many ( inside one another";
+        return -1;
+        }
+      int node = regex_parse_alt (ps);
+      ps->depth--;
+      if (node < 0) return -1;
+      if (ps->pos >= ps->len || ps->p[ps->pos] != ')')
+        {
+        ps->error = "Unmatched (";
+        return -1;
+        }
+      ps->pos++;
+      return node;
+      }
+    case '[':
+      return regex_parse_class (ps);
+    case '.':
+      {
+      int node = regex_add_set (ps);
+      regex_set_add (regex_set_bits (ps, node), 0, 255);
+      return node;
+      }
+    case '^':
+      return regex_add_node (ps, REGEX_NODE_BOL, 0, 0);
+    case '$':
+      return regex_add_node (ps, REGEX_NODE_EOL, 0, 0);
+    case '*': case '+': case '?':
+      ps->error = "Nothing to repeat";
+      return -1;
+    case '\\':
+      {
+      if (ps->pos >= ps->len)
+        {
+        ps->error = "Trailing \\";
+        return -1;
+        }
+      c = ps->p[ps->pos++];
+      int node = regex_add_set (ps);
+      unsigned char *bits = regex_set_bits (ps, node);
+      if (!regex_set_escape (bits, c))
+        {
+        c = regex_escape_char (c);
+        regex_set_add (bits, c, c);
+        }
+      return node;
+      }
+    }
+  int node = regex_add_set (ps);
+  regex_set_add (regex_set_bits (ps, node), c, c);
+  return node;
+  }
+
+/*===========================================================================
+
+  regex_parse_repeat
+
+  An atom, and any * + ? or {} after it
+
+===========================================================================*/
+static int regex_parse_repeat (RegexParser *ps)
+  {
+  int node = regex_parse_atom (ps);
+  while (node >= 0 && ps->pos < ps->len)
+    {
+    int min, max;
+    int c = ps->p[ps->pos];
+    if (c == '*' || c == '+' || c == '?')
+      {
+      ps->pos++;
+      min = c == '+' ? 1 : 0;
+      max = c == '?' ? 1 : -1;
+      }
+    else if (c != '{' || !regex_parse_braces (ps, &min, &max))
+      break;
+    if (min > REGEX_MAX_REPEAT || max > REGEX_MAX_REPEAT
+        || (max >= 0 && max < min))
+      {
+      ps->error = "Bad repeat count";
+      return -1;
+      }
+    int repeat = regex_add_node (ps, REGEX_NODE_REPEAT, node, 0);
+    ps->nodes[repeat].min = min;
+    ps->nodes[repeat].max = max;
+    node = repeat;
+    }
+  return node;
+  }
+
+/*===========================================================================
+
+  regex_parse_cat
+
+  Atoms one after another, up to a | or ) or the end
+
+===========================================================================*/
+static int regex_parse_cat (RegexParser *ps)
+  {
+  int node = -1;
+  while (ps->pos < ps->len && ps->p[ps->pos] != '|'
+       && ps->p[ps->pos] != ')')
+    {
+    int next = regex_parse_repeat (ps);
+    if (next < 0) return -1;
+    node = node < 0 ? next : regex_add_node (ps, REGEX_NODE_CAT, node, next);
+    }
+  if (node < 0) node = regex_add_node (ps, REGEX_NODE_EMPTY, 0, 0);
+  return node;
+  }
+
+/*===========================================================================
+
+  regex_parse_alt
+
+===========================================================================*/
+static int regex_parse_alt (RegexParser *ps)
+  {
+  int node = regex_parse_cat (ps);
+  while (node >= 0 && ps->pos < ps->len && ps->p[ps->pos] == '|')
+    {
+    ps->pos++;
+    int next = regex_parse_cat (ps);
+    if (next < 0) return -1;
+    node = regex_add_node (ps, REGEX_NODE_ALT, node, next);
+    }
+  return node;
+  }
+
+/*===========================================================================
+
+  regex_add_state
+
+  Returns -1 if there are too many
+
+===========================================================================*/
+static int regex_add_state (Regex *self, RegexStateType type, int set)
+  {
+  if (self->nstates == REGEX_MAX_NFA) return -1;
+  RegexState *state = &self->states[self->nstates];
+  state->type = type;
+  state->out = -1;
+  state->out1 = -1;
+  state->set = set;
+  return self->nstates++;
+  }
+
+/*===========================================================================
+
+  regex_gen
+
+  Make the NFA states for a node, reversed if 'reverse' is set. Each
+  part has a state it starts at, and one it ends at, whose out is to be
+  set to whatever comes after. Returns FALSE if there are too many
+  states
+
+===========================================================================*/
+static BOOL regex_gen (Regex *self, const RegexNode *nodes, int n,
+     BOOL reverse, int *start, int *end)
+  {
+  const RegexNode *node = &nodes[n];
+  int s1, e1, s2, e2;
+  switch (node->type)
+    {
+    case REGEX_NODE_SET:
+    case REGEX_NODE_BOL:
+    case REGEX_NODE_EOL:
+      {
+      RegexStateType type = REGEX_STATE_SET;
+      // Reversed, the start of the text is its end
+      if (node->type == REGEX_NODE_BOL)
+        type = reverse ? REGEX_STATE_EOL : REGEX_STATE_BOL;
+      if (node->type == REGEX_NODE_EOL)
+        type = reverse ? REGEX_STATE_BOL : REGEX_STATE_EOL;
+      *start = regex_add_state (self, type, node->a);
+      *end = regex_add_state (self, REGEX_STATE_EMPTY, 0);
+      if (*end < 0) return FALSE;
+      self->states[*start].out = *end;
+      return TRUE;
+      }
+    case REGEX_NODE_EMPTY:
+      *start = *end = regex_add_state (self, REGEX_STATE_EMPTY, 0);
+      return *start >= 0;
+    case REGEX_NODE_CAT:
+      if (!regex_gen (self, nodes, reverse ? node->b : node->a, reverse,
+            &s1, &e1)
+          || !regex_gen (self, nodes, reverse ? node->a : node->b, reverse,
+            &s2, &e2))
+        return FALSE;
+      self->states[e1].out = s2;
+      *start = s1;
+      *end = e2;
+      return TRUE;
+    case REGEX_NODE_ALT:
+      if (!regex_gen (self, nodes, node->a, reverse, &s1, &e1)
+          || !regex_gen (self, nodes, node->b, reverse, &s2, &e2))
+        return FALSE;
+      *start = regex_add_state (self, REGEX_STATE_SPLIT, 0);
+      *end = regex_add_state (self, REGEX_STATE_EMPTY, 0);
+      if (*end < 0) return FALSE;
+      self->states[*start].out = s1;
+      self->states[*start].out1 = s2;
+      self->states[e1].out = *end;
+      self->states[e2].out = *end;
+      return TRUE;
+    case REGEX_NODE_REPEAT:
+      {
+      // min copies, one after another, and then either a loop, or
+      //   max - min copies, each of which may be skipped to the end
+      *start = *end = regex_add_state (self, REGEX_STATE_EMPTY, 0);
+      if (*start < 0) return FALSE;
+      for (int i = 0; i < node->min; i++)
+        {
+        if (!regex_gen (self, nodes, node->a, reverse, &s1, &e1))
+          return FALSE;
+        self->states[*end].out = s1;
+        *end = e1;
+        }
+      int last = regex_add_state (self, REGEX_STATE_EMPTY, 0);
+      if (last < 0) return FALSE;
+      if (node->max < 0)
+        {
+        int split = regex_add_state (self, REGEX_STATE_SPLIT, 0);
+        if (split < 0
+            || !regex_gen (self, nodes, node->a, reverse, &s1, &e1))
+          return FALSE;
+        self->states[*end].out = split;
+        self->states[split].out = s1;
+        self->states[split].out1 = last;
+        self->states[e1].out = split;
+        }
+      else
+        {
+        for (int i = node->min; i < node->max; i++)
+          {
+          int split = regex_add_state (self, REGEX_STATE_SPLIT, 0);
+          if (split < 0
+              || !regex_gen (self, nodes, node->a, reverse, &s1, &e1))
+            return FALSE;
+          self->states[*end].out = split;
+          self->states[split].out = s1;
+          self->states[split].out1 = last;
+          *end = e1;
+          }
+        self->states[*end].out = last;
+        }
+      *end = last;
+      return TRUE;
+      }
+    }
+  return FALSE;
+  }
+
+/*===========================================================================
+
+  regex_make_classes
+
+  Split the bytes into classes, so that every set has either all or
+  none of the bytes of each class. Each set splits the classes there
+  are so far into the bytes in it, and those not
+
+===========================================================================*/
+static void regex_make_classes (Regex *self)
+  {
+  memset (self->cls, 0, 256);
+  self->ncls = 1;
+  int split[512];
+  for (int s = 0; s < self->nsets; s++)
+    {
+    const unsigned char *bits = self->sets + s * 32;
+    for (int i = 0; i < self->ncls * 2; i++) split[i] = -1;
+    int n = 0;
+    for (int c = 0; c < 256; c++)
+      {
+      int k = self->cls[c] * 2 + ((bits[c >> 3] >> (c & 7)) & 1);
+      if (split[k] < 0) split[k] = n++;
+      self->cls[c] = split[k];
+      }
+    self->ncls = n;
+    }
+  for (int c = 255; c >= 0; c--)
+    self->rep[self->cls[c]] = c;
+  self->shift = 0;
+  while ((1 << self->shift) < self->ncls) self->shift++;
+  }
+
+/*===========================================================================
+
+  regex_dfa_reset
+
+  Throw away all the states of a DFA
+
+===========================================================================*/
+static void regex_dfa_reset (RegexDfa *dfa)
+  {
+  dfa->nstates = 0;
+  dfa->pool_len = 0;
+  dfa->resets++;
+  for (int i = 0; i < REGEX_HASH_SIZE; i++) dfa->hash[i] = -1;
+  dfa->begin[0] = dfa->begin[1] = REGEX_UNKNOWN;
+  }
+
+/*===========================================================================
+
+  regex_dfa_init
+
+===========================================================================*/
+static void regex_dfa_init (Regex *self, RegexDfa *dfa, int start,
+     BOOL unanchored)
+  {
+  dfa->start = start;
+  dfa->unanchored = unanchored;
+  dfa->states = malloc (REGEX_DFA_STATES * sizeof (RegexDfaState));
+  dfa->trans = malloc ((REGEX_DFA_STATES << self->shift) * sizeof (int));
+  dfa->pool_size = 256;
+  dfa->pool = malloc (dfa->pool_size * sizeof (int));
+  regex_dfa_reset (dfa);
+  }
+
+/*===========================================================================
+
+  regex_follow
+
+  Add to the set the NFA states that can be reached from state s
+  without consuming a byte: those that consume one, and the match, and
+  the end-of-text assertions, which are passed only when the set is
+  made for the end. The start-of-text assertions are passed if 'bol' is
+  set, and otherwise lead nowhere. Returns the new size of the set
+
+===========================================================================*/
+static int regex_follow (Regex *self, int s, BOOL bol, BOOL eol, int n)
+  {
+  int sp = 0;
+  self->stack[sp++] = s;
+  while (sp > 0)
+    {
+    s = self->stack[--sp];
+    if (s < 0 || self->mark[s] == self->gen) continue;
+    self->mark[s] = self->gen;
+    const RegexState *state = &self->states[s];
+    switch (state->type)
+      {
+      case REGEX_STATE_SET:
+      case REGEX_STATE_MATCH:
+        self->set[n++] = s;
+        break;
+      case REGEX_STATE_EOL:
+        if (eol)
+          self->stack[sp++] = state->out;
+        else
+          self->set[n++] = s;
+        break;
+      case REGEX_STATE_BOL:
+        if (bol) self->stack[sp++] = state->out;
+        break;
+      case REGEX_STATE_SPLIT:
+        self->stack[sp++] = state->out1;
+        self->stack[sp++] = state->out;
+        break;
+      case REGEX_STATE_EMPTY:
+        self->stack[sp++] = state->out;
+        break;
+      }
+    }
+  return n;
+  }
+
+/*===========================================================================
+
+  regex_match_end
+
+  Whether a DFA state is a match at the end of the text, going on past
+  any end assertions, and past start assertions if it is at the start
+  as well
+
+===========================================================================*/
+static BOOL regex_match_end (Regex *self, const RegexDfa *dfa, 
+     const RegexDfaState *state, BOOL bol)
+  {
+  self->gen++;
+  int m = 0;
+  for (int i = 0; i < state->n; i++)
+    {
+    int s = dfa->pool[state->first + i];
+    if (self->states[s].type != REGEX_STATE_SET)
+      m = regex_follow (self, s, bol, TRUE, m);
+    }
+  for (int i = 0; i < m; i++)
+    if (self->states[self->set[i]].type == REGEX_STATE_MATCH) return TRUE;
+  return FALSE;
+  }
+
+/*===========================================================================
+
+  regex_dfa_add
+
+  The DFA state for the set of NFA states in self->set, made if there
+  isn't one already. If the DFA is full, all its states are thrown away
+  first
+
+===========================================================================*/
+static int regex_dfa_add (Regex *self, RegexDfa *dfa, int n)
+  {
+  int *set = self->set;
+  // In order, so that the same set is always the same
+  for (int i = 1; i < n; i++)
+    {
+    int v = set[i];
+    int j = i - 1;
+    while (j >= 0 && set[j] > v)
+      {
+      set[j + 1] = set[j];
+      j--;
+      }
+    set[j + 1] = v;
+    }
+  unsigned int hash = 2166136261u;
+  for (int i = 0; i < n; i++) hash = (hash ^ set[i]) * 16777619u;
+  for (int d = dfa->hash[hash % REGEX_HASH_SIZE]; d >= 0;
+        d = dfa->states[d].chain)
+    {
+    const RegexDfaState *state = &dfa->states[d];
+    if (state->hash == hash && state->n == n
+         && memcmp (dfa->pool + state->first, set, n * sizeof (int)) == 0)
+      return d;
+    }
+
+  if (dfa->nstates == REGEX_DFA_STATES) regex_dfa_reset (dfa);
+  if (dfa->pool_len + n > dfa->pool_size)
+    {
+    int size = dfa->pool_size * 2 + n;
+    dfa->pool = regex_grow (dfa->pool, dfa->pool_len, size, sizeof (int));
+    dfa->pool_size = size;
+    }
+  int d = dfa->nstates++;
+  RegexDfaState *state = &dfa->states[d];
+  state->first = dfa->pool_len;
+  state->n = n;
+  state->hash = hash;
+  state->chain = dfa->hash[hash % REGEX_HASH_SIZE];
+  dfa->hash[hash % REGEX_HASH_SIZE] = d;
+  memcpy (dfa->pool + dfa->pool_len, set, n * sizeof (int));
+  dfa->pool_len += n;
+  for (int i = 0; i < self->ncls; i++)
+    dfa->trans[(d << self->shift) + i] = REGEX_UNKNOWN;
+
+  // Whether it is a match, now, or at the end of the text, past any
+  //   end assertions
+  state->match = FALSE;
+  for (int i = 0; i < n; i++)
+    if (self->states[set[i]].type == REGEX_STATE_MATCH) state->match = TRUE;
+  state->match_end = regex_match_end (self, dfa, state, FALSE);
+  state->match_empty = regex_match_end (self, dfa, state, TRUE);
+  return d;
+  }
+
+/*===========================================================================
+
+  regex_dfa_begin
+
+  The state a DFA starts in, at the start of the text or not, as where
+  its transitions are
+
+===========================================================================*/
+static int regex_dfa_begin (Regex *self, RegexDfa *dfa, BOOL bol)
+  {
+  if (dfa->begin[bol] == REGEX_UNKNOWN)
+    {
+    self->gen++;
+    int n = regex_follow (self, dfa->start, bol, FALSE, 0);
+    int d = regex_dfa_add (self, dfa, n);
+    // Adding it may have emptied the DFA
+    dfa->begin[bol] = d;
+    }
+  return dfa->begin[bol] << self->shift;
+  }
+
+/*===========================================================================
+
+  regex_dfa_next
+
+  Work out the state that a byte of class c leads to from state d, and
+  return where its transitions are, with REGEX_MATCHING if it is a 
+  match
+
+===========================================================================*/
+static int regex_dfa_next (Regex *self, RegexDfa *dfa, int d, int c)
+  {
+  unsigned char b = self->rep[c];
+  self->gen++;
+  int n = 0;
+  const RegexDfaState *state = &dfa->states[d];
+  for (int i = 0; i < state->n; i++)
+    {
+    const RegexState *s = &self->states[dfa->pool[state->first + i]];
+    if (s->type == REGEX_STATE_SET
+         && (self->sets[s->set * 32 + (b >> 3)] >> (b & 7)) & 1)
+      n = regex_follow (self, s->out, FALSE, FALSE, n);
+    }
+  if (dfa->unanchored)
+    n = regex_follow (self, dfa->start, FALSE, FALSE, n);
+  if (n == 0)
+    {
+    dfa->trans[(d << self->shift) + c] = REGEX_DEAD;
+    return REGEX_DEAD;
+    }
+  int resets = dfa->resets;
+  int next = regex_dfa_add (self, dfa, n);
+  // If the DFA was emptied to make room, d is no more
+  BOOL match = dfa->states[next].match;
+  next <<= self->shift;
+  if (match) next |= REGEX_MATCHING;
+  if (dfa->resets == resets) dfa->trans[(d << self->shift) + c] = next;
+  return next;
+  }
+
+/*===========================================================================
+
+  regex_dfa_run
+
+  Run a DFA from the state whose transitions are at t, over the text
+  from position i to 'stop', forwards or backwards as dir is 1 or -1. 
+  Returns the last place where it was in a match, or if 'first' is set,
+  the first, or -1. Where it stops, the state it is in, or REGEX_DEAD,
+  is put in *end
+
+===========================================================================*/
+static inline int regex_dfa_run (Regex *self, RegexDfa *dfa, int t,
+     const unsigned char *s, int i, int stop, int dir, BOOL first, 
+     int *end)
+  {
+  const int *trans = dfa->trans;
+  const unsigned char *cls = self->cls;
+  int found = -1;
+  if (dfa->states[t >> self->shift].match)
+    {
+    found = i;
+    if (first) stop = i;
+    }
+  while (i != stop)
+    {
+    int c = cls[dir > 0 ? s[i] : s[i - 1]];
+    int next = trans[t + c];
+    i += dir;
+    // All that isn't a state that isn't a match is at or above this
+    if ((unsigned int)next >= REGEX_MATCHING)
+      {
+      if (next == REGEX_UNKNOWN) 
+        next = regex_dfa_next (self, dfa, t >> self->shift, c);
+      if (next == REGEX_DEAD)
+        {
+        t = REGEX_DEAD;
+        break;
+        }
+      if (next & REGEX_MATCHING)
+        {
+        next &= ~REGEX_MATCHING;
+        found = i;
+        if (first) stop = i;
+        }
+      }
+    t = next;
+    }
+  *end = t;
+  return found;
+  }
+
+/*===========================================================================
+
+  regex_at_end
+
+  Whether a DFA, in the state whose transitions are at t, is in a match
+  at the end of a line of len bytes, when it gets there
+
+===========================================================================*/
+static BOOL regex_at_end (const Regex *self, const RegexDfa *dfa, int t,
+     int len)
+  {
+  if (t == REGEX_DEAD) return FALSE;
+  const RegexDfaState *state = &dfa->states[t >> self->shift];
+  return len == 0 ? state->match_empty : state->match_end;
+  }
+
+/*===========================================================================
+
+  regex_join
+
+  Put text b after text a, and keep no more than REGEX_MAX_LITERAL
+  bytes of the result, from its start, or from its end if 'tail' is set.
+  Returns FALSE if some had to be dropped
+
+===========================================================================*/
+static BOOL regex_join (unsigned char *out, int *out_len, 
+     const unsigned char *a, int a_len, const unsigned char *b, int b_len,
+     BOOL tail)
+  {
+  unsigned char buf[2 * REGEX_MAX_LITERAL];
+  memcpy (buf, a, a_len);
+  memcpy (buf + a_len, b, b_len);
+  int len = a_len + b_len;
+  int n = len < REGEX_MAX_LITERAL ? len : REGEX_MAX_LITERAL;
+  memcpy (out, tail ? buf + len - n : buf, n);
+  *out_len = n;
+  return n == len;
+  }
+
+/*===========================================================================
+
+  regex_rarity
+
+  How good a piece of text is to look for, to find the few lines that 
+  might match: longer is better, and other bytes are taken to be less 
+  common than lower-case letters and spaces
+
+===========================================================================*/
+static int regex_rarity (const unsigned char *s, int len)
+  {
+  int ret = 0;
+  for (int i = 0; i < len; i++)
+    ret += (s[i] >= 'a' && s[i] <= 'z') || s[i] == ' ' ? 1 : 2;
+  return ret;
+  }
+
+/*===========================================================================
+
+  regex_literal
+
+  Work out what text a node always matches, as a RegexLiteral. Only a
+  set of one byte, and parts made of them one after another, match any
+  text exactly; anything that can be left out, or matched in more than
+  one way, breaks the text up
+
+===========================================================================*/
+static void regex_literal (const Regex *self, const RegexNode *nodes, int n,
+     RegexLiteral *lit)
+  {
+  const RegexNode *node = &nodes[n];
+  lit->exact = FALSE;
+  lit->prefix_len = lit->suffix_len = lit->best_len = 0;
+  switch (node->type)
+    {
+    case REGEX_NODE_SET:
+      {
+      const unsigned char *set = self->sets + node->a * 32;
+      int count = 0;
+      int byte = 0;
+      for (int c = 0; c < 256; c++)
+        if (set[c >> 3] & (1 << (c & 7)))
+          {
+          count++;
+          byte = c;
+          }
+      if (count == 1)
+        {
+        lit->exact = TRUE;
+        lit->prefix[0] = lit->suffix[0] = lit->best[0] = byte;
+        lit->prefix_len = lit->suffix_len = lit->best_len = 1;
+        }
+      break;
+      }
+    case REGEX_NODE_EMPTY:
+    case REGEX_NODE_BOL:
+    case REGEX_NODE_EOL:
+      lit->exact = TRUE;
+      break;
+    case REGEX_NODE_CAT:
+      {
+      RegexLiteral a, b;
+      regex_literal (self, nodes, node->a, &a);
+      regex_literal (self, nodes, node->b, &b);
+      BOOL whole = regex_join (lit->prefix, &lit->prefix_len, a.prefix, 
+        a.prefix_len, a.exact ? b.prefix : NULL, a.exact ? b.prefix_len : 0,
+        FALSE);
+      regex_join (lit->suffix, &lit->suffix_len, b.exact ? a.suffix : NULL,
+        b.exact ? a.suffix_len : 0, b.suffix, b.suffix_len, TRUE);
+      lit->exact = a.exact && b.exact && whole;
+      // The best of what each includes, and what spans the two
+      regex_join (lit->best, &lit->best_len, a.suffix, a.suffix_len,
+        b.prefix, b.prefix_len, FALSE);
+      int rarity = regex_rarity (lit->best, lit->best_len);
+      if (regex_rarity (a.best, a.best_len) > rarity)
+        {
+        memcpy (lit->best, a.best, a.best_len);
+        lit->best_len = a.best_len;
+        rarity = regex_rarity (a.best, a.best_len);
+        }
+      if (regex_rarity (b.best, b.best_len) > rarity)
+        {
+        memcpy (lit->best, b.best, b.best_len);
+        lit->best_len = b.best_len;
+        }
+      break;
+      }
+    case REGEX_NODE_REPEAT:
+      if (node->min > 0)
+        {
+        RegexLiteral a;
+        regex_literal (self, nodes, node->a, &a);
+        lit->exact = a.exact && node->min == 1 && node->max == 1;
+        memcpy (lit->prefix, a.prefix, a.prefix_len);
+        lit->prefix_len = a.prefix_len;
+        memcpy (lit->suffix, a.suffix, a.suffix_len);
+        lit->suffix_len = a.suffix_len;
+        memcpy (lit->best, a.best, a.best_len);
+        lit->best_len = a.best_len;
+        }
+      break;
+    case REGEX_NODE_ALT:
+      break;
+    }
+  }
+
+/*===========================================================================
+
+  regex_compile
+
+===========================================================================*/
+Regex *regex_compile (const char *pattern, int len, const char **error)
+  {
+  Regex *self = malloc (sizeof (Regex));
+  memset (self, 0, sizeof (Regex));
+  RegexParser ps;
+  memset (&ps, 0, sizeof (ps));
+  ps.p = (const unsigned char *)pattern;
+  ps.len = len;
+  ps.re = self;
+  int root = regex_parse_alt (&ps);
+  if (root >= 0 && ps.pos < ps.len) ps.error = "Unmatched )";
+
+  if (!ps.error)
+    {
+    self->states = malloc (REGEX_MAX_NFA * sizeof (RegexState));
+    int s, e, rs, re;
+    if (regex_gen (self, ps.nodes, root, FALSE, &s, &e)
+        && regex_gen (self, ps.nodes, root, TRUE, &rs, &re))
+      {
+      int match = regex_add_state (self, REGEX_STATE_MATCH, 0);
+      int rmatch = regex_add_state (self, REGEX_STATE_MATCH, 0);
+      if (rmatch < 0)
+        ps.error = "Pattern too big";
+      else
+        {
+        self->states[e].out = match;
+        self->states[re].out = rmatch;
+        regex_make_classes (self);
+        self->mark = malloc (self->nstates * sizeof (int));
+        memset (self->mark, 0, self->nstates * sizeof (int));
+        // A state is pushed once for each way into it
+        self->stack = malloc ((2 * self->nstates + 1) * sizeof (int));
+        self->set = malloc (self->nstates * sizeof (int));
+        regex_dfa_init (self, &self->fwd, s, FALSE);
+        regex_dfa_init (self, &self->rev, rs, TRUE);
+        regex_dfa_init (self, &self->any, s, TRUE);
+        RegexLiteral lit;
+        regex_literal (self, ps.nodes, root, &lit);
+        memcpy (self->literal, lit.best, lit.best_len);
+        self->literal_len = lit.best_len;
+        }
+      }
+    else
+      ps.error = "Pattern too big";
+    }
+  if (ps.nodes) free (ps.nodes);
+  if (ps.error)
+    {
+    *error = ps.error;
+    regex_destroy (self);
+    return NULL;
+    }
+  return self;
+  }
+
+/*===========================================================================
+
+  regex_destroy
+
+===========================================================================*/
+void regex_destroy (Regex *self)
+  {
+  if (self)
+    {
+    RegexDfa *dfas[3] = { &self->fwd, &self->rev, &self->any };
+    for (int i = 0; i < 3; i++)
+      {
+      if (dfas[i]->states) free (dfas[i]->states);
+      if (dfas[i]->trans) free (dfas[i]->trans);
+      if (dfas[i]->pool) free (dfas[i]->pool);
+      }
+    if (self->states) free (self->states);
+    if (self->sets) free (self->sets);
+    if (self->mark) free (self->mark);
+    if (self->stack) free (self->stack);
+    if (self->set) free (self->set);
+    if (self->starts) free (self->starts);
+    free (self);
+    }
+  }
+
+/*===========================================================================
+
+  regex_get_literal
+
+===========================================================================*/
+const char *regex_get_literal (const Regex *self, int *len)
+  {
+  *len = self->literal_len;
+  return self->literal_len > 0 ? (const char *)self->literal : NULL;
+  }
+
+/*===========================================================================
+
+  regex_set_line
+
+===========================================================================*/
+void regex_set_line (Regex *self, const char *line, int len)
+  {
+  self->line = line;
+  self->line_len = len;
+  self->have_starts = FALSE;
+  }
+
+/*===========================================================================
+
+  regex_find_starts
+
+  Run the reversed DFA back from the end of the set line to its start,
+  or until there can be no more matches, and note each place that it is
+  in a match, which is where a match starts. This is regex_dfa_run, 
+  noting every match, not only the last
+
+===========================================================================*/
+static void regex_find_starts (Regex *self)
+  {
+  const unsigned char *s = (const unsigned char *)self->line;
+  int len = self->line_len;
+  int words = len / REGEX_WORD_BITS + 1;
+  if (words > self->starts_size)
+    {
+    if (self->starts) free (self->starts);
+    self->starts_size = words > self->starts_size * 2 
+      ? words : self->starts_size * 2;
+    self->starts = malloc (self->starts_size * sizeof (unsigned long));
+    }
+  unsigned long *starts = self->starts;
+  memset (starts, 0, words * sizeof (unsigned long));
+
+  RegexDfa *dfa = &self->rev;
+  const unsigned char *cls = self->cls;
+  int t = regex_dfa_begin (self, dfa, TRUE);
+  int i = len;
+  if (dfa->states[t >> self->shift].match)
+    starts[i / REGEX_WORD_BITS] |= 1UL << (i % REGEX_WORD_BITS);
+  while (i > 0)
+    {
+    int c = cls[s[i - 1]];
+    int next = dfa->trans[t + c];
+    i--;
+    if ((unsigned int)next >= REGEX_MATCHING)
+      {
+      if (next == REGEX_UNKNOWN) 
+        next = regex_dfa_next (self, dfa, t >> self->shift, c);
+      if (next == REGEX_DEAD)
+        {
+        t = REGEX_DEAD;
+        break;
+        }
+      if (next & REGEX_MATCHING)
+        {
+        next &= ~REGEX_MATCHING;
+        starts[i / REGEX_WORD_BITS] |= 1UL << (i % REGEX_WORD_BITS);
+        }
+      }
+    t = next;
+    }
+  // Only a DFA that got to the start of the line is not dead
+  if (regex_at_end (self, dfa, t, len)) starts[0] |= 1;
+  self->have_starts = TRUE;
+  }
+
+/*===========================================================================
+
+  regex_next_start
+
+  The first place at or after 'from' in the set line that a match 
+  starts, or -1. A word at a time, so a line with few matches is looked
+  through quickly
+
+===========================================================================*/
+static int regex_next_start (const Regex *self, int from)
+  {
+  int words = self->line_len / REGEX_WORD_BITS + 1;
+  int w = from / REGEX_WORD_BITS;
+  unsigned long bits = self->starts[w] >> (from % REGEX_WORD_BITS);
+  int at = from;
+  if (bits == 0)
+    {
+    do
+      {
+      if (++w == words) return -1;
+      }
+    while (self->starts[w] == 0);
+    bits = self->starts[w];
+    at = w * REGEX_WORD_BITS;
+    }
+  while (!(bits & 1))
+    {
+    bits >>= 1;
+    at++;
+    }
+  return at;
+  }
+
+/*===========================================================================
+
+  regex_longest
+
+  The length of the longest match that starts at 'start', which one is
+  known to
+
+===========================================================================*/
+static int regex_longest (Regex *self, const unsigned char *s, int len,
+     int start)
+  {
+  int t;
+  RegexDfa *dfa = &self->fwd;
+  int end = regex_dfa_run (self, dfa, regex_dfa_begin (self, dfa, 
+    start == 0), s, start, len, 1, FALSE, &t);
+  if (regex_at_end (self, dfa, t, len)) end = len;
+  if (end < 0) end = start;
+  return end - start;
+  }
+
+/*===========================================================================
+
+  regex_search
+
+===========================================================================*/
+int regex_search (Regex *self, const char *line, int len, int from,
+     int *match_len)
+  {
+  const unsigned char *s = (const unsigned char *)line;
+  if (from < 0) from = 0;
+  if (from > len) return -1;
+  BOOL set = line == self->line && len == self->line_len;
+
+  // Whether there is a match, going no further than the end of the 
+  //   first one to end. Once the places where matches start in the set
+  //   line are known, that says
+  int t;
+  RegexDfa *dfa = &self->any;
+  if (!(set && self->have_starts)
+      && regex_dfa_run (self, dfa, regex_dfa_begin (self, dfa, from == 0),
+        s, from, len, 1, TRUE, &t) < 0 
+      && !regex_at_end (self, dfa, t, len))
+    return -1;
+
+  // Back from the end of the line, to find where the first match starts.
+  //   The end of the line is the start of the reversed text, and the
+  //   start of the line its end, if the search goes back that far
+  int start;
+  if (set)
+    {
+    if (!self->have_starts) regex_find_starts (self);
+    start = regex_next_start (self, from);
+    }
+  else
+    {
+    dfa = &self->rev;
+    start = regex_dfa_run (self, dfa, regex_dfa_begin (self, dfa, TRUE),
+      s, len, from, -1, FALSE, &t);
+    if (from == 0 && regex_at_end (self, dfa, t, len)) start = 0;
+    }
+  if (start < 0) return -1;
+  *match_len = regex_longest (self, s, len, start);
+  return start;
+  }
+
+/*===========================================================================
+
+  regex_search_back
+
+  The places where matches start are found as for a set line, and
+  forgotten after, unless it is the set line
+
+===========================================================================*/
+int regex_search_back (Regex *self, const char *line, int len, int to,
+     int *match_len)
+  {
+  if (to < 0) return -1;
+  if (to > len) to = len;
+  BOOL set = line == self->line && len == self->line_len;
+  if (!set) regex_set_line (self, line, len);
+  if (!self->have_starts) regex_find_starts (self);
+
+  // Back a word at a time from 'to'
+  int w = to / REGEX_WORD_BITS;
+  int at = to;
+  unsigned long bits = self->starts[w] 
+    << (REGEX_WORD_BITS - 1 - to % REGEX_WORD_BITS);
+  if (bits == 0)
+    {
+    do
+      {
+      if (--w < 0) break;
+      }
+    while (self->starts[w] == 0);
+    at = w * REGEX_WORD_BITS + REGEX_WORD_BITS - 1;
+    bits = w < 0 ? 0 : self->starts[w];
+    }
+  if (!set) regex_set_line (self, NULL, 0);
+  if (bits == 0) return -1;
+  unsigned long top = 1UL << (REGEX_WORD_BITS - 1);
+  while (!(bits & top))
+    {
+    bits <<= 1;
+    at--;
+    }
+  *match_len = regex_longest (self, (const unsigned char *)line, len, at);
+  return at;
+  }
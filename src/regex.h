@@ -0,0 +1,50 @@
+/*===========================================================================
+
+  bute -- barely useful text editor
+
+  regex.h
+
+  Copyright (c)2020 Kevin Boone. Distributed uner the terms of the
+    GNU PUblic Licence, v3.0
+
+===========================================================================*/
+#pragma once
+
+#include "cnolib.h"
+
+// A compiled regular expression, in the extended (egrep) syntax:
+//   . [] [^] ^ $ * + ? {m,n} | (), with \s \d \w (and \S \D \W) for
+//   spaces, digits and word characters, and [:space:] and so on in
+//   brackets. Characters are bytes. The pattern is run by a DFA that
+//   is built as it is needed, so the time taken is in proportion to
+//   the length of the text, whatever the pattern. It is not safe to
+//   use one Regex on more than one thread at once
+struct _Regex;
+typedef struct _Regex Regex;
+
+// Compile a pattern of len bytes, which need not be null-terminated.
+//   Returns NULL, and a message in *error, if it is not valid
+extern Regex      *regex_compile (const char *pattern, int len,
+                     const char **error);
+extern void        regex_destroy (Regex *self);
+// Text that every match includes, so that text without it can be
+//   passed over, and its length in *len; or NULL if there is none
+extern const char *regex_get_literal (const Regex *self, int *len);
+
+// The first match in a line of len bytes that starts at or after
+//   'from', the longest if more than one starts there. Returns its
+//   start, and its length in *match_len, or -1 if there is none. ^ and
+//   $ match at the start and end of the line
+extern int         regex_search (Regex *self, const char *line, int len,
+                     int from, int *match_len);
+// The last match in a line of len bytes that starts at or before 'to',
+//   the longest that starts there, as regex_search finds it
+extern int         regex_search_back (Regex *self, const char *line,
+                     int len, int to, int *match_len);
+// Set a line of len bytes to be searched for one match after another.
+//   The first search in it finds where all its matches start, so that
+//   each search after that need not go back from the end of the line.
+//   The line must not change while it is set; set NULL when done with
+//   it
+extern void        regex_set_line (Regex *self, const char *line, int len);
+
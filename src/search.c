@@ -0,0 +1,1006 @@
+/*===========================================================================
+
+  bute
+
+  search.c
+
+  Copyright (c)2020 Kevin Boone. Distributed uner the terms of the
+    GNU PUblic Licence, v3.0
+
+  Looking for a piece of text in the lines of a file, where they are,
+  without copying them. A line is looked through a machine word at a
+  time: each step compares eight (or four) places at once with the
+  first byte of the pattern, and the places pattern-length bytes on
+  with its last byte, and only a place where both are the same is
+  compared with the rest of the pattern. For most patterns that is
+  seldom, so the cost is near that of reading the line. What is left at
+  the end of the line, too short for a word, is looked through by
+  Boyer-Moore-Horspool, which skips along by as much as the last byte
+  of the place it has tried allows.
+
+  A regular expression is looked for with its own matcher, a line at a
+  time, since ^ and $ need to know where the lines start and end. If
+  every match must include some text as it is, that is looked for
+  first, in the same way as any other, and the matcher is run only on 
+  the lines that have it.
+
+  A file is looked through in pieces of a block, or of SEARCH_LINES
+  lines or about SEARCH_PIECE_BYTES, whichever is less. The piece that
+  the search starts in is looked through first, on this thread, since 
+  that is often where the match is. The rest are shared among several
+  threads, each taking the next piece in the direction of the search
+  when it is done with the one before. A thread that finds a match 
+  says so, and the others stop when the piece they would take next is
+  after it, so the first match is the one found, whichever thread is
+  quickest. Each thread needs its own copy of a regular expression, 
+  since its DFA is built as it is run. A large file is looked through
+  a few pieces to each thread at a time, and the blocks read for them
+  are dropped after each round.
+
+===========================================================================*/
+#include "cnolib.h"
+#include "search.h"
+#include "regex.h"
+
+// A machine word, which may be read from memory that holds chars, and
+//   one that may be read from any address. Both ARM and AMD64 can read
+//   words that are not aligned, if not as quickly
+typedef unsigned long Word __attribute__ ((__may_alias__));
+typedef struct _UnalignedWord
+  {
+  Word w;
+  } __attribute__ ((__packed__, __may_alias__)) UnalignedWord;
+// A word with each byte set to one, and to 0x80
+#define WORD_ONES ((unsigned long)-1 / 0xFF)
+#define WORD_HIGHS (WORD_ONES * 0x80)
+// Non-zero if any byte of w is zero. Every zero byte has its top bit
+//   set in the result, but so may a byte above one
+#define WORD_HAS_ZERO(w) (((w) - WORD_ONES) & ~(w) & WORD_HIGHS)
+
+// A file is looked through this many lines at a time, and no more than
+//   this much of it as one piece
+#define SEARCH_LINES 4096
+#define SEARCH_MAX_RUN (1 << 28)
+// The most a piece that one thread looks through is, in bytes, as far
+//   as that can be told from where the lines are; and the most threads
+#define SEARCH_PIECE_BYTES (1024 * 1024)
+#define SEARCH_MAX_THREADS 64
+// The pieces of a file that are shared among the threads at a time:
+//   all of them, up to SEARCH_ROUND_MAX, for a file that is all in 
+//   memory, and this many to a thread for a large one
+#define SEARCH_ROUND_MAX 1024
+#define SEARCH_ROUND_PIECES 2
+
+struct _Search
+  {
+  unsigned char *pattern;
+  int len;
+  // The first and last bytes of the pattern, in every byte of a word
+  Word first;
+  Word last;
+  // How far along a failed place can move, for each byte that might be
+  //   under the last byte of the pattern
+  int skip[256];
+  // The compiled pattern, if it is a regular expression, and the text
+  //   that every match of it includes, if there is any
+  Regex *regex;
+  struct _Search *literal;
+  // The threads to look through a file with, zero for one per 
+  //   processor, and the copies of a regular expression that the
+  //   threads after the first use, made when they are first needed
+  int threads;
+  struct _Search **copies;
+  };
+
+// Lines a to b of a file, all in one block, for one thread to look 
+//   through, with the position in line a to start from and in line b
+//   to end at, as search_lines takes them; and the match found in them,
+//   if any, with row set to -1 if there is none. When the lines with
+//   matches are wanted, they are put in rows, and how many matches
+//   each has in counts
+typedef struct _SearchPiece
+  {
+  int a;
+  int b;
+  int from;
+  int to;
+  int row;
+  int col;
+  int match_len;
+  int *rows;
+  int *counts;
+  int nrows;
+  } SearchPiece;
+
+// Pieces shared among threads: the next to be taken, and the first 
+//   that a match has been found in so far, or npieces. With 'count' 
+//   set, every match is counted, instead, and with 'rows' set too, 
+//   the lines they are in are noted
+typedef struct _SearchJob
+  {
+  TextFile *text_file;
+  BOOL back;
+  BOOL count;
+  BOOL rows;
+  SearchPiece *pieces;
+  int npieces;
+  int next;
+  int found;
+  } SearchJob;
+
+// What one thread looks with, and how many matches it has counted
+typedef struct _SearchWorker
+  {
+  SearchJob *job;
+  Search *search;
+  long count;
+  } SearchWorker;
+
+/*===========================================================================
+
+  search_create
+
+===========================================================================*/
+Search *search_create (const char *pattern, int len)
+  {
+  Search *self = malloc (sizeof (Search));
+  self->pattern = malloc (len + 1);
+  memcpy (self->pattern, pattern, len);
+  self->pattern[len] = 0;
+  self->len = len;
+  if (len > 0)
+    {
+    self->first = WORD_ONES * self->pattern[0];
+    self->last = WORD_ONES * self->pattern[len - 1];
+    }
+  for (int i = 0; i < 256; i++)
+    self->skip[i] = len > 0 ? len : 1;
+  for (int i = 0; i < len - 1; i++)
+    self->skip[self->pattern[i]] = len - 1 - i;
+  self->regex = NULL;
+  self->literal = NULL;
+  self->threads = 0;
+  self->copies = NULL;
+  return self;
+  }
+
+/*===========================================================================
+
+  search_create_regex
+
+===========================================================================*/
+Search *search_create_regex (const char *pattern, int len, 
+     const char **error)
+  {
+  Regex *regex = regex_compile (pattern, len, error);
+  if (!regex) return NULL;
+  Search *self = search_create (pattern, len);
+  self->regex = regex;
+  int n;
+  const char *literal = regex_get_literal (regex, &n);
+  if (literal) self->literal = search_create (literal, n);
+  return self;
+  }
+
+/*===========================================================================
+
+  search_destroy
+
+===========================================================================*/
+void search_destroy (Search *self)
+  {
+  if (self)
+    {
+    if (self->regex) regex_destroy (self->regex);
+    search_destroy (self->literal);
+    if (self->copies)
+      {
+      for (int i = 0; i < SEARCH_MAX_THREADS; i++)
+        search_destroy (self->copies[i]);
+      free (self->copies);
+      }
+    free (self->pattern);
+    free (self);
+    }
+  }
+
+/*===========================================================================
+
+  search_set_threads
+
+===========================================================================*/
+void search_set_threads (Search *self, int threads)
+  {
+  self->threads = threads;
+  }
+
+/*===========================================================================
+
+  search_strlen
+
+  The length of a line, looked through a word at a time once it is on a
+  word boundary. An aligned word never crosses into a page that might
+  not be mapped, even if it includes the terminating null
+
+===========================================================================*/
+static int search_strlen (const char *s)
+  {
+  const char *p = s;
+  while (((unsigned long)p & (sizeof (Word) - 1)) != 0)
+    {
+    if (*p == 0) return p - s;
+    p++;
+    }
+  while (!WORD_HAS_ZERO (*(const Word *)p)) p += sizeof (Word);
+  while (*p) p++;
+  return p - s;
+  }
+
+/*===========================================================================
+
+  search_matches
+
+  Whether the pattern is at s, when its first and last bytes are known
+  to be. The rest is compared from the end, as Horspool does
+
+===========================================================================*/
+static inline BOOL search_matches (const Search *self,
+     const unsigned char *s)
+  {
+  for (int j = self->len - 2; j > 0; j--)
+    if (s[j] != self->pattern[j]) return FALSE;
+  return TRUE;
+  }
+
+/*===========================================================================
+
+  search_literal
+
+  The first place at or after 'from' that the pattern is, taken as it
+  is
+
+===========================================================================*/
+static int search_literal (const Search *self, const char *line, int len, 
+     int from)
+  {
+  const unsigned char *s = (const unsigned char *)line;
+  const unsigned char *p = self->pattern;
+  int m = self->len;
+  if (from < 0) from = 0;
+  if (m == 0) return from <= len ? from : -1;
+  int i = from;
+
+  // A word from each place, and from pattern-length bytes on, so long
+  //   as both are within the line
+  while (i + m - 1 + (int)sizeof (Word) <= len)
+    {
+    Word a = ((const UnalignedWord *)(s + i))->w ^ self->first;
+    Word b = ((const UnalignedWord *)(s + i + m - 1))->w ^ self->last;
+    if (WORD_HAS_ZERO (a) && WORD_HAS_ZERO (b))
+      {
+      // Which bytes those were depends on the order of bytes in a word,
+      //   and the test can mark one that isn't, so they are looked at
+      //   again
+      for (int k = 0; k < (int)sizeof (Word); k++)
+        {
+        if (s[i + k] == p[0] && s[i + k + m - 1] == p[m - 1]
+             && search_matches (self, s + i + k))
+          return i + k;
+        }
+      }
+    i += sizeof (Word);
+    }
+
+  // Boyer-Moore-Horspool for the rest
+  while (i + m <= len)
+    {
+    unsigned char c = s[i + m - 1];
+    if (c == p[m - 1] && s[i] == p[0] && search_matches (self, s + i))
+      return i;
+    i += self->skip[c];
+    }
+  return -1;
+  }
+
+/*===========================================================================
+
+  search_line
+
+===========================================================================*/
+int search_line (const Search *self, const char *line, int len, int from,
+     int *match_len)
+  {
+  if (from < 0) from = 0;
+  if (self->regex)
+    {
+    if (from > len) return -1;
+    return regex_search (self->regex, line, len, from, match_len);
+    }
+  *match_len = self->len;
+  return search_literal (self, line, len, from);
+  }
+
+/*===========================================================================
+
+  search_set_line
+
+===========================================================================*/
+void search_set_line (const Search *self, const char *line, int len)
+  {
+  if (self->regex) regex_set_line (self->regex, line, len);
+  }
+
+/*===========================================================================
+
+  search_line_back
+
+  Matches are found from the start of the line, and the last one kept.
+  Text taken as it is need be looked through no further than a match 
+  that starts at 'to' could reach. A regular expression may need to 
+  know where the line ends, and finds where all its matches start in
+  one go back over the line
+
+===========================================================================*/
+int search_line_back (const Search *self, const char *line, int len, int to,
+     int *match_len)
+  {
+  if (to < 0) return -1;
+  if (self->regex)
+    return regex_search_back (self->regex, line, len, to, match_len);
+  if (to < len - self->len) len = to + self->len;
+  int ret = -1;
+  int n;
+  int at = search_line (self, line, len, 0, &n);
+  while (at >= 0 && at <= to)
+    {
+    ret = at;
+    *match_len = n;
+    at = search_line (self, line, len, at + 1, &n);
+    }
+  return ret;
+  }
+
+/*===========================================================================
+
+  search_regex_line
+
+  Look for a regular expression in line k, of lines a to b, as 
+  search_lines does. Returns its position, or -1
+
+===========================================================================*/
+static int search_regex_line (const Search *self, const char *line, int len,
+     int k, int a, int b, int from, int to, BOOL last, int *match_len)
+  {
+  int at;
+  if (!last)
+    {
+    at = search_line (self, line, len, k == a ? from : 0, match_len);
+    if (k == b && at > to) at = -1;
+    }
+  else
+    {
+    at = search_line_back (self, line, len, k == b ? to : len, match_len);
+    if (k == a && at < from) at = -1;
+    }
+  return at;
+  }
+
+/*===========================================================================
+
+  search_lines
+
+  Look through lines a to b of a block, for the first match, or the
+  last if 'last' is set, but in line a only from position 'from', and in
+  line b only up to 'to'. Lines that follow one another in the text the
+  block was read as are looked through as one piece, so that there is
+  no cost for each line, except where there is a match; the text 
+  between them may include some that is no longer part of a line, and 
+  a match in that is passed over. Returns the line of the match, and 
+  its position in *col and length in *match_len, or -1. 
+
+  For a regular expression, it is the text that every match includes
+  that is looked for, and the line it is found in is looked at with the
+  expression, and passed over if that doesn't match
+
+===========================================================================*/
+static int search_lines (const Search *self, const char * const *lines, 
+     int a, int b, int from, int to, BOOL last, const char *text, 
+     size_t text_len, int *col, int *match_len)
+  {
+  const Search *literal = self->regex ? self->literal : self;
+  int m = literal->len;
+  int ret = -1;
+  // The line that the last match was in, and its length
+  int in = -1;
+  int in_len = 0;
+  // Starting beyond the end of line a would be starting in the next
+  int len_a = search_strlen (lines[a]);
+  if (from > len_a) from = len_a;
+  int k = a;
+  while (k <= b)
+    {
+    const char *start = lines[k];
+    int j = k;
+    if (text && start >= text && start <= text + text_len)
+      {
+      while (j < b && lines[j + 1] > lines[j] 
+          && lines[j + 1] <= text + text_len
+          && lines[j + 1] - start < SEARCH_MAX_RUN)
+        j++;
+      }
+    // A match of an expression that starts before 'to' may go on to 
+    //   include the text after it
+    const char *end = lines[j] + search_strlen (lines[j]);
+    if (j == b && !self->regex && end - lines[j] - m > to) 
+      end = lines[j] + to + m;
+    int len = end - start;
+    int pos = k == a ? from : 0;
+    int at;
+    while ((at = search_literal (literal, start, len, pos)) >= 0)
+      {
+      // The line that the match starts in is the last one to start at
+      //   or before it
+      const char *p = start + at;
+      int lo = k;
+      int hi = j;
+      while (lo < hi)
+        {
+        int mid = (lo + hi + 1) / 2;
+        if (lines[mid] <= p)
+          lo = mid;
+        else
+          hi = mid - 1;
+        }
+      if (lo != in)
+        {
+        in = lo;
+        in_len = search_strlen (lines[lo]);
+        }
+      pos = at + 1;
+      if (p - lines[lo] + m <= in_len)
+        {
+        int c = p - lines[lo];
+        int n = m;
+        if (self->regex)
+          {
+          c = search_regex_line (self, lines[lo], in_len, lo, a, b, from,
+            to, last, &n);
+          // Either way, that line is done with
+          pos = lines[lo] + in_len + 1 - start;
+          }
+        if (c >= 0)
+          {
+          ret = lo;
+          *col = c;
+          *match_len = n;
+          if (!last) return ret;
+          }
+        }
+      }
+    k = j + 1;
+    }
+  return ret;
+  }
+
+/*===========================================================================
+
+  search_lines_regex
+
+  Look through lines a to b for a regular expression that need not
+  include any text as it is, as search_lines does, a line at a time
+
+===========================================================================*/
+static int search_lines_regex (const Search *self, 
+     const char * const *lines, int a, int b, int from, int to, BOOL last, 
+     const char *text, size_t text_len, int *col, int *match_len)
+  {
+  for (int i = 0; i <= b - a; i++)
+    {
+    int k = last ? b - i : a + i;
+    const char *line = lines[k];
+    int at = search_regex_line (self, line, search_strlen (line), k, a, b,
+      from, to, last, match_len);
+    if (at >= 0)
+      {
+      *col = at;
+      return k;
+      }
+    }
+  return -1;
+  }
+
+/*===========================================================================
+
+  search_threads
+
+  How many threads to look through a file with
+
+===========================================================================*/
+static int search_threads (const Search *self)
+  {
+  int threads = self->threads > 0 ? self->threads : get_nprocs ();
+  if (threads > SEARCH_MAX_THREADS) threads = SEARCH_MAX_THREADS;
+  if (threads < 1) threads = 1;
+  return threads;
+  }
+
+/*===========================================================================
+
+  search_for_thread
+
+  What thread i looks with: the search itself, unless it is a regular
+  expression, which each thread after the first needs a copy of
+
+===========================================================================*/
+static Search *search_for_thread (Search *self, int i)
+  {
+  if (i == 0 || !self->regex) return self;
+  if (!self->copies)
+    {
+    self->copies = malloc (SEARCH_MAX_THREADS * sizeof (Search *));
+    memset (self->copies, 0, SEARCH_MAX_THREADS * sizeof (Search *));
+    }
+  if (!self->copies[i])
+    {
+    const char *error;
+    self->copies[i] = search_create_regex ((const char *)self->pattern, 
+      self->len, &error);
+    }
+  return self->copies[i];
+  }
+
+/*===========================================================================
+
+  search_cut
+
+  Where a piece that starts at line r of a file that is all in memory 
+  should end, going from r towards line 'end', so that it is no more
+  than about SEARCH_PIECE_BYTES. The lines that haven't changed follow
+  one another in memory, so the distance between them is near enough
+
+===========================================================================*/
+static int search_cut (TextFile *text_file, int r, int end)
+  {
+  int first, n;
+  const char * const *lines = text_file_get_lines (text_file, r, &first,
+    &n);
+  const char *start = lines[r - first];
+  int lo = r;
+  int hi = end;
+  while (lo != hi)
+    {
+    int mid = lo < hi ? (lo + hi + 1) / 2 : (lo + hi - 1) / 2;
+    const char *p = lines[mid - first];
+    if ((p > start ? p - start : start - p) <= SEARCH_PIECE_BYTES)
+      lo = mid;
+    else
+      hi = lo < hi ? mid - 1 : mid + 1;
+    }
+  return lo;
+  }
+
+/*===========================================================================
+
+  search_pieces
+
+  Split the file from line *row, position *col, into as many as 'max'
+  pieces, going backwards, or forwards as far as line 'last', and move
+  *row and *col on to where the next piece would start. Returns how 
+  many there are
+
+===========================================================================*/
+static int search_pieces (TextFile *text_file, BOOL back, int *row, 
+     int *col, int last, SearchPiece *pieces, int max)
+  {
+  int nlines = text_file_get_line_count (text_file);
+  BOOL large = text_file_is_large (text_file);
+  int r = *row;
+  int c = *col;
+  int npieces = 0;
+  if (last > nlines - 1) last = nlines - 1;
+  while (npieces < max && r >= 0 && (back ? r < nlines : r <= last))
+    {
+    SearchPiece *piece = &pieces[npieces++];
+    int n;
+    int first = text_file_get_block_start (text_file, r, &n);
+    int end;
+    if (!back)
+      {
+      end = first + n - 1;
+      if (end > r + SEARCH_LINES - 1) end = r + SEARCH_LINES - 1;
+      if (end > last) end = last;
+      }
+    else
+      {
+      end = first;
+      if (end < r - (SEARCH_LINES - 1)) end = r - (SEARCH_LINES - 1);
+      }
+    // A block of a large file is no more than about a piece anyway
+    if (!large) end = search_cut (text_file, r, end);
+    piece->a = back ? end : r;
+    piece->b = back ? r : end;
+    piece->from = back ? 0 : c;
+    piece->to = back ? c : 0x7fffffff;
+    piece->row = -1;
+    piece->rows = NULL;
+    piece->counts = NULL;
+    piece->nrows = 0;
+    r = back ? end - 1 : end + 1;
+    c = back ? 0x7fffffff : 0;
+    }
+  *row = r;
+  *col = c;
+  return npieces;
+  }
+
+/*===========================================================================
+
+  search_piece
+
+  Look through a piece, for the first match in the direction of the
+  search. Returns TRUE if there is one
+
+===========================================================================*/
+static BOOL search_piece (const Search *self, TextFile *text_file, 
+     BOOL back, SearchPiece *piece)
+  {
+  int first, n;
+  size_t text_len;
+  const char * const *lines = text_file_get_lines (text_file, piece->a,
+    &first, &n);
+  const char *text = text_file_get_block_text (text_file, piece->a, 
+    &text_len);
+  int found = (self->regex && !self->literal ? search_lines_regex 
+    : search_lines) (self, lines, piece->a - first, piece->b - first,
+    piece->from, piece->to, back, text, text_len, &piece->col, 
+    &piece->match_len);
+  piece->row = found >= 0 ? first + found : -1;
+  return found >= 0;
+  }
+
+/*===========================================================================
+
+  search_count_from
+
+  Count the matches in a line from one at c, of length len, up to those
+  that start at 'to'. After a match that isn't empty, an empty one 
+  where it ends isn't counted, as it wouldn't be replaced
+
+===========================================================================*/
+static int search_count_from (const Search *self, const char *line, 
+     int line_len, int c, int len, int to)
+  {
+  int count = 0;
+  int end = -1;
+  search_set_line (self, line, line_len);
+  while (c >= 0 && c < to)
+    {
+    if (len > 0 || c != end) count++;
+    if (len > 0) end = c + len;
+    c = search_line (self, line, line_len, len > 0 ? c + len : c + 1, 
+      &len);
+    }
+  search_set_line (self, NULL, 0);
+  return count;
+  }
+
+/*===========================================================================
+
+  search_count_line
+
+===========================================================================*/
+int search_count_line (const Search *self, const char *line, int len, 
+     int to)
+  {
+  int match_len = 0;
+  int c = search_line (self, line, len, 0, &match_len);
+  return search_count_from (self, line, len, c, match_len, to);
+  }
+
+/*===========================================================================
+
+  search_count_piece
+
+  Count the matches in a piece, and if 'rows' is set, note the lines
+  they are in
+
+===========================================================================*/
+static long search_count_piece (const Search *self, TextFile *text_file, 
+     SearchPiece *piece, BOOL rows)
+  {
+  int first, n;
+  size_t text_len;
+  const char * const *lines = text_file_get_lines (text_file, piece->a,
+    &first, &n);
+  const char *text = text_file_get_block_text (text_file, piece->a, 
+    &text_len);
+  long count = 0;
+  int size = 0;
+  int k = piece->a - first;
+  int b = piece->b - first;
+  // Finding where a run of lines ends means going through all of it,
+  //   so after a match, only a few lines are looked through at once, 
+  //   and twice as many each time there is no match in them
+  int step = 16;
+  while (k <= b)
+    {
+    int c, len;
+    int last = b - k < step ? b : k + step - 1;
+    // The first line with a match, which is then looked through for
+    //   the rest of the matches in it
+    int found = (self->regex && !self->literal ? search_lines_regex 
+      : search_lines) (self, lines, k, last, 0, 0x7fffffff, FALSE, text, 
+      text_len, &c, &len);
+    if (found < 0)
+      {
+      k = last + 1;
+      if (step < SEARCH_LINES) step *= 2;
+      continue;
+      }
+    step = 16;
+    k = found;
+    const char *line = lines[k];
+    int in_line = search_count_from (self, line, search_strlen (line), c,
+      len, 0x7fffffff);
+    count += in_line;
+    if (rows)
+      {
+      if (piece->nrows == size)
+        {
+        size = size > 0 ? size * 2 : 64;
+        int *r = malloc (size * sizeof (int));
+        int *n = malloc (size * sizeof (int));
+        if (piece->rows)
+          {
+          memcpy (r, piece->rows, piece->nrows * sizeof (int));
+          memcpy (n, piece->counts, piece->nrows * sizeof (int));
+          free (piece->rows);
+          free (piece->counts);
+          }
+        piece->rows = r;
+        piece->counts = n;
+        }
+      piece->rows[piece->nrows] = first + k;
+      piece->counts[piece->nrows] = in_line;
+      piece->nrows++;
+      }
+    k++;
+    }
+  return count;
+  }
+
+/*===========================================================================
+
+  search_work
+
+  Take pieces in turn, and look through them, until there are none 
+  left, or the next is after one that a match has been found in. This
+  runs on a thread of its own
+
+===========================================================================*/
+static void *search_work (void *arg)
+  {
+  SearchWorker *worker = arg;
+  SearchJob *job = worker->job;
+  for (;;)
+    {
+    int i = atomic_fetch_add (&job->next, 1);
+    if (i >= job->npieces || i > atomic_load (&job->found)) break;
+    SearchPiece *piece = &job->pieces[i];
+    if (job->count)
+      worker->count += search_count_piece (worker->search, 
+        job->text_file, piece, job->rows);
+    else if (search_piece (worker->search, job->text_file, job->back, 
+        piece))
+      {
+      int found = atomic_load (&job->found);
+      while (i < found 
+          && !atomic_compare_exchange_strong (&job->found, &found, i))
+        ;
+      }
+    }
+  return NULL;
+  }
+
+/*===========================================================================
+
+  search_run
+
+  Share the pieces of a job among as many threads as there are, or 
+  pieces if fewer. This thread is one of them; if another can't be 
+  started, the rest take its share. Returns how many matches were
+  counted
+
+===========================================================================*/
+static long search_run (Search *self, SearchJob *job, int threads)
+  {
+  SearchWorker workers[SEARCH_MAX_THREADS];
+  pthread_t ids[SEARCH_MAX_THREADS];
+  BOOL started[SEARCH_MAX_THREADS];
+  if (threads > job->npieces) threads = job->npieces;
+  job->next = 0;
+  job->found = job->npieces;
+  for (int i = 0; i < threads; i++)
+    {
+    workers[i].job = job;
+    workers[i].search = search_for_thread (self, i);
+    workers[i].count = 0;
+    }
+  for (int i = 1; i < threads; i++)
+    started[i] = workers[i].search 
+      && pthread_create (&ids[i], NULL, search_work, &workers[i]) == 0;
+  search_work (&workers[0]);
+  long count = workers[0].count;
+  for (int i = 1; i < threads; i++)
+    {
+    if (started[i]) 
+      {
+      pthread_join (ids[i], NULL);
+      count += workers[i].count;
+      }
+    }
+  return count;
+  }
+
+/*===========================================================================
+
+  search_round_max
+
+  The most pieces to share among the threads at a time
+
+===========================================================================*/
+static int search_round_max (TextFile *text_file, int threads)
+  {
+  return text_file_is_large (text_file) 
+    ? threads * SEARCH_ROUND_PIECES : SEARCH_ROUND_MAX;
+  }
+
+/*===========================================================================
+
+  search_file
+
+  After each round of pieces, the blocks that are out of sight are 
+  dropped. A match in the first piece needs no threads
+
+===========================================================================*/
+BOOL search_file (Search *self, TextFile *text_file, BOOL back,
+     int *row, int *col, int *match_len)
+  {
+  int nlines = text_file_get_line_count (text_file);
+  int r = *row;
+  int c = *col;
+  if (r >= nlines)
+    {
+    if (!back) return FALSE;
+    r = nlines - 1;
+    c = 0x7fffffff;
+    }
+  SearchPiece piece;
+  if (r < 0 || search_pieces (text_file, back, &r, &c, nlines, &piece, 1)
+       == 0)
+    return FALSE;
+  BOOL found = search_piece (self, text_file, back, &piece);
+  int threads = 1;
+  int max = 1;
+  SearchPiece *pieces = &piece;
+  if (!found && r >= 0 && r < nlines)
+    {
+    threads = search_threads (self);
+    max = threads > 1 ? search_round_max (text_file, threads) : 1;
+    if (max > 1) pieces = malloc (max * sizeof (SearchPiece));
+    }
+  while (!found && r >= 0 && r < nlines)
+    {
+    SearchJob job;
+    job.text_file = text_file;
+    job.back = back;
+    job.count = FALSE;
+    job.rows = FALSE;
+    job.pieces = pieces;
+    job.npieces = search_pieces (text_file, back, &r, &c, nlines, pieces,
+      max);
+    search_run (self, &job, threads);
+    if (job.found < job.npieces)
+      {
+      piece = pieces[job.found];
+      found = TRUE;
+      }
+    text_file_trim (text_file, found ? piece.row : r, 1);
+    }
+  if (pieces != &piece) free (pieces);
+  if (found)
+    {
+    *row = piece.row;
+    *col = piece.col;
+    *match_len = piece.match_len;
+    }
+  return found;
+  }
+
+/*===========================================================================
+
+  search_count_file
+
+===========================================================================*/
+long search_count_file (Search *self, TextFile *text_file)
+  {
+  int nlines = text_file_get_line_count (text_file);
+  int threads = search_threads (self);
+  int max = search_round_max (text_file, threads);
+  SearchPiece *pieces = malloc (max * sizeof (SearchPiece));
+  long count = 0;
+  int r = 0;
+  int c = 0;
+  while (r < nlines)
+    {
+    SearchJob job;
+    job.text_file = text_file;
+    job.back = FALSE;
+    job.count = TRUE;
+    job.rows = FALSE;
+    job.pieces = pieces;
+    job.npieces = search_pieces (text_file, FALSE, &r, &c, nlines, pieces,
+      max);
+    count += search_run (self, &job, threads);
+    text_file_trim (text_file, r, 1);
+    }
+  free (pieces);
+  return count;
+  }
+
+/*===========================================================================
+
+  search_file_lines
+
+  No more pieces are taken than the threads can look through about
+  'bytes' of each, whatever the number of lines
+
+===========================================================================*/
+int search_file_lines (Search *self, TextFile *text_file, int *row, 
+     int last, int bytes, int **rows, int **counts, int *size)
+  {
+  text_file_trim (text_file, *row, 1);
+  int threads = search_threads (self);
+  int max = search_round_max (text_file, threads);
+  // No piece is much more than SEARCH_PIECE_BYTES
+  int pieces_each = bytes / SEARCH_PIECE_BYTES;
+  if (pieces_each < 1) pieces_each = 1;
+  if (max > threads * pieces_each) max = threads * pieces_each;
+  SearchPiece *pieces = malloc (max * sizeof (SearchPiece));
+  int c = 0;
+  SearchJob job;
+  job.text_file = text_file;
+  job.back = FALSE;
+  job.count = TRUE;
+  job.rows = TRUE;
+  job.pieces = pieces;
+  job.npieces = search_pieces (text_file, FALSE, row, &c, last, pieces, 
+    max);
+  search_run (self, &job, threads);
+  int n = 0;
+  for (int i = 0; i < job.npieces; i++) n += pieces[i].nrows;
+  if (n > *size)
+    {
+    if (*size > 0)
+      {
+      free (*rows);
+      free (*counts);
+      }
+    *size = n;
+    *rows = malloc (n * sizeof (int));
+    *counts = malloc (n * sizeof (int));
+    }
+  n = 0;
+  for (int i = 0; i < job.npieces; i++)
+    {
+    SearchPiece *piece = &pieces[i];
+    if (piece->nrows == 0) continue;
+    memcpy (*rows + n, piece->rows, piece->nrows * sizeof (int));
+    memcpy (*counts + n, piece->counts, piece->nrows * sizeof (int));
+    n += piece->nrows;
+    free (piece->rows);
+    free (piece->counts);
+    }
+  free (pieces);
+  return n;
+  }
@@ -0,0 +1,78 @@
+/*===========================================================================
+
+  bute -- barely useful text editor
+
+  search.h
+
+  Copyright (c)2020 Kevin Boone. Distributed uner the terms of the
+    GNU PUblic Licence, v3.0
+
+===========================================================================*/
+#pragma once
+
+#include "cnolib.h"
+#include "textfile.h"
+
+// A piece of text to look for in the lines of a file, exactly as it is,
+//   or as a regular expression (see regex.h). A match can't span lines
+struct _Search;
+typedef struct _Search Search;
+
+// The pattern is len bytes, and need not be null-terminated. It should
+//   not contain a null
+extern Search     *search_create (const char *pattern, int len);
+// The same, for a regular expression. Returns NULL, and a message in 
+//   *error, if it is not valid
+extern Search     *search_create_regex (const char *pattern, int len,
+                     const char **error);
+extern void        search_destroy (Search *self);
+
+// The position of the first match in a line of len bytes that starts at
+//   or after 'from', or -1 if there is none. Its length is put in 
+//   *match_len
+extern int         search_line (const Search *self, const char *line,
+                     int len, int from, int *match_len);
+// Set a line of len bytes that is to be searched for one match after
+//   another, so that a regular expression need look back over it only
+//   once, not for each match. It must not change while it is set; set
+//   NULL when done with it
+extern void        search_set_line (const Search *self, const char *line,
+                     int len);
+// The position of the last match in a line of len bytes that starts at
+//   or before 'to', or -1 if there is none
+extern int         search_line_back (const Search *self, const char *line,
+                     int len, int to, int *match_len);
+// The number of matches in a line of len bytes that start before 'to',
+//   not counting an empty match straight after one that isn't, as 
+//   search_count_file counts them
+extern int         search_count_line (const Search *self, const char *line,
+                     int len, int to);
+// Set how many threads to look through a file with. Zero, the default,
+//   means one for each processor
+extern void        search_set_threads (Search *self, int threads);
+// Look through the lines of a file from line *row, position *col:
+//   forwards for the first match that starts there or after, or
+//   backwards for the last that starts there or before. Returns TRUE,
+//   and the match in *row and *col, and its length in *match_len, if
+//   there is one. Only the lines loaded so far are looked at, and the
+//   file is trimmed as the search goes, so a large one is not all read
+//   into memory. Past the lines near the start, they are shared among
+//   several threads
+extern BOOL        search_file (Search *self, TextFile *text_file,
+                     BOOL back, int *row, int *col, int *match_len);
+// The number of matches in the lines of a file loaded so far, not 
+//   counting an empty match straight after one that isn't, as 
+//   replacing all of them would. The file is trimmed as for search_file
+extern long        search_count_file (Search *self, TextFile *text_file);
+// The lines of a file from line *row to line 'last' that have matches,
+//   and how many each has, as search_count_file counts them, found as
+//   search_file finds them, in one round of pieces, of no more than
+//   about 'bytes' of text for each thread. They are put in order in
+//   *rows and *counts, which are made bigger when they need to be,
+//   with the room in them in *size, and *row is moved to the line after
+//   those looked through. Returns how many there are. Each call trims
+//   the file to the lines from *row
+extern int         search_file_lines (Search *self, TextFile *text_file,
+                     int *row, int last, int bytes, int **rows,
+                     int **counts, int *size);
+
@@ -0,0 +1,159 @@
+/*===========================================================================
+
+  bute
+
+  tabstops.c
+
+  Copyright (c)2020 Kevin Boone. Distributed uner the terms of the
+    GNU PUblic Licence, v3.0
+
+  A "class" that records where the tab stops are. Finding the next
+  stop is a lookup in a table worked out in advance, because it is
+  done for every tab that is displayed, measured or drawn.
+
+===========================================================================*/
+#include "tabstops.h"
+
+// The table covers at least this many columns. Beyond the table, stops
+//   are regularly spaced, and the next one is calculated
+#define TAB_TABLE_MIN 512
+
+// Most stops that can be given in a list
+#define TAB_STOPS_MAX 64
+
+struct _TabStops
+  {
+  // Stops are every 'width' columns from column 'last'
+  int width;
+  int last;
+  // next[col] is the first stop after col, for col < size
+  int size;
+  int *next;
+  BOOL is_default;
+  };
+
+/*===========================================================================
+
+  tab_stops_build
+
+  Work out the table, given the explicit stops (there may be none)
+
+===========================================================================*/
+static TabStops *tab_stops_build (const int *stops, int nstops, int width,
+      int last)
+  {
+  TabStops *self = malloc (sizeof (TabStops));
+  self->width = width;
+  self->last = last;
+  self->size = last + width;
+  while (self->size < TAB_TABLE_MIN) self->size += width;
+  self->next = malloc (self->size * sizeof (int));
+
+  int s = 0;
+  int stop = nstops > 0 ? stops[0] : width;
+  for (int col = 0; col < self->size; col++)
+    {
+    if (col >= stop)
+      {
+      s++;
+      if (s < nstops)
+        stop = stops[s];
+      else
+        stop = last + ((col - last) / width + 1) * width;
+      }
+    self->next[col] = stop;
+    }
+  self->is_default = (last == 0 && width == 8);
+  return self;
+  }
+
+/*===========================================================================
+
+  tab_stops_create
+
+===========================================================================*/
+TabStops *tab_stops_create (int width)
+  {
+  return tab_stops_build (NULL, 0, width, 0);
+  }
+
+/*===========================================================================
+
+  tab_stops_parse
+
+===========================================================================*/
+TabStops *tab_stops_parse (const char *spec, char **error)
+  {
+  int stops[TAB_STOPS_MAX];
+  int nstops = 0;
+  const char *p = spec;
+  while (*p)
+    {
+    if (*p < '0' || *p > '9' || nstops == TAB_STOPS_MAX)
+      {
+      if (error) *error = strdup ("Invalid tab stops");
+      return NULL;
+      }
+    int n = 0;
+    while (*p >= '0' && *p <= '9' && n < 10000)
+      n = n * 10 + *p++ - '0';
+    if (n == 0 || (nstops > 0 && n <= stops[nstops - 1]))
+      {
+      if (error)
+        *error = strdup ("Tab stops must be positive, and increasing");
+      return NULL;
+      }
+    stops[nstops++] = n;
+    if (*p == ',' && *++p == 0)
+      {
+      if (error) *error = strdup ("Invalid tab stops");
+      return NULL;
+      }
+    }
+
+  if (nstops == 0)
+    {
+    if (error) *error = strdup ("Invalid tab stops");
+    return NULL;
+    }
+  if (nstops == 1)
+    return tab_stops_create (stops[0]);
+  return tab_stops_build (stops, nstops,
+    stops[nstops - 1] - stops[nstops - 2], stops[nstops - 1]);
+  }
+
+/*===========================================================================
+
+  tab_stops_destroy
+
+===========================================================================*/
+void tab_stops_destroy (TabStops *self)
+  {
+  if (self)
+    {
+    free (self->next);
+    free (self);
+    }
+  }
+
+/*===========================================================================
+
+  tab_stops_next
+
+===========================================================================*/
+int tab_stops_next (const TabStops *self, int col)
+  {
+  if (col < self->size) return self->next[col];
+  return col + self->width - (col - self->last) % self->width;
+  }
+
+/*===========================================================================
+
+  tab_stops_is_default
+
+===========================================================================*/
+BOOL tab_stops_is_default (const TabStops *self)
+  {
+  return self->is_default;
+  }
+
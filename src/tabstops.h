@@ -0,0 +1,36 @@
+/*===========================================================================
+
+  bute -- barely useful text editor
+
+  tabstops.h
+
+  Copyright (c)2020 Kevin Boone. Distributed uner the terms of the
+    GNU PUblic Licence, v3.0
+
+===========================================================================*/
+#pragma once
+
+#include "cnolib.h"
+
+// The tab stops used to display text. The default is a stop every
+//   eight columns.
+struct _TabStops;
+typedef struct _TabStops TabStops;
+
+// Stops every 'width' columns
+extern TabStops   *tab_stops_create (int width);
+// Parse a specification in the form used by expand(1): a single number
+//   is the tab width; a list of increasing, comma-separated numbers
+//   gives the columns (counting from zero) at which there are stops.
+//   After the last stop in a list, stops continue at the same interval
+//   as the last two. Returns NULL, and sets *error, if the
+//   specification is invalid
+extern TabStops   *tab_stops_parse (const char *spec, char **error);
+extern void        tab_stops_destroy (TabStops *self);
+
+// The column of the first stop after 'col'
+extern int         tab_stops_next (const TabStops *self, int col);
+// TRUE if the stops are every eight columns, as a terminal's are when
+//   it is reset
+extern BOOL        tab_stops_is_default (const TabStops *self);
+
@@ -13,6 +13,8 @@
 ===========================================================================*/
 #pragma once
 
+#include "tabstops.h"
+
 // Key codes for cursor movement, etc
 #define VK_BACK     8
 #define VK_TAB      9
@@ -27,6 +29,16 @@
 #define VK_PGDN  1005 
 #define VK_HOME  1006 
 #define VK_END   10067
+// Returned by read_key when the terminal starts a bracketed paste. The
+//   pasted text should then be collected using read_paste
+#define VK_PASTE 1008
+// Returned by read_key when there will be no more input, as when the
+//   keystrokes given to a virtual terminal run out
+#define VK_EOF   1009
+// Returned by read_key when what arrived was not a key, but a report 
+//   that the terminal sent in reply to a query, and nothing else is 
+//   waiting to be read
+#define VK_NONE  1010
 
 
 struct _Terminal;
@@ -49,6 +61,17 @@ typedef void (*TerminalClearFn) (struct _Terminal *self);
 typedef void (*TerminalWriteLineFn) (struct _Terminal *self, int row, 
                  const char *line, BOOL truncate);
 
+// Write n characters of the line, starting at character position 'from',
+//   which is displayed at column 'dcol' of the line, as they would appear 
+//   if the whole line were written. If n is -1, write the rest of the 
+//   line, and erase whatever follows it on the row. The line is shifted
+//   left by the columns set by set_left_col, and output is truncated at
+//   the terminal width, so the cost depends on how much of the line is 
+//   visible, not on its length. This allows a small edit to redraw 
+//   only the characters that changed
+typedef void (*TerminalWriteLineFromFn) (struct _Terminal *self, int row, 
+                 const char *line, int from, int dcol, int n);
+
 // Set or unset raw mode, where characters are not echoed. Note that
 //  we must enter raw mode before leaving it
 typedef void (*TerminalRawModeFn) (struct _Terminal *self, BOOL raw); 
@@ -56,18 +79,59 @@ typedef void (*TerminalRawModeFn) (struct _Terminal *self, BOOL raw);
 // Read a single key code, without echo
 typedef int  (*TerminalReadKeyFn) (struct _Terminal *self); 
 
+// Whether a key, or the start of one, can be read without waiting
+typedef BOOL (*TerminalKeyWaitingFn) (const struct _Terminal *self); 
+
+// Read the body of a bracketed paste, after read_key has returned
+//   VK_PASTE. Line endings are converted to \n. Returns a newly-allocated
+//   buffer that the caller must free, and sets *len to its length. The
+//   buffer is not null-terminated
+typedef char *(*TerminalReadPasteFn) (struct _Terminal *self, int *len); 
+
 // Set the cursor position to the row and column, which start at zero
 typedef void (*TerminalSetCursorFn) (struct _Terminal *self, int row, int col);
 
 // Erase the whole of the current line. Cursor position need not be preserved
 typedef void (*TerminalEraseCurrentLineFn) (struct _Terminal *self);
 
+// Insert n blank cells at the cursor, shifting the rest of the row
+//   right. Cells shifted past the right margin are lost
+typedef void (*TerminalInsertCharsFn) (struct _Terminal *self, int n);
+
+// Delete n cells at the cursor, shifting the rest of the row left. 
+//   The cells that become vacant at the right margin are blank
+typedef void (*TerminalDeleteCharsFn) (struct _Terminal *self, int n);
+
+// Start a frame: a set of changes that should appear on the screen
+//   together. Output is held back until the frame ends
+typedef void (*TerminalBeginFrameFn) (struct _Terminal *self);
+
+// Finish a frame, and send it to the terminal. If the frame draws on
+//   more than one row, the cursor is hidden while it is drawn and, if
+//   the terminal supports it, the terminal is asked to show the whole
+//   frame at once. The terminal may instead drop a frame that would be
+//   slow to send, if more input is already waiting. Then the screen is
+//   left as it was before the frame began, and FALSE is returned; the
+//   caller must redraw whatever the frame changed
+typedef BOOL (*TerminalEndFrameFn) (struct _Terminal *self);
+
 // Set the cursor to a block (not all terminals will respond)
 typedef void (*TerminalCursorBlockFn) (struct _Terminal *self);
 
 // Set the cursor to a line (not all terminals will respond)
 typedef void (*TerminalCursorLineFn) (struct _Terminal *self);
 
+// Set the tab stops used to display text. If they are not the ones a
+//   terminal has by default, the terminal's own stops are changed to 
+//   match. Must be called before raw_mode() and the first clear()
+typedef void (*TerminalSetTabStopsFn) (struct _Terminal *self, 
+  const TabStops *tab_stops);
+
+// Set the column of a line that is shown at the left edge of the
+//   screen, for lines written by write_line_from. write_line always 
+//   starts at the first column of the line
+typedef void (*TerminalSetLeftColFn) (struct _Terminal *self, int left_col);
+
 // get_displayed_length returns the number of screen columns that will be
 //   taken up by 'len' characters in 'line'. This size allows for expanding
 //   tabs. 'len' is allowed to be longer than the line length, in which 
@@ -75,19 +139,45 @@ typedef void (*TerminalCursorLineFn) (struct _Terminal *self);
 typedef int  (*TerminalGetDisplayedLengthFn) (const struct _Terminal *self, 
   const char *line, int len);
 
+// A device that a terminal handler can use in place of the process's 
+//   own terminal. It is taken to be a raw terminal, with no line 
+//   discipline. A VirtualTerminal is one
+typedef struct _TerminalDevice
+  {
+  // Write len bytes to the device
+  void (*write) (struct _TerminalDevice *self, const char *s, int len);
+  // Read up to len bytes. Returns the number read, which may be zero if
+  //   nothing arrived in a short time, or -1 if no more ever will 
+  int  (*read) (struct _TerminalDevice *self, char *s, int len);
+  // The number of bytes that could be read without waiting
+  int  (*input_waiting) (const struct _TerminalDevice *self);
+  // The size of the device's screen
+  void (*get_size) (const struct _TerminalDevice *self, int *rows, 
+         int *columns);
+  } TerminalDevice;
+
 typedef struct _Terminal 
   {
   TerminalInitFn init; 
   TerminalGetSizeFn get_size;
   TerminalClearFn clear;
   TerminalWriteLineFn write_line;
+  TerminalWriteLineFromFn write_line_from;
   TerminalRawModeFn raw_mode;
   TerminalReadKeyFn read_key;
+  TerminalKeyWaitingFn key_waiting;
+  TerminalReadPasteFn read_paste;
   TerminalSetCursorFn set_cursor;
   TerminalEraseCurrentLineFn erase_current_line;
+  TerminalInsertCharsFn insert_chars;
+  TerminalDeleteCharsFn delete_chars;
+  TerminalBeginFrameFn begin_frame;
+  TerminalEndFrameFn end_frame;
   TerminalCursorBlockFn cursor_block;
   TerminalCursorLineFn cursor_line;
   TerminalGetDisplayedLengthFn get_displayed_length;
+  TerminalSetTabStopsFn set_tab_stops;
+  TerminalSetLeftColFn set_left_col;
   } Terminal;
 
 
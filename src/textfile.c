@@ -10,171 +10,2032 @@
   A "class" for handling text files as a variable-length array of
   dynamically-allocated text strings. 
 
+  A file is loaded into one buffer, with its newlines replaced by NULs,
+  and the lines point into that until they are changed in a way that
+  needs more space, when they get an allocation of their own. The 
+  buffer is read, and split into lines, by several threads at once, 
+  each working on a chunk of the file: first each reads its chunk and
+  counts the newlines in it, which tells each chunk the number of its
+  first line; then each records where its lines start.
+
+  A file can also be loaded a part at a time: the first part straight
+  away, so that the first screen can be drawn, and the rest when the
+  editor has nothing else to do. The lines of each part are added after
+  the last line, so edits made to the lines already loaded don't get in
+  the way; the line that a part ends in the middle of is held back until
+  the rest of it is read.
+
+  The lines are held in blocks. A file that fits in memory is all one
+  block. A large one is split into blocks of BLOCK_LINES lines, or of
+  about BLOCK_BYTES, and loading it only finds where each block starts
+  in the file, and how many lines it has; a block is read when one of
+  its lines is wanted, and dropped again by text_file_trim, unless it
+  has been changed. Saving a large file copies the blocks that haven't
+  changed straight from the old file to a new one, which replaces it.
+
+  Where the blocks of a large file start is saved beside it, when it has
+  all been loaded, and when it is saved, so that the next time it is
+  opened, if it hasn't changed, it needn't be read through again.
+
+  Many lines can be replaced at once, rebuilding the line array of each
+  block they are in only once, and what they replaced kept as one step
+  that can be undone. It is kept only as long as nothing else changes:
+  'changes' counts every change, so the step can tell if any has been
+  made since. The lines replaced are kept as they were -- a line that 
+  is still in the buffer a file that is all in memory was read into 
+  stays there -- so nothing is copied to keep them, except from a
+  block of a large file, which may be dropped.
+
+  While changes are being noted, each change records the lines it 
+  touched, merged with the runs of lines changed before that it 
+  touches, so that something that keeps a record of each line -- such
+  as the matches in it -- can go through only the lines that have 
+  changed since it last looked.
+
+===========================================================================*/
+#include "textfile.h"
+#include "lineindex.h"
+#include "utf8.h"
+
+// The display column of a character about every COL_INDEX_STEP bytes 
+//   along a line is recorded, the first time it is needed, so that 
+//   working out the screen position of a character does not mean 
+//   scanning the line from the start. When the line is edited, the 
+//   record is kept up to the edit, and, if the line has no tabs, whose
+//   width depends on where they are, moved along with the text after it
+#define COL_INDEX_STEP 64
+
+// The most threads a file is loaded with, and the least of the file
+//   each is given
+#define LOAD_MAX_THREADS 64
+#define LOAD_MIN_CHUNK (1024 * 1024)
+// The most that is read in one system call
+#define LOAD_MAX_READ (1 << 30)
+// The first part of a file that is loaded a part at a time, which is
+//   usually enough for the first screen. Each later part is as much as
+//   the threads load a LOAD_MIN_CHUNK of
+#define LOAD_FIRST (64 * 1024)
+
+// A block of a large file starts at every BLOCK_LINES'th line, and at
+//   the first line to start in each BLOCK_BYTES of the file, so that it
+//   is quick to read whatever the length of its lines
+#define BLOCK_LINES 4096
+#define BLOCK_BYTES (1024 * 1024)
+
+// The most things that can note the changes to a file at once
+#define TEXT_FILE_NOTERS 4
+
+// What is known about the display columns of a line
+typedef struct _ColIndex
+  {
+  // Set if the line is all ASCII, so every byte is a character
+  BOOL ascii;
+  // Set if the line may have tabs in it
+  BOOL tabs;
+  // The length of the line, and the number of columns it takes up
+  int len;
+  int width;
+  // The number of checkpoints, and for each, the position in the line
+  //   and the display column, in order of position, starting at 0
+  int n;
+  int check[][2];
+  } ColIndex;
+
+// The runs of lines changed since one thing that notes them last took
+//   them, in order, with room for 'size' of them
+typedef struct _TextFileNoter
+  {
+  BOOL on;
+  TextFileChange *changed;
+  int n;
+  int size;
+  } TextFileNoter;
+
+// A run of lines of the file
+typedef struct _TextBlock
+  {
+  int nlines;
+  // Where the block's text is in the file, in a large file
+  off64_t start;
+  off64_t end;
+  // Set if the lines are in memory, and if they have been changed since
+  //   they were read, so they can't be dropped
+  BOOL resident;
+  BOOL dirty;
+  // The lines, with room for lines_size of them
+  char **lines;
+  int lines_size;
+  // For each line, NULL or its display column index
+  ColIndex **col_index;
+  // The text as it was read, which unchanged lines point into
+  char *loaded;
+  size_t loaded_len;
+  } TextBlock;
+
+typedef struct _TextFile
+  {
+  int nlines;
+  // The blocks, with room for blocks_size of them
+  TextBlock *blocks;
+  int nblocks;
+  int blocks_size;
+  // tree[i], counting from one, is the sum of the lines of the blocks
+  //   from i - (i & -i) up to i - 1
+  int *tree;
+  // The blocks that are in memory
+  int *resident;
+  int nresident;
+  const TabStops *tab_stops;
+  BOOL modified;
+  // The number of threads to load with, or zero for one per processor
+  int load_threads;
+  // Files bigger than this are read a block at a time. -1 means a
+  //   quarter of the memory
+  off64_t large_min;
+  // Set if the file is read a block at a time, from fd, and the name
+  //   it was read from, for its saved index
+  BOOL large;
+  int fd;
+  char *file_name;
+  off64_t file_size;
+  // Held while a block is read, so that several threads can get the
+  //   lines of a large file at once, so long as it isn't changed
+  pthread_mutex_t read_lock;
+  // While a file is being loaded, the descriptor it is read from, and
+  //   the most chunks a part of it is loaded in; otherwise -1
+  int load_fd;
+  int load_chunks;
+  // How much of the file has been loaded, and where the line that 
+  //   follows the lines loaded so far starts
+  off64_t load_pos;
+  char *load_next;
+  // In a large file, the lines found so far, where the last of them
+  //   starts, and where the block that is not yet complete starts, and
+  //   its first line; and the buffer each part is read into
+  int load_lines;
+  off64_t load_line_start;
+  off64_t load_block;
+  int load_block_line;
+  char *load_buff;
+  // The reason, if the file couldn't all be loaded
+  int load_error;
+  // The number of changes made so far; and the edits that would undo
+  //   the step being recorded, with room for undo_size of them, and the
+  //   number of changes when it was last added to. undo is NULL if 
+  //   there is no step
+  unsigned long changes;
+  TextFileEdit *undo;
+  int nundo;
+  int undo_size;
+  unsigned long undo_changes;
+  // The changes noted for each thing that has asked for them
+  TextFileNoter noters[TEXT_FILE_NOTERS];
+  } TextFile;
+
+// A part of the file that one thread loads. Its text is from start to
+//   end of buff, which holds the file from offset base
+typedef struct _TextFileChunk
+  {
+  TextFile *text_file;
+  int fd;
+  char *buff;
+  off64_t base;
+  size_t start;
+  size_t end;
+  // The newlines in the chunk, the number of the line that follows
+  //   the first of them, and the last of them, if any
+  int newlines;
+  int first;
+  const char *last;
+  // In a large file, where the line that the chunk starts in starts,
+  //   and the lines that start a block: for each, where it starts and
+  //   its number
+  off64_t prev;
+  off64_t *bound;
+  int *bound_line;
+  int nbounds;
+  // Set if the chunk couldn't be read
+  int error;
+  } TextFileChunk;
+
+/*===========================================================================
+
+  text_file_reset
+
+  Make the file empty: one block, in memory, with no lines
+
+===========================================================================*/
+static void text_file_reset (TextFile *self)
+  {
+  self->nlines = 0;
+  self->blocks_size = 1;
+  self->blocks = malloc (sizeof (TextBlock));
+  memset (self->blocks, 0, sizeof (TextBlock));
+  self->blocks[0].resident = TRUE;
+  self->nblocks = 1;
+  self->tree = malloc (2 * sizeof (int));
+  self->tree[0] = 0;
+  self->tree[1] = 0;
+  self->resident = malloc (sizeof (int));
+  self->resident[0] = 0;
+  self->nresident = 1;
+  self->large = FALSE;
+  self->fd = -1;
+  self->file_name = NULL;
+  self->file_size = 0;
+  self->load_fd = -1;
+  self->load_buff = NULL;
+  }
+
+/*===========================================================================
+
+  text_file_create
+
+===========================================================================*/
+TextFile *text_file_create (void)
+  {
+  TextFile *self = malloc (sizeof (TextFile));
+  self->tab_stops = NULL;
+  self->modified = FALSE;
+  self->load_threads = 0;
+  self->large_min = -1;
+  self->load_chunks = 0;
+  self->load_pos = 0;
+  self->load_next = NULL;
+  self->load_error = 0;
+  self->changes = 0;
+  self->undo = NULL;
+  self->nundo = 0;
+  memset (self->noters, 0, sizeof (self->noters));
+  pthread_mutex_init (&self->read_lock, NULL);
+  text_file_reset (self);
+  return self;
+  }
+
+/*===========================================================================
+
+  text_file_is_loaded_line
+
+  Whether a line is still in the buffer its block was read into
+
+===========================================================================*/
+static BOOL text_file_is_loaded_line (const TextBlock *block,
+     const char *line)
+  {
+  return block->loaded && line >= block->loaded
+    && line <= block->loaded + block->loaded_len;
+  }
+
+/*===========================================================================
+
+  text_file_free_line
+
+===========================================================================*/
+static void text_file_free_line (TextBlock *block, char *line)
+  {
+  if (!text_file_is_loaded_line (block, line)) free (line);
+  }
+
+/*===========================================================================
+
+  text_file_free_text
+
+  Free the text of an edit that would undo a change, unless it is a 
+  line still in the buffer that a file all in memory was read into
+
+===========================================================================*/
+static void text_file_free_text (TextFile *self, char *text)
+  {
+  if (self->large || !text_file_is_loaded_line (&self->blocks[0], text))
+    free (text);
+  }
+
+/*===========================================================================
+
+  text_file_forget_undo
+
+===========================================================================*/
+static void text_file_forget_undo (TextFile *self)
+  {
+  if (!self->undo) return;
+  for (int i = 0; i < self->nundo; i++)
+    text_file_free_text (self, self->undo[i].text);
+  free (self->undo);
+  self->undo = NULL;
+  self->nundo = 0;
+  }
+
+/*===========================================================================
+
+  text_file_resize_line
+
+  Make the space for a line size bytes, which must be at least enough
+  for what is in it. A line that is still in the load buffer is copied
+  out of it
+
+===========================================================================*/
+static char *text_file_resize_line (TextBlock *block, int i, size_t size)
+  {
+  char *line = block->lines[i];
+  if (text_file_is_loaded_line (block, line))
+    {
+    block->lines[i] = malloc (size);
+    memcpy (block->lines[i], line, strlen (line) + 1);
+    }
+  else
+    block->lines[i] = realloc (line, size);
+  return block->lines[i];
+  }
+
+/*===========================================================================
+
+  text_file_make_room
+
+  Make room for at least n lines in a block. The room is doubled when it
+  runs out, so that adding lines one at a time, or a part of a file at
+  a time, doesn't copy the whole array each time
+
+===========================================================================*/
+static void text_file_make_room (TextBlock *block, int n)
+  {
+  if (n <= block->lines_size) return;
+  int size = block->lines_size * 2;
+  if (size < n) size = n;
+  char **lines = malloc (size * sizeof (char *));
+  ColIndex **col_index = malloc (size * sizeof (ColIndex *));
+  if (block->lines)
+    {
+    memcpy (lines, block->lines, block->nlines * sizeof (char *));
+    memcpy (col_index, block->col_index,
+      block->nlines * sizeof (ColIndex *));
+    free (block->lines);
+    free (block->col_index);
+    }
+  block->lines = lines;
+  block->col_index = col_index;
+  block->lines_size = size;
+  }
+
+/*===========================================================================
+
+  text_file_count_lines
+
+  Add delta lines to the count for a block, and so to the counts of the
+  tree nodes that include it
+
+===========================================================================*/
+static void text_file_count_lines (TextFile *self, int b, int delta)
+  {
+  self->blocks[b].nlines += delta;
+  self->nlines += delta;
+  for (int node = b + 1; node <= self->nblocks; node += node & -node)
+    self->tree[node] += delta;
+  }
+
+/*===========================================================================
+
+  text_file_add_block
+
+  Add a block, not yet read, after the last. A new tree node is the sum
+  of its own block and the nodes below it, which are all there already
+
+===========================================================================*/
+static void text_file_add_block (TextFile *self, off64_t start,
+     off64_t end, int nlines)
+  {
+  if (self->nblocks == self->blocks_size)
+    {
+    int size = self->blocks_size * 2;
+    if (size < 16) size = 16;
+    TextBlock *blocks = malloc (size * sizeof (TextBlock));
+    int *tree = malloc ((size + 1) * sizeof (int));
+    int *resident = malloc (size * sizeof (int));
+    memcpy (blocks, self->blocks, self->nblocks * sizeof (TextBlock));
+    memcpy (tree, self->tree, (self->nblocks + 1) * sizeof (int));
+    memcpy (resident, self->resident, self->nresident * sizeof (int));
+    free (self->blocks);
+    free (self->tree);
+    free (self->resident);
+    self->blocks = blocks;
+    self->tree = tree;
+    self->resident = resident;
+    self->blocks_size = size;
+    }
+  TextBlock *block = &self->blocks[self->nblocks];
+  memset (block, 0, sizeof (TextBlock));
+  block->start = start;
+  block->end = end;
+  block->nlines = nlines;
+  self->nblocks++;
+  int node = self->nblocks;
+  self->tree[node] = nlines;
+  for (int child = 1; child < (node & -node); child *= 2)
+    self->tree[node] += self->tree[node - child];
+  self->nlines += nlines;
+  }
+
+/*===========================================================================
+
+  text_file_block_at
+
+  The block that holds a line, and in *i the line's place in it. Walk
+  down the tree, taking each node whose lines all come before 'row'. If
+  row is the number of lines, returns the number of blocks
+
+===========================================================================*/
+static int text_file_block_at (const TextFile *self, int row, int *i)
+  {
+  if (self->nblocks == 1)
+    {
+    *i = row;
+    return 0;
+    }
+  int step = 1;
+  while (step * 2 <= self->nblocks) step *= 2;
+  int b = 0;
+  for (; step > 0; step /= 2)
+    {
+    if (b + step <= self->nblocks && self->tree[b + step] <= row)
+      {
+      b += step;
+      row -= self->tree[b];
+      }
+    }
+  *i = row;
+  return b;
+  }
+
+/*===========================================================================
+
+  text_file_read_block
+
+  Read a block of a large file, and split it into its lines. If the
+  file has changed since it was loaded, so the lines aren't what they
+  were, the block is given as many lines as it should have, but the
+  file can't be saved
+
+===========================================================================*/
+static void text_file_read_block (TextFile *self, int b)
+  {
+  TextBlock *block = &self->blocks[b];
+  size_t len = (size_t)(block->end - block->start);
+  char *buff = malloc (len + 1);
+  size_t pos = 0;
+  while (pos < len)
+    {
+    size_t want = len - pos;
+    if (want > LOAD_MAX_READ) want = LOAD_MAX_READ;
+    int n = pread64 (self->fd, buff + pos, (int)want, block->start + pos);
+    if (n <= 0)
+      {
+      self->load_error = n < 0 ? errno : EIO;
+      len = pos;
+      break;
+      }
+    pos += n;
+    }
+  buff[len] = 0;
+
+  int nlines = block->nlines;
+  block->loaded = buff;
+  block->loaded_len = len;
+  block->lines_size = nlines > 0 ? nlines : 1;
+  block->lines = malloc (block->lines_size * sizeof (char *));
+  block->col_index = malloc (block->lines_size * sizeof (ColIndex *));
+  // Every line but the last of the file ends in a newline
+  int found = len > 0;
+  if (found && nlines > 0) block->lines[0] = buff;
+  for (size_t i = 0; i < len; i++)
+    {
+    if (buff[i] == '\n')
+      {
+      buff[i] = 0;
+      if (i + 1 < len)
+        {
+        if (found < nlines) block->lines[found] = buff + i + 1;
+        found++;
+        }
+      }
+    }
+  if (found != nlines || (len > 0 && buff[len - 1] != 0
+       && b != self->nblocks - 1))
+    {
+    if (!self->load_error) self->load_error = EIO;
+    }
+  for (int n = found; n < nlines; n++) block->lines[n] = buff + len;
+  for (int i = 0; i < nlines; i++) block->col_index[i] = NULL;
+  self->resident[self->nresident++] = b;
+  // Another thread may see this without taking the lock, so it is set
+  //   only once the lines are
+  atomic_store (&block->resident, TRUE);
+  }
+
+/*===========================================================================
+
+  text_file_drop_block
+
+  Free the lines of a block, which must not have changed since it was
+  read or saved, so that it can be read again
+
+===========================================================================*/
+static void text_file_drop_block (TextFile *self, int b)
+  {
+  TextBlock *block = &self->blocks[b];
+  for (int i = 0; i < block->nlines; i++)
+    {
+    text_file_free_line (block, block->lines[i]);
+    if (block->col_index[i]) free (block->col_index[i]);
+    }
+  if (block->lines)
+    {
+    free (block->lines);
+    free (block->col_index);
+    }
+  if (block->loaded) free (block->loaded);
+  block->lines = NULL;
+  block->col_index = NULL;
+  block->lines_size = 0;
+  block->loaded = NULL;
+  block->loaded_len = 0;
+  block->resident = FALSE;
+  for (int k = 0; k < self->nresident; k++)
+    {
+    if (self->resident[k] == b)
+      {
+      self->resident[k] = self->resident[--self->nresident];
+      break;
+      }
+    }
+  }
+
+/*===========================================================================
+
+  text_file_find
+
+  The block that holds a line, read if necessary, and in *i the line's
+  place in it
+
+===========================================================================*/
+static TextBlock *text_file_find (const TextFile *self, int row, int *i)
+  {
+  int b = text_file_block_at (self, row, i);
+  TextBlock *block = &self->blocks[b];
+  // Reading a block doesn't change the text, so the file is const as
+  //   far as the caller is concerned
+  if (!atomic_load (&block->resident))
+    {
+    pthread_mutex_t *lock = (pthread_mutex_t *)&self->read_lock;
+    pthread_mutex_lock (lock);
+    if (!block->resident) text_file_read_block ((TextFile *)self, b);
+    pthread_mutex_unlock (lock);
+    }
+  return block;
+  }
+
+/*===========================================================================
+
+  text_file_find_end
+
+  The block that a line added after the last line goes in, and in *i
+  the place in it
+
+===========================================================================*/
+static TextBlock *text_file_find_end (TextFile *self, int *i)
+  {
+  if (self->nblocks == 0)
+    {
+    text_file_add_block (self, self->load_block, self->load_block, 0);
+    text_file_read_block (self, 0);
+    }
+  int b = self->nblocks - 1;
+  if (!self->blocks[b].resident) text_file_read_block (self, b);
+  *i = self->blocks[b].nlines;
+  return &self->blocks[b];
+  }
+
+/*===========================================================================
+
+  text_file_changed
+
+===========================================================================*/
+static void text_file_changed (TextFile *self, TextBlock *block)
+  {
+  block->dirty = TRUE;
+  self->modified = TRUE;
+  self->changes++;
+  }
+
+/*===========================================================================
+
+  text_file_note_run
+
+  Note for one noter that 'removed' lines at 'row' have been replaced by
+  'added' lines. The runs that touch those lines are merged with them
+  into one, and those after it move with the lines
+
+===========================================================================*/
+static void text_file_note_run (TextFileNoter *noter, int row, int removed,
+     int added)
+  {
+  // The first run that ends at or after the row
+  int lo = 0;
+  int hi = noter->n;
+  while (lo < hi)
+    {
+    int mid = (lo + hi) / 2;
+    if (noter->changed[mid].end < row)
+      lo = mid + 1;
+    else
+      hi = mid;
+    }
+  int first = row;
+  int end = row + removed;
+  int sum = 0;
+  int k = lo;
+  for (; k < noter->n && noter->changed[k].first <= row + removed; k++)
+    {
+    if (noter->changed[k].first < first) first = noter->changed[k].first;
+    if (noter->changed[k].end > end) end = noter->changed[k].end;
+    sum += noter->changed[k].added;
+    }
+  if (k == lo && noter->n == noter->size)
+    {
+    int size = noter->size > 0 ? noter->size * 2 : 16;
+    TextFileChange *changed = malloc (size * sizeof (TextFileChange));
+    if (noter->changed)
+      {
+      memcpy (changed, noter->changed, noter->n * sizeof (TextFileChange));
+      free (noter->changed);
+      }
+    noter->changed = changed;
+    noter->size = size;
+    }
+  // The runs from lo to k - 1 become one
+  if (k != lo + 1)
+    {
+    memmove (noter->changed + lo + 1, noter->changed + k,
+      (noter->n - k) * sizeof (TextFileChange));
+    noter->n += lo + 1 - k;
+    }
+  int delta = added - removed;
+  noter->changed[lo].first = first;
+  noter->changed[lo].end = end + delta;
+  noter->changed[lo].added = sum + delta;
+  for (int i = lo + 1; i < noter->n; i++)
+    {
+    noter->changed[i].first += delta;
+    noter->changed[i].end += delta;
+    }
+  }
+
+/*===========================================================================
+
+  text_file_note
+
+  Note that 'removed' lines at 'row' have been replaced by 'added' 
+  lines, for each thing that is noting changes
+
+===========================================================================*/
+static void text_file_note (TextFile *self, int row, int removed, 
+     int added)
+  {
+  for (int i = 0; i < TEXT_FILE_NOTERS; i++)
+    if (self->noters[i].on) 
+      text_file_note_run (&self->noters[i], row, removed, added);
+  }
+
+/*===========================================================================
+
+  text_file_open_lines
+
+  Make room for n lines at line i of a block, moving those after them
+  along. The new lines have no text yet
+
+===========================================================================*/
+static void text_file_open_lines (TextFile *self, TextBlock *block, int i,
+     int n)
+  {
+  text_file_make_room (block, block->nlines + n);
+  memmove (block->lines + i + n, block->lines + i,
+    (block->nlines - i) * sizeof (char *));
+  memmove (block->col_index + i + n, block->col_index + i,
+    (block->nlines - i) * sizeof (ColIndex *));
+  for (int k = i; k < i + n; k++) block->col_index[k] = NULL;
+  text_file_count_lines (self, block - self->blocks, n);
+  text_file_changed (self, block);
+  }
+
+/*===========================================================================
+
+  text_file_free_blocks
+
+===========================================================================*/
+static void text_file_free_blocks (TextFile *self)
+  {
+  text_file_forget_undo (self);
+  while (self->nresident > 0)
+    text_file_drop_block (self, self->resident[0]);
+  free (self->blocks);
+  free (self->tree);
+  free (self->resident);
+  if (self->load_fd >= 0 && self->load_fd != self->fd)
+    close (self->load_fd);
+  if (self->fd >= 0) close (self->fd);
+  if (self->file_name) free (self->file_name);
+  if (self->load_buff) free (self->load_buff);
+  }
+
+/*===========================================================================
+
+  text_file_unload
+
+  Discard everything loaded of a file that couldn't be read
+
+===========================================================================*/
+static void text_file_unload (TextFile *self)
+  {
+  text_file_free_blocks (self);
+  text_file_reset (self);
+  }
+
+/*===========================================================================
+
+  text_file_destroy
+
+===========================================================================*/
+void text_file_destroy (TextFile *self)
+  {
+  if (self)
+    {
+    text_file_free_blocks (self);
+    for (int i = 0; i < TEXT_FILE_NOTERS; i++)
+      if (self->noters[i].changed) free (self->noters[i].changed);
+    free (self);
+    }
+  }
+
+/*===========================================================================
+
+  text_file_set_load_threads
+
+===========================================================================*/
+void text_file_set_load_threads (TextFile *self, int threads)
+  {
+  self->load_threads = threads;
+  }
+
+/*===========================================================================
+
+  text_file_set_large_min
+
+===========================================================================*/
+void text_file_set_large_min (TextFile *self, off64_t bytes)
+  {
+  self->large_min = bytes;
+  }
+
+/*===========================================================================
+
+  text_file_is_large
+
+===========================================================================*/
+BOOL text_file_is_large (const TextFile *self)
+  {
+  return self->large;
+  }
+
+/*===========================================================================
+
+  text_file_trim
+
+===========================================================================*/
+void text_file_trim (TextFile *self, int row, int rows)
+  {
+  if (!self->large || self->nlines == 0) return;
+  int i;
+  int from = row - rows;
+  if (from < 0) from = 0;
+  int to = row + 2 * rows;
+  if (to > self->nlines - 1) to = self->nlines - 1;
+  int first = text_file_block_at (self, from, &i);
+  int last = text_file_block_at (self, to, &i);
+  for (int k = self->nresident - 1; k >= 0; k--)
+    {
+    int b = self->resident[k];
+    if ((b < first || b > last) && !self->blocks[b].dirty)
+      text_file_drop_block (self, b);
+    }
+  }
+
+/*===========================================================================
+
+  text_file_read_chunk
+
+  Read a chunk of the file into its place in the buffer, and count the
+  newlines in it. This runs on a thread of its own
+
+===========================================================================*/
+static void *text_file_read_chunk (void *arg)
+  {
+  TextFileChunk *chunk = arg;
+  char *buff = chunk->buff;
+  size_t pos = chunk->start;
+  while (pos < chunk->end)
+    {
+    size_t want = chunk->end - pos;
+    if (want > LOAD_MAX_READ) want = LOAD_MAX_READ;
+    int n = pread64 (chunk->fd, buff + pos, (int)want, chunk->base + pos);
+    if (n <= 0)
+      {
+      // The file got shorter since we found its size, if nothing 
+      //   was read
+      chunk->error = n < 0 ? errno : EIO;
+      return NULL;
+      }
+    pos += n;
+    }
+  int newlines = 0;
+  const char *last = NULL;
+  for (size_t i = chunk->start; i < chunk->end; i++)
+    {
+    if (buff[i] == '\n')
+      {
+      newlines++;
+      last = buff + i;
+      }
+    }
+  chunk->newlines = newlines;
+  chunk->last = last;
+  return NULL;
+  }
+
+/*===========================================================================
+
+  text_file_split_chunk
+
+  Turn the newlines in a chunk into NULs, and record where each of the
+  lines after them starts, even the one after a newline at the end of
+  what is loaded, which has no text yet. This runs on a thread of its own
+
+===========================================================================*/
+static void *text_file_split_chunk (void *arg)
+  {
+  TextFileChunk *chunk = arg;
+  TextBlock *block = &chunk->text_file->blocks[0];
+  char *buff = chunk->buff;
+  int n = chunk->first;
+  for (size_t i = chunk->start; i < chunk->end; i++)
+    {
+    if (buff[i] == '\n')
+      {
+      buff[i] = 0;
+      block->lines[n] = buff + i + 1;
+      block->col_index[n] = NULL;
+      n++;
+      }
+    }
+  return NULL;
+  }
+
+/*===========================================================================
+
+  text_file_index_chunk
+
+  Find the lines in a chunk of a large file that start a block. A line
+  that starts at the end of the file has no text, so isn't one. This
+  runs on a thread of its own
+
+===========================================================================*/
+static void *text_file_index_chunk (void *arg)
+  {
+  TextFileChunk *chunk = arg;
+  off64_t size = chunk->text_file->file_size;
+  const char *buff = chunk->buff;
+  off64_t prev = chunk->prev;
+  int line = chunk->first;
+  for (size_t i = chunk->start; i < chunk->end; i++)
+    {
+    if (buff[i] == '\n')
+      {
+      off64_t start = chunk->base + i + 1;
+      if (start < size && (line % BLOCK_LINES == 0
+           || start / BLOCK_BYTES != prev / BLOCK_BYTES))
+        {
+        chunk->bound[chunk->nbounds] = start;
+        chunk->bound_line[chunk->nbounds] = line;
+        chunk->nbounds++;
+        }
+      prev = start;
+      line++;
+      }
+    }
+  return NULL;
+  }
+
+/*===========================================================================
+
+  text_file_run_chunks
+
+  Run a function on every chunk, each on its own thread, except the 
+  first, which this thread does. A chunk whose thread can't be started
+  is done here too
+
+===========================================================================*/
+static void text_file_run_chunks (TextFileChunk *chunks, int nchunks,
+     void *(*fn)(void *))
+  {
+  pthread_t threads[LOAD_MAX_THREADS];
+  BOOL started[LOAD_MAX_THREADS];
+  for (int i = 1; i < nchunks; i++)
+    started[i] = pthread_create (&threads[i], NULL, fn, &chunks[i]) == 0;
+  fn (&chunks[0]);
+  for (int i = 1; i < nchunks; i++)
+    {
+    if (started[i])
+      pthread_join (threads[i], NULL);
+    else
+      fn (&chunks[i]);
+    }
+  }
+
+/*===========================================================================
+
+  text_file_large_min
+
+  The size above which a file is read a block at a time
+
+===========================================================================*/
+static off64_t text_file_large_min (const TextFile *self)
+  {
+  if (self->large_min >= 0) return self->large_min;
+  struct sysinfo info;
+  if (sysinfo (&info) != 0) return 256LL * 1024 * 1024;
+  return (off64_t)info.totalram * info.mem_unit / 4;
+  }
+
+/*===========================================================================
+
+  text_file_open_index
+
+  Get the blocks of a large file from the index saved beside it, if 
+  there is one that is still right. Returns FALSE if the file must be
+  read through to find them
+
+===========================================================================*/
+static BOOL text_file_open_index (TextFile *self)
+  {
+  LineIndex *index = line_index_open (self->file_name, self->fd);
+  if (!index) return FALSE;
+  const LineIndexEntry *entries = line_index_get_entries (index);
+  int count = line_index_get_count (index);
+  for (int i = 0; i < count; i++)
+    {
+    text_file_add_block (self, entries[i].start, 
+      i + 1 < count ? entries[i + 1].start : self->file_size, 
+      entries[i].nlines);
+    }
+  line_index_close (index);
+  self->load_pos = self->file_size;
+  self->load_fd = -1;
+  return TRUE;
+  }
+
+/*===========================================================================
+
+  text_file_save_index
+
+  Save where the blocks of a large file start beside it. If it can't
+  be saved, the file will have to be read through the next time
+
+===========================================================================*/
+static void text_file_save_index (const TextFile *self)
+  {
+  LineIndexEntry *entries = malloc (self->nblocks * sizeof (LineIndexEntry));
+  for (int b = 0; b < self->nblocks; b++)
+    {
+    entries[b].start = self->blocks[b].start;
+    entries[b].nlines = self->blocks[b].nlines;
+    entries[b].unused = 0;
+    }
+  line_index_save (self->file_name, self->fd, entries, self->nblocks);
+  free (entries);
+  }
+
+/*===========================================================================
+
+  text_file_load_open
+
+  Open a file, and make a buffer for the whole of it -- or, for a large
+  file, for a part of it -- but don't read any of it yet
+
+===========================================================================*/
+static BOOL text_file_load_open (TextFile *self, const char *file)
+  {
+  int fd = open (file, O_RDONLY | O_LARGEFILE);
+  if (fd < 0) return FALSE;
+  off64_t size = lseek64 (fd, 0, SEEK_END);
+  if (size < 0)
+    {
+    close (fd);
+    return FALSE;
+    }
+  int chunks = self->load_threads > 0 ? self->load_threads 
+    : get_nprocs ();
+  if (chunks > LOAD_MAX_THREADS) chunks = LOAD_MAX_THREADS;
+  if (chunks < 1) chunks = 1;
+
+  // A file too big for one buffer is large, whatever the setting
+  self->large = size > text_file_large_min (self)
+    || size > (off64_t)(~(size_t)0 >> 1);
+  if (self->large)
+    {
+    // There are no blocks until the first has been found
+    text_file_drop_block (self, 0);
+    self->nblocks = 0;
+    self->tree[1] = 0;
+    self->fd = fd;
+    self->file_name = strdup (file);
+    self->load_lines = 0;
+    self->load_line_start = 0;
+    self->load_block = 0;
+    self->load_block_line = 0;
+    }
+  else
+    {
+    TextBlock *block = &self->blocks[0];
+    block->loaded = malloc (size + 1);
+    block->loaded[size] = 0;
+    block->loaded_len = size;
+    block->end = size;
+    self->load_next = block->loaded;
+    }
+  self->file_size = size;
+  self->load_fd = fd;
+  self->load_chunks = chunks;
+  self->load_pos = 0;
+  self->load_error = 0;
+  self->modified = FALSE;
+  if (self->large && !text_file_open_index (self))
+    self->load_buff = malloc ((size_t)chunks * LOAD_MIN_CHUNK);
+  return TRUE;
+  }
+
+/*===========================================================================
+
+  text_file_load_lines
+
+  Add the lines of the chunks of a part of a file that fits in memory
+  to the end of the file
+
+===========================================================================*/
+static void text_file_load_lines (TextFile *self, TextFileChunk *chunks,
+     int nchunks, int newlines)
+  {
+  TextBlock *block = &self->blocks[0];
+  for (int i = 0; i < nchunks; i++)
+    {
+    chunks[i].first = block->nlines + newlines + 1;
+    newlines += chunks[i].newlines;
+    }
+  text_file_make_room (block, block->nlines + newlines + 1);
+  block->lines[block->nlines] = self->load_next;
+  block->col_index[block->nlines] = NULL;
+  text_file_run_chunks (chunks, nchunks, text_file_split_chunk);
+  text_file_count_lines (self, 0, newlines);
+  self->load_next = block->lines[block->nlines];
+
+  if (self->load_pos == self->file_size)
+    {
+    // The text after the last newline is a line, if there is any
+    if (self->load_next < block->loaded + block->loaded_len)
+      text_file_count_lines (self, 0, 1);
+    }
+  }
+
+/*===========================================================================
+
+  text_file_load_blocks
+
+  Add the blocks that the chunks of a part of a large file complete to
+  the end of the file
+
+===========================================================================*/
+static void text_file_load_blocks (TextFile *self, TextFileChunk *chunks,
+     int nchunks, int newlines)
+  {
+  // Each chunk starts in the line that the last newline before it
+  //   ends, and may have as many bounds as the numbers and the
+  //   BLOCK_BYTES it covers allow
+  off64_t prev = self->load_line_start;
+  for (int i = 0; i < nchunks; i++)
+    {
+    TextFileChunk *chunk = &chunks[i];
+    chunk->first = self->load_lines + newlines + 1;
+    chunk->prev = prev;
+    if (chunk->last) prev = chunk->base + (chunk->last - chunk->buff) + 1;
+    int most = chunk->newlines / BLOCK_LINES
+      + (int)((chunk->end - chunk->start) / BLOCK_BYTES) + 2;
+    chunk->bound = malloc (most * sizeof (off64_t));
+    chunk->bound_line = malloc (most * sizeof (int));
+    chunk->nbounds = 0;
+    newlines += chunk->newlines;
+    }
+  text_file_run_chunks (chunks, nchunks, text_file_index_chunk);
+
+  for (int i = 0; i < nchunks; i++)
+    {
+    TextFileChunk *chunk = &chunks[i];
+    for (int k = 0; k < chunk->nbounds; k++)
+      {
+      text_file_add_block (self, self->load_block, chunk->bound[k],
+        chunk->bound_line[k] - self->load_block_line);
+      self->load_block = chunk->bound[k];
+      self->load_block_line = chunk->bound_line[k];
+      }
+    free (chunk->bound);
+    free (chunk->bound_line);
+    }
+  self->load_lines += newlines;
+  self->load_line_start = prev;
+
+  if (self->load_pos == self->file_size)
+    {
+    // The text after the last newline is a line, if there is any
+    int tail = self->load_line_start < self->file_size;
+    text_file_add_block (self, self->load_block, self->file_size,
+      self->load_lines + tail - self->load_block_line);
+    free (self->load_buff);
+    self->load_buff = NULL;
+    // Lines added or removed while loading would make the index wrong
+    //   for the file as it is
+    if (!self->modified) text_file_save_index (self);
+    }
+  }
+
+/*===========================================================================
+
+  text_file_load_to
+
+  Load the file up to byte 'to', adding the lines that end before there
+  to the end of the file. If that is the end of the file, it is closed,
+  unless it is large, and its blocks have still to be read
+
+===========================================================================*/
+static BOOL text_file_load_to (TextFile *self, off64_t to)
+  {
+  off64_t from = self->load_pos;
+  size_t len = (size_t)(to - from);
+  int nchunks = self->load_chunks;
+  if ((size_t)nchunks > len / LOAD_MIN_CHUNK) 
+    nchunks = (int)(len / LOAD_MIN_CHUNK);
+  if (nchunks < 1) nchunks = 1;
+
+  // A large file is read a part at a time into the same buffer; any
+  //   other into its place in the block
+  char *buff = self->large ? self->load_buff : self->blocks[0].loaded;
+  off64_t base = self->large ? from : 0;
+  size_t first = (size_t)(from - base);
+  TextFileChunk chunks[LOAD_MAX_THREADS];
+  for (int i = 0; i < nchunks; i++)
+    {
+    TextFileChunk *chunk = &chunks[i];
+    chunk->text_file = self;
+    chunk->fd = self->load_fd;
+    chunk->buff = buff;
+    chunk->base = base;
+    chunk->start = first + len / nchunks * i;
+    chunk->end = i == nchunks - 1 ? first + len
+      : first + len / nchunks * (i + 1);
+    chunk->newlines = 0;
+    chunk->last = NULL;
+    chunk->error = 0;
+    }
+  text_file_run_chunks (chunks, nchunks, text_file_read_chunk);
+
+  for (int i = 0; i < nchunks; i++)
+    {
+    if (chunks[i].error)
+      {
+      if (self->load_fd != self->fd) close (self->load_fd);
+      self->load_fd = -1;
+      self->load_error = chunks[i].error;
+      errno = chunks[i].error;
+      return FALSE;
+      }
+    }
+  // Each chunk's lines are numbered on from those of the chunks before,
+  //   and the first follow the lines already loaded
+  self->load_pos = to;
+  if (self->large)
+    text_file_load_blocks (self, chunks, nchunks, 0);
+  else
+    text_file_load_lines (self, chunks, nchunks, 0);
+
+  if (to == self->file_size)
+    {
+    if (self->load_fd != self->fd) close (self->load_fd);
+    self->load_fd = -1;
+    }
+  return TRUE;
+  }
+
+/*===========================================================================
+
+  text_file_part
+
+  The end of the next part of the file to load a part at a time
+
+===========================================================================*/
+static off64_t text_file_part (const TextFile *self, off64_t size)
+  {
+  off64_t to = self->load_pos + size;
+  return to < self->file_size ? to : self->file_size;
+  }
+
+/*===========================================================================
+
+  text_file_load_rest
+
+  Load whatever is left of the file. A large file is read through a 
+  buffer of one part
+
+===========================================================================*/
+static BOOL text_file_load_rest (TextFile *self)
+  {
+  while (self->load_fd >= 0)
+    {
+    off64_t to = self->large ? text_file_part (self,
+      (off64_t)self->load_chunks * LOAD_MIN_CHUNK) : self->file_size;
+    if (!text_file_load_to (self, to)) return FALSE;
+    }
+  return TRUE;
+  }
+
+/*===========================================================================
+
+  text_file_load
+
+===========================================================================*/
+BOOL text_file_load (TextFile *self, const char *file)
+  {
+  if (!text_file_load_open (self, file)) return FALSE;
+  if (!text_file_load_rest (self))
+    {
+    text_file_unload (self);
+    return FALSE;
+    }
+  return TRUE;
+  }
+
+/*===========================================================================
+
+  text_file_load_start
+
+  A large file has no lines until the first block is complete, so the
+  first part of it is a whole part
+
+===========================================================================*/
+BOOL text_file_load_start (TextFile *self, const char *file)
+  {
+  if (!text_file_load_open (self, file)) return FALSE;
+  // There is nothing to load if the blocks were in the saved index
+  if (self->load_fd < 0) return TRUE;
+  off64_t to = text_file_part (self, self->large
+    ? (off64_t)self->load_chunks * LOAD_MIN_CHUNK : LOAD_FIRST);
+  if (!text_file_load_to (self, to))
+    {
+    text_file_unload (self);
+    return FALSE;
+    }
+  return TRUE;
+  }
+
+/*===========================================================================
+
+  text_file_load_more
+
+===========================================================================*/
+BOOL text_file_load_more (TextFile *self)
+  {
+  if (self->load_fd < 0) return TRUE;
+  return text_file_load_to (self, text_file_part (self,
+    (off64_t)self->load_chunks * LOAD_MIN_CHUNK));
+  }
+
+/*===========================================================================
+
+  text_file_is_loading
+
+===========================================================================*/
+BOOL text_file_is_loading (const TextFile *self)
+  {
+  return self->load_fd >= 0;
+  }
+
+/*===========================================================================
+
+  text_file_get_load_percent
+
+===========================================================================*/
+int text_file_get_load_percent (const TextFile *self)
+  {
+  if (self->file_size == 0) return 100;
+  // The sum is done in an int, as a 32-bit machine has no instruction
+  //   to divide 64-bit numbers
+  off64_t pos = self->load_pos;
+  off64_t size = self->file_size;
+  while (size > 0xffffff)
+    {
+    pos >>= 8;
+    size >>= 8;
+    }
+  return (int)pos * 100 / (int)size;
+  }
+
+/*===========================================================================
+
+  text_file_copy_block
+
+  Copy a block of a large file, which hasn't changed, from the file to
+  the file being saved, through buff, of LOAD_MIN_CHUNK bytes. The last
+  line gets a newline, if it hasn't one. Returns the bytes written, or
+  -1, with errno set, if the file can't be read
+
+===========================================================================*/
+static off64_t text_file_copy_block (TextFile *self, const TextBlock *block,
+     char *buff, FILE *f)
+  {
+  off64_t pos = block->start;
+  char last = '\n';
+  while (pos < block->end)
+    {
+    off64_t want = block->end - pos;
+    if (want > LOAD_MIN_CHUNK) want = LOAD_MIN_CHUNK;
+    int n = pread64 (self->fd, buff, (int)want, pos);
+    if (n <= 0)
+      {
+      if (n == 0) errno = EIO;
+      return -1;
+      }
+    fwrite (buff, 1, n, f);
+    last = buff[n - 1];
+    pos += n;
+    }
+  if (last != '\n') fputc ('\n', f);
+  return block->end - block->start + (last != '\n');
+  }
+
+/*===========================================================================
+
+  text_file_copy_back
+
+  Copy the file just saved, open as from, over the file that it is to
+  replace, in place, through buff, of LOAD_MIN_CHUNK bytes. Returns 
+  FALSE, with errno set, if it can't all be copied and synced
+
+===========================================================================*/
+static BOOL text_file_copy_back (int from, const char *file, char *buff)
+  {
+  int fd = open (file, O_WRONLY | O_TRUNC | O_LARGEFILE);
+  if (fd < 0) return FALSE;
+  BOOL ok = TRUE;
+  off64_t pos = 0;
+  int n;
+  while (ok && (n = pread64 (from, buff, LOAD_MIN_CHUNK, pos)) > 0)
+    {
+    for (int done = 0; ok && done < n; )
+      {
+      int w = write (fd, buff + done, n - done);
+      if (w == 0) errno = EIO;
+      ok = w > 0;
+      if (ok) done += w;
+      }
+    pos += n;
+    }
+  if (ok && n < 0) ok = FALSE;
+  if (ok && fsync (fd) != 0) ok = FALSE;
+  int error = errno;
+  close (fd);
+  errno = error;
+  return ok;
+  }
+
+/*===========================================================================
+
+  text_file_use_saved
+
+  Read the blocks of a large file from fd from now on, where they were
+  written when it was saved, starting at starts, with the end of the
+  last at starts[nblocks]. fd may be the file that is open already,
+  written over in place
+
+===========================================================================*/
+static void text_file_use_saved (TextFile *self, int fd, 
+    const off64_t *starts)
+  {
+  if (fd != self->fd) close (self->fd);
+  self->fd = fd;
+  for (int b = 0; b < self->nblocks; b++)
+    {
+    self->blocks[b].start = starts[b];
+    self->blocks[b].end = starts[b + 1];
+    self->blocks[b].dirty = FALSE;
+    }
+  self->file_size = starts[self->nblocks];
+  }
+
+/*===========================================================================
+
+  text_file_save_large
+
+  Write a large file to a new file, and read the blocks from there from
+  then on. Blocks that haven't changed are copied without being split 
+  into lines. The new file is made afresh, so a link left at its name
+  isn't followed, and synced, and then renamed over the old one, with
+  its owner and permissions. If the old file has other links, or its 
+  owner can't be given to the new one, the new one is copied back over
+  it instead, so that they are kept; if that fails part way, the new 
+  one is kept, and the blocks are read from it
+
+===========================================================================*/
+static BOOL text_file_save_large (TextFile *self, const char *file)
+  {
+  BOOL ret = FALSE;
+  struct stat open_st;
+  if (fstat (self->fd, &open_st) != 0) return FALSE;
+  // When saving under another name, what is already there is the file
+  //   whose owner and permissions are kept
+  struct stat st = open_st;
+  BOOL exists = FALSE;
+  int old_fd = open (file, O_RDONLY | O_LARGEFILE);
+  if (old_fd >= 0)
+    {
+    exists = fstat (old_fd, &st) == 0;
+    close (old_fd);
+    }
+  // Whether the file written over is the one the blocks are read from
+  BOOL same = exists && st.st_dev == open_st.st_dev 
+    && st.st_ino == open_st.st_ino;
+  char *temp = str2 (file, ".bute-save");
+  int fd = open (temp, O_WRONLY | O_CREAT | O_EXCL | O_LARGEFILE);
+  if (fd < 0 && errno == EEXIST)
+    {
+    // Left by a save that didn't finish
+    unlink (temp);
+    fd = open (temp, O_WRONLY | O_CREAT | O_EXCL | O_LARGEFILE);
+    }
+  if (fd >= 0)
+    {
+    BOOL in_place = exists && (st.st_nlink > 1
+      || fchown (fd, st.st_uid, st.st_gid) != 0);
+    // After the owner, which would clear set-user-ID
+    fchmod (fd, st.st_mode & 07777);
+    FILE *f = fdopen (fd, "w");
+    char *buff = malloc (LOAD_MIN_CHUNK);
+    off64_t *starts = malloc ((self->nblocks + 1) * sizeof (off64_t));
+    off64_t pos = 0;
+    BOOL ok = TRUE;
+    for (int b = 0; b < self->nblocks && ok; b++)
+      {
+      TextBlock *block = &self->blocks[b];
+      starts[b] = pos;
+      if (block->dirty)
+        {
+        for (int i = 0; i < block->nlines; i++)
+          {
+          fputs (block->lines[i], f);
+          fputs ("\n", f);
+          pos += strlen (block->lines[i]) + 1;
+          }
+        }
+      else
+        {
+        off64_t n = text_file_copy_block (self, block, buff, f);
+        ok = n >= 0;
+        pos += n;
+        }
+      }
+    starts[self->nblocks] = pos;
+    fflush (f);
+    if (ok && ferror (f))
+      {
+      ok = FALSE;
+      errno = EIO;
+      }
+    // Synced before it replaces the old file, so that a crash leaves
+    //   one or the other whole
+    if (ok && fsync (fd) != 0) ok = FALSE;
+    int error = errno;
+    fclose (f);
+    BOOL keep_temp = FALSE;
+    if (ok && !in_place && rename (temp, file) != 0)
+      {
+      ok = FALSE;
+      error = errno;
+      }
+    if (ok && in_place)
+      {
+      int temp_fd = open (temp, O_RDONLY | O_LARGEFILE);
+      if (temp_fd >= 0 && text_file_copy_back (temp_fd, file, buff))
+        {
+        close (temp_fd);
+        unlink (temp);
+        }
+      else
+        {
+        ok = FALSE;
+        error = errno;
+        // The old file may be half written, so the text is read from 
+        //   the new one, which is kept
+        if (temp_fd >= 0 && same)
+          {
+          text_file_use_saved (self, temp_fd, starts);
+          keep_temp = TRUE;
+          }
+        else if (temp_fd >= 0)
+          close (temp_fd);
+        }
+      }
+    free (buff);
+    if (ok)
+      {
+      // The blocks are where they were written in the new file. If 
+      //   that can't be opened, they are still in the old one, which
+      //   stays open -- unless it was written over in place, when the
+      //   one open is the new one
+      int new_fd = open (file, O_RDONLY | O_LARGEFILE);
+      if (new_fd < 0 && in_place && same) new_fd = self->fd;
+      if (new_fd >= 0)
+        {
+        text_file_use_saved (self, new_fd, starts);
+        free (self->file_name);
+        self->file_name = strdup (file);
+        text_file_save_index (self);
+        }
+      self->modified = FALSE;
+      ret = TRUE;
+      }
+    else
+      {
+      if (!keep_temp) unlink (temp);
+      errno = error;
+      }
+    free (starts);
+    }
+  free (temp);
+  return ret;
+  }
+
+/*===========================================================================
+
+  text_file_save
+
+===========================================================================*/
+BOOL text_file_save (TextFile *self, const char *file)
+  {
+  BOOL ret = FALSE;
+  // What is loaded of a file that couldn't all be read would replace
+  //   the whole of it
+  text_file_load_rest (self);
+  if (self->load_error)
+    {
+    errno = self->load_error;
+    return FALSE;
+    }
+  if (self->large) return text_file_save_large (self, file);
+  FILE *f = fopen (file, "w");
+  if (f)
+    {
+    TextBlock *block = &self->blocks[0];
+    for (int i = 0; i < block->nlines; i++)
+      {
+      fputs (block->lines[i], f);
+      fputs ("\n", f);
+      }
+    fflush (f);
+    fclose (f);
+    ret = TRUE;
+    self->modified = FALSE;
+    }
+  return ret;
+  }
+
+/*===========================================================================
+
+  text_file_get_line_count
+
 ===========================================================================*/
-#include "textfile.h"
+size_t text_file_get_line_count (const TextFile *self)
+  {
+  return self->nlines;
+  }
 
-typedef struct _TextFile
+/*===========================================================================
+
+  text_file_get_line
+
+===========================================================================*/
+const char *text_file_get_line (const TextFile *self, int n)
   {
-  int nlines;
-  char **lines;
-  BOOL modified;
-  } TextFile;
+  int i;
+  TextBlock *block = text_file_find (self, n, &i);
+  return block->lines[i];
+  }
 
 /*===========================================================================
 
-  text_file_create
+  text_file_get_lines
 
 ===========================================================================*/
-TextFile *text_file_create (void)
+const char * const *text_file_get_lines (const TextFile *self, int row,
+     int *first, int *n)
   {
-  TextFile *self = malloc (sizeof (TextFile));
-  self->nlines = 0;
-  self->modified = FALSE;
-  return self;
+  int i;
+  TextBlock *block = text_file_find (self, row, &i);
+  *first = row - i;
+  *n = block->nlines;
+  return (const char * const *)block->lines;
   }
 
 /*===========================================================================
 
-  text_file_destroy
+  text_file_get_block_start
 
 ===========================================================================*/
-void text_file_destroy (TextFile *self)
+int text_file_get_block_start (const TextFile *self, int row, int *n)
   {
-  if (self)
+  int i;
+  int b = text_file_block_at (self, row, &i);
+  *n = b < self->nblocks ? self->blocks[b].nlines : 0;
+  return row - i;
+  }
+
+/*===========================================================================
+
+  text_file_get_block_text
+
+===========================================================================*/
+const char *text_file_get_block_text (const TextFile *self, int row, 
+     size_t *len)
+  {
+  int i;
+  TextBlock *block = text_file_find (self, row, &i);
+  *len = block->loaded_len;
+  return block->loaded;
+  }
+
+/*===========================================================================
+
+  text_file_set_tab_stops
+
+===========================================================================*/
+void text_file_set_tab_stops (TextFile *self, const TabStops *tab_stops)
+  {
+  self->tab_stops = tab_stops;
+  for (int k = 0; k < self->nresident; k++)
     {
-    if (self->lines)
+    TextBlock *block = &self->blocks[self->resident[k]];
+    for (int i = 0; i < block->nlines; i++)
       {
-      for (int i = 0; i < self->nlines; i++)
-        free (self->lines[i]);
-      free (self->lines);
+      if (block->col_index[i])
+        {
+        free (block->col_index[i]);
+        block->col_index[i] = NULL;
+        }
       }
-    free (self);
     }
   }
 
 /*===========================================================================
 
-  text_file_load
+  text_file_forget_cols
+
+  Discard the display column index of a line that has changed
 
 ===========================================================================*/
-BOOL text_file_load (TextFile *self, const char *file)
+static void text_file_forget_cols (TextBlock *block, int i)
   {
-  BOOL ret = TRUE;
-  FILE *f = fopen (file, "r");
-  if (f)
+  if (block->col_index[i])
+    {
+    free (block->col_index[i]);
+    block->col_index[i] = NULL;
+    }
+  }
+
+/*===========================================================================
+
+  text_file_scan
+
+  Move along a line from position i, at display column *col, until
+  position 'end' (if it is not negative) or the end of the line, keeping
+  track of the column. 
+  Runs of bytes that are each one column wide are passed over in one 
+  step. A multi-byte character is passed over whole, so the result may 
+  be a little beyond 'end'.
+
+===========================================================================*/
+static int text_file_scan (const TextFile *self, const char *line, int i, 
+      int end, int *col)
+  {
+  while ((end < 0 || i < end) && line[i])
     {
-    char line[1024]; // TODO -- allow variable line length
-    while (fgets (line, sizeof (line), f))
+    int run = utf8_plain_run (line + i, end < 0 ? -1 : end - i);
+    i += run;
+    *col += run;
+    if ((end >= 0 && i >= end) || line[i] == 0) break;
+    if (line[i] == '\t')
       {
-      self->nlines++;
+      *col = tab_stops_next (self->tab_stops, *col);
+      i++;
       }
-    fseek (f, 0, SEEK_SET);
- 
-    self->lines = malloc (self->nlines * sizeof (char *));    
-
-    int n = 0;
-    while (fgets (line, sizeof (line), f))
+    else
       {
-      if (line [strlen (line) - 1] == 10)
-        line [strlen (line) - 1] = 0;
-      self->lines[n] = strdup (line); 
-      n++;
+      int width;
+      i += utf8_char (line + i, &width);
+      *col += width;
       }
-    fclose (f);
-    self->modified = FALSE;
     }
-  else
-    ret = FALSE;
-  
-  return ret;
+  return i;
   }
 
 /*===========================================================================
 
-  text_file_save
+  text_file_add_checks
+
+  Add checkpoints to a display column index, every COL_INDEX_STEP bytes
+  or so from the last one, up to position 'end', or the end of the line
+  if 'end' is negative. Returns the position reached, which may be a 
+  little beyond 'end', and the column there in *col
 
 ===========================================================================*/
-BOOL text_file_save (TextFile *self, const char *file)
+static int text_file_add_checks (const TextFile *self, const char *line,
+     ColIndex *index, int end, int *col)
   {
-  BOOL ret = FALSE;
-  FILE *f = fopen (file, "w");
-  if (f)
+  int pos = index->check[index->n - 1][0];
+  *col = index->check[index->n - 1][1];
+  for (;;)
+    {
+    int next = pos + COL_INDEX_STEP;
+    if (end >= 0 && next > end) next = end;
+    pos = text_file_scan (self, line, pos, next, col);
+    if (line[pos] == 0 || (end >= 0 && pos >= end)) return pos;
+    index->check[index->n][0] = pos;
+    index->check[index->n][1] = *col;
+    index->n++;
+    }
+  }
+
+/*===========================================================================
+
+  text_file_find_check
+
+  Find the last checkpoint of a display column index at or before 
+  position pos, by binary search
+
+===========================================================================*/
+static int text_file_find_check (const ColIndex *index, int pos)
+  {
+  int lo = 0, hi = index->n - 1;
+  while (lo < hi)
+    {
+    int mid = (lo + hi + 1) / 2;
+    if (index->check[mid][0] <= pos) 
+      lo = mid;
+    else
+      hi = mid - 1;
+    }
+  return lo;
+  }
+
+/*===========================================================================
+
+  text_file_get_col_index
+
+  Get the display column index of line i of a block, working it out if
+  necessary
+
+===========================================================================*/
+static const ColIndex *text_file_get_col_index (TextFile *self,
+     TextBlock *block, int i)
+  {
+  if (!block->col_index[i])
+    {
+    const char *line = block->lines[i];
+    int len = strlen (line);
+    int n = len / COL_INDEX_STEP + 1;
+    ColIndex *index = malloc (sizeof (ColIndex) + n * sizeof (int[2]));
+    index->ascii = utf8_ascii_run (line, len) == len;
+    index->tabs = memchr (line, '\t', len) != NULL;
+    index->len = len;
+    index->n = 1;
+    index->check[0][0] = 0;
+    index->check[0][1] = 0;
+    text_file_add_checks (self, line, index, -1, &index->width);
+    block->col_index[i] = index;
+    }
+  return block->col_index[i];
+  }
+
+/*===========================================================================
+
+  text_file_edit_cols
+
+  Bring the display column index of line i of a block up to date, if it
+  has one, after 'removed' bytes at position 'at' have been replaced by
+  'added' bytes. The checkpoints up to the edit still hold. If the line
+  has no tabs, a column is the same width wherever it is, so the ones
+  after the edit move by as many bytes and columns as the text after it
+  does, and only the text between is scanned; otherwise, the line is 
+  scanned from the edit to the end
+
+===========================================================================*/
+static void text_file_edit_cols (TextFile *self, TextBlock *block, int i,
+     int at, int removed, int added)
+  {
+  ColIndex *old = block->col_index[i];
+  if (!old) return;
+  const char *line = block->lines[i];
+  int len = old->len - removed + added;
+  // How a character is read may depend on up to three bytes after it
+  //   starts, if it is not properly encoded, so those a little before
+  //   the edit may now end elsewhere
+  int k0 = text_file_find_check (old, at - 4);
+  int k1 = text_file_find_check (old, at + removed - 1) + 1;
+  if (k1 <= k0) k1 = k0 + 1;
+  int moved = old->n - k1;
+  int most = k0 + 1 + (len - old->check[k0][0]) / COL_INDEX_STEP + moved;
+  ColIndex *index = malloc (sizeof (ColIndex) + most * sizeof (int[2]));
+  index->ascii = old->ascii && utf8_ascii_run (line + at, added) == added;
+  index->tabs = old->tabs || memchr (line + at, '\t', added) != NULL;
+  index->len = len;
+  index->n = k0 + 1;
+  memcpy (index->check, old->check, index->n * sizeof (int[2]));
+  BOOL done = FALSE;
+  if (!index->tabs && moved > 0)
     {
-    for (int i = 0; i < self->nlines; i++)
+    int shift = added - removed;
+    int end = old->check[k1][0] + shift;
+    int col;
+    // The text after the edit may not split into characters in the same
+    //   way, if the edit left part of a character, when the scan goes
+    //   past where the checkpoint would move to
+    if (text_file_add_checks (self, line, index, end, &col) == end)
       {
-      fputs (self->lines[i], f);
-      fputs ("\n", f);
+      int dcol = col - old->check[k1][1];
+      // Where text was removed right after a checkpoint, the next one
+      //   moves onto it
+      if (end == index->check[index->n - 1][0]) k1++;
+      for (int k = k1; k < old->n; k++)
+        {
+        index->check[index->n][0] = old->check[k][0] + shift;
+        index->check[index->n][1] = old->check[k][1] + dcol;
+        index->n++;
+        }
+      index->width = old->width + dcol;
+      done = TRUE;
       }
-    fflush (f);
-    fclose (f);
-    ret = TRUE;
-    self->modified = FALSE;
     }
-  return ret;
+  if (!done) text_file_add_checks (self, line, index, -1, &index->width);
+  free (old);
+  block->col_index[i] = index;
   }
 
 /*===========================================================================
 
-  text_file_get_line_count
+  text_file_get_display_col
 
 ===========================================================================*/
-size_t text_file_get_line_count (const TextFile *self)
+int text_file_get_display_col (TextFile *self, int row, int col)
   {
-  return self->nlines;
+  int n;
+  TextBlock *block = text_file_find (self, row, &n);
+  const char *line = block->lines[n];
+  const ColIndex *index = text_file_get_col_index (self, block, n);
+  int k = text_file_find_check (index, col);
+  int dcol = index->check[k][1];
+  int i = text_file_scan (self, line, index->check[k][0], col, &dcol);
+  // Positions beyond the end of the line count as one column each
+  if (line[i] == 0 && i < col) dcol += col - i;
+  return dcol;
   }
 
 /*===========================================================================
 
-  text_file_get_line
+  text_file_get_display_width
+
+  If the line has a column index, the width is recorded there. Otherwise
+  the line is measured without making an index, because this may be 
+  done for every line in the file.
 
 ===========================================================================*/
-const char *text_file_get_line (const TextFile *self, int n)
+int text_file_get_display_width (const TextFile *self, int row)
+  {
+  int n;
+  const TextBlock *block = text_file_find (self, row, &n);
+  const ColIndex *index = block->col_index[n];
+  if (index) return index->width;
+  int col = 0;
+  text_file_scan (self, block->lines[n], 0, -1, &col);
+  return col;
+  }
+
+/*===========================================================================
+
+  text_file_get_col_at_display
+
+  Find the checkpoint at or before the display column by binary search,
+  then scan forward from it. On an ASCII line, the scan goes a byte at a
+  time; otherwise, a character at a time.
+
+===========================================================================*/
+int text_file_get_col_at_display (TextFile *self, int row, int dcol)
   {
-  return self->lines[n];
+  int n;
+  TextBlock *block = text_file_find (self, row, &n);
+  const char *line = block->lines[n];
+  const ColIndex *index = text_file_get_col_index (self, block, n);
+  int lo = 0, hi = index->n - 1;
+  while (lo < hi)
+    {
+    int mid = (lo + hi + 1) / 2;
+    if (index->check[mid][1] <= dcol) 
+      lo = mid;
+    else
+      hi = mid - 1;
+    }
+  int i = index->check[lo][0];
+  int col = index->check[lo][1];
+  while (line[i])
+    {
+    int next = col;
+    int len = 1;
+    if (line[i] == '\t')
+      next = tab_stops_next (self->tab_stops, col);
+    else if (index->ascii)
+      next++;
+    else
+      {
+      int width;
+      len = utf8_next (line, i) - i;
+      utf8_char (line + i, &width);
+      next += width;
+      }
+    if (next > dcol) break;
+    col = next;
+    i += len;
+    }
+  return i;
   }
 
 /*===========================================================================
 
   text_file_insert_blank_line_at
-  
+
   Insert a new line at specified row.
 
-  row can be == nlines, to get a new line at the start of file. 
+  row can be == nlines, to get a new line at the end of file.
 
 ===========================================================================*/
 void text_file_insert_blank_line_at (TextFile *self, int row)
   {
-  self->nlines++;
-  self->lines = realloc (self->lines, self->nlines * sizeof (char *));
-  for (int i = self->nlines - 1; i < row; i--)
-    self->lines[i] = self->lines[i - 1];
-  self->lines[row] = malloc (1);
-  self->lines[row][0] = 0;
-  self->modified = TRUE;
+  int i;
+  TextBlock *block = row < self->nlines ? text_file_find (self, row, &i)
+    : text_file_find_end (self, &i);
+  text_file_note (self, row, 0, 1);
+  text_file_open_lines (self, block, i, 1);
+  block->lines[i] = malloc (1);
+  block->lines[i][0] = 0;
   }
 
 /*===========================================================================
 
   text_file_insert_blank_line
-  
+
   Insert a new line after row.
 
   The row indicated by row arg is unchanged. The next line is a blank
   line.
-  
+
   row can be == nlines, to get a new line on the end of the file. However,
   if row is > nlines, it will crash
 
 ===========================================================================*/
 void text_file_insert_blank_line (TextFile *self, int row)
   {
-  self->nlines++;
-  self->lines = realloc (self->lines, self->nlines * sizeof (char *));
-  for (int i = self->nlines - 1; i > row; i--)
-    self->lines[i] = self->lines[i - 1];
-  self->lines[row + 1] = malloc (1);
-  self->lines[row + 1][0] = 0;
-  self->modified = TRUE;
+  int i;
+  TextBlock *block;
+  if (row < self->nlines)
+    {
+    // The line goes in the same block as the one it follows
+    block = text_file_find (self, row, &i);
+    i++;
+    }
+  else
+    block = text_file_find_end (self, &i);
+  text_file_note (self, row < self->nlines ? row + 1 : self->nlines, 0, 1);
+  text_file_open_lines (self, block, i, 1);
+  block->lines[i] = malloc (1);
+  block->lines[i][0] = 0;
   }
 
 /*===========================================================================
@@ -184,17 +2045,21 @@ void text_file_insert_blank_line (TextFile *self, int row)
 ===========================================================================*/
 void text_file_insert_newline (TextFile *self, int row, int col)
   {
-  char *line = self->lines[row];
+  int i;
+  TextBlock *block = text_file_find (self, row, &i);
+  char *line = block->lines[i];
   int len = strlen (line);
 
   text_file_insert_blank_line (self, row);
   if (col < len)
     {
-    free (self->lines[row + 1]);
-    self->lines[row + 1] = strdup (self->lines[row] + col);
+    free (block->lines[i + 1]);
+    block->lines[i + 1] = strdup (line + col);
     }
   line[col] = 0;
-  self->modified = TRUE;
+  if (col < len) text_file_edit_cols (self, block, i, col, len - col, 0);
+  text_file_note (self, row, 1, 1);
+  text_file_changed (self, block);
   }
 
 
@@ -207,17 +2072,24 @@ void text_file_replace_char (TextFile *self, int row, int col, int c)
   {
   if (row < self->nlines)
     {
-    char *line = self->lines[row];
+    int n;
+    TextBlock *block = text_file_find (self, row, &n);
+    char *line = block->lines[n];
     int len = strlen (line);
     if (col > len - 1)
       {
-      self->lines[row] = realloc (self->lines[row], 
-        (col + 1) * sizeof (char)); 
+      line = text_file_resize_line (block, n, (col + 2) * sizeof (char));
       for (int i = len; i < col; i++)
-        self->lines[row][i] = (char)' ';
+        line[i] = (char)' ';
+      line[col + 1] = 0;
       }
-    self->lines[row][col] = (char)c;
-    self->modified = TRUE;
+    line[col] = (char)c;
+    if (col < len)
+      text_file_edit_cols (self, block, n, col, 1, 1);
+    else
+      text_file_edit_cols (self, block, n, len, 0, col + 1 - len);
+    text_file_note (self, row, 1, 1);
+    text_file_changed (self, block);
     }
   else
     {
@@ -234,18 +2106,83 @@ void text_file_insert_char (TextFile *self, int row, int col, int c)
   {
   if (row < self->nlines)
     {
-    char *line = self->lines[row];
-    int len = strlen (line);
+    int n;
+    TextBlock *block = text_file_find (self, row, &n);
+    int len = strlen (block->lines[n]);
 
     // Expand line by one character
-    self->lines[row] = realloc (self->lines[row], 
-        (len + 2) * sizeof (char)); 
-    
+    char *line = text_file_resize_line (block, n, (len + 2) * sizeof (char));
+
     // Move everything from col to len up one place
-    memmove (self->lines[row] + col + 1, self->lines[row] + col, len - col + 1);
+    memmove (line + col + 1, line + col, len - col + 1);
+
+    line[col] = (char)c;
+    text_file_edit_cols (self, block, n, col, 0, 1);
+    text_file_note (self, row, 1, 1);
+    text_file_changed (self, block);
+    }
+  else
+    {
+    // What can we do here?
+    }
+  }
+
+/*===========================================================================
+
+  text_file_insert_text
+
+  All the new lines are added to the line array in one step, so the 
+  cost is proportional to the size of the text and the number of lines
+  that follow the insertion point, however many newlines the text 
+  contains.
+
+===========================================================================*/
+void text_file_insert_text (TextFile *self, int row, int col, 
+       const char *text, int len)
+  {
+  if (row < self->nlines)
+    {
+    int i;
+    TextBlock *block = text_file_find (self, row, &i);
+    char *line = block->lines[i];
+    int linelen = strlen (line);
+    if (col > linelen) col = linelen;
 
-    self->lines[row][col] = (char)c;
-    self->modified = TRUE;
+    int newlines = 0;
+    for (int k = 0; k < len; k++)
+      if (text[k] == '\n') newlines++;
+
+    // Without a newline, the index of the line is brought up to date
+    //   once the text is in it
+    if (newlines > 0) text_file_forget_cols (block, i);
+    if (newlines > 0) text_file_open_lines (self, block, i + 1, newlines);
+
+    // The text after the insertion point ends up on the last line
+    //   of the inserted text
+    const char *suffix = line + col;
+    int lsuffix = linelen - col;
+    const char *p = text;
+    const char *end = text + len;
+    for (int n = 0; n <= newlines; n++)
+      {
+      const char *eol = p;
+      while (eol < end && *eol != '\n') eol++;
+      int lseg = eol - p;
+      int lprefix = (n == 0) ? col : 0; 
+      int ltail = (n == newlines) ? lsuffix : 0;
+      char *newline = malloc (lprefix + lseg + ltail + 1);
+      memcpy (newline, line, lprefix);
+      memcpy (newline + lprefix, p, lseg);
+      memcpy (newline + lprefix + lseg, suffix, ltail);
+      newline[lprefix + lseg + ltail] = 0;
+      block->lines[i + n] = newline;
+      p = eol + 1;
+      }
+
+    text_file_free_line (block, line);
+    if (newlines == 0) text_file_edit_cols (self, block, i, col, 0, len);
+    text_file_note (self, row, 1, newlines + 1);
+    text_file_changed (self, block);
     }
   else
     {
@@ -260,10 +2197,35 @@ void text_file_insert_char (TextFile *self, int row, int col, int c)
 ===========================================================================*/
 void text_file_delete_char (TextFile *self, int row, int col)
   {
-  char *line = self->lines[row];
+  int n;
+  TextBlock *block = text_file_find (self, row, &n);
+  char *line = block->lines[n];
   int len = strlen (line);
   memmove (line + col, line + col + 1, len - col);
-  self->modified = TRUE;
+  text_file_edit_cols (self, block, n, col, 1, 0);
+  text_file_note (self, row, 1, 1);
+  text_file_changed (self, block);
+  }
+
+/*===========================================================================
+
+  text_file_delete_text
+
+===========================================================================*/
+void text_file_delete_text (TextFile *self, int row, int col, int len)
+  {
+  int n;
+  TextBlock *block = text_file_find (self, row, &n);
+  char *line = block->lines[n];
+  int linelen = strlen (line);
+  if (col + len > linelen) len = linelen - col;
+  if (len > 0)
+    {
+    memmove (line + col, line + col + len, linelen - col - len + 1);
+    text_file_edit_cols (self, block, n, col, len, 0);
+    text_file_note (self, row, 1, 1);
+    text_file_changed (self, block);
+    }
   }
 
 /*===========================================================================
@@ -277,14 +2239,17 @@ void text_file_merge_line_forward (TextFile *self, int row)
   // TODO
   if (row < self->nlines - 1)
     {
-    char *old = strdup (self->lines[row + 1]);
+    char *old = strdup (text_file_get_line (self, row + 1));
     text_file_delete_line (self, row + 1);
-    int l1 = strlen (self->lines[row]);
+    int n;
+    TextBlock *block = text_file_find (self, row, &n);
+    int l1 = strlen (block->lines[n]);
     int l2 = strlen (old);
-    self->lines [row] = realloc (self->lines[row], l1 + l2 + 1);
-    strcat (self->lines[row], old);
+    strcat (text_file_resize_line (block, n, l1 + l2 + 1), old);
     free (old);
-    self->modified = TRUE;
+    text_file_edit_cols (self, block, n, l1, 0, l2);
+    text_file_note (self, row, 1, 1);
+    text_file_changed (self, block);
     }
   else
     {
@@ -303,22 +2268,299 @@ void text_file_delete_line (TextFile *self, int row)
   {
   if (self->nlines > 0)
     {
-    for (int i = row; i < self->nlines - 1; i++)
-      self->lines[i] = self->lines[i + 1];
-    self->nlines--;
-    self->modified = TRUE;
+    int n;
+    TextBlock *block = text_file_find (self, row, &n);
+    text_file_forget_cols (block, n);
+    memmove (block->lines + n, block->lines + n + 1,
+      (block->nlines - n - 1) * sizeof (char *));
+    memmove (block->col_index + n, block->col_index + n + 1,
+      (block->nlines - n - 1) * sizeof (ColIndex *));
+    text_file_count_lines (self, block - self->blocks, -1);
+    text_file_note (self, row, 1, 0);
+    text_file_changed (self, block);
     }
   }
 
 /*===========================================================================
 
-  text_file_delete_line
+  text_file_old_text
+
+  The text of lines i to i + n - 1 of a block, which are being replaced,
+  for an edit that would put them back: one line as it is, or several
+  joined with newlines, when they are freed
+
+===========================================================================*/
+static char *text_file_old_text (TextFile *self, TextBlock *block, int i,
+     int n)
+  {
+  if (n == 1)
+    {
+    char *line = block->lines[i];
+    // The buffer of a block of a large file goes when the block does
+    if (self->large && text_file_is_loaded_line (block, line))
+      return strdup (line);
+    return line;
+    }
+  size_t len = 0;
+  for (int k = i; k < i + n; k++) len += strlen (block->lines[k]) + 1;
+  char *text = malloc (len);
+  char *p = text;
+  for (int k = i; k < i + n; k++)
+    {
+    int l = strlen (block->lines[k]);
+    memcpy (p, block->lines[k], l);
+    p += l;
+    *p++ = k < i + n - 1 ? '\n' : 0;
+    text_file_free_line (block, block->lines[k]);
+    }
+  return text;
+  }
+
+/*===========================================================================
+
+  text_file_split_text
+
+  Put the lines of the text of an edit at line i of an array, the first
+  in the text itself and the others copied out of it. Returns how many
+
+===========================================================================*/
+static int text_file_split_text (char **lines, ColIndex **col_index, int i,
+     char *text)
+  {
+  int n = 0;
+  char *p = text;
+  for (;;)
+    {
+    char *eol = p;
+    while (*eol && *eol != '\n') eol++;
+    if (n == 0)
+      lines[i] = text;
+    else
+      {
+      lines[i + n] = malloc (eol - p + 1);
+      memcpy (lines[i + n], p, eol - p);
+      lines[i + n][eol - p] = 0;
+      }
+    col_index[i + n] = NULL;
+    n++;
+    if (!*eol) break;
+    p = eol + 1;
+    }
+  // The first line ends where the second starts
+  char *nl = strchr (text, '\n');
+  if (nl) *nl = 0;
+  return n;
+  }
+
+/*===========================================================================
+
+  text_file_replace_lines
+
+  The edits in each block are made by copying its lines to a new array,
+  with the new lines in place of those they replace -- or, if none of
+  the edits add or remove lines, in the array as it is
+
+===========================================================================*/
+int text_file_replace_lines (TextFile *self, TextFileEdit *edits, 
+     int count)
+  {
+  BOOL record = self->undo && self->changes == self->undo_changes;
+  if (!record) text_file_forget_undo (self);
+  int added = 0;
+  int e = 0;
+  while (e < count)
+    {
+    int i;
+    TextBlock *block = text_file_find (self, edits[e].row + added, &i);
+    int first = edits[e].row + added - i;
+    // The edits that are in this block, and how many lines they add
+    int base = added;
+    int f = e;
+    int grow = 0;
+    BOOL same = TRUE;
+    while (f < count && edits[f].row + base - first < block->nlines)
+      {
+      int n = 1;
+      for (const char *p = edits[f].text; *p; p++)
+        if (*p == '\n') n++;
+      grow += n - edits[f].n;
+      if (n != 1 || edits[f].n != 1) same = FALSE;
+      f++;
+      }
+    if (record && self->nundo + (f - e) > self->undo_size)
+      {
+      int size = self->undo_size * 2;
+      if (size < self->nundo + (f - e)) size = self->nundo + (f - e);
+      TextFileEdit *undo = malloc (size * sizeof (TextFileEdit));
+      memcpy (undo, self->undo, self->nundo * sizeof (TextFileEdit));
+      free (self->undo);
+      self->undo = undo;
+      self->undo_size = size;
+      }
+
+    int nlines = block->nlines + grow;
+    char **lines = block->lines;
+    ColIndex **col_index = block->col_index;
+    if (!same)
+      {
+      int size = nlines > 0 ? nlines : 1;
+      lines = malloc (size * sizeof (char *));
+      col_index = malloc (size * sizeof (ColIndex *));
+      }
+    int to = 0;
+    int from = 0;
+    for (int k = e; k < f; k++)
+      {
+      int at = edits[k].row + base - first;
+      int n = edits[k].n;
+      if (!same)
+        {
+        memcpy (lines + to, block->lines + from, (at - from) * sizeof (char *));
+        memcpy (col_index + to, block->col_index + from, 
+          (at - from) * sizeof (ColIndex *));
+        }
+      to += at - from;
+      for (int j = at; j < at + n; j++) text_file_forget_cols (block, j);
+      char *old = NULL;
+      if (record)
+        old = text_file_old_text (self, block, at, n);
+      else
+        for (int j = at; j < at + n; j++) 
+          text_file_free_line (block, block->lines[j]);
+      int made = text_file_split_text (lines, col_index, to, edits[k].text);
+      if (record)
+        {
+        TextFileEdit *undo = &self->undo[self->nundo++];
+        undo->row = first + to;
+        undo->n = made;
+        undo->text = old;
+        }
+      text_file_note (self, edits[k].row + added, n, made);
+      to += made;
+      from = at + n;
+      added += made - n;
+      }
+    if (!same)
+      {
+      memcpy (lines + to, block->lines + from, 
+        (block->nlines - from) * sizeof (char *));
+      memcpy (col_index + to, block->col_index + from, 
+        (block->nlines - from) * sizeof (ColIndex *));
+      if (block->lines)
+        {
+        free (block->lines);
+        free (block->col_index);
+        }
+      block->lines = lines;
+      block->col_index = col_index;
+      block->lines_size = nlines > 0 ? nlines : 1;
+      }
+    if (grow != 0) text_file_count_lines (self, block - self->blocks, grow);
+    text_file_changed (self, block);
+    e = f;
+    }
+  if (record) self->undo_changes = self->changes;
+  return added;
+  }
+
+/*===========================================================================
+
+  text_file_begin_undo
+
+===========================================================================*/
+void text_file_begin_undo (TextFile *self)
+  {
+  text_file_forget_undo (self);
+  self->undo_size = 16;
+  self->undo = malloc (self->undo_size * sizeof (TextFileEdit));
+  self->nundo = 0;
+  self->undo_changes = self->changes;
+  }
+
+/*===========================================================================
+
+  text_file_undo
+
+  The edits that undo the step are made as one batch, and they put back
+  the lines that were replaced, with nothing copied
+
+===========================================================================*/
+int text_file_undo (TextFile *self)
+  {
+  if (!self->undo || self->nundo == 0 
+       || self->changes != self->undo_changes)
+    {
+    text_file_forget_undo (self);
+    return -1;
+    }
+  TextFileEdit *undo = self->undo;
+  int n = self->nundo;
+  self->undo = NULL;
+  self->nundo = 0;
+  text_file_replace_lines (self, undo, n);
+  int row = undo[0].row;
+  free (undo);
+  return row;
+  }
+
+/*===========================================================================
+
+  text_file_note_changes
+
+===========================================================================*/
+int text_file_note_changes (TextFile *self)
+  {
+  for (int i = 0; i < TEXT_FILE_NOTERS; i++)
+    {
+    if (!self->noters[i].on)
+      {
+      self->noters[i].on = TRUE;
+      return i;
+      }
+    }
+  return -1;
+  }
+
+/*===========================================================================
+
+  text_file_stop_noting
+
+===========================================================================*/
+void text_file_stop_noting (TextFile *self, int noter)
+  {
+  if (noter < 0) return;
+  TextFileNoter *n = &self->noters[noter];
+  if (n->changed) free (n->changed);
+  memset (n, 0, sizeof (TextFileNoter));
+  }
+
+/*===========================================================================
+
+  text_file_take_changes
+
+===========================================================================*/
+TextFileChange *text_file_take_changes (TextFile *self, int noter, int *n)
+  {
+  *n = 0;
+  if (noter < 0) return NULL;
+  TextFileNoter *from = &self->noters[noter];
+  TextFileChange *changed = from->n > 0 ? from->changed : NULL;
+  if (from->changed && !changed) free (from->changed);
+  *n = from->n;
+  from->changed = NULL;
+  from->n = 0;
+  from->size = 0;
+  return changed;
+  }
+
+/*===========================================================================
+
+  text_file_init_empty
 
 ===========================================================================*/
 void text_file_init_empty (TextFile *self)
   {
-  self->lines = malloc (0);    
-  self->nlines = 0;
+  text_file_unload (self);
   text_file_insert_blank_line_at (self, 0);
   // We consider the file to be unmodified, since it has no
   //  contents that merit saving
@@ -11,24 +11,131 @@
 #pragma once
 
 #include "cnolib.h"
+#include "tabstops.h"
 
 struct _TextFile;
 typedef struct _TextFile TextFile;
 
+// A change to the lines of a file: lines row to row + n - 1, at least
+//   one, are replaced by the lines of 'text', split at its newlines.
+//   The text must have been got from malloc(), and becomes the file's
+typedef struct _TextFileEdit
+  {
+  int row;
+  int n;
+  char *text;
+  } TextFileEdit;
+
+// A run of lines that has changed: lines first to end - 1 are now 
+//   where end - first - added lines of the file were, added being 
+//   negative if lines have gone. A run may be empty, where lines have
+//   only been removed
+typedef struct _TextFileChange
+  {
+  int first;
+  int end;
+  int added;
+  } TextFileChange;
+
 extern TextFile   *text_file_create (void);
 extern void        text_file_destroy (TextFile *self);
 
 extern const char *text_file_get_line (const TextFile *self, int n);
 extern size_t      text_file_get_line_count (const TextFile *self);
+// The lines of the block that holds line 'row', and in *first the 
+//   number of the block's first line and in *n how many it has, so 
+//   that a run of lines can be looked through without finding each one.
+//   They are valid until the file is changed or trimmed. This, and
+//   text_file_get_block_text, may be called from several threads at 
+//   once, so long as nothing else is done to the file meanwhile
+extern const char * const *text_file_get_lines (const TextFile *self, 
+                     int row, int *first, int *n);
+// The number of the first line of the block that holds line 'row', 
+//   and in *n how many it has, without reading it
+extern int         text_file_get_block_start (const TextFile *self, 
+                     int row, int *n);
+// The text that the block holding line 'row' was read as, with its
+//   newlines made nulls, and in *len its length; or NULL if there is 
+//   none. The lines that haven't changed point into it, one after 
+//   another, but between them there may be the text of lines that have
+//   since been deleted, or shortened
+extern const char *text_file_get_block_text (const TextFile *self, 
+                     int row, size_t *len);
 extern void        text_file_insert_newline (TextFile *self, int line, int col);
 extern void        text_file_insert_blank_line (TextFile *self, int line);
 extern void        text_file_insert_blank_line_at (TextFile *self, int row);
+// Returns FALSE, with errno set, if the file can't be read
 extern BOOL        text_file_load (TextFile *self, const char *file);
+// Load only the first part of a file, usually enough for a screenful,
+//   and leave the rest to text_file_load_more. Returns FALSE, with
+//   errno set, if the file can't be read
+extern BOOL        text_file_load_start (TextFile *self, const char *file);
+// Load the next part of a file, after text_file_load_start. Its lines
+//   are added after the last line, whatever editing has been done.
+//   Returns FALSE, with errno set, if it can't be read; then the lines
+//   loaded already are kept, but the file can't be saved. Saving
+//   loads whatever is left first
+extern BOOL        text_file_load_more (TextFile *self);
+extern BOOL        text_file_is_loading (const TextFile *self);
+extern int         text_file_get_load_percent (const TextFile *self);
+// Set how many threads to load a file with. Zero, the default, means 
+//   one for each processor. Small files are loaded with fewer
+extern void        text_file_set_load_threads (TextFile *self, 
+                     int threads);
+// Set the size, in bytes, above which a file is large: only the blocks
+//   of it whose lines are wanted are read, and those that haven't been
+//   changed are dropped again by text_file_trim. By default it is a 
+//   quarter of the memory. Must be called before the file is loaded
+extern void        text_file_set_large_min (TextFile *self, off64_t bytes);
+extern BOOL        text_file_is_large (const TextFile *self);
+// Drop the blocks of a large file that are not near the 'rows' lines 
+//   from 'row', and haven't been changed. Lines got from the file
+//   before this may no longer be valid
+extern void        text_file_trim (TextFile *self, int row, int rows);
 extern void        text_file_replace_char (TextFile *self, int line, 
                      int col, int c);
 extern void        text_file_insert_char (TextFile *self, int line, 
                      int col, int c);
 extern void        text_file_delete_char (TextFile *self, int line, int col);
+// Delete len bytes from a line, which may be a multi-byte character
+extern void        text_file_delete_text (TextFile *self, int line, 
+                     int col, int len);
+// Insert len bytes of text at the specified position. The text may
+//   contain newlines, in which case the line is split and new lines
+//   are added after it. The text need not be null-terminated
+extern void        text_file_insert_text (TextFile *self, int line, 
+                     int col, const char *text, int len);
+// Make a batch of edits, in order of row and not overlapping, with the
+//   rows as they are before any of them. The lines that an edit 
+//   replaces must all be in one block, as those that a line has been 
+//   split into are. The lines of each block are rebuilt only once, 
+//   however many edits there are in it. Returns how many lines were
+//   added, less how many were removed
+extern int         text_file_replace_lines (TextFile *self, 
+                     TextFileEdit *edits, int count);
+// Start recording what text_file_replace_lines replaces, as one step 
+//   that text_file_undo can undo, forgetting any step before. Each
+//   batch in a step must come after the lines of the one before. The 
+//   step is forgotten when the file is changed in any other way
+extern void        text_file_begin_undo (TextFile *self);
+// Undo the step recorded since text_file_begin_undo. Returns the first
+//   line it changed, or -1 if there is no step to undo
+extern int         text_file_undo (TextFile *self);
+// Start noting which lines change, so that something that keeps a 
+//   record of each line can bring only those lines up to date. Lines 
+//   that are loaded are added at the end, and are not changes. Each 
+//   thing that notes them has its own record, and a few can at once. 
+//   Returns the number to take the changes with, or -1 if too many 
+//   things are already noting them
+extern int         text_file_note_changes (TextFile *self);
+extern void        text_file_stop_noting (TextFile *self, int noter);
+// The runs of lines that have changed since the last call, or since 
+//   noting started, in order and not touching one another, with the 
+//   rows as they are now, and how many there are in *n. The array is
+//   the caller's to free; it is NULL if nothing has changed, or if 
+//   noter is -1
+extern TextFileChange *text_file_take_changes (TextFile *self, int noter,
+                     int *n);
 // self is not const in _save, because a successful save resets the
 //   modified status
 extern BOOL        text_file_save (TextFile *self, const char *file);
@@ -38,5 +145,25 @@ extern void        text_file_merge_line_forward (TextFile *self, int line);
 extern void        text_file_delete_line (TextFile *self, int line);
 extern void        text_file_init_empty (TextFile *self);
 extern BOOL        text_file_is_modified (const TextFile *self);
+// Set the tab stops used to work out display columns. This must be
+//   done before any display column is asked for. The TextFile does not
+//   take ownership of the TabStops
+extern void        text_file_set_tab_stops (TextFile *self, 
+                     const TabStops *tab_stops);
+// Positions in a line ('col') are byte offsets. Display columns allow 
+//   for tabs, and for UTF-8 characters that take up no columns, or two
+
+// The screen column at which the character at 'col' of a line is 
+//   displayed, allowing for tabs. col may be beyond the end of the line
+extern int         text_file_get_display_col (TextFile *self, int line, 
+                     int col);
+// The number of screen columns a line takes up
+extern int         text_file_get_display_width (const TextFile *self, 
+                     int line);
+// The position in a line of the character displayed at screen column 
+//   dcol, or of the tab that covers it. Returns the length of the line
+//   if dcol is beyond its end
+extern int         text_file_get_col_at_display (TextFile *self, int line, 
+                     int dcol);
 
 
@@ -0,0 +1,271 @@
+/*===========================================================================
+
+  bute
+
+  utf8.c
+
+  Copyright (c)2020 Kevin Boone. Distributed uner the terms of the
+    GNU PUblic Licence, v3.0
+
+  Functions for stepping through UTF-8 text, and measuring it on the
+  screen. Most lines of most files are plain ASCII, and the run
+  functions find that out a machine word at a time, so that callers can
+  treat a byte as a column without decoding anything.
+
+===========================================================================*/
+#include "cnolib.h"
+#include "utf8.h"
+
+// A machine word, which may be read from memory that holds chars
+typedef unsigned long Word __attribute__ ((__may_alias__));
+// A word with each byte set to one, and to 0x80
+#define WORD_ONES ((unsigned long)-1 / 0xFF)
+#define WORD_HIGHS (WORD_ONES * 0x80)
+// Non-zero if any byte of w is zero
+#define WORD_HAS_ZERO(w) (((w) - WORD_ONES) & ~(w) & WORD_HIGHS)
+
+// Ranges of code points, as first and last
+typedef struct _Utf8Range
+  {
+  int first;
+  int last;
+  } Utf8Range;
+
+// Characters that combine with the one before them, and so take up no
+//   columns of their own. This is the commonly-used subset, not the
+//   whole of Unicode's list
+static const Utf8Range utf8_zero_width[] =
+  {
+  { 0x0300, 0x036F }, { 0x0483, 0x0489 }, { 0x0591, 0x05BD },
+  { 0x05BF, 0x05BF }, { 0x05C1, 0x05C2 }, { 0x05C4, 0x05C5 },
+  { 0x05C7, 0x05C7 }, { 0x0610, 0x061A }, { 0x064B, 0x065F },
+  { 0x0670, 0x0670 }, { 0x06D6, 0x06DC }, { 0x06DF, 0x06E4 },
+  { 0x06E7, 0x06E8 }, { 0x06EA, 0x06ED }, { 0x0711, 0x0711 },
+  { 0x0730, 0x074A }, { 0x07A6, 0x07B0 }, { 0x0900, 0x0902 },
+  { 0x093C, 0x093C }, { 0x0941, 0x0948 }, { 0x094D, 0x094D },
+  { 0x0951, 0x0954 }, { 0x0962, 0x0963 }, { 0x0E31, 0x0E31 },
+  { 0x0E34, 0x0E3A }, { 0x0E47, 0x0E4E }, { 0x1AB0, 0x1AFF },
+  { 0x1DC0, 0x1DFF }, { 0x200B, 0x200F }, { 0x202A, 0x202E },
+  { 0x2060, 0x2064 }, { 0x20D0, 0x20FF }, { 0x302A, 0x302D },
+  { 0x3099, 0x309A }, { 0xFE00, 0xFE0F }, { 0xFE20, 0xFE2F },
+  { 0xFEFF, 0xFEFF }, { 0xE0100, 0xE01EF }
+  };
+
+// Characters that East Asian Width classes as wide or fullwidth, and
+//   the emoji that terminals show two columns wide
+static const Utf8Range utf8_wide[] =
+  {
+  { 0x1100, 0x115F }, { 0x231A, 0x231B }, { 0x2329, 0x232A },
+  { 0x23E9, 0x23EC }, { 0x23F0, 0x23F0 }, { 0x23F3, 0x23F3 },
+  { 0x25FD, 0x25FE }, { 0x2614, 0x2615 }, { 0x2648, 0x2653 },
+  { 0x267F, 0x267F }, { 0x2693, 0x2693 }, { 0x26A1, 0x26A1 },
+  { 0x26AA, 0x26AB }, { 0x26BD, 0x26BE }, { 0x26C4, 0x26C5 },
+  { 0x26CE, 0x26CE }, { 0x26D4, 0x26D4 }, { 0x26EA, 0x26EA },
+  { 0x26F2, 0x26F3 }, { 0x26F5, 0x26F5 }, { 0x26FA, 0x26FA },
+  { 0x26FD, 0x26FD }, { 0x2705, 0x2705 }, { 0x270A, 0x270B },
+  { 0x2728, 0x2728 }, { 0x274C, 0x274C }, { 0x274E, 0x274E },
+  { 0x2753, 0x2755 }, { 0x2757, 0x2757 }, { 0x2795, 0x2797 },
+  { 0x27B0, 0x27B0 }, { 0x27BF, 0x27BF }, { 0x2B1B, 0x2B1C },
+  { 0x2B50, 0x2B50 }, { 0x2B55, 0x2B55 }, { 0x2E80, 0x303E },
+  { 0x3041, 0x4DBF }, { 0x4E00, 0xA4CF }, { 0xA960, 0xA97F },
+  { 0xAC00, 0xD7A3 }, { 0xF900, 0xFAFF }, { 0xFE10, 0xFE19 },
+  { 0xFE30, 0xFE6F }, { 0xFF00, 0xFF60 }, { 0xFFE0, 0xFFE6 },
+  { 0x16FE0, 0x16FE4 }, { 0x17000, 0x18AFF }, { 0x1B000, 0x1B2FF },
+  { 0x1F004, 0x1F004 }, { 0x1F0CF, 0x1F0CF }, { 0x1F18E, 0x1F18E },
+  { 0x1F191, 0x1F19A }, { 0x1F200, 0x1F251 }, { 0x1F300, 0x1F64F },
+  { 0x1F680, 0x1F6FF }, { 0x1F7E0, 0x1F7EB }, { 0x1F90C, 0x1F9FF },
+  { 0x1FA70, 0x1FAFF }, { 0x20000, 0x2FFFD }, { 0x30000, 0x3FFFD }
+  };
+
+/*===========================================================================
+
+  utf8_in_ranges
+
+  Binary search of a table of ranges
+
+===========================================================================*/
+static BOOL utf8_in_ranges (const Utf8Range *ranges, int n, int cp)
+  {
+  if (cp < ranges[0].first || cp > ranges[n - 1].last) return FALSE;
+  int lo = 0, hi = n - 1;
+  while (lo <= hi)
+    {
+    int mid = (lo + hi) / 2;
+    if (cp > ranges[mid].last)
+      lo = mid + 1;
+    else if (cp < ranges[mid].first)
+      hi = mid - 1;
+    else
+      return TRUE;
+    }
+  return FALSE;
+  }
+
+/*===========================================================================
+
+  utf8_width
+
+  The number of columns taken up by a code point
+
+===========================================================================*/
+static int utf8_width (int cp)
+  {
+  if (cp < 0x300) return 1;
+  if (utf8_in_ranges (utf8_zero_width,
+       sizeof (utf8_zero_width) / sizeof (Utf8Range), cp))
+    return 0;
+  if (utf8_in_ranges (utf8_wide, sizeof (utf8_wide) / sizeof (Utf8Range),
+       cp))
+    return 2;
+  return 1;
+  }
+
+/*===========================================================================
+
+  utf8_seq_len
+
+===========================================================================*/
+int utf8_seq_len (int c)
+  {
+  c &= 0xFF;
+  if (c < 0x80) return 1;
+  if (c < 0xC2) return 0; // Continuation, or the start of an overlong form
+  if (c < 0xE0) return 2;
+  if (c < 0xF0) return 3;
+  if (c < 0xF5) return 4;
+  return 0;
+  }
+
+/*===========================================================================
+
+  utf8_char
+
+===========================================================================*/
+int utf8_char (const char *s, int *width)
+  {
+  const unsigned char *p = (const unsigned char *)s;
+  int len = utf8_seq_len (p[0]);
+  if (len > 1)
+    {
+    int cp = p[0] & (0x7F >> len);
+    int i;
+    // A null, or any other byte that isn't a continuation, ends the
+    //   sequence early
+    for (i = 1; i < len && (p[i] & 0xC0) == 0x80; i++)
+      cp = (cp << 6) | (p[i] & 0x3F);
+    if (i == len && !(len == 3 && cp < 0x800)
+        && !(len == 4 && (cp < 0x10000 || cp > 0x10FFFF))
+        && !(cp >= 0xD800 && cp <= 0xDFFF))
+      {
+      if (width) *width = utf8_width (cp);
+      return len;
+      }
+    }
+  if (width) *width = 1;
+  return 1;
+  }
+
+/*===========================================================================
+
+  utf8_run
+
+  Count the bytes at the start of s, up to n, that are ASCII, and not 
+  tabs if 'tabs' is set. Bytes are looked at one at a time until they
+  are on a word boundary, and then a word at a time; an aligned word 
+  never crosses into a page that might not be mapped, even if it 
+  includes the terminating null
+
+===========================================================================*/
+static inline int utf8_run (const char *s, int n, BOOL tabs)
+  {
+  unsigned long max = n < 0 ? (unsigned long)-1 : (unsigned long)n;
+  unsigned long i = 0;
+  while (i < max && ((unsigned long)(s + i) & (sizeof (Word) - 1)) != 0)
+    {
+    unsigned char c = s[i];
+    if (c == 0 || c >= 0x80 || (tabs && c == '\t')) return i;
+    i++;
+    }
+  while (max - i >= sizeof (Word))
+    {
+    Word w = *(const Word *)(s + i);
+    if ((w & WORD_HIGHS) || WORD_HAS_ZERO (w)
+        || (tabs && WORD_HAS_ZERO (w ^ (WORD_ONES * '\t'))))
+      break;
+    i += sizeof (Word);
+    }
+  while (i < max)
+    {
+    unsigned char c = s[i];
+    if (c == 0 || c >= 0x80 || (tabs && c == '\t')) break;
+    i++;
+    }
+  return i;
+  }
+
+/*===========================================================================
+
+  utf8_ascii_run
+
+===========================================================================*/
+int utf8_ascii_run (const char *s, int n)
+  {
+  return utf8_run (s, n, FALSE);
+  }
+
+/*===========================================================================
+
+  utf8_plain_run
+
+===========================================================================*/
+int utf8_plain_run (const char *s, int n)
+  {
+  return utf8_run (s, n, TRUE);
+  }
+
+/*===========================================================================
+
+  utf8_next
+
+===========================================================================*/
+int utf8_next (const char *s, int i)
+  {
+  if (s[i] == 0) return i;
+  i += utf8_char (s + i, NULL);
+  // Nothing below U+0300 combines, so an ASCII byte ends the search
+  while ((unsigned char)s[i] >= 0x80)
+    {
+    int width;
+    int len = utf8_char (s + i, &width);
+    if (width != 0) break;
+    i += len;
+    }
+  return i;
+  }
+
+/*===========================================================================
+
+  utf8_prev
+
+===========================================================================*/
+int utf8_prev (const char *s, int i)
+  {
+  while (i > 0)
+    {
+    // A valid sequence has no more than three continuation bytes. If
+    //   what comes before i is not a valid sequence, the last byte
+    //   stands on its own
+    int j = i - 1;
+    while (j > 0 && i - j < 4 && ((unsigned char)s[j] & 0xC0) == 0x80) j--;
+    int width;
+    if (utf8_char (s + j, &width) != i - j)
+      {
+      j = i - 1;
+      width = 1;
+      }
+    i = j;
+    if (width != 0) break;
+    }
+  return i;
+  }
+
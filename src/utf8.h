@@ -0,0 +1,44 @@
+/*===========================================================================
+
+  bute -- barely useful text editor
+
+  utf8.h
+
+  Copyright (c)2020 Kevin Boone. Distributed uner the terms of the
+    GNU PUblic Licence, v3.0
+
+===========================================================================*/
+#pragma once
+
+#include "cnolib.h"
+
+// Functions for stepping through UTF-8 text, and working out how many
+//   screen columns it takes up. A byte that is not part of a valid
+//   sequence counts as a character on its own, one column wide, which
+//   is how terminals show it
+
+// The number of bytes in the character at s, and in *width (which may
+//   be NULL) the number of screen columns it takes up: zero for a
+//   combining mark, two for an East Asian wide character, and one for
+//   anything else, including a tab, a control character, or a byte that
+//   is not valid UTF-8
+extern int         utf8_char (const char *s, int *width);
+// The number of bytes that a character starting with byte c has, if
+//   it is valid. A byte that can't start a character gives zero
+extern int         utf8_seq_len (int c);
+
+// The number of bytes at the start of s, up to n (or up to the null,
+//   if n is negative) that are ASCII, and so one byte to a character.
+//   The bytes are looked at a machine word at a time
+extern int         utf8_ascii_run (const char *s, int n);
+// The same, but stopping at a tab as well, so that every byte counted
+//   takes up exactly one column
+extern int         utf8_plain_run (const char *s, int n);
+
+// The position in s after the character at i, and after any
+//   zero-width characters that combine with it
+extern int         utf8_next (const char *s, int i);
+// The position in s of the character before i, or of the character
+//   that the zero-width characters before i combine with
+extern int         utf8_prev (const char *s, int i);
+
@@ -0,0 +1,780 @@
+/*===========================================================================
+
+  bute
+
+  virtualterminal.c
+
+  Copyright (c)2020 Kevin Boone. Distributed uner the terms of the
+    GNU PUblic Licence, v3.0
+
+  A terminal emulator with no display. It understands the control
+  characters and sequences that a LinuxTerminal sends, in the way that
+  xterm does, and a few more; anything else is ignored.
+
+===========================================================================*/
+#include "cnolib.h"
+#include "utf8.h"
+#include "terminal.h"
+#include "virtualterminal.h"
+
+// The most parameters of a control sequence that are kept
+#define VT_MAX_PARAMS 8
+
+// Parser states: ordinary text, after ESC, and in a control sequence
+#define VT_GROUND 0
+#define VT_ESC    1
+#define VT_CSI    2
+
+// A cell of the screen. It holds the UTF-8 bytes of one character,
+//   and any combining marks that fit after it. A cell with no bytes is
+//   the right half of a wide character in the cell before it
+typedef struct _VtCell
+  {
+  char text[8];
+  int len;
+  } VtCell;
+
+struct _VirtualTerminal
+  {
+  TerminalDevice parent;
+  int rows;
+  int columns;
+  VtCell *cells;
+  int cur_row;
+  int cur_col;
+  // Set after a character is written to the last column. The cursor
+  //   stays there, and the next character starts a new row
+  BOOL wrap_pending;
+  // The tab stop at each column
+  BOOL *tabs;
+  // The last character written, which REP repeats
+  VtCell last;
+  int last_width;
+  BOOL cursor_visible;
+  BOOL sync;
+  BOOL paste;
+  // Parser state. utf8 holds the start of a character whose other
+  //   bytes have not arrived yet
+  int state;
+  char private;
+  char inter;
+  int param[VT_MAX_PARAMS];
+  int nparam;
+  char utf8[4];
+  int utf8_len;
+  int utf8_need;
+  // Replies to queries, which are read before any more keys
+  char reply[32];
+  int reply_len;
+  int reply_pos;
+  const char *keys;
+  int keys_len;
+  int keys_pos;
+  // The screen and cursor when the keys ran out
+  VtCell *snapshot;
+  int snap_row;
+  int snap_col;
+  VirtualTerminalCounts counts;
+  };
+
+static void virtual_terminal_write (TerminalDevice *device, const char *s,
+     int len);
+static int  virtual_terminal_read (TerminalDevice *device, char *s, int len);
+static int  virtual_terminal_input_waiting (const TerminalDevice *device);
+static void virtual_terminal_get_size (const TerminalDevice *device,
+     int *rows, int *columns);
+
+/*===========================================================================
+
+  virtual_terminal_create
+
+===========================================================================*/
+VirtualTerminal *virtual_terminal_create (int rows, int columns)
+  {
+  VirtualTerminal *self = malloc (sizeof (VirtualTerminal));
+  memset (self, 0, sizeof (VirtualTerminal));
+  self->parent.write = virtual_terminal_write;
+  self->parent.read = virtual_terminal_read;
+  self->parent.input_waiting = virtual_terminal_input_waiting;
+  self->parent.get_size = virtual_terminal_get_size;
+  self->rows = rows;
+  self->columns = columns;
+  self->cells = malloc (rows * columns * sizeof (VtCell));
+  for (int i = 0; i < rows * columns; i++)
+    {
+    self->cells[i].text[0] = ' ';
+    self->cells[i].len = 1;
+    }
+  self->tabs = malloc (columns * sizeof (BOOL));
+  for (int i = 0; i < columns; i++)
+    self->tabs[i] = i > 0 && i % 8 == 0;
+  self->cursor_visible = TRUE;
+  return self;
+  }
+
+/*===========================================================================
+
+  virtual_terminal_destroy
+
+===========================================================================*/
+void virtual_terminal_destroy (VirtualTerminal *self)
+  {
+  if (self)
+    {
+    free (self->cells);
+    free (self->tabs);
+    if (self->snapshot) free (self->snapshot);
+    free (self);
+    }
+  }
+
+/*===========================================================================
+
+  virtual_terminal_get_device
+
+===========================================================================*/
+TerminalDevice *virtual_terminal_get_device (VirtualTerminal *self)
+  {
+  return &self->parent;
+  }
+
+/*===========================================================================
+
+  virtual_terminal_set_keys
+
+===========================================================================*/
+void virtual_terminal_set_keys (VirtualTerminal *self, const char *keys,
+      int len)
+  {
+  self->keys = keys;
+  self->keys_len = len;
+  self->keys_pos = 0;
+  }
+
+/*===========================================================================
+
+  virtual_terminal_get_counts
+
+===========================================================================*/
+void virtual_terminal_get_counts (const VirtualTerminal *self,
+      VirtualTerminalCounts *counts)
+  {
+  *counts = self->counts;
+  }
+
+/*===========================================================================
+
+  virtual_terminal_blank
+
+  Blank a cell, and the other half of any wide character it is part of
+
+===========================================================================*/
+static void virtual_terminal_blank (VirtualTerminal *self, int row, int col)
+  {
+  VtCell *line = self->cells + row * self->columns;
+  if (line[col].len == 0 && col > 0)
+    {
+    line[col - 1].text[0] = ' ';
+    line[col - 1].len = 1;
+    }
+  else if (col + 1 < self->columns && line[col + 1].len == 0)
+    {
+    line[col + 1].text[0] = ' ';
+    line[col + 1].len = 1;
+    }
+  line[col].text[0] = ' ';
+  line[col].len = 1;
+  }
+
+/*===========================================================================
+
+  virtual_terminal_erase
+
+  Blank the cells of a row from 'from' up to, but not including, 'to'
+
+===========================================================================*/
+static void virtual_terminal_erase (VirtualTerminal *self, int row,
+      int from, int to)
+  {
+  if (to > self->columns) to = self->columns;
+  for (int col = from; col < to; col++)
+    virtual_terminal_blank (self, row, col);
+  }
+
+/*===========================================================================
+
+  virtual_terminal_scroll
+
+  Move the rows of the screen up one if 'up' is set, or down, leaving a
+  blank row at the bottom or top
+
+===========================================================================*/
+static void virtual_terminal_scroll (VirtualTerminal *self, BOOL up)
+  {
+  int row_size = self->columns * sizeof (VtCell);
+  int moved = (self->rows - 1) * row_size;
+  char *cells = (char *)self->cells;
+  if (up)
+    {
+    memmove (cells, cells + row_size, moved);
+    virtual_terminal_erase (self, self->rows - 1, 0, self->columns);
+    }
+  else
+    {
+    memmove (cells + row_size, cells, moved);
+    virtual_terminal_erase (self, 0, 0, self->columns);
+    }
+  }
+
+/*===========================================================================
+
+  virtual_terminal_line_feed
+
+===========================================================================*/
+static void virtual_terminal_line_feed (VirtualTerminal *self)
+  {
+  if (self->cur_row == self->rows - 1)
+    virtual_terminal_scroll (self, TRUE);
+  else
+    self->cur_row++;
+  }
+
+/*===========================================================================
+
+  virtual_terminal_print
+
+  Put a character at the cursor, and move the cursor past it. A
+  character with no width is added to the one before it
+
+===========================================================================*/
+static void virtual_terminal_print (VirtualTerminal *self, const char *s,
+      int len, int width)
+  {
+  VtCell *line = self->cells + self->cur_row * self->columns;
+  if (width == 0)
+    {
+    int col = self->wrap_pending ? self->cur_col : self->cur_col - 1;
+    if (col < 0) return;
+    if (line[col].len == 0 && col > 0) col--;
+    if (line[col].len + len <= (int)sizeof (line[col].text))
+      {
+      memcpy (line[col].text + line[col].len, s, len);
+      line[col].len += len;
+      }
+    return;
+    }
+  if (self->wrap_pending || (width == 2 && self->cur_col == self->columns - 1))
+    {
+    // A wide character that doesn't fit goes on the next row
+    if (!self->wrap_pending) virtual_terminal_blank (self, self->cur_row,
+       self->cur_col);
+    self->cur_col = 0;
+    self->wrap_pending = FALSE;
+    virtual_terminal_line_feed (self);
+    line = self->cells + self->cur_row * self->columns;
+    }
+  int col = self->cur_col;
+  virtual_terminal_blank (self, self->cur_row, col);
+  memcpy (line[col].text, s, len);
+  line[col].len = len;
+  if (width == 2)
+    {
+    virtual_terminal_blank (self, self->cur_row, col + 1);
+    line[col + 1].len = 0;
+    }
+  self->last = line[col];
+  self->last_width = width;
+  self->cur_col += width;
+  if (self->cur_col >= self->columns)
+    {
+    self->cur_col = self->columns - 1;
+    self->wrap_pending = TRUE;
+    }
+  }
+
+/*===========================================================================
+
+  virtual_terminal_print_bytes
+
+  Print bytes that are not a valid UTF-8 character as a character each
+
+===========================================================================*/
+static void virtual_terminal_print_bytes (VirtualTerminal *self,
+      const char *s, int len)
+  {
+  for (int i = 0; i < len; i++)
+    virtual_terminal_print (self, s + i, 1, 1);
+  }
+
+/*===========================================================================
+
+  virtual_terminal_shift
+
+  Insert n blank cells at the cursor if n is positive, or delete -n
+  cells, moving the rest of the row
+
+===========================================================================*/
+static void virtual_terminal_shift (VirtualTerminal *self, int n)
+  {
+  VtCell *line = self->cells + self->cur_row * self->columns;
+  int col = self->cur_col;
+  int count = n > 0 ? n : -n;
+  if (count > self->columns - col) count = self->columns - col;
+  // Wide characters cut in two by the move are lost
+  if (line[col].len == 0) virtual_terminal_blank (self, self->cur_row, col);
+  if (n > 0)
+    {
+    virtual_terminal_blank (self, self->cur_row, self->columns - count);
+    memmove (line + col + count, line + col,
+      (self->columns - col - count) * sizeof (VtCell));
+    virtual_terminal_erase (self, self->cur_row, col, col + count);
+    }
+  else
+    {
+    if (col + count < self->columns && line[col + count].len == 0)
+      virtual_terminal_blank (self, self->cur_row, col + count);
+    memmove (line + col, line + col + count,
+      (self->columns - col - count) * sizeof (VtCell));
+    for (int c = self->columns - count; c < self->columns; c++)
+      {
+      line[c].text[0] = ' ';
+      line[c].len = 1;
+      }
+    }
+  }
+
+/*===========================================================================
+
+  virtual_terminal_snapshot
+
+  Save the screen at the end of a session: when the keys run out, or
+  the program turns off bracketed paste, as it does when it has
+  finished with the terminal. The program is likely to clear the screen
+  after that, on the way out
+
+===========================================================================*/
+static void virtual_terminal_snapshot (VirtualTerminal *self)
+  {
+  if (self->snapshot) return;
+  int size = self->rows * self->columns * sizeof (VtCell);
+  self->snapshot = malloc (size);
+  memcpy (self->snapshot, self->cells, size);
+  self->snap_row = self->cur_row;
+  self->snap_col = self->cur_col;
+  }
+
+/*===========================================================================
+
+  virtual_terminal_reply_mode
+
+  Answer DECRQM: whether a private mode is set (1) or reset (2), or
+  not known (0)
+
+===========================================================================*/
+static void virtual_terminal_reply_mode (VirtualTerminal *self, int mode)
+  {
+  int status = 0;
+  if (self->reply_len + 16 > (int)sizeof (self->reply)) return;
+  switch (mode)
+    {
+    case 25: status = self->cursor_visible ? 1 : 2; break;
+    case 2004: status = self->paste ? 1 : 2; break;
+    case 2026: status = self->sync ? 1 : 2; break;
+    }
+  char num[12];
+  char *r = self->reply + self->reply_len;
+  strcpy (r, "\033[?");
+  strcat (r, itoa (mode, num, 10));
+  strcat (r, ";");
+  strcat (r, itoa (status, num, 10));
+  strcat (r, "$y");
+  self->reply_len += strlen (r);
+  }
+
+/*===========================================================================
+
+  virtual_terminal_control
+
+  A control character
+
+===========================================================================*/
+static void virtual_terminal_control (VirtualTerminal *self, char c)
+  {
+  switch (c)
+    {
+    case '\r':
+      self->cur_col = 0;
+      break;
+    case '\n': case '\v': case '\f':
+      virtual_terminal_line_feed (self);
+      break;
+    case '\b':
+      if (self->cur_col > 0) self->cur_col--;
+      break;
+    case '\t':
+      do
+        self->cur_col++;
+      while (self->cur_col < self->columns - 1 && !self->tabs[self->cur_col]);
+      if (self->cur_col >= self->columns) self->cur_col = self->columns - 1;
+      break;
+    default:
+      return;
+    }
+  self->wrap_pending = FALSE;
+  self->counts.cursor_moves++;
+  }
+
+/*===========================================================================
+
+  virtual_terminal_csi
+
+  The end of a control sequence
+
+===========================================================================*/
+static void virtual_terminal_csi (VirtualTerminal *self, char final)
+  {
+  int p0 = self->param[0];
+  int n = p0 > 0 ? p0 : 1;
+  int row = self->cur_row;
+  int col = self->cur_col;
+  self->wrap_pending = FALSE;
+  if (self->private == '?')
+    {
+    if (final == 'h' || final == 'l')
+      {
+      for (int i = 0; i < self->nparam && i < VT_MAX_PARAMS; i++)
+        {
+        switch (self->param[i])
+          {
+          case 25: self->cursor_visible = final == 'h'; break;
+          case 2004: 
+            self->paste = final == 'h'; 
+            if (!self->paste) virtual_terminal_snapshot (self);
+            break;
+          case 2026: self->sync = final == 'h'; break;
+          }
+        }
+      }
+    else if (final == 'p' && self->inter == '$')
+      virtual_terminal_reply_mode (self, p0);
+    return;
+    }
+  if (self->private || self->inter) return;
+  switch (final)
+    {
+    case 'A': row -= n; break;
+    case 'B': row += n; break;
+    case 'C': col += n; break;
+    case 'D': col -= n; break;
+    case 'G': col = n - 1; break;
+    case 'd': row = n - 1; break;
+    case 'H': case 'f':
+      row = n - 1;
+      col = (self->param[1] > 0 ? self->param[1] : 1) - 1;
+      break;
+    case 'J':
+      if (p0 == 0)
+        {
+        virtual_terminal_erase (self, row, col, self->columns);
+        for (int r = row + 1; r < self->rows; r++)
+          virtual_terminal_erase (self, r, 0, self->columns);
+        }
+      else
+        {
+        for (int r = 0; r < row; r++)
+          virtual_terminal_erase (self, r, 0, self->columns);
+        virtual_terminal_erase (self, row, 0,
+          p0 == 1 ? col + 1 : self->columns);
+        if (p0 != 1)
+          for (int r = row + 1; r < self->rows; r++)
+            virtual_terminal_erase (self, r, 0, self->columns);
+        }
+      return;
+    case 'K':
+      if (p0 == 0)
+        virtual_terminal_erase (self, row, col, self->columns);
+      else
+        virtual_terminal_erase (self, row, 0,
+          p0 == 1 ? col + 1 : self->columns);
+      return;
+    case 'X':
+      virtual_terminal_erase (self, row, col, col + n);
+      return;
+    case '@':
+      virtual_terminal_shift (self, n);
+      return;
+    case 'P':
+      virtual_terminal_shift (self, -n);
+      return;
+    case 'b':
+      if (self->last_width > 0)
+        for (int i = 0; i < n; i++)
+          virtual_terminal_print (self, self->last.text, self->last.len,
+            self->last_width);
+      return;
+    case 'g':
+      if (p0 == 0)
+        self->tabs[col] = FALSE;
+      else if (p0 == 3)
+        memset (self->tabs, 0, self->columns * sizeof (BOOL));
+      return;
+    default:
+      return;
+    }
+  if (row < 0) row = 0;
+  if (row >= self->rows) row = self->rows - 1;
+  if (col < 0) col = 0;
+  if (col >= self->columns) col = self->columns - 1;
+  self->cur_row = row;
+  self->cur_col = col;
+  self->counts.cursor_moves++;
+  }
+
+/*===========================================================================
+
+  virtual_terminal_esc
+
+  The character after an ESC
+
+===========================================================================*/
+static void virtual_terminal_esc (VirtualTerminal *self, char c)
+  {
+  self->state = VT_GROUND;
+  switch (c)
+    {
+    case '[':
+      self->state = VT_CSI;
+      self->private = 0;
+      self->inter = 0;
+      self->nparam = 0;
+      memset (self->param, 0, sizeof (self->param));
+      break;
+    case 'M': // RI: up a row, scrolling down at the top
+      self->wrap_pending = FALSE;
+      if (self->cur_row == 0)
+        virtual_terminal_scroll (self, FALSE);
+      else
+        self->cur_row--;
+      self->counts.cursor_moves++;
+      break;
+    case 'H': // HTS: set a tab stop
+      self->tabs[self->cur_col] = TRUE;
+      break;
+    }
+  }
+
+/*===========================================================================
+
+  virtual_terminal_byte
+
+===========================================================================*/
+static void virtual_terminal_byte (VirtualTerminal *self, unsigned char c)
+  {
+  if (self->utf8_need > 0)
+    {
+    if ((c & 0xC0) == 0x80)
+      {
+      self->utf8[self->utf8_len++] = c;
+      if (self->utf8_len < self->utf8_need) return;
+      char s[5];
+      int width;
+      memcpy (s, self->utf8, self->utf8_len);
+      s[self->utf8_len] = 0;
+      self->utf8_need = 0;
+      if (utf8_char (s, &width) == self->utf8_len)
+        virtual_terminal_print (self, s, self->utf8_len, width);
+      else
+        virtual_terminal_print_bytes (self, s, self->utf8_len);
+      return;
+      }
+    // The character was cut short
+    self->utf8_need = 0;
+    virtual_terminal_print_bytes (self, self->utf8, self->utf8_len);
+    }
+
+  switch (self->state)
+    {
+    case VT_ESC:
+      virtual_terminal_esc (self, c);
+      return;
+    case VT_CSI:
+      if (c >= '0' && c <= '9')
+        {
+        if (self->nparam < VT_MAX_PARAMS)
+          self->param[self->nparam] = self->param[self->nparam] * 10
+            + c - '0';
+        }
+      else if (c == ';')
+        self->nparam++;
+      else if (c >= '<' && c <= '?')
+        self->private = c;
+      else if (c >= 0x20 && c <= 0x2F)
+        self->inter = c;
+      else if (c >= 0x40 && c <= 0x7E)
+        {
+        self->nparam++;
+        self->state = VT_GROUND;
+        virtual_terminal_csi (self, c);
+        }
+      else if (c == 0x1b)
+        self->state = VT_ESC;
+      else
+        virtual_terminal_control (self, c);
+      return;
+    }
+
+  if (c == 0x1b)
+    self->state = VT_ESC;
+  else if (c < 0x20 || c == 0x7f)
+    virtual_terminal_control (self, c);
+  else if (c < 0x80 || utf8_seq_len (c) < 2)
+    virtual_terminal_print (self, (const char *)&c, 1, 1);
+  else
+    {
+    self->utf8[0] = c;
+    self->utf8_len = 1;
+    self->utf8_need = utf8_seq_len (c);
+    }
+  }
+
+/*===========================================================================
+
+  virtual_terminal_write
+
+===========================================================================*/
+static void virtual_terminal_write (TerminalDevice *device, const char *s,
+      int len)
+  {
+  VirtualTerminal *self = (VirtualTerminal *)device;
+  self->counts.writes++;
+  self->counts.bytes += len;
+  for (int i = 0; i < len; i++)
+    virtual_terminal_byte (self, s[i]);
+  }
+
+/*===========================================================================
+
+  virtual_terminal_read
+
+  Replies to queries come first, then the keys
+
+===========================================================================*/
+static int virtual_terminal_read (TerminalDevice *device, char *s, int len)
+  {
+  VirtualTerminal *self = (VirtualTerminal *)device;
+  const char *from;
+  int n;
+  if (self->reply_pos < self->reply_len)
+    {
+    from = self->reply + self->reply_pos;
+    n = self->reply_len - self->reply_pos;
+    if (n > len) n = len;
+    self->reply_pos += n;
+    if (self->reply_pos == self->reply_len)
+      self->reply_pos = self->reply_len = 0;
+    }
+  else if (self->keys_pos < self->keys_len)
+    {
+    from = self->keys + self->keys_pos;
+    n = self->keys_len - self->keys_pos;
+    if (n > len) n = len;
+    self->keys_pos += n;
+    self->counts.keys += n;
+    // The terminal driver, in the mode a LinuxTerminal sets, turns the
+    //   CR that the Enter key sends into LF
+    memcpy (s, from, n);
+    for (int i = 0; i < n; i++)
+      if (s[i] == '\r') s[i] = '\n';
+    return n;
+    }
+  else
+    {
+    virtual_terminal_snapshot (self);
+    return -1;
+    }
+  memcpy (s, from, n);
+  return n;
+  }
+
+/*===========================================================================
+
+  virtual_terminal_input_waiting
+
+  Keys are taken to arrive one at a time, once the screen has caught up
+  with the last, so the terminal never drops a frame to catch up with
+  them. Only replies wait to be read
+
+===========================================================================*/
+static int virtual_terminal_input_waiting (const TerminalDevice *device)
+  {
+  const VirtualTerminal *self = (const VirtualTerminal *)device;
+  return self->reply_len - self->reply_pos;
+  }
+
+/*===========================================================================
+
+  virtual_terminal_get_size
+
+===========================================================================*/
+static void virtual_terminal_get_size (const TerminalDevice *device,
+      int *rows, int *columns)
+  {
+  const VirtualTerminal *self = (const VirtualTerminal *)device;
+  *rows = self->rows;
+  *columns = self->columns;
+  }
+
+/*===========================================================================
+
+  virtual_terminal_dump_count
+
+===========================================================================*/
+static void virtual_terminal_dump_count (FILE *f, const char *name, long n)
+  {
+  char num[24];
+  fputs (name, f);
+  fputs (" ", f);
+  fputs (ltoa (n, num, 10), f);
+  fputs ("\n", f);
+  }
+
+/*===========================================================================
+
+  virtual_terminal_dump
+
+===========================================================================*/
+void virtual_terminal_dump (const VirtualTerminal *self, FILE *f)
+  {
+  const VtCell *cells = self->snapshot ? self->snapshot : self->cells;
+  char *line = malloc (self->columns * sizeof (cells->text) + 2);
+  for (int row = 0; row < self->rows; row++)
+    {
+    int len = 0;
+    int end = 0;
+    for (int col = 0; col < self->columns; col++)
+      {
+      const VtCell *cell = cells + row * self->columns + col;
+      memcpy (line + len, cell->text, cell->len);
+      len += cell->len;
+      if (cell->len != 1 || cell->text[0] != ' ') end = len;
+      }
+    line[end] = '\n';
+    line[end + 1] = 0;
+    fputs (line, f);
+    }
+  free (line);
+  char num[12];
+  fputs ("cursor ", f);
+  fputs (itoa ((self->snapshot ? self->snap_row : self->cur_row) + 1,
+    num, 10), f);
+  fputs (",", f);
+  fputs (itoa ((self->snapshot ? self->snap_col : self->cur_col) + 1,
+    num, 10), f);
+  fputs ("\n", f);
+  virtual_terminal_dump_count (f, "bytes", self->counts.bytes);
+  virtual_terminal_dump_count (f, "writes", self->counts.writes);
+  virtual_terminal_dump_count (f, "cursor_moves", self->counts.cursor_moves);
+  virtual_terminal_dump_count (f, "keys", self->counts.keys);
+  fflush (f);
+  }
+
@@ -0,0 +1,61 @@
+/*===========================================================================
+
+  bute -- barely useful text editor
+
+  virtualterminal.h
+
+  Copyright (c)2020 Kevin Boone. Distributed uner the terms of the
+    GNU PUblic Licence, v3.0
+
+===========================================================================*/
+#pragma once
+
+#include "cnolib.h"
+#include "terminal.h"
+
+// A terminal that exists only in memory. It is a TerminalDevice, so a
+//   LinuxTerminal can draw on it exactly as it would on a real terminal.
+//   The escape sequences it receives are worked out into a grid of
+//   cells, and the output is counted, so that the editor can be tested
+//   and timed with no TTY. Keystrokes come from a script, given as the
+//   bytes a terminal would send
+struct _VirtualTerminal;
+typedef struct _VirtualTerminal VirtualTerminal;
+
+// Counts of what has been sent to, and read from, a VirtualTerminal
+typedef struct _VirtualTerminalCounts
+  {
+  // Bytes written, and the number of writes they arrived in. Each
+  //   write would be a system call on a real terminal
+  long bytes;
+  long writes;
+  // Control characters and sequences that only move the cursor
+  long cursor_moves;
+  // Bytes of the script read so far
+  long keys;
+  } VirtualTerminalCounts;
+
+extern VirtualTerminal *virtual_terminal_create (int rows, int columns);
+extern void        virtual_terminal_destroy (VirtualTerminal *self);
+
+// The device, to pass to linux_terminal_set_device() or
+//   bute_set_device()
+extern TerminalDevice *virtual_terminal_get_device (VirtualTerminal *self);
+
+// Set the keystrokes to read. The VirtualTerminal does not take a copy,
+//   so they must stay in place until it has read them. Once they have
+//   all been read, the device says there is no more input
+extern void        virtual_terminal_set_keys (VirtualTerminal *self,
+                     const char *keys, int len);
+
+extern void        virtual_terminal_get_counts (const VirtualTerminal *self,
+                     VirtualTerminalCounts *counts);
+
+// Write the screen, as it was at the end of the session -- when the 
+//   keystrokes ran out, or the program turned off bracketed paste on
+//   leaving raw mode -- or as it is now, if the session hasn't ended. 
+//   The rows are written one to a line, with trailing blanks left off;
+//   then the cursor position and the counts
+extern void        virtual_terminal_dump (const VirtualTerminal *self,
+                     FILE *f);
+
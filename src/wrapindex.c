@@ -0,0 +1,350 @@
+/*===========================================================================
+
+  bute
+
+  wrapindex.c
+
+  Copyright (c)2020 Kevin Boone. Distributed uner the terms of the
+    GNU PUblic Licence, v3.0
+
+  A "class" that records how many screen rows each line takes up when
+  long lines are wrapped. The counts are held in a Fenwick tree, so that 
+  changing the count for a line, finding the row at which a line starts,
+  and finding the line at a row, take time proportional to the logarithm
+  of the number of lines. Lines added at the end can be added to the
+  tree as they are.
+
+  The file notes the runs of lines that change. When lines have been
+  added or removed, the rows of the lines that haven't changed are
+  moved to where their lines are now, only the lines in the runs are
+  measured, and the tree is built again from the rows, which needs
+  only a pass over them.
+
+===========================================================================*/
+#include "cnolib.h"
+#include "textfile.h"
+#include "wrapindex.h"
+
+struct _WrapIndex
+  {
+  // The file the index was built for, and what the file notes the 
+  //   changes to it for the index with
+  TextFile *text_file;
+  int noter;
+  int nlines;
+  int columns;
+  // The number of entries there is room for in rows and tree
+  int size;
+  // rows[i] is the number of rows taken by line i
+  int *rows;
+  // tree[i], counting from one, is the sum of the rows of the lines from 
+  //   i - (i & -i) up to i - 1
+  int *tree;
+  // Room for as many rows, which the rows are moved into when lines are
+  //   added or removed, and which then take the place of the old, or 
+  //   NULL
+  int *spare;
+  };
+
+/*===========================================================================
+
+  wrap_index_create
+
+===========================================================================*/
+WrapIndex *wrap_index_create (void)
+  {
+  WrapIndex *self = malloc (sizeof (WrapIndex));
+  memset (self, 0, sizeof (WrapIndex));
+  self->noter = -1;
+  return self;
+  }
+
+/*===========================================================================
+
+  wrap_index_destroy
+
+===========================================================================*/
+void wrap_index_destroy (WrapIndex *self)
+  {
+  if (self)
+    {
+    if (self->text_file) text_file_stop_noting (self->text_file, self->noter);
+    if (self->rows) free (self->rows);
+    if (self->tree) free (self->tree);
+    if (self->spare) free (self->spare);
+    free (self);
+    }
+  }
+
+/*===========================================================================
+
+  wrap_index_line_rows
+
+  The rows taken by a line. There is always room for the cursor after
+  the last character, so a line that exactly fills some number of rows
+  takes one more
+
+===========================================================================*/
+static int wrap_index_line_rows (const WrapIndex *self, 
+      const TextFile *text_file, int line)
+  {
+  return text_file_get_display_width (text_file, line) / self->columns + 1;
+  }
+
+/*===========================================================================
+
+  wrap_index_build_tree
+
+  Each node adds itself to its parent, which gives the whole tree in
+  one pass
+
+===========================================================================*/
+static void wrap_index_build_tree (WrapIndex *self)
+  {
+  self->tree[0] = 0;
+  for (int i = 0; i < self->nlines; i++)
+    self->tree[i + 1] = self->rows[i];
+  for (int i = 1; i <= self->nlines; i++)
+    {
+    int parent = i + (i & -i);
+    if (parent <= self->nlines) self->tree[parent] += self->tree[i];
+    }
+  }
+
+/*===========================================================================
+
+  wrap_index_build
+
+  The changes noted so far are all taken in, so are dropped
+
+===========================================================================*/
+void wrap_index_build (WrapIndex *self, TextFile *text_file, int columns)
+  {
+  if (self->text_file != text_file)
+    {
+    if (self->text_file) text_file_stop_noting (self->text_file, self->noter);
+    self->text_file = text_file;
+    self->noter = text_file_note_changes (text_file);
+    }
+  int n;
+  TextFileChange *changes = text_file_take_changes (text_file, self->noter,
+    &n);
+  if (changes) free (changes);
+
+  if (self->rows) free (self->rows);
+  if (self->tree) free (self->tree);
+  if (self->spare) free (self->spare);
+  self->spare = NULL;
+  self->nlines = text_file_get_line_count (text_file);
+  self->columns = columns > 0 ? columns : 1;
+  self->size = self->nlines + 1;
+  self->rows = malloc (self->size * sizeof (int));
+  self->tree = malloc (self->size * sizeof (int));
+  for (int i = 0; i < self->nlines; i++)
+    self->rows[i] = wrap_index_line_rows (self, text_file, i);
+  wrap_index_build_tree (self);
+  }
+
+/*===========================================================================
+
+  wrap_index_apply
+
+  Measure the lines in the runs that have changed. When no run adds or
+  removes lines, the others stay where they are, and only the rows that
+  change are changed in the tree
+
+===========================================================================*/
+static void wrap_index_apply (WrapIndex *self, const TextFile *text_file,
+     const TextFileChange *changes, int n, int added)
+  {
+  BOOL moved = FALSE;
+  for (int i = 0; i < n; i++)
+    if (changes[i].added != 0) moved = TRUE;
+  if (!moved)
+    {
+    for (int i = 0; i < n; i++)
+      for (int line = changes[i].first; line < changes[i].end; line++)
+        wrap_index_update_line (self, text_file, line);
+    return;
+    }
+  int nlines = self->nlines + added;
+  BOOL grow = nlines + 1 > self->size;
+  int size = self->size;
+  if (grow)
+    {
+    size = self->size * 2;
+    if (size < nlines + 1) size = nlines + 1;
+    }
+  if (grow || !self->spare)
+    {
+    if (self->spare) free (self->spare);
+    self->spare = malloc (size * sizeof (int));
+    }
+  int *rows = self->spare;
+  // Where the lines that haven't changed were, and where they are now
+  int from = 0;
+  int to = 0;
+  for (int i = 0; i <= n; i++)
+    {
+    int len = (i < n ? changes[i].first : nlines) - to;
+    memcpy (rows + to, self->rows + from, len * sizeof (int));
+    from += len;
+    to += len;
+    if (i == n) break;
+    const TextFileChange *run = &changes[i];
+    for (; to < run->end; to++)
+      rows[to] = wrap_index_line_rows (self, text_file, to);
+    from += run->end - run->first - run->added;
+    }
+  self->spare = self->rows;
+  self->rows = rows;
+  if (grow)
+    {
+    // The old rows are too small to be the spare
+    free (self->spare);
+    self->spare = NULL;
+    free (self->tree);
+    self->tree = malloc (size * sizeof (int));
+    self->size = size;
+    }
+  self->nlines = nlines;
+  wrap_index_build_tree (self);
+  }
+
+/*===========================================================================
+
+  wrap_index_update
+
+  The changes are counted from the lines there were when they were 
+  made. If lines have been loaded since, which is not how the editor
+  uses the index, the rows are all worked out again
+
+===========================================================================*/
+void wrap_index_update (WrapIndex *self, TextFile *text_file)
+  {
+  int n;
+  TextFileChange *changes = text_file_take_changes (text_file, self->noter,
+    &n);
+  if (!changes) return;
+  int added = 0;
+  for (int i = 0; i < n; i++) added += changes[i].added;
+  if (self->nlines + added == text_file_get_line_count (text_file))
+    wrap_index_apply (self, text_file, changes, n, added);
+  else
+    wrap_index_build (self, text_file, self->columns);
+  free (changes);
+  }
+
+/*===========================================================================
+
+  wrap_index_add_lines
+
+  A new node is the sum of its own line and the nodes below it, which 
+  are all there already
+
+===========================================================================*/
+void wrap_index_add_lines (WrapIndex *self, TextFile *text_file)
+  {
+  wrap_index_update (self, text_file);
+  int nlines = text_file_get_line_count (text_file);
+  if (nlines + 1 > self->size)
+    {
+    int size = self->size * 2;
+    if (size < nlines + 1) size = nlines + 1;
+    int *rows = malloc (size * sizeof (int));
+    int *tree = malloc (size * sizeof (int));
+    memcpy (rows, self->rows, self->nlines * sizeof (int));
+    memcpy (tree, self->tree, (self->nlines + 1) * sizeof (int));
+    free (self->rows);
+    free (self->tree);
+    if (self->spare) free (self->spare);
+    self->rows = rows;
+    self->tree = tree;
+    self->spare = NULL;
+    self->size = size;
+    }
+  for (int i = self->nlines; i < nlines; i++)
+    {
+    int node = i + 1;
+    self->rows[i] = wrap_index_line_rows (self, text_file, i);
+    self->tree[node] = self->rows[i];
+    for (int child = 1; child < (node & -node); child *= 2)
+      self->tree[node] += self->tree[node - child];
+    }
+  self->nlines = nlines;
+  }
+
+/*===========================================================================
+
+  wrap_index_update_line
+
+===========================================================================*/
+void wrap_index_update_line (WrapIndex *self, const TextFile *text_file, 
+      int line)
+  {
+  int rows = wrap_index_line_rows (self, text_file, line);
+  int delta = rows - self->rows[line];
+  if (delta == 0) return;
+  self->rows[line] = rows;
+  for (int i = line + 1; i <= self->nlines; i += i & -i)
+    self->tree[i] += delta;
+  }
+
+/*===========================================================================
+
+  wrap_index_get_columns
+
+===========================================================================*/
+int wrap_index_get_columns (const WrapIndex *self)
+  {
+  return self->columns;
+  }
+
+/*===========================================================================
+
+  wrap_index_get_rows
+
+===========================================================================*/
+int wrap_index_get_rows (const WrapIndex *self, int line)
+  {
+  return self->rows[line];
+  }
+
+/*===========================================================================
+
+  wrap_index_rows_before
+
+===========================================================================*/
+int wrap_index_rows_before (const WrapIndex *self, int line)
+  {
+  int sum = 0;
+  for (int i = line; i > 0; i -= i & -i)
+    sum += self->tree[i];
+  return sum;
+  }
+
+/*===========================================================================
+
+  wrap_index_line_at
+
+  Walk down the tree, taking each node whose rows all come before 'row'
+
+===========================================================================*/
+int wrap_index_line_at (const WrapIndex *self, int row, int *sub)
+  {
+  int step = 1;
+  while (step * 2 <= self->nlines) step *= 2;
+
+  int line = 0;
+  for (; step > 0; step /= 2)
+    {
+    if (line + step <= self->nlines && self->tree[line + step] <= row)
+      {
+      line += step;
+      row -= self->tree[line];
+      }
+    }
+  *sub = row;
+  return line;
+  }
+
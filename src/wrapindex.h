@@ -0,0 +1,57 @@
+/*===========================================================================
+
+  bute -- barely useful text editor
+
+  wrapindex.h
+
+  Copyright (c)2020 Kevin Boone. Distributed uner the terms of the
+    GNU PUblic Licence, v3.0
+
+===========================================================================*/
+#pragma once
+
+#include "cnolib.h"
+#include "textfile.h"
+
+// The number of screen rows each line of a file takes up when long lines
+//   are wrapped, kept so that the screen row at which a line starts, and
+//   the line at a screen row, can be found without counting every line
+//   above it
+struct _WrapIndex;
+typedef struct _WrapIndex WrapIndex;
+
+extern WrapIndex  *wrap_index_create (void);
+extern void        wrap_index_destroy (WrapIndex *self);
+
+// Work out the rows for every line of the file, for a screen of the
+//   given width. From then on, the file notes the lines that change
+//   for the index, until it is destroyed, which must be before the file
+//   is
+extern void        wrap_index_build (WrapIndex *self, TextFile *text_file,
+                     int columns);
+// Work out the rows again for the lines that have changed, or been
+//   added or removed, since the index was built or last brought up to
+//   date, and move the rows of the others to where their lines are now
+extern void        wrap_index_update (WrapIndex *self, TextFile *text_file);
+// Work out the rows for the lines that have been added to the end of 
+//   the file since the index was built, as when a file is loaded a 
+//   part at a time
+extern void        wrap_index_add_lines (WrapIndex *self, 
+                     TextFile *text_file);
+// Update the rows for one line, after it has changed
+extern void        wrap_index_update_line (WrapIndex *self, 
+                     const TextFile *text_file, int line);
+
+// The screen width the index was built for
+extern int         wrap_index_get_columns (const WrapIndex *self);
+// The number of rows a line takes up
+extern int         wrap_index_get_rows (const WrapIndex *self, int line);
+// The number of rows taken up by the lines before 'line'. line may be
+//   the number of lines, to get the rows in the whole file
+extern int         wrap_index_rows_before (const WrapIndex *self, int line);
+// The line that includes row 'row', counting from the start of the file,
+//   and in *sub the row within that line. If row is beyond the end of
+//   the file, returns the number of lines
+extern int         wrap_index_line_at (const WrapIndex *self, int row, 
+                     int *sub);
+